@@ -6,11 +6,11 @@
 #include "raylib/extraction/raysegment.h"
 #include "raylib/raycloud.h"
 #include "raylib/raycloudwriter.h"
+#include "raylib/rayneighbourindex.h"
 #include "raylib/rayparse.h"
 #define STB_IMAGE_IMPLEMENTATION
 #include "raylib/imageread.h"
 
-#include <nabo/nabo.h>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
@@ -32,6 +32,9 @@ void usage(int exit_code = 1)
   std::cout << "                   branches      - red and green are lidar intensity and cylindricality respectively, greater for branches than for leaves" << std::endl;
   std::cout << "                   image planview.png - colour all points from image, stretched to fit the point bounds" << std::endl;
   std::cout << "                         --lit   - shaded (slow on large datasets)" << std::endl;
+  std::cout << "                 --approximate   - faster approximate neighbours for shape and lit, on large datasets" << std::endl;
+  std::cout << "             --float_precision   - faster single precision surface fitting for shape, normal and lit" << std::endl;
+  std::cout << "             --save_neighbours   - keep the neighbour search in raycloud.ply.nbr, for later runs on the same file" << std::endl;
   // clang-format on
   exit(exit_code);
 }
@@ -100,14 +103,15 @@ int rayColour(int argc, char *argv[])
 {
   ray::FileArgument cloud_file, image_file;
   ray::KeyChoice colour_type({ "time", "height", "shape", "normal", "alpha", "branches" });
-  ray::OptionalFlagArgument lit("lit", 'l');
+  ray::OptionalFlagArgument lit("lit", 'l'), approximate("approximate", 'a'), float_precision("float_precision", 'f'),
+    save_neighbours("save_neighbours", 'n');
   ray::Vector3dArgument col(0.0, 1.0);
   ray::DoubleArgument alpha(0.0, 1.0);
   ray::TextArgument alpha_text("alpha"), image_text("image");
-  const bool standard_format = ray::parseCommandLine(argc, argv, { &cloud_file, &colour_type }, { &lit });
-  const bool flat_colour = ray::parseCommandLine(argc, argv, { &cloud_file, &col }, { &lit });
-  const bool flat_alpha = ray::parseCommandLine(argc, argv, { &cloud_file, &alpha_text, &alpha }, { &lit });
-  const bool image_format = ray::parseCommandLine(argc, argv, { &cloud_file, &image_text, &image_file }, { &lit });
+  const bool standard_format = ray::parseCommandLine(argc, argv, { &cloud_file, &colour_type }, { &lit, &approximate, &float_precision, &save_neighbours });
+  const bool flat_colour = ray::parseCommandLine(argc, argv, { &cloud_file, &col }, { &lit, &approximate, &float_precision, &save_neighbours });
+  const bool flat_alpha = ray::parseCommandLine(argc, argv, { &cloud_file, &alpha_text, &alpha }, { &lit, &approximate, &float_precision, &save_neighbours });
+  const bool image_format = ray::parseCommandLine(argc, argv, { &cloud_file, &image_text, &image_file }, { &lit, &approximate, &float_precision, &save_neighbours });
   if (!standard_format && !flat_colour && !flat_alpha && !image_format)
     usage();
 
@@ -119,7 +123,7 @@ int rayColour(int argc, char *argv[])
   if (type != "shape" && type != "normal" && type != "branches")  // chunk loading possible for simple cases
   {
     ray::CloudWriter writer;
-    if (!writer.begin(out_file))
+    if (!writer.begin(out_file, 2))  // written in the background, while the next chunk is coloured
       usage();
 
     auto colour_rays = [flat_colour, flat_alpha, &type, &col, &alpha, &writer, &split_alpha](
@@ -234,7 +238,22 @@ int rayColour(int argc, char *argv[])
   }
 
   if (calc_surfels)
-    cloud.getSurfels(search_size, cents, norms, dims, mats, inds, max_distance, false);
+  {
+    // reuse the neighbour index saved by an earlier run on this cloud file if there is one
+    ray::NeighbourIndex neighbour_index;
+    const bool index_loaded = !approximate.isSet() && neighbour_index.load(in_file);
+    if (approximate.isSet())
+      neighbour_index.buildApproximate(cloud, 0.0, search_size);
+    else if (!index_loaded)
+      neighbour_index.build(cloud);
+    const bool save_index = save_neighbours.isSet() && !index_loaded && !approximate.isSet();
+    if (save_index)
+      neighbour_index.knnSelf(search_size, max_distance);  // kept in the index to be saved
+    cloud.getSurfels(neighbour_index, search_size, cents, norms, dims, mats, inds, max_distance, false,
+                     float_precision.isSet());
+    if (save_index)
+      neighbour_index.save(in_file);
+  }
   if (type == "shape")
   {
     for (int i = 0; i < (int)cloud.ends.size(); i++)
@@ -275,7 +294,7 @@ int rayColour(int argc, char *argv[])
       // we use the median of the neighbour points to be robust to noise
       cols.clear();
       cols.push_back(cloud.colours[i].alpha);
-      for (int j = 0; j < 4 && indices(j, i) != Nabo::NNSearchD::InvalidIndex; j++)
+      for (int j = 0; j < 4 && indices(j, i) != ray::NeighbourIndex::kInvalidIndex; j++)
       {
         cols.push_back(cloud.colours[indices(j, i)].alpha);
       }
@@ -295,7 +314,7 @@ int rayColour(int argc, char *argv[])
       // 2. green is cylindricality
       Eigen::Vector3d mean = cloud.ends[i];  // centroid
       int num = 1;
-      for (int j = 0; j < search_size && indices(j, i) != Nabo::NNSearchD::InvalidIndex; j++)
+      for (int j = 0; j < search_size && indices(j, i) != ray::NeighbourIndex::kInvalidIndex; j++)
       {
         mean += cloud.ends[indices(j, i)];
         num++;
@@ -303,7 +322,7 @@ int rayColour(int argc, char *argv[])
       mean /= (double)num;
       // get teh scatter matrix of the neighbourhood of points
       Eigen::Matrix3d scatter = (cloud.ends[i] - mean) * (cloud.ends[i] - mean).transpose();
-      for (int j = 0; j < search_size && indices(j, i) != Nabo::NNSearchD::InvalidIndex; j++)
+      for (int j = 0; j < search_size && indices(j, i) != ray::NeighbourIndex::kInvalidIndex; j++)
       {
         Eigen::Vector3d v = cloud.ends[indices(j, i)] - mean;
         scatter += v * v.transpose();
@@ -329,7 +348,7 @@ int rayColour(int argc, char *argv[])
       if (!cloud.rayBounded(i))
         continue;
       double sum_x = 0, sum_y = 0, sum_xy = 0, sum_xx = 0, sum_yy = 0, n = 0;
-      for (int j = 0; j < search_size && indices(j, i) != Nabo::NNSearchD::InvalidIndex; j++)
+      for (int j = 0; j < search_size && indices(j, i) != ray::NeighbourIndex::kInvalidIndex; j++)
       {
         int id = indices(j, i);
         Eigen::Vector3d flat = cloud.ends[id] - centroids[i];
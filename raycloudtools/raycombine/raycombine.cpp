@@ -33,6 +33,8 @@ void usage(int exit_code = 1)
   std::cout << "raycombine basecloud min raycloud1 raycloud2 20 rays - 3-way merge, choses the changed geometry (from basecloud) at any differences. " << std::endl;
   std::cout << "                                                       For merge conflicts it uses the specified merge type." << std::endl;
   std::cout << "        --output raycloud_combined.ply               - optionally specify the output file name." << std::endl;
+  std::cout << "        --tile 20                                    - merge in 20 m tiles, for clouds too large to fit in memory together." << std::endl;
+  std::cout << "        --halo 1                                     - with --tile, the overlap of the tiles in m. Defaults to three ray grid voxels." << std::endl;
   // clang-format on
   exit(exit_code);
 }
@@ -48,9 +50,13 @@ int rayCombine(int argc, char *argv[])
   // Below: false = allow unusual file extensions, for auto-merging, which occurs on non-standard temporary file names
   ray::FileArgument base_cloud(false), cloud_1(false), cloud_2(false), output_file(false);
   ray::OptionalKeyValueArgument output("output", 'o', &output_file);
+  ray::DoubleArgument tile_width(0.01, 1000000.0), halo_width(0.001, 1000.0);
+  ray::OptionalKeyValueArgument tile_option("tile", 't', &tile_width);
+  ray::OptionalKeyValueArgument halo_option("halo", 0, &halo_width);
 
   // three-way merge option
-  bool standard_format = ray::parseCommandLine(argc, argv, { &merge_type, &cloud_files, &num_rays, &rays_text }, { &output });
+  bool standard_format = ray::parseCommandLine(argc, argv, { &merge_type, &cloud_files, &num_rays, &rays_text },
+                                               { &output, &tile_option, &halo_option });
   bool concatenate_all = ray::parseCommandLine(argc, argv, { &all_text, &cloud_files }, { &output });
   bool threeway = ray::parseCommandLine(
     argc, argv, { &base_cloud, &merge_type, &cloud_1, &cloud_2, &num_rays, &rays_text }, { &output });
@@ -78,7 +84,7 @@ int rayCombine(int argc, char *argv[])
     if (!clouds[1].load(cloud_2.name(), false))
       usage();
   }
-  else if (!concatenate_all)
+  else if (!concatenate_all && !tile_option.isSet())
   {
     clouds.resize(cloud_files.files().size());
     for (int i = 0; i < (int)cloud_files.files().size(); i++)
@@ -146,6 +152,21 @@ int rayCombine(int argc, char *argv[])
   ray::Merger merger(config);
   ray::Progress progress;
   ray::ProgressThread progress_thread(progress);
+  if (tile_option.isSet())
+  {
+    // the tiles are streamed from and to file, so only the current tiles of each cloud are in memory
+    std::vector<std::string> file_names;
+    for (const auto &file : cloud_files.files())
+    {
+      file_names.push_back(file.name());
+    }
+    const bool merged = merger.mergeMultipleFiles(file_names, combined_file, file_stub + "_differences.ply",
+                                                  tile_width.value(), halo_option.isSet() ? halo_width.value() : 0.0,
+                                                  &progress);
+    progress_thread.requestQuit();
+    progress_thread.join();
+    return merged ? 0 : 1;
+  }
   ray::Cloud concatenated_cloud;
   const ray::Cloud *fixed_cloud = &merger.fixedCloud();
 
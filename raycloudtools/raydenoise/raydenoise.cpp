@@ -4,9 +4,9 @@
 //
 // Author: Thomas Lowe
 #include "raylib/raycloud.h"
+#include "raylib/rayneighbourindex.h"
 #include "raylib/rayparse.h"
 
-#include <nabo/nabo.h>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
@@ -20,6 +20,8 @@ void usage(int exit_code = 1)
   std::cout << "raydenoise raycloud 4 cm     - removes rays that contact more than 4 cm from any other," << std::endl;
   std::cout << "raydenoise raycloud 3 sigmas - removes points more than 3 sigmas from nearest points" << std::endl;
   std::cout << "                    range 4 cm - remove mixed-signal noise that occurs at a range gap." << std::endl;
+  std::cout << "                    --save_neighbours - with sigmas, keep the neighbour search in raycloud.ply.nbr, for" << std::endl;
+  std::cout << "                                        later runs on the same file" << std::endl;
   // clang-format on
   exit(exit_code);
 }
@@ -33,8 +35,9 @@ int rayDenoise(int argc, char *argv[])
   ray::DoubleArgument range(1.0, 1000.0);
   ray::TextArgument cm_text("cm");
   ray::ValueKeyChoice quantity({ &vox_width, &sigmas, &range }, { "cm", "sigmas" });
+  ray::OptionalFlagArgument save_neighbours("save_neighbours", 'n');
 
-  bool standard_format = ray::parseCommandLine(argc, argv, { &cloud_file, &quantity });
+  bool standard_format = ray::parseCommandLine(argc, argv, { &cloud_file, &quantity }, { &save_neighbours });
   bool range_noise = ray::parseCommandLine(argc, argv, { &cloud_file, &range_text, &range, &cm_text });
   if (!standard_format && !range_noise)
     usage();
@@ -47,6 +50,15 @@ int rayDenoise(int argc, char *argv[])
   if (range_noise)  // range-based distance measure. For mixed-points where lidar has contacted two surfaces.
   {
     double range_distance = 0.01 * range.value();
+    // adjacent rays are only neighbouring measurements when the cloud is in time order
+    size_t out_of_order = 0;
+    for (size_t i = 1; i < cloud.times.size(); i++)
+    {
+      if (cloud.times[i] < cloud.times[i - 1])
+        out_of_order++;
+    }
+    if (out_of_order > cloud.times.size() / 16)
+      std::cout << "Warning: times are unordered, use raysort raycloud time before range denoising." << std::endl;
     new_cloud.starts.reserve(cloud.starts.size());
     new_cloud.ends.reserve(cloud.ends.size());
     new_cloud.times.reserve(cloud.times.size());
@@ -72,23 +84,15 @@ int rayDenoise(int argc, char *argv[])
     Eigen::MatrixXi indices;
     Eigen::MatrixXd dists2;
 
-    Nabo::NNSearchD *nns;
-    Nabo::Parameters params("bucketSize", 8);
     std::vector<Eigen::Vector3d> &points = cloud.ends;
-    Eigen::MatrixXd points_p(3, points.size());
-    for (unsigned int i = 0; i < points.size(); i++) 
-    {
-      points_p.col(i) = points[i];
-    }
-    nns = Nabo::NNSearchD::createKDTreeLinearHeap(points_p, 3);
+    ray::NeighbourIndex neighbour_index;
+    neighbour_index.build(points);
 
     // Run the search
     const int search_size = 1;
-    indices.resize(search_size, points.size());
-    dists2.resize(search_size, points.size());
-    nns->knn(points_p, indices, dists2, search_size, ray::kNearestNeighbourEpsilon, 0);
+    neighbour_index.knn(neighbour_index.points(), search_size, indices, dists2);
     indices.resize(0, 0);
-    delete nns;
+    neighbour_index.clear();
 
     new_cloud.starts.reserve(cloud.starts.size());
     new_cloud.ends.reserve(cloud.ends.size());
@@ -110,7 +114,17 @@ int rayDenoise(int argc, char *argv[])
     Eigen::MatrixXi indices;
 
     const int search_size = std::min(10, (int)cloud.ends.size() - 1);
-    cloud.getSurfels(search_size, &centroids, nullptr, &dimensions, &matrices, &indices);
+    // reuse the neighbour index saved by an earlier run on this cloud file if there is one
+    ray::NeighbourIndex neighbour_index;
+    const bool index_loaded = neighbour_index.load(cloud_file.name());
+    if (!index_loaded)
+      neighbour_index.build(cloud);
+    const bool save_index = save_neighbours.isSet() && !index_loaded;
+    if (save_index)
+      neighbour_index.knnSelf(search_size);  // kept in the index to be saved, otherwise it is searched in batches
+    cloud.getSurfels(neighbour_index, search_size, &centroids, nullptr, &dimensions, &matrices, &indices);
+    if (save_index)
+      neighbour_index.save(cloud_file.name());
 
     new_cloud.starts.reserve(cloud.starts.size());
     new_cloud.ends.reserve(cloud.ends.size());
@@ -124,7 +138,7 @@ int rayDenoise(int argc, char *argv[])
       bool is_noise = false;
       if (cloud.rayBounded(i))
       {
-        if (indices(0, i) == Nabo::NNSearchD::InvalidIndex)  // no neighbours in range, we consider this as noise
+        if (indices(0, i) == ray::NeighbourIndex::kInvalidIndex)  // no neighbours in range, we consider this as noise
           continue;
         int other_i = indices(0, i);
         Eigen::Vector3d vec = cloud.ends[i] - centroids[other_i];
@@ -133,7 +147,7 @@ int rayDenoise(int argc, char *argv[])
         newVec[1] /= dimensions[other_i][1];
         newVec[2] /= dimensions[other_i][2];
         int num = 0;
-        for (int j = 0; j < search_size && indices(j, i) != Nabo::NNSearchD::InvalidIndex; j++) num = j + 1;
+        for (int j = 0; j < search_size && indices(j, i) != ray::NeighbourIndex::kInvalidIndex; j++) num = j + 1;
         nums += (double)num;
         dims += dimensions[other_i];
         cnt++;
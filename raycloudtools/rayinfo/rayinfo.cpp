@@ -4,6 +4,7 @@
 //
 // Author: Thomas Lowe
 #include "raylib/raycloud.h"
+#include "raylib/raycloudindex.h"
 #include "raylib/rayparse.h"
 #include "raylib/raycuboid.h"
 #include "raylib/rayply.h"
@@ -20,6 +21,8 @@ void usage(int exit_code = 1)
   std::cout << "Get basic information on the ray cloud, such as its bounds" << std::endl;
   std::cout << "usage:" << std::endl;
   std::cout << "rayinfo raycloud.ply" << std::endl;
+  std::cout << "                     --index - also save a spatial index (raycloud.ply.idx), which speeds up later reads" << std::endl;
+  std::cout << "                               of small regions of the cloud" << std::endl;
   // clang-format on
   exit(exit_code);
 }
@@ -54,7 +57,8 @@ public:
 int rayInfo(int argc, char *argv[])
 {
   ray::FileArgument cloud;
-  if (!ray::parseCommandLine(argc, argv, { &cloud }, {}))
+  ray::OptionalFlagArgument build_index("index", 'i');
+  if (!ray::parseCommandLine(argc, argv, { &cloud }, { &build_index }))
   {
     usage();
   }
@@ -141,7 +145,28 @@ int rayInfo(int argc, char *argv[])
       }
     }
   };
-  if (!ray::readPly(cloud.name(), true, get_info, 0))
+  // the index is built in the same pass, one index segment per chunk
+  ray::CloudIndex index;
+  index.reset();
+  auto get_info_and_index = [&](std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends,
+                                std::vector<double> &times, std::vector<ray::RGBA> &colours) {
+    index.addSegment(starts, ends, times);
+    get_info(starts, ends, times, colours);
+  };
+  if (build_index.isSet())
+  {
+    ray::PlyReadOptions options;
+    options.exact_chunk_size = true;
+    if (!ray::readPly(cloud.name(), true, get_info_and_index, 0, false, index.rowsPerSegment(), options))
+    {
+      usage();
+    }
+    if (index.save(cloud.name()))
+    {
+      std::cout << "saved spatial index " << ray::CloudIndex::fileName(cloud.name()) << std::endl;
+    }
+  }
+  else if (!ray::readPly(cloud.name(), true, get_info, 0))
   {
     usage();
   }
@@ -172,7 +197,7 @@ int rayInfo(int argc, char *argv[])
   std::cout << std::endl;
   if (out_of_order > info.num_rays/16)
   {
-    std::cout << "  times are unordered." << std::endl;
+    std::cout << "  times are unordered. Use raysort raycloud time to sort them." << std::endl;
   }
   else if (num_jumps > info.num_rays/16)
   {
@@ -45,7 +45,7 @@ int rayRestore(int argc, char *argv[])
 
   ray::Cloud full_decimated;       // we need a decimated version of the full cloud, to compare to
   std::vector<int64_t> subsample;  // single buffer minimises memory allocations
-  std::set<Eigen::Vector3i, ray::Vector3iLess> voxel_set;
+  ray::VoxelSet voxel_set;
   full_decimated.reserve(decimated_cloud.ends.size());  // good guess at memory required
 
   // decimation functions
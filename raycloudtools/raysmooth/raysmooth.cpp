@@ -4,10 +4,9 @@
 //
 // Author: Thomas Lowe
 #include "raylib/raycloud.h"
+#include "raylib/rayneighbourindex.h"
 #include "raylib/rayparse.h"
 
-#include <nabo/nabo.h>
-
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
@@ -19,6 +18,10 @@ void usage(int exit_code = 1)
   std::cout << "Smooth a ray cloud. Nearby off-surface points are moved onto the nearest surface." << std::endl;
   std::cout << "usage:" << std::endl;
   std::cout << "raysmooth raycloud" << std::endl;
+  std::cout << "                    --approximate - faster approximate neighbours, for large clouds" << std::endl;
+  std::cout << "                    --float_precision - faster single precision surface fitting" << std::endl;
+  std::cout << "                    --save_neighbours - keep the neighbour search in raycloud.ply.nbr, for later runs on" << std::endl;
+  std::cout << "                                        the same file" << std::endl;
   // clang-format on
   exit(exit_code);
 }
@@ -26,7 +29,9 @@ void usage(int exit_code = 1)
 int raySmooth(int argc, char *argv[])
 {
   ray::FileArgument cloud_file;
-  if (!ray::parseCommandLine(argc, argv, { &cloud_file }))
+  ray::OptionalFlagArgument approximate("approximate", 'a'), float_precision("float_precision", 'f'),
+    save_neighbours("save_neighbours", 'n');
+  if (!ray::parseCommandLine(argc, argv, { &cloud_file }, { &approximate, &float_precision, &save_neighbours }))
     usage();
 
   ray::Cloud cloud;
@@ -40,7 +45,20 @@ int raySmooth(int argc, char *argv[])
   const int num_neighbours = 16;
   std::vector<Eigen::Vector3d> normals;
   Eigen::MatrixXi neighbour_indices;
-  cloud.getSurfels(num_neighbours, nullptr, &normals, nullptr, nullptr, &neighbour_indices);
+  // reuse the neighbour index saved by an earlier run on this cloud file if there is one
+  ray::NeighbourIndex neighbour_index;
+  const bool index_loaded = !approximate.isSet() && neighbour_index.load(cloud_file.name());
+  if (approximate.isSet())
+    neighbour_index.buildApproximate(cloud, 0.0, num_neighbours);
+  else if (!index_loaded)
+    neighbour_index.build(cloud);
+  const bool save_index = save_neighbours.isSet() && !index_loaded && !approximate.isSet();
+  if (save_index)
+    neighbour_index.knnSelf(num_neighbours);  // kept in the index to be saved, otherwise it is searched in batches
+  cloud.getSurfels(neighbour_index, num_neighbours, nullptr, &normals, nullptr, nullptr, &neighbour_indices, 0.0, true,
+                   float_precision.isSet());
+  if (save_index)
+    neighbour_index.save(cloud_file.name());
 
   std::vector<Eigen::Vector3d> centroids(cloud.ends.size());
   for (size_t i = 0; i < cloud.ends.size(); i++)
@@ -49,7 +67,7 @@ int raySmooth(int argc, char *argv[])
       continue;
     double total_weight = 0.2;  // more averaging if it uses less of the central position, but 0 risks a divide by 0
     Eigen::Vector3d weighted_sum = cloud.ends[i] * total_weight;
-    for (int j = 0; j < num_neighbours && neighbour_indices(j, i) != Nabo::NNSearchD::InvalidIndex; j++)
+    for (int j = 0; j < num_neighbours && neighbour_indices(j, i) != ray::NeighbourIndex::kInvalidIndex; j++)
     {
       int k = neighbour_indices(j, i);
       double weight = std::max(0.0, 1.0 - (normals[k] - normals[i]).squaredNorm());
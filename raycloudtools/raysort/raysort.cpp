@@ -0,0 +1,55 @@
+// Copyright (c) 2020
+// Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+// ABN 41 687 119 230
+//
+// Author: Thomas Lowe
+#include "raylib/raymemory.h"
+#include "raylib/rayparse.h"
+#include "raylib/raysort.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+void usage(int exit_code = 1)
+{
+  // clang-format off
+  std::cout << "Sort the rays in a ray cloud file, without loading the whole file into memory" << std::endl;
+  std::cout << "usage:" << std::endl;
+  std::cout << "raysort raycloud 10 cm - sort spatially, along a Z-order curve of the 10 cm voxels containing the end points." << std::endl;
+  std::cout << "                         Spatial processing of the sorted cloud is more cache friendly" << std::endl;
+  std::cout << "raysort raycloud time  - sort by time, for example to restore the time order of a spatially sorted cloud" << std::endl;
+  std::cout << "                         Half of the global --memory_limit budget is used for the sort runs. Larger clouds are sorted in several runs" << std::endl;
+  // clang-format on
+  exit(exit_code);
+}
+
+int raySort(int argc, char *argv[])
+{
+  ray::FileArgument cloud_file;
+  ray::DoubleArgument vox_width(0.01, 100000.0);
+  ray::TextArgument cm("cm"), time("time");
+  const bool spatial_format = ray::parseCommandLine(argc, argv, { &cloud_file, &vox_width, &cm });
+  const bool time_format = ray::parseCommandLine(argc, argv, { &cloud_file, &time });
+  if (!spatial_format && !time_format)
+    usage();
+
+  const std::string out_file = cloud_file.nameStub() + "_sorted.ply";
+  // the global --memory_limit option sets the sort's memory budget. The file reader's chunks take up to a quarter of the
+  // limit (see Memory::chunkSize), and the writer's queue some more, so the sort itself is given half of it
+  const size_t memory_limit = ray::Memory::limited() ? ray::Memory::limit() / 2 : ray::kSortMemoryLimit;
+  bool res;
+  if (spatial_format)
+    res = ray::sortSpatial(cloud_file.name(), out_file, 0.01 * vox_width.value(), memory_limit);
+  else
+    res = ray::sortTime(cloud_file.name(), out_file, memory_limit);
+  if (!res)
+    usage();
+  return 0;
+}
+
+int main(int argc, char *argv[])
+{
+  return ray::runWithMemoryCheck(raySort, argc, argv);
+}
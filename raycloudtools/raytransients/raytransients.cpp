@@ -4,6 +4,7 @@
 //
 // Author: Thomas Lowe
 #include "raylib/raycloud.h"
+#include "raylib/raycompactcloud.h"
 #include "raylib/raymerger.h"
 #include "raylib/raymesh.h"
 #include "raylib/rayparse.h"
@@ -30,6 +31,11 @@ void usage(int exit_code = 1)
   std::cout << "              oldest - keeps the oldest geometry when there is a difference over time." << std::endl;
   std::cout << "              newest - uses the newest geometry when there is a difference over time." << std::endl;
   std::cout << " --colour     - also colours the clouds, to help tweak numRays. blue: opacity, green: pass throughs." << std::endl;
+  std::cout << " --tile 20    - filter in 20 m tiles, for clouds too large to fit in memory." << std::endl;
+  std::cout << " --halo 1     - with --tile, the overlap of the tiles in m. Defaults to three ray grid voxels." << std::endl;
+  std::cout << " --bvh        - trace the rays through a hierarchy of the ellipsoids rather than a ray grid. Faster for long rays" << std::endl;
+  std::cout << "                (tens of metres or more), and may find slightly more pass through rays than the grid." << std::endl;
+  std::cout << " --compact    - hold the cloud in single precision relative to its origin, using 40% less memory." << std::endl;
   // clang-format on
   exit(exit_code);
 }
@@ -41,12 +47,24 @@ int rayTransients(int argc, char *argv[])
   ray::DoubleArgument num_rays(0.1, 100.0);
   ray::TextArgument text("rays");
   ray::OptionalFlagArgument colour("colour", 'c');
-  if (!ray::parseCommandLine(argc, argv, { &merge_type, &cloud_file, &num_rays, &text }, { &colour }))
+  ray::DoubleArgument tile_width(0.01, 1000000.0), halo_width(0.001, 1000.0);
+  ray::OptionalKeyValueArgument tile_option("tile", 't', &tile_width);
+  ray::OptionalKeyValueArgument halo_option("halo", 0, &halo_width);
+  ray::OptionalFlagArgument bvh("bvh", 'b');
+  ray::OptionalFlagArgument compact("compact", 0);
+  if (!ray::parseCommandLine(argc, argv, { &merge_type, &cloud_file, &num_rays, &text },
+                             { &colour, &tile_option, &halo_option, &bvh, &compact }))
     usage();
 
   ray::Cloud cloud;
-  if (!cloud.load(cloud_file.name()))
-    usage();
+  ray::CompactCloud compact_cloud;
+  // with --tile, the cloud is loaded a tile at a time
+  if (!tile_option.isSet())
+  {
+    const bool loaded = compact.isSet() ? compact_cloud.load(cloud_file.name()) : cloud.load(cloud_file.name());
+    if (!loaded)
+      usage();
+  }
 
   ray::Threads::init();
   ray::MergerConfig config;
@@ -55,6 +73,7 @@ int rayTransients(int argc, char *argv[])
   config.num_rays_filter_threshold = num_rays.value();
   config.merge_type = ray::MergeType::Mininum;
   config.colour_cloud = colour.isSet();
+  config.acceleration = bvh.isSet() ? ray::MergerAcceleration::Bvh : ray::MergerAcceleration::Grid;
 
   if (merge_type.selectedKey() == "oldest")
   {
@@ -77,6 +96,25 @@ int rayTransients(int argc, char *argv[])
   ray::Progress progress;
   ray::ProgressThread progress_thread(progress);
 
+  if (tile_option.isSet())
+  {
+    // the tiles are streamed from and to file, so the cloud is never all in memory
+    const bool filtered = filter.filterFile(cloud_file.name(), cloud_file.nameStub() + "_fixed.ply",
+                                            cloud_file.nameStub() + "_transient.ply", tile_width.value(),
+                                            halo_option.isSet() ? halo_width.value() : 0.0, &progress);
+    progress_thread.requestQuit();
+    progress_thread.join();
+    return filtered ? 0 : 1;
+  }
+  if (compact.isSet())
+  {
+    // the results are streamed to file, so only the compact cloud is held in memory
+    const bool filtered = filter.filter(compact_cloud, cloud_file.nameStub() + "_fixed.ply",
+                                        cloud_file.nameStub() + "_transient.ply", &progress);
+    progress_thread.requestQuit();
+    progress_thread.join();
+    return filtered ? 0 : 1;
+  }
   filter.filter(cloud, &progress);
 
   progress_thread.requestQuit();
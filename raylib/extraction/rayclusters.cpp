@@ -4,7 +4,7 @@
 //
 // Author: Thomas Lowe
 #include "rayclusters.h"
-#include <nabo/nabo.h>
+#include "../rayneighbourindex.h"
 
 namespace ray
 {
@@ -15,18 +15,12 @@ void clustersAgglomerate(const std::vector<Eigen::Vector3d> &points, double min_
 {
   // 1. get nearest neighbours for each point
   const int search_size = std::min(8, static_cast<int>(points.size()) - 1);
-  Eigen::MatrixXd points_p(3, points.size());
-  for (unsigned int i = 0; i < points.size(); i++)
-  {
-    points_p.col(i) = points[i];
-  }
-  Nabo::NNSearchD *nns = Nabo::NNSearchD::createKDTreeLinearHeap(points_p, 3);
+  NeighbourIndex neighbour_index;
+  neighbour_index.build(points);
   // Run the search
   Eigen::MatrixXi indices;
   Eigen::MatrixXd dists2;
-  indices.resize(search_size, points.size());
-  dists2.resize(search_size, points.size());
-  nns->knn(points_p, indices, dists2, search_size, kNearestNeighbourEpsilon, 0, min_diameter);
+  neighbour_index.knn(neighbour_index.points(), search_size, indices, dists2, min_diameter);
 
   // temporary node structure in order to sort the neighbours by distance
   struct Nd
@@ -42,7 +36,7 @@ void clustersAgglomerate(const std::vector<Eigen::Vector3d> &points, double min_
   std::vector<Nd> nds;
   for (size_t i = 0; i < points.size(); i++)
   {
-    for (int j = 0; j < search_size && indices(j, i) != Nabo::NNSearchD::InvalidIndex; j++)
+    for (int j = 0; j < search_size && indices(j, i) != NeighbourIndex::kInvalidIndex; j++)
     {
       nds.push_back(Nd(static_cast<int>(i), indices(j, i), dists2(j, i)));
     }
@@ -3,12 +3,12 @@
 // ABN 41 687 119 230
 //
 // Author: Thomas Lowe
-#include <nabo/nabo.h>
 #include "rayleaves.h"
 #include "../rayrenderer.h"
 #include "../raycuboid.h"
 #include "../rayply.h"
 #include "../raymesh.h"
+#include "../rayneighbourindex.h"
 #include "../rayforeststructure.h"
 #define STB_IMAGE_IMPLEMENTATION
 #include "raylib/imageread.h"
@@ -110,14 +110,12 @@ bool generateLeaves(const std::string &cloud_stub, const std::string &trees_file
         }
       }
     }
-    Nabo::NNSearchD *nns = Nabo::NNSearchD::createKDTreeLinearHeap(points_p, 3);
+    NeighbourIndex neighbour_index;
+    neighbour_index.build(std::move(points_p));
     Eigen::MatrixXi indices;
     Eigen::MatrixXd dists2;
-    indices.resize(search_size, q_size);
-    dists2.resize(search_size, q_size);
     const double max_distance = 2.0; 
-    nns->knn(points_q, indices, dists2, search_size, kNearestNeighbourEpsilon, 0, max_distance);
-    delete nns;
+    neighbour_index.knn(points_q, search_size, indices, dists2, max_distance);
 
     // Convert these set of nearest neighbours into surfels
     for (int i = 0; i < (int)grid.voxels().size(); i++)
@@ -125,7 +123,7 @@ bool generateLeaves(const std::string &cloud_stub, const std::string &trees_file
       int id = dense_voxel_indices[i];
       if (id != -1)
       {
-        for (int j = 0; j < search_size && indices(j, id) != Nabo::NNSearchD::InvalidIndex; j++) 
+        for (int j = 0; j < search_size && indices(j, id) != NeighbourIndex::kInvalidIndex; j++) 
         {
           neighbour_segments[i].push_back(indices(j, id));
         }
@@ -4,7 +4,7 @@
 //
 // Author: Thomas Lowe
 #include "raysegment.h"
-#include <nabo/nabo.h>
+#include "../rayneighbourindex.h"
 #include "rayterrain.h"
 #include <queue>
 
@@ -52,13 +52,12 @@ void connectPointsShortestPath(
   {
     points_p.col(i) = points[i].pos;
   }
-  Nabo::NNSearchD *nns = Nabo::NNSearchD::createKDTreeLinearHeap(points_p, 3);
+  NeighbourIndex neighbour_index;
+  neighbour_index.build(std::move(points_p));
   // Run the search
   Eigen::MatrixXi indices;
   Eigen::MatrixXd dists2;
-  indices.resize(search_size, points.size());
-  dists2.resize(search_size, points.size());
-  nns->knn(points_p, indices, dists2, search_size, kNearestNeighbourEpsilon, 0, distance_limit);
+  neighbour_index.knn(neighbour_index.points(), search_size, indices, dists2, distance_limit);
 
   // 2. climb up from lowest points, this part is based on Djikstra's algorithm
   while (!closest_node.empty())
@@ -68,7 +67,7 @@ void connectPointsShortestPath(
     if (!points[node.id].visited)
     {
       // for each unvisited point, look at its nearest neighbours
-      for (int i = 0; i < search_size && indices(i, node.id) != Nabo::NNSearchD::InvalidIndex; i++)
+      for (int i = 0; i < search_size && indices(i, node.id) != NeighbourIndex::kInvalidIndex; i++)
       {
         const int child = indices(i, node.id);
         const double dist2 = dists2(i, node.id);  // square distance to neighbour
@@ -9,11 +9,7 @@
 #include "../rayply.h"
 #include "../rayprogress.h"
 #include "../rayprogressthread.h"
-
-#if RAYLIB_WITH_TBB
-#include <tbb/enumerable_thread_specific.h>
-#include <tbb/parallel_for.h>
-#endif  // RAYLIB_WITH_TBB
+#include "../raythreads.h"
 static int num_visits = 0;
 static int num_cone_tests = 0;
 
@@ -174,15 +170,7 @@ void Terrain::getParetoFront(const std::vector<Vector4d> &points, std::vector<Ve
     else
       nodes[n].is_set = 1;
   };
-#if RAYLIB_WITH_TBB
-  tbb::parallel_for<size_t>(0, nodes.size(), process_rays);
-#else
-  #pragma omp parallel for
-  for (size_t n = 0; n < nodes.size(); n++)
-  {
-    process_rays(n);
-  }
-#endif
+  parallelFor(0, nodes.size(), process_rays);
   for (auto &node : nodes)
   {
     if (node.is_set)
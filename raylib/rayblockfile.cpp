@@ -0,0 +1,548 @@
+// Copyright (c) 2020
+// Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+// ABN 41 687 119 230
+//
+// Author: Thomas Lowe
+#include "rayblockfile.h"
+#include "raymappedfile.h"
+#include "raymemory.h"
+#include "raythreads.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <iostream>
+#include <limits>
+
+namespace ray
+{
+namespace
+{
+const char kMagic[8] = { 'R', 'A', 'Y', 'B', 'L', 'O', 'C', 'K' };
+const uint32_t kVersion = 1;
+/// bits per component of the octahedral ray direction
+const int kDirectionBits = 20;
+const double kDirectionScale = static_cast<double>((1 << (kDirectionBits - 1)) - 1);
+
+/// The columns of a block, each encoded independently
+enum Column
+{
+  kColEndX,
+  kColEndY,
+  kColEndZ,
+  kColTime,
+  kColDirU,
+  kColDirV,
+  kColLength,
+  kColRed,
+  kColGreen,
+  kColBlue,
+  kColAlpha,
+  kNumColumns
+};
+
+/// The file header. The ray count, block count and index offset are filled in by @c RayBlockWriter::end()
+struct FileHeader
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t direction_bits;
+  double position_resolution;
+  double time_resolution;
+  uint64_t num_rays;
+  uint64_t num_blocks;
+  uint64_t index_offset;
+};
+
+/// The header at the start of each block
+struct BlockHeader
+{
+  uint64_t num_rays;
+  uint64_t column_bytes[kNumColumns];
+  double origin[3];
+  double min_bound[3];
+  double max_bound[3];
+  double min_time;
+  double max_time;
+};
+
+/// An entry of the block index at the end of the file
+struct IndexEntry
+{
+  uint64_t offset;
+  uint64_t num_rays;
+  double min_bound[3];
+  double max_bound[3];
+  double min_time;
+  double max_time;
+};
+
+inline uint64_t zigzag(int64_t value)
+{
+  return (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63);
+}
+
+inline int64_t unzigzag(uint64_t value)
+{
+  return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+}
+
+/// append @c value as a little-endian base 128 varint
+inline void putVarint(std::vector<uint8_t> &out, uint64_t value)
+{
+  while (value >= 0x80)
+  {
+    out.push_back(static_cast<uint8_t>(value | 0x80));
+    value >>= 7;
+  }
+  out.push_back(static_cast<uint8_t>(value));
+}
+
+/// read a varint at @c data, which is advanced. Returns false if the varint runs past @c end
+inline bool getVarint(const uint8_t *&data, const uint8_t *end, uint64_t &value)
+{
+  value = 0;
+  for (int shift = 0; shift < 64 && data < end; shift += 7)
+  {
+    const uint8_t byte = *data++;
+    value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+    if (!(byte & 0x80))
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+/// A column under construction, holding the delta encoded values of one field
+struct ColumnEncoder
+{
+  std::vector<uint8_t> bytes;
+  int64_t previous = 0;
+  void add(int64_t value)
+  {
+    putVarint(bytes, zigzag(value - previous));
+    previous = value;
+  }
+};
+
+/// Reads back the values of a @c ColumnEncoder column
+struct ColumnDecoder
+{
+  const uint8_t *data;
+  const uint8_t *end;
+  int64_t previous = 0;
+  bool valid = true;
+  ColumnDecoder(const uint8_t *data, size_t size)
+    : data(data)
+    , end(data + size)
+  {}
+  int64_t next()
+  {
+    uint64_t value = 0;
+    valid = getVarint(data, end, value) && valid;
+    previous += unzigzag(value);
+    return previous;
+  }
+};
+
+/// octahedral mapping of the unit vector @c dir onto the square [-1,1]^2
+Eigen::Vector2d encodeOctahedral(const Eigen::Vector3d &dir)
+{
+  const Eigen::Vector3d n = dir / (std::abs(dir[0]) + std::abs(dir[1]) + std::abs(dir[2]));
+  if (n[2] >= 0.0)
+  {
+    return Eigen::Vector2d(n[0], n[1]);
+  }
+  return Eigen::Vector2d((1.0 - std::abs(n[1])) * (n[0] >= 0.0 ? 1.0 : -1.0),
+                         (1.0 - std::abs(n[0])) * (n[1] >= 0.0 ? 1.0 : -1.0));
+}
+
+Eigen::Vector3d decodeOctahedral(double u, double v)
+{
+  Eigen::Vector3d n(u, v, 1.0 - std::abs(u) - std::abs(v));
+  if (n[2] < 0.0)
+  {
+    n[0] = (1.0 - std::abs(v)) * (u >= 0.0 ? 1.0 : -1.0);
+    n[1] = (1.0 - std::abs(u)) * (v >= 0.0 ? 1.0 : -1.0);
+  }
+  return n.normalized();
+}
+
+inline int64_t quantise(double value, double resolution)
+{
+  return static_cast<int64_t>(std::llround(value / resolution));
+}
+
+/// decode the block at @c data into the ray vectors, from index @c out_index. Returns false if the block is corrupt
+bool decodeBlock(const uint8_t *data, size_t size, const FileHeader &file_header, const RayBlockInfo &block,
+                 std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends, std::vector<double> &times,
+                 std::vector<RGBA> &colours, size_t out_index)
+{
+  BlockHeader header;
+  if (size < sizeof(BlockHeader))
+  {
+    return false;
+  }
+  memcpy(&header, data, sizeof(BlockHeader));
+  if (header.num_rays != block.num_rays)
+  {
+    return false;
+  }
+  const uint8_t *column_start = data + sizeof(BlockHeader);
+  std::vector<ColumnDecoder> columns;
+  columns.reserve(kNumColumns);
+  size_t total = sizeof(BlockHeader);
+  for (int c = 0; c < kNumColumns; c++)
+  {
+    total += header.column_bytes[c];
+    if (total > size)
+    {
+      return false;
+    }
+    columns.emplace_back(column_start, header.column_bytes[c]);
+    column_start += header.column_bytes[c];
+  }
+
+  const double res = file_header.position_resolution;
+  const Eigen::Vector3d origin(header.origin[0], header.origin[1], header.origin[2]);
+  for (size_t i = 0; i < header.num_rays; i++)
+  {
+    const size_t j = out_index + i;
+    ends[j] = origin + res * Eigen::Vector3d(static_cast<double>(columns[kColEndX].next()),
+                                             static_cast<double>(columns[kColEndY].next()),
+                                             static_cast<double>(columns[kColEndZ].next()));
+    times[j] = header.min_time + file_header.time_resolution * static_cast<double>(columns[kColTime].next());
+    const double u = static_cast<double>(columns[kColDirU].next()) / kDirectionScale;
+    const double v = static_cast<double>(columns[kColDirV].next()) / kDirectionScale;
+    const int64_t length = columns[kColLength].next();
+    starts[j] = length == 0 ? ends[j] :
+                              Eigen::Vector3d(ends[j] + decodeOctahedral(u, v) * (res * static_cast<double>(length)));
+    colours[j].red = static_cast<uint8_t>(columns[kColRed].next());
+    colours[j].green = static_cast<uint8_t>(columns[kColGreen].next());
+    colours[j].blue = static_cast<uint8_t>(columns[kColBlue].next());
+    colours[j].alpha = static_cast<uint8_t>(columns[kColAlpha].next());
+  }
+  for (auto &column : columns)
+  {
+    if (!column.valid)
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+/// map the file and check its header
+bool openBlockFile(const std::string &file_name, MappedFile &file, FileHeader &header)
+{
+  if (!file.open(file_name))
+  {
+    std::cerr << "Error: cannot open " << file_name << std::endl;
+    return false;
+  }
+  if (file.size() < sizeof(FileHeader))
+  {
+    std::cerr << "Error: " << file_name << " is too small to be a .rcb file" << std::endl;
+    return false;
+  }
+  memcpy(&header, file.data(), sizeof(FileHeader));
+  if (memcmp(header.magic, kMagic, sizeof(kMagic)) != 0 || header.version != kVersion ||
+      header.direction_bits != kDirectionBits)
+  {
+    std::cerr << "Error: " << file_name << " is not a supported .rcb file" << std::endl;
+    return false;
+  }
+  // written so that a corrupt block count cannot overflow
+  if (header.index_offset == 0 || header.index_offset > file.size() ||
+      header.num_blocks > (file.size() - header.index_offset) / sizeof(IndexEntry))
+  {
+    std::cerr << "Error: " << file_name
+              << " has a missing or corrupt block index, the file may not have been fully written" << std::endl;
+    return false;
+  }
+  return true;
+}
+
+/// read the block index of the mapped @c file. Returns false if an entry is inconsistent with the file, so that a
+/// corrupt ray count is not used to size the decoded rays
+bool readIndex(const std::string &file_name, const MappedFile &file, const FileHeader &header,
+               std::vector<RayBlockInfo> &blocks)
+{
+  blocks.resize(header.num_blocks);
+  uint64_t remaining_rays = header.num_rays;
+  for (size_t b = 0; b < blocks.size(); b++)
+  {
+    IndexEntry entry;
+    memcpy(&entry, file.data() + header.index_offset + b * sizeof(IndexEntry), sizeof(IndexEntry));
+    // each ray of a block takes at least one byte in each column, and the blocks are before the index. Written so
+    // that corrupt values cannot overflow
+    if (entry.offset < sizeof(FileHeader) || entry.offset > header.index_offset ||
+        header.index_offset - entry.offset < sizeof(BlockHeader) || entry.num_rays > remaining_rays ||
+        entry.num_rays > (header.index_offset - entry.offset - sizeof(BlockHeader)) / kNumColumns)
+    {
+      std::cerr << "Error: " << file_name << " has a corrupt entry in its block index" << std::endl;
+      blocks.clear();
+      return false;
+    }
+    remaining_rays -= entry.num_rays;
+    RayBlockInfo &block = blocks[b];
+    block.offset = entry.offset;
+    block.num_rays = entry.num_rays;
+    block.min_bound = Eigen::Vector3d(entry.min_bound[0], entry.min_bound[1], entry.min_bound[2]);
+    block.max_bound = Eigen::Vector3d(entry.max_bound[0], entry.max_bound[1], entry.max_bound[2]);
+    block.min_time = entry.min_time;
+    block.max_time = entry.max_time;
+  }
+  return true;
+}
+}  // namespace
+
+bool isRayBlockFile(const std::string &file_name)
+{
+  return file_name.size() > 4 && file_name.substr(file_name.size() - 4) == ".rcb";
+}
+
+bool RayBlockWriter::begin(const std::string &file_name, const RayBlockOptions &options)
+{
+  if (!(options.position_resolution > 0.0) || !(options.time_resolution > 0.0) || options.rays_per_block == 0)
+  {
+    std::cerr << "Error: invalid .rcb options" << std::endl;
+    return false;
+  }
+  out_.open(file_name, std::ios::binary | std::ios::out);
+  if (out_.fail())
+  {
+    std::cerr << "Error: cannot open " << file_name << " for writing." << std::endl;
+    return false;
+  }
+  options_ = options;
+  blocks_.clear();
+  num_rays_ = 0;
+  has_warned_ = false;
+  FileHeader header;
+  memset(&header, 0, sizeof(FileHeader));
+  memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.version = kVersion;
+  header.direction_bits = kDirectionBits;
+  header.position_resolution = options.position_resolution;
+  header.time_resolution = options.time_resolution;
+  out_.write(reinterpret_cast<const char *>(&header), sizeof(FileHeader));
+  return out_.good();
+}
+
+bool RayBlockWriter::writeChunk(const std::vector<Eigen::Vector3d> &starts, const std::vector<Eigen::Vector3d> &ends,
+                                const std::vector<double> &times, const std::vector<RGBA> &colours)
+{
+  for (size_t i = 0; i < ends.size(); i++)
+  {
+    if (!(ends[i] == ends[i]) || !(starts[i] == starts[i]))
+    {
+      if (!has_warned_)
+      {
+        std::cout << "WARNING: nans in ray: " << i << ", removing all such rays" << std::endl;
+        has_warned_ = true;
+      }
+      continue;
+    }
+    starts_.push_back(starts[i]);
+    ends_.push_back(ends[i]);
+    times_.push_back(times[i]);
+    colours_.push_back(colours[i]);
+    if (ends_.size() >= options_.rays_per_block && !writeBlock())
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool RayBlockWriter::writeBlock()
+{
+  if (ends_.empty())
+  {
+    return true;
+  }
+  BlockHeader header;
+  memset(&header, 0, sizeof(BlockHeader));
+  header.num_rays = ends_.size();
+  Eigen::Vector3d origin = ends_[0], min_bound = ends_[0], max_bound = ends_[0];
+  header.min_time = header.max_time = times_[0];
+  for (size_t i = 0; i < ends_.size(); i++)
+  {
+    origin = minVector(origin, ends_[i]);
+    min_bound = minVector(min_bound, minVector(ends_[i], starts_[i]));
+    max_bound = maxVector(max_bound, maxVector(ends_[i], starts_[i]));
+    header.min_time = std::min(header.min_time, times_[i]);
+    header.max_time = std::max(header.max_time, times_[i]);
+  }
+  for (int k = 0; k < 3; k++)
+  {
+    header.origin[k] = origin[k];
+    header.min_bound[k] = min_bound[k];
+    header.max_bound[k] = max_bound[k];
+  }
+
+  const double res = options_.position_resolution;
+  std::vector<ColumnEncoder> columns(kNumColumns);
+  for (size_t i = 0; i < ends_.size(); i++)
+  {
+    const Eigen::Vector3d end = ends_[i] - origin;
+    columns[kColEndX].add(quantise(end[0], res));
+    columns[kColEndY].add(quantise(end[1], res));
+    columns[kColEndZ].add(quantise(end[2], res));
+    columns[kColTime].add(quantise(times_[i] - header.min_time, options_.time_resolution));
+    const Eigen::Vector3d ray = starts_[i] - ends_[i];
+    const double length = ray.norm();
+    Eigen::Vector2d uv(0, 0);
+    if (length > 0.0)
+    {
+      uv = encodeOctahedral(ray / length);
+    }
+    columns[kColDirU].add(static_cast<int64_t>(std::llround(uv[0] * kDirectionScale)));
+    columns[kColDirV].add(static_cast<int64_t>(std::llround(uv[1] * kDirectionScale)));
+    columns[kColLength].add(quantise(length, res));
+    columns[kColRed].add(colours_[i].red);
+    columns[kColGreen].add(colours_[i].green);
+    columns[kColBlue].add(colours_[i].blue);
+    columns[kColAlpha].add(colours_[i].alpha);
+  }
+  for (int c = 0; c < kNumColumns; c++)
+  {
+    header.column_bytes[c] = columns[c].bytes.size();
+  }
+
+  RayBlockInfo block;
+  block.offset = static_cast<uint64_t>(out_.tellp());
+  block.num_rays = header.num_rays;
+  block.min_bound = min_bound;
+  block.max_bound = max_bound;
+  block.min_time = header.min_time;
+  block.max_time = header.max_time;
+  blocks_.push_back(block);
+
+  out_.write(reinterpret_cast<const char *>(&header), sizeof(BlockHeader));
+  for (auto &column : columns)
+  {
+    out_.write(reinterpret_cast<const char *>(column.bytes.data()), column.bytes.size());
+  }
+  num_rays_ += ends_.size();
+  starts_.clear();
+  ends_.clear();
+  times_.clear();
+  colours_.clear();
+  if (!out_.good())
+  {
+    std::cerr << "error writing to file" << std::endl;
+    return false;
+  }
+  return true;
+}
+
+unsigned long RayBlockWriter::end()
+{
+  writeBlock();
+  const uint64_t index_offset = static_cast<uint64_t>(out_.tellp());
+  for (const auto &block : blocks_)
+  {
+    IndexEntry entry;
+    entry.offset = block.offset;
+    entry.num_rays = block.num_rays;
+    for (int k = 0; k < 3; k++)
+    {
+      entry.min_bound[k] = block.min_bound[k];
+      entry.max_bound[k] = block.max_bound[k];
+    }
+    entry.min_time = block.min_time;
+    entry.max_time = block.max_time;
+    out_.write(reinterpret_cast<const char *>(&entry), sizeof(IndexEntry));
+  }
+  // fill in the totals, now that they are known
+  const uint64_t num_blocks = blocks_.size();
+  out_.seekp(offsetof(FileHeader, num_rays));
+  out_.write(reinterpret_cast<const char *>(&num_rays_), sizeof(uint64_t));
+  out_.write(reinterpret_cast<const char *>(&num_blocks), sizeof(uint64_t));
+  out_.write(reinterpret_cast<const char *>(&index_offset), sizeof(uint64_t));
+  out_.close();
+  return static_cast<unsigned long>(num_rays_);
+}
+
+bool readRayBlockIndex(const std::string &file_name, std::vector<RayBlockInfo> &blocks)
+{
+  MappedFile file;
+  FileHeader header;
+  if (!openBlockFile(file_name, file, header))
+  {
+    return false;
+  }
+  return readIndex(file_name, file, header, blocks);
+}
+
+bool readRayBlocks(const std::string &file_name,
+                   std::function<void(std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends,
+                                      std::vector<double> &times, std::vector<RGBA> &colours)>
+                     apply,
+                   size_t chunk_size, const Cuboid *bounds)
+{
+  chunk_size = Memory::chunkSize(chunk_size);
+  MappedFile file;
+  FileHeader header;
+  if (!openBlockFile(file_name, file, header))
+  {
+    return false;
+  }
+  file.adviseSequential();
+  std::vector<RayBlockInfo> blocks;
+  if (!readIndex(file_name, file, header, blocks))
+  {
+    return false;
+  }
+  if (bounds)
+  {
+    blocks.erase(std::remove_if(blocks.begin(), blocks.end(),
+                                [bounds](const RayBlockInfo &block) {
+                                  return !bounds->overlaps(Cuboid(block.min_bound, block.max_bound));
+                                }),
+                 blocks.end());
+  }
+
+  std::vector<Eigen::Vector3d> starts, ends;
+  std::vector<double> times;
+  std::vector<RGBA> colours;
+  std::vector<size_t> first_ray;
+  size_t b = 0;
+  while (b < blocks.size())
+  {
+    // gather whole blocks into a chunk of about chunk_size rays
+    const size_t first_block = b;
+    size_t num_rays = 0;
+    first_ray.clear();
+    do
+    {
+      first_ray.push_back(num_rays);
+      num_rays += blocks[b].num_rays;
+      b++;
+    } while (b < blocks.size() && num_rays + blocks[b].num_rays <= chunk_size);
+    starts.resize(num_rays);
+    ends.resize(num_rays);
+    times.resize(num_rays);
+    colours.resize(num_rays);
+
+    const size_t num_chunk_blocks = b - first_block;
+    std::vector<char> valid(num_chunk_blocks, 0);
+    auto decode = [&](size_t i) {
+      const RayBlockInfo &block = blocks[first_block + i];
+      valid[i] = block.offset < file.size() && decodeBlock(file.data() + block.offset, file.size() - block.offset,
+                                                           header, block, starts, ends, times, colours, first_ray[i]);
+    };
+    parallelFor(0, num_chunk_blocks, decode, 1);
+    if (std::find(valid.begin(), valid.end(), 0) != valid.end())
+    {
+      std::cerr << "Error: corrupt block in " << file_name << std::endl;
+      return false;
+    }
+    apply(starts, ends, times, colours);
+  }
+  return true;
+}
+}  // namespace ray
@@ -0,0 +1,97 @@
+// Copyright (c) 2020
+// Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+// ABN 41 687 119 230
+//
+// Author: Thomas Lowe
+#ifndef RAYLIB_RAYBLOCKFILE_H
+#define RAYLIB_RAYBLOCKFILE_H
+
+#include "raylib/raylibconfig.h"
+#include "raycuboid.h"
+#include "rayutils.h"
+
+#include <fstream>
+
+namespace ray
+{
+/// The block compressed ray cloud format (.rcb) is a compact alternative to the ray cloud .ply format.
+/// Rays are stored in blocks, and each block stores its rays column by column:
+/// - end points, quantised to @c position_resolution relative to the block's minimum end point
+/// - times, quantised to @c time_resolution relative to the block's minimum time
+/// - the ray vector from end to start, as a quantised octahedral direction plus a quantised length
+/// - the colour channels
+/// Each column is delta encoded from the previous ray, then stored as zigzag variable length integers. Every block
+/// starts with a header giving its ray bounds and time range, and an index of the block headers is stored at the end of
+/// the file, so that readers can skip blocks without decoding them.
+///
+/// The format is lossy. End points are within half of @c position_resolution of the original, and times within
+/// half of @c time_resolution. Ray starts also carry the direction quantisation, about 3e-6 radians.
+struct RAYLIB_EXPORT RayBlockOptions
+{
+  /// spacing of the position quantisation, in metres
+  double position_resolution = 0.001;
+  /// spacing of the time quantisation, in seconds
+  double time_resolution = 1e-6;
+  /// the number of rays per block. Smaller blocks give finer grained block bounds, at a small cost in file size
+  size_t rays_per_block = 65536;
+};
+
+/// Summary of one block of a .rcb file, as stored in the file's block index
+struct RAYLIB_EXPORT RayBlockInfo
+{
+  /// byte offset of the block in the file
+  uint64_t offset;
+  uint64_t num_rays;
+  /// bounds of the rays in the block, both starts and ends
+  Eigen::Vector3d min_bound, max_bound;
+  double min_time, max_time;
+};
+
+/// whether @c file_name has the .rcb extension of the block compressed ray cloud format
+bool RAYLIB_EXPORT isRayBlockFile(const std::string &file_name);
+
+/// Chunked writer of .rcb files.
+class RAYLIB_EXPORT RayBlockWriter
+{
+public:
+  /// open the file to write to
+  bool begin(const std::string &file_name, const RayBlockOptions &options = RayBlockOptions());
+  /// add a set of rays to the file. These are written whenever a block is filled. Rays containing NaNs are skipped.
+  bool writeChunk(const std::vector<Eigen::Vector3d> &starts, const std::vector<Eigen::Vector3d> &ends,
+                  const std::vector<double> &times, const std::vector<RGBA> &colours);
+  /// write the final partial block and the block index. Returns the number of rays written.
+  unsigned long end();
+  /// whether the file has been written without error so far
+  bool good() const { return out_.good(); }
+
+private:
+  bool writeBlock();
+
+  std::ofstream out_;
+  RayBlockOptions options_;
+  /// the rays of the block being filled
+  std::vector<Eigen::Vector3d> starts_, ends_;
+  std::vector<double> times_;
+  std::vector<RGBA> colours_;
+  /// buffer for the encoded block, reused between blocks
+  std::vector<uint8_t> encoded_;
+  std::vector<RayBlockInfo> blocks_;
+  uint64_t num_rays_ = 0;
+  bool has_warned_ = false;
+};
+
+/// read the block index of a .rcb file
+bool RAYLIB_EXPORT readRayBlockIndex(const std::string &file_name, std::vector<RayBlockInfo> &blocks);
+
+/// read a .rcb file one chunk at a time, calling @c apply on each chunk in file order. Each chunk is made of whole
+/// blocks and holds about @c chunk_size rays. The blocks within a chunk are decoded in parallel.
+/// If @c bounds is given then only the blocks that overlap it are read.
+bool RAYLIB_EXPORT readRayBlocks(const std::string &file_name,
+                                 std::function<void(std::vector<Eigen::Vector3d> &starts,
+                                                    std::vector<Eigen::Vector3d> &ends, std::vector<double> &times,
+                                                    std::vector<RGBA> &colours)>
+                                   apply,
+                                 size_t chunk_size = 1000000, const Cuboid *bounds = nullptr);
+}  // namespace ray
+
+#endif  // RAYLIB_RAYBLOCKFILE_H
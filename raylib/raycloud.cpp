@@ -5,12 +5,18 @@
 // Author: Thomas Lowe
 #include "raycloud.h"
 
+#include "rayblockfile.h"
+#include "raycloudindex.h"
+#include "raycompactcloud.h"
 #include "raylaz.h"
+#include "rayneighbourindex.h"
 #include "rayply.h"
 #include "rayprogress.h"
+#include "raysort.h"
+#include "raythreads.h"
 
-#include <nabo/nabo.h>
-
+#include <cstring>
+#include <fstream>
 #include <iostream>
 #include <limits>
 #include <set>
@@ -29,17 +35,49 @@ void Cloud::clear()
 void Cloud::save(const std::string &file_name) const
 {
   std::string name = file_name;
+  if (isRayBlockFile(name))
+  {
+    RayBlockWriter writer;
+    if (writer.begin(name) && writer.writeChunk(starts, ends, times, colours))
+    {
+      writer.end();
+    }
+    return;
+  }
   writePlyRayCloud(name, starts, ends, times, colours);
 }
 
 bool Cloud::load(const std::string &file_name, bool check_extension, int min_num_rays)
 {
   // look first for the raycloud PLY
+  if (isRayBlockFile(file_name))
+  {
+    clear();
+    // reserve the total of the block sizes, so the vectors don't grow past the cloud size
+    std::vector<RayBlockInfo> blocks;
+    if (readRayBlockIndex(file_name, blocks))
+    {
+      uint64_t num_rays = 0;
+      for (const auto &block : blocks)
+      {
+        num_rays += block.num_rays;
+      }
+      reserve(static_cast<size_t>(num_rays));
+    }
+    auto append = [this](std::vector<Eigen::Vector3d> &chunk_starts, std::vector<Eigen::Vector3d> &chunk_ends,
+                         std::vector<double> &chunk_times, std::vector<RGBA> &chunk_colours) {
+      starts.insert(starts.end(), chunk_starts.begin(), chunk_starts.end());
+      ends.insert(ends.end(), chunk_ends.begin(), chunk_ends.end());
+      times.insert(times.end(), chunk_times.begin(), chunk_times.end());
+      colours.insert(colours.end(), chunk_colours.begin(), chunk_colours.end());
+    };
+    return readRayBlocks(file_name, append) && (int)ends.size() >= min_num_rays;
+  }
   if (file_name.substr(file_name.size() - 4) == ".ply" || !check_extension)
     return loadPLY(file_name, min_num_rays);
 
-  std::cerr << "Attempting to load ray cloud " << file_name << " which doesn't have expected file extension .ply"
-            << std::endl;
+  std::cerr << "Attempting to load ray cloud " << file_name
+            << " which doesn't have expected file extension .ply or .rcb" << std::endl;
   return false;
 }
 
@@ -157,7 +195,7 @@ void Cloud::removeUnboundedRays()
   colours.resize(valids.size());
 }
 
-void Cloud::decimate(double voxel_width, std::set<Eigen::Vector3i, Vector3iLess> &voxel_set)
+void Cloud::decimate(double voxel_width, VoxelSet &voxel_set)
 {
   std::vector<int64_t> subsample;
   voxelSubsample(ends, voxel_width, subsample, voxel_set);
@@ -175,17 +213,45 @@ void Cloud::decimate(double voxel_width, std::set<Eigen::Vector3i, Vector3iLess>
   times.resize(subsample.size());
 }
 
-void Cloud::eigenSolve(const std::vector<int> &ray_ids, const Eigen::MatrixXi &indices, int index, int num_neighbours,
+void Cloud::sortSpatial(double voxel_width)
+{
+  // the voxels are counted from the minimum bound, as in the file sort
+  Eigen::Vector3d min_bound, max_bound;
+  if (!calcBounds(&min_bound, &max_bound))
+  {
+    min_bound.setZero();
+  }
+  // sorting the ray indices with their codes keeps equal codes in their original order
+  std::vector<std::pair<uint64_t, size_t>> order(ends.size());
+  for (size_t i = 0; i < ends.size(); i++)
+  {
+    order[i] = std::make_pair(mortonCode(ends[i], min_bound, voxel_width), i);
+  }
+  std::sort(order.begin(), order.end());
+  auto reorder = [&order](auto &values) {
+    typename std::remove_reference<decltype(values)>::type sorted(values.size());
+    for (size_t i = 0; i < order.size(); i++)
+    {
+      sorted[i] = values[order[i].second];
+    }
+    values.swap(sorted);
+  };
+  reorder(starts);
+  reorder(ends);
+  reorder(times);
+  reorder(colours);
+}
+
+void Cloud::eigenSolve(const std::vector<int> &ray_ids, const int *neighbours, int ray_id, int num_neighbours,
                        Eigen::SelfAdjointEigenSolver<Eigen::Matrix3d> &solver, Eigen::Vector3d &centroid) const
 {
-  int ray_id = ray_ids[index];
   centroid = ends[ray_id];
-  for (int j = 0; j < num_neighbours; j++) centroid += ends[ray_ids[indices(j, index)]];
+  for (int j = 0; j < num_neighbours; j++) centroid += ends[ray_ids[neighbours[j]]];
   centroid /= (double)(num_neighbours + 1);
   Eigen::Matrix3d scatter = (ends[ray_id] - centroid) * (ends[ray_id] - centroid).transpose();
   for (int j = 0; j < num_neighbours; j++)
   {
-    Eigen::Vector3d offset = ends[ray_ids[indices(j, index)]] - centroid;
+    Eigen::Vector3d offset = ends[ray_ids[neighbours[j]]] - centroid;
     scatter += offset * offset.transpose();
   }
   scatter /= (double)(num_neighbours + 1);
@@ -193,11 +259,63 @@ void Cloud::eigenSolve(const std::vector<int> &ray_ids, const Eigen::MatrixXi &i
   ASSERT(solver.info() == Eigen::ComputationInfo::Success);
 }
 
+namespace
+{
+/// the number of points whose surfels are found together, sized so that each batch's neighbour search stays in cache
+const int kSurfelBatchSize = 1024;
+
+/// as Cloud::eigenSolve, in single precision with the closed form 3x3 eigen solver. The neighbours are taken relative
+/// to the point itself, so that large coordinates do not lose precision
+void eigenSolveFloat(const std::vector<Eigen::Vector3d> &ends, const std::vector<int> &ray_ids, const int *neighbours,
+                     int ray_id, int num_neighbours, Eigen::SelfAdjointEigenSolver<Eigen::Matrix3f> &solver,
+                     Eigen::Vector3d &centroid)
+{
+  const Eigen::Vector3d &origin = ends[ray_id];
+  Eigen::Vector3f mean(0, 0, 0);
+  for (int j = 0; j < num_neighbours; j++)
+  {
+    mean += (ends[ray_ids[neighbours[j]]] - origin).cast<float>();
+  }
+  mean /= static_cast<float>(num_neighbours + 1);
+  Eigen::Matrix3f scatter = mean * mean.transpose();
+  for (int j = 0; j < num_neighbours; j++)
+  {
+    const Eigen::Vector3f offset = (ends[ray_ids[neighbours[j]]] - origin).cast<float>() - mean;
+    scatter += offset * offset.transpose();
+  }
+  scatter /= static_cast<float>(num_neighbours + 1);
+  centroid = origin + mean.cast<double>();
+  solver.computeDirect(scatter);
+}
+}  // namespace
+
 void Cloud::getSurfels(int search_size, std::vector<Eigen::Vector3d> *centroids, std::vector<Eigen::Vector3d> *normals,
                        std::vector<Eigen::Vector3d> *dimensions, std::vector<Eigen::Matrix3d> *mats,
-                       Eigen::MatrixXi *neighbour_indices, double max_distance, bool reject_back_facing_rays) const
+                       Eigen::MatrixXi *neighbour_indices, double max_distance, bool reject_back_facing_rays,
+                       bool float_precision) const
+{
+  NeighbourIndex index;
+  index.build(*this);
+  surfelsFromNeighbours(index, nullptr, search_size, centroids, normals, dimensions, mats, neighbour_indices,
+                        max_distance, reject_back_facing_rays, float_precision);
+}
+
+void Cloud::getSurfels(const NeighbourIndex &index, int search_size, std::vector<Eigen::Vector3d> *centroids,
+                       std::vector<Eigen::Vector3d> *normals, std::vector<Eigen::Vector3d> *dimensions,
+                       std::vector<Eigen::Matrix3d> *mats, Eigen::MatrixXi *neighbour_indices, double max_distance,
+                       bool reject_back_facing_rays, bool float_precision) const
+{
+  const NeighbourIndex::SelfSearch *search = index.findSelfSearch(search_size, max_distance);
+  surfelsFromNeighbours(index, search ? &search->indices : nullptr, search_size, centroids, normals, dimensions, mats,
+                        neighbour_indices, max_distance, reject_back_facing_rays, float_precision);
+}
+
+void Cloud::surfelsFromNeighbours(const NeighbourIndex &index, const Eigen::MatrixXi *indices, int search_size,
+                                  std::vector<Eigen::Vector3d> *centroids, std::vector<Eigen::Vector3d> *normals,
+                                  std::vector<Eigen::Vector3d> *dimensions, std::vector<Eigen::Matrix3d> *mats,
+                                  Eigen::MatrixXi *neighbour_indices, double max_distance,
+                                  bool reject_back_facing_rays, bool float_precision) const
 {
-  // simplest scheme... find 3 nearest neighbours and do cross product
   if (centroids)
     centroids->resize(ends.size());
   if (normals)
@@ -206,157 +324,286 @@ void Cloud::getSurfels(int search_size, std::vector<Eigen::Vector3d> *centroids,
     dimensions->resize(ends.size());
   if (mats)
     mats->resize(ends.size());
-  Nabo::NNSearchD *nns;
-  std::vector<int> ray_ids;
-  ray_ids.reserve(ends.size());
-  for (unsigned int i = 0; i < ends.size(); i++)
-    if (rayBounded(i))
-      ray_ids.push_back(i);
-  Eigen::MatrixXd points_p(3, ray_ids.size());
-  for (unsigned int i = 0; i < ray_ids.size(); i++) points_p.col(i) = ends[ray_ids[i]];
-  nns = Nabo::NNSearchD::createKDTreeLinearHeap(points_p, 3);
-
-  // Run the search
-  Eigen::MatrixXi indices;
-  Eigen::MatrixXd dists2;
-  indices.resize(search_size, ray_ids.size());
-  dists2.resize(search_size, ray_ids.size());
-  if (max_distance != 0.0)
-    nns->knn(points_p, indices, dists2, search_size, kNearestNeighbourEpsilon, 0, max_distance);
-  else
-    nns->knn(points_p, indices, dists2, search_size, kNearestNeighbourEpsilon, 0);
-  delete nns;
-
   if (neighbour_indices)
   {
-    neighbour_indices->resize(search_size, ends.size());
-    for (int i = 0; i<neighbour_indices->rows(); i++)
+    neighbour_indices->resize(std::max(search_size, 0), ends.size());
+    neighbour_indices->setConstant(-1);
+  }
+  const bool fit_surfels = centroids || normals || dimensions || mats;
+  const std::vector<int> &ray_ids = index.rayIds();
+  const int num_points = static_cast<int>(ray_ids.size());
+
+  const auto process_batch = [&](size_t batch) {
+    const int first = static_cast<int>(batch) * kSurfelBatchSize;
+    const int count = std::min(kSurfelBatchSize, num_points - first);
+    // the neighbour indices of this batch's points, read in place from a full search, or searched for the batch
+    Eigen::MatrixXi batch_indices;
+    if (!indices)
     {
-      for (int j = 0; j < neighbour_indices->cols(); j++)
-      {
-        (*neighbour_indices)(i, j) = -1;
-      }
+      Eigen::MatrixXd dists2;
+      index.knn(index.points().middleCols(first, count), search_size, batch_indices, dists2, max_distance);
     }
-    for (int i = 0; i < (int)ray_ids.size(); i++)
+    const Eigen::MatrixXi &found = indices ? *indices : batch_indices;
+    const int found_first = indices ? first : 0;
+    std::vector<int> kept_neighbours(std::max(search_size, 0));  // for removing back facing neighbours
+    Eigen::SelfAdjointEigenSolver<Eigen::Matrix3d> eigen_solver(3);
+    Eigen::SelfAdjointEigenSolver<Eigen::Matrix3f> eigen_solver_float(3);
+    for (int i = 0; i < count; i++)
     {
-      int ray_id = ray_ids[i];
-      for (int j = 0; j < search_size && indices(j, i) != Nabo::NNSearchD::InvalidIndex; j++) 
+      const int ray_id = ray_ids[first + i];
+      const int *neighbours = found.data() + static_cast<Eigen::Index>(found_first + i) * found.rows();
+      int num_neighbours;
+      for (num_neighbours = 0;
+           num_neighbours < search_size && neighbours[num_neighbours] != NeighbourIndex::kInvalidIndex;
+           num_neighbours++)
       {
-        (*neighbour_indices)(j, ray_id) = ray_ids[indices(j, i)];
       }
-    }
-  }
-  if (centroids || normals || dimensions || mats)
-  {
-    for (int i = 0; i < (int)ray_ids.size(); i++)
-    {
-      int ray_id = ray_ids[i];
-      Eigen::Vector3d centroid;
-      int num_neighbours;
-      for (num_neighbours = 0; num_neighbours < search_size && indices(num_neighbours, i) != Nabo::NNSearchD::InvalidIndex; num_neighbours++){}
+      if (neighbour_indices)
+      {
+        for (int j = 0; j < num_neighbours; j++)
+        {
+          (*neighbour_indices)(j, ray_id) = ray_ids[neighbours[j]];
+        }
+      }
+      if (!fit_surfels)
+        continue;
 
-      Eigen::SelfAdjointEigenSolver<Eigen::Matrix3d> eigen_solver(3);
-      eigenSolve(ray_ids, indices, i, num_neighbours, eigen_solver, centroid);
+      // convert the neighbours' offsets into an ellipsoid of best fit
+      Eigen::Vector3d centroid;
+      Eigen::Vector3d eigenvalues;
+      Eigen::Matrix3d eigenvectors;
+      const auto solve = [&]() {
+        if (float_precision)
+        {
+          eigenSolveFloat(ends, ray_ids, neighbours, ray_id, num_neighbours, eigen_solver_float, centroid);
+          eigenvalues = eigen_solver_float.eigenvalues().cast<double>();
+          eigenvectors = eigen_solver_float.eigenvectors().cast<double>();
+        }
+        else
+        {
+          eigenSolve(ray_ids, neighbours, ray_id, num_neighbours, eigen_solver, centroid);
+          eigenvalues = eigen_solver.eigenvalues();
+          eigenvectors = eigen_solver.eigenvectors();
+        }
+      };
+      solve();
       if (reject_back_facing_rays)
       {
-        Eigen::Vector3d normal = eigen_solver.eigenvectors().col(0);
+        Eigen::Vector3d normal = eigenvectors.col(0);
         if ((ends[ray_id] - starts[ray_id]).dot(normal) > 0.0)
           normal = -normal;
         bool changed = false;
         for (int j = num_neighbours - 1; j >= 0; j--)
         {
-          int id = ray_ids[indices(j, i)];
+          int id = ray_ids[neighbours[j]];
           if ((ends[id] - starts[id]).dot(normal) > 0.0)
           {
-            indices(j, i) = indices(--num_neighbours, i);
+            if (!changed)  // the search results are shared, so remove from a copy of this point's neighbours
+            {
+              std::copy(neighbours, neighbours + num_neighbours, kept_neighbours.begin());
+              neighbours = kept_neighbours.data();
+            }
+            kept_neighbours[j] = kept_neighbours[--num_neighbours];
             changed = true;
           }
         }
         if (changed)
         {
-          eigenSolve(ray_ids, indices, i, num_neighbours, eigen_solver, centroid);
+          solve();
         }
-      }   
+      }
       if (centroids)
         (*centroids)[ray_id] = centroid;
       if (normals)
       {
-        Eigen::Vector3d normal = eigen_solver.eigenvectors().col(0);
+        Eigen::Vector3d normal = eigenvectors.col(0);
         if ((ends[ray_id] - starts[ray_id]).dot(normal) > 0.0)
           normal = -normal;
         (*normals)[ray_id] = normal;
       }
       if (dimensions)
       {
-        Eigen::Vector3d eigenvals = maxVector(Eigen::Vector3d(1e-10, 1e-10, 1e-10), eigen_solver.eigenvalues());
+        Eigen::Vector3d eigenvals = maxVector(Eigen::Vector3d(1e-10, 1e-10, 1e-10), eigenvalues);
         (*dimensions)[ray_id] =
           Eigen::Vector3d(std::sqrt(eigenvals[0]), std::sqrt(eigenvals[1]), std::sqrt(eigenvals[2]));
       }
       if (mats)
-        (*mats)[ray_id] = eigen_solver.eigenvectors();
+        (*mats)[ray_id] = eigenvectors;
     }
-  }
+  };
+  if (!neighbour_indices && !fit_surfels)
+    return;
+  const int num_batches = (num_points + kSurfelBatchSize - 1) / kSurfelBatchSize;
+  parallelFor(0, num_batches, process_batch, 1);
 }
 
 // starts are required to get the normal the right way around
-std::vector<Eigen::Vector3d> Cloud::generateNormals(int search_size)
+std::vector<Eigen::Vector3d> Cloud::generateNormals(int search_size, bool approximate)
 {
+  NeighbourIndex index;
+  if (approximate)
+  {
+    index.buildApproximate(*this, 0.0, search_size);
+  }
+  else
+  {
+    index.build(*this);
+  }
   std::vector<Eigen::Vector3d> normals;
-  getSurfels(search_size, nullptr, &normals, nullptr, nullptr, nullptr);
+  surfelsFromNeighbours(index, nullptr, search_size, nullptr, &normals, nullptr, nullptr, nullptr, 0.0, true, false);
   return normals;
 }
 
-bool RAYLIB_EXPORT Cloud::getInfo(const std::string &file_name, Info &info)
+void Cloud::Info::reset()
 {
   double min_s = std::numeric_limits<double>::max();
   double max_s = std::numeric_limits<double>::lowest();
   Eigen::Vector3d min_v(min_s, min_s, min_s);
   Eigen::Vector3d max_v(max_s, max_s, max_s);
   Cuboid unbounded(min_v, max_v);
-  info.ends_bound = info.starts_bound = info.rays_bound = unbounded;
-  info.num_rays = info.num_bounded = 0;
-  info.min_time = min_s;
-  info.max_time = max_s;
-  info.centroid.setZero();
-  info.start_pos.setZero();
-  info.end_pos.setZero();
+  ends_bound = starts_bound = rays_bound = unbounded;
+  num_rays = num_bounded = 0;
+  min_time = min_s;
+  max_time = max_s;
+  centroid.setZero();
+  start_pos.setZero();
+  end_pos.setZero();
+}
+
+void Cloud::Info::addRay(const Eigen::Vector3d &start, const Eigen::Vector3d &end, double time, const RGBA &colour)
+{
+  if (colour.alpha > 0)
+  {
+    ends_bound.min_bound_ = minVector(ends_bound.min_bound_, end);
+    ends_bound.max_bound_ = maxVector(ends_bound.max_bound_, end);
+    num_bounded++;
+    centroid += end;
+  }
+  num_rays++;
+  starts_bound.min_bound_ = minVector(starts_bound.min_bound_, start);
+  starts_bound.max_bound_ = maxVector(starts_bound.max_bound_, start);
+  rays_bound.min_bound_ = minVector(rays_bound.min_bound_, minVector(start, end));
+  rays_bound.max_bound_ = maxVector(rays_bound.max_bound_, maxVector(start, end));
+  if (time < min_time)
+  {
+    start_pos = start;
+  }
+  min_time = std::min(min_time, time);
+  if (time > max_time)
+  {
+    end_pos = start;
+  }
+  max_time = std::max(max_time, time);
+}
+
+bool RAYLIB_EXPORT Cloud::getInfo(const std::string &file_name, Info &info)
+{
+  if (loadInfo(file_name, info))
+  {
+    return true;
+  }
+  info.reset();
   auto find_bounds = [&](std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends,
                          std::vector<double> &times, std::vector<ray::RGBA> &colours) {
     for (size_t i = 0; i < ends.size(); i++)
     {
-      if (colours[i].alpha > 0)
-      {
-        info.ends_bound.min_bound_ = minVector(info.ends_bound.min_bound_, ends[i]);
-        info.ends_bound.max_bound_ = maxVector(info.ends_bound.max_bound_, ends[i]);
-        info.num_bounded++;
-        info.centroid += ends[i];
-      }
-      info.num_rays++;
-      info.starts_bound.min_bound_ = minVector(info.starts_bound.min_bound_, starts[i]);
-      info.starts_bound.max_bound_ = maxVector(info.starts_bound.max_bound_, starts[i]);
-      info.rays_bound.min_bound_ = minVector(info.rays_bound.min_bound_, ends[i]);
-      info.rays_bound.max_bound_ = maxVector(info.rays_bound.max_bound_, ends[i]);
-      if (times[i] < info.min_time)
-      {
-        info.start_pos = starts[i];
-      }
-      info.min_time = std::min(info.min_time, times[i]);
-      if (times[i] > info.max_time)
-      {
-        info.end_pos = starts[i];
-      }
-      info.max_time = std::max(info.max_time, times[i]);
+      info.addRay(starts[i], ends[i], times[i], colours[i]);
     }
-    info.rays_bound.min_bound_ = minVector(info.rays_bound.min_bound_, info.starts_bound.min_bound_);
-    info.rays_bound.max_bound_ = maxVector(info.rays_bound.max_bound_, info.starts_bound.max_bound_);
   };
-  bool success = readPly(file_name, true, find_bounds, 0);
+  bool success = read(file_name, find_bounds);
   info.centroid /= static_cast<double>(info.num_bounded);
   return success;
 }
 
+namespace
+{
+const char kInfoMagic[8] = { 'R', 'A', 'Y', 'I', 'N', 'F', 'O', '\0' };
+const uint32_t kInfoVersion = 2;
 
-double Cloud::estimatePointSpacing(const std::string &file_name, const Cuboid &bounds, int num_points)
+/// The contents of the info sidecar file
+struct InfoFile
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t reserved;
+  uint64_t num_bounded;
+  uint64_t num_rays;
+  /// the stamp of the ray cloud file, so that the information is ignored once the file changes
+  FileStamp cloud_stamp;
+  double bounds[9][3];  // min and max of the ends, starts and rays bounds, then the centroid, start_pos and end_pos
+  double min_time, max_time;
+};
+}  // namespace
+
+bool Cloud::saveInfo(const std::string &file_name, const Info &info)
+{
+  InfoFile contents = InfoFile();
+  memcpy(contents.magic, kInfoMagic, sizeof(kInfoMagic));
+  contents.version = kInfoVersion;
+  if (!contents.cloud_stamp.read(file_name))
+  {
+    std::cerr << "Error: cannot find " << file_name << std::endl;
+    return false;
+  }
+  contents.num_bounded = static_cast<uint64_t>(info.num_bounded);
+  contents.num_rays = static_cast<uint64_t>(info.num_rays);
+  const Eigen::Vector3d *vectors[9] = { &info.ends_bound.min_bound_,   &info.ends_bound.max_bound_,
+                                        &info.starts_bound.min_bound_, &info.starts_bound.max_bound_,
+                                        &info.rays_bound.min_bound_,   &info.rays_bound.max_bound_,
+                                        &info.centroid,                &info.start_pos,
+                                        &info.end_pos };
+  for (int i = 0; i < 9; i++)
+  {
+    for (int k = 0; k < 3; k++)
+    {
+      contents.bounds[i][k] = (*vectors[i])[k];
+    }
+  }
+  contents.min_time = info.min_time;
+  contents.max_time = info.max_time;
+
+  std::ofstream out(infoFileName(file_name), std::ios::binary | std::ios::out);
+  if (out.fail())
+  {
+    std::cerr << "Warning: cannot write ray cloud information to " << infoFileName(file_name) << std::endl;
+    return false;
+  }
+  out.write(reinterpret_cast<const char *>(&contents), sizeof(InfoFile));
+  return out.good();
+}
+
+bool Cloud::loadInfo(const std::string &file_name, Info &info)
+{
+  std::ifstream in(infoFileName(file_name), std::ios::binary | std::ios::in);
+  if (in.fail())
+  {
+    return false;
+  }
+  InfoFile contents;
+  FileStamp cloud_stamp;
+  if (!in.read(reinterpret_cast<char *>(&contents), sizeof(InfoFile)) ||
+      memcmp(contents.magic, kInfoMagic, sizeof(kInfoMagic)) != 0 || contents.version != kInfoVersion ||
+      !cloud_stamp.read(file_name) || cloud_stamp != contents.cloud_stamp)
+  {
+    return false;
+  }
+  info.num_bounded = static_cast<int64_t>(contents.num_bounded);
+  info.num_rays = static_cast<int64_t>(contents.num_rays);
+  Eigen::Vector3d *vectors[9] = { &info.ends_bound.min_bound_,   &info.ends_bound.max_bound_,
+                                  &info.starts_bound.min_bound_, &info.starts_bound.max_bound_,
+                                  &info.rays_bound.min_bound_,   &info.rays_bound.max_bound_,
+                                  &info.centroid,                &info.start_pos,
+                                  &info.end_pos };
+  for (int i = 0; i < 9; i++)
+  {
+    *vectors[i] = Eigen::Vector3d(contents.bounds[i][0], contents.bounds[i][1], contents.bounds[i][2]);
+  }
+  info.min_time = contents.min_time;
+  info.max_time = contents.max_time;
+  return true;
+}
+
+double Cloud::estimatePointSpacing(const std::string &file_name, const Cuboid &bounds, int64_t num_points)
 {
   // two-iteration estimation, modelling the point distribution by the below exponent.
   // larger exponents (towards 2.5) match thick forests, lower exponents (towards 2) match smooth terrain and surfaces
@@ -369,7 +616,7 @@ double Cloud::estimatePointSpacing(const std::string &file_name, const Cuboid &b
     5.0;  // we want to use a larger width because this process only works when the width is an overestimation
   std::cout << "initial voxel width estimate: " << voxel_width << std::endl;
   double num_voxels = 0;
-  std::set<Eigen::Vector3i, Vector3iLess> test_set;
+  VoxelSet test_set;
 
   auto estimate_size = [&](std::vector<Eigen::Vector3d> &, std::vector<Eigen::Vector3d> &ends, std::vector<double> &,
                            std::vector<ray::RGBA> &colours) {
@@ -379,6 +626,8 @@ double Cloud::estimatePointSpacing(const std::string &file_name, const Cuboid &b
         continue;
 
       const Eigen::Vector3d &point = ends[i];
+      if ((point.array() < bounds.min_bound_.array()).any() || (point.array() > bounds.max_bound_.array()).any())
+        continue;
       Eigen::Vector3i place(int(std::floor(point[0] / voxel_width)), int(std::floor(point[1] / voxel_width)),
                             int(std::floor(point[2] / voxel_width)));
       if (test_set.insert(place).second)
@@ -387,7 +636,7 @@ double Cloud::estimatePointSpacing(const std::string &file_name, const Cuboid &b
       }
     }
   };
-  if (!readPly(file_name, true, estimate_size, 0))
+  if (!read(file_name, bounds, estimate_size))
     return 0;
 
   double points_per_voxel = (double)num_points / num_voxels;
@@ -396,31 +645,48 @@ double Cloud::estimatePointSpacing(const std::string &file_name, const Cuboid &b
   return width;
 }
 
-double Cloud::estimatePointSpacing() const
+namespace
+{
+/// Cloud::estimatePointSpacing() for either type of cloud
+template <class CloudType>
+double estimatePointSpacingT(const CloudType &cloud)
 {
   // two-iteration estimation, modelling the point distribution by the below exponent.
   // larger exponents (towards 2.5) match thick forests, lower exponents (towards 2) match smooth terrain and surfaces
   const double cloud_exponent = 2.0;  // model num_points = (cloud_width/voxel_width)^cloud_exponent
 
-  Eigen::Vector3d min_bound, max_bound;
-  calcBounds(&min_bound, &max_bound, kBFEnd);
-  Eigen::Vector3d extent = max_bound - min_bound;
+  Eigen::Vector3d min_bound(std::numeric_limits<double>::max(), std::numeric_limits<double>::max(),
+                            std::numeric_limits<double>::max());
+  Eigen::Vector3d max_bound(std::numeric_limits<double>::lowest(), std::numeric_limits<double>::lowest(),
+                            std::numeric_limits<double>::lowest());
   int num_points = 0;
-  for (unsigned int i = 0; i < ends.size(); i++)
-    if (rayBounded(i))
+  for (size_t i = 0; i < cloud.rayCount(); i++)
+  {
+    if (cloud.rayBounded(i))
+    {
+      min_bound = minVector(min_bound, Eigen::Vector3d(cloud.end(i)));
+      max_bound = maxVector(max_bound, Eigen::Vector3d(cloud.end(i)));
       num_points++;
+    }
+  }
+  if (num_points == 0)
+  {
+    min_bound.setZero();
+    max_bound.setZero();
+  }
+  Eigen::Vector3d extent = max_bound - min_bound;
   double cloud_width = pow(extent[0] * extent[1] * extent[2], 1.0 / 3.0);  // an average
   double voxel_width = cloud_width / pow((double)num_points, 1.0 / cloud_exponent);
   voxel_width *=
     5.0;  // we want to use a larger width because this process only works when the width is an overestimation
   std::cout << "initial voxel width estimate: " << voxel_width << std::endl;
   double num_voxels = 0;
-  std::set<Eigen::Vector3i, Vector3iLess> test_set;
-  for (unsigned int i = 0; i < ends.size(); i++)
+  VoxelSet test_set;
+  for (size_t i = 0; i < cloud.rayCount(); i++)
   {
-    if (rayBounded(i))
+    if (cloud.rayBounded(i))
     {
-      const Eigen::Vector3d &point = ends[i];
+      const Eigen::Vector3d point = cloud.end(i);
       Eigen::Vector3i place(int(std::floor(point[0] / voxel_width)), int(std::floor(point[1] / voxel_width)),
                             int(std::floor(point[2] / voxel_width)));
       if (test_set.insert(place).second)
@@ -434,6 +700,17 @@ double Cloud::estimatePointSpacing() const
   std::cout << "estimated point spacing: " << width << std::endl;
   return width;
 }
+}  // namespace
+
+double Cloud::estimatePointSpacing() const
+{
+  return estimatePointSpacingT(*this);
+}
+
+double Cloud::estimatePointSpacing(const CompactCloud &cloud)
+{
+  return estimatePointSpacingT(cloud);
+}
 
 void Cloud::split(Cloud &cloud1, Cloud &cloud2, std::function<bool(int i)> fptr)
 {
@@ -525,9 +802,39 @@ Eigen::Array<double, 22, 1> Cloud::getMoments() const
 bool Cloud::read(const std::string &file_name,
                  std::function<void(std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends,
                                     std::vector<double> &times, std::vector<RGBA> &colours)>
-                   apply)
+                   apply,
+                 const PlyReadOptions &options)
 {
-  return readPly(file_name, true, apply, 0);
+  if (isRayBlockFile(file_name))
+  {
+    return readRayBlocks(file_name, apply);
+  }
+  return readPly(file_name, true, apply, 0, false, 1000000, options);
+}
+
+bool Cloud::read(const std::string &file_name, const Cuboid &bounds,
+                 std::function<void(std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends,
+                                    std::vector<double> &times, std::vector<RGBA> &colours)>
+                   apply,
+                 const PlyReadOptions &options)
+{
+  if (isRayBlockFile(file_name))
+  {
+    return readRayBlocks(file_name, apply, 1000000, &bounds);
+  }
+  CloudIndex index;
+  if (!index.load(file_name))
+  {
+    // no valid index (see rayinfo --index), so read the whole file
+    return readPly(file_name, true, apply, 0, false, 1000000, options);
+  }
+  PlyReadOptions bounded_options = options;
+  bounded_options.row_ranges = index.rowRanges(bounds);
+  if (bounded_options.row_ranges.empty())
+  {
+    return true;  // no part of the file overlaps the bounds
+  }
+  return readPly(file_name, true, apply, 0, false, 1000000, bounded_options);
 }
 
 }  // namespace ray
@@ -11,12 +11,15 @@
 
 #include <set>
 #include "raygrid.h"
+#include "rayply.h"
 #include "raypose.h"
 #include "rayutils.h"
 
 namespace ray
 {
 class Progress;
+class NeighbourIndex;
+class CompactCloud;
 
 /// Flags for use with @c Cloud::calcBounds()
 enum BoundsFlag
@@ -53,6 +56,11 @@ public:
 
   /// the number of rays
   inline size_t rayCount() const { return ends.size(); }
+  /// accessors of ray @c i, matching those of CompactCloud so that algorithms can be written for either cloud type
+  inline const Eigen::Vector3d &start(size_t i) const { return starts[i]; }
+  inline const Eigen::Vector3d &end(size_t i) const { return ends[i]; }
+  inline double time(size_t i) const { return times[i]; }
+  inline const RGBA &colour(size_t i) const { return colours[i]; }
 
   void save(const std::string &file_name) const;
   /// load a ray cloud file. @c check_extension checks the file extension before proceeding
@@ -92,7 +100,10 @@ public:
   /// apply a Euclidean transform and time shift to the ray cloud
   void transform(const Pose &pose, double time_delta);
   /// spatial decimation of the ray cloud, into one end point per voxel of width @c voxel_width
-  void decimate(double voxel_width, std::set<Eigen::Vector3i, Vector3iLess> &voxel_set);
+  void decimate(double voxel_width, VoxelSet &voxel_set);
+  /// reorder the rays along a Morton (Z-order) curve of the @c voxel_width voxels containing their end points, so that
+  /// rays ending near each other are mostly near each other in memory. Rays in the same voxel keep their order
+  void sortSpatial(double voxel_width);
   /// add a new ray to the ray cloud
   void addRay(const Eigen::Vector3d &start, const Eigen::Vector3d &end, double time, const RGBA &colour);
   /// add a new ray to the ray cloud, from another cloud
@@ -104,11 +115,21 @@ public:
   /// are optional attributes of this covariance matrix, which can be returned. Each covariance matrix represents a
   /// SURFace ELement (surfel) with a centroid, normal, matrix and dimensions (of the ellipsoid that it represents)
   /// The list of neighbours can also be returned, to allow further analysis.
-  /// The last argument excludes back-facing rays from the surfel, this produces flatter surfels on thin double walls
+  /// @c reject_back_facing_rays excludes back-facing rays from the surfel, this produces flatter surfels on thin double
+  /// walls. @c float_precision fits the surfels in single precision with a closed form eigen solver, which is faster
+  /// but less accurate for very flat or thin surfels.
+  /// Points are processed in parallel batches, and only the requested attributes are stored
   void getSurfels(int search_size, std::vector<Eigen::Vector3d> *centroids, std::vector<Eigen::Vector3d> *normals,
                   std::vector<Eigen::Vector3d> *dimensions, std::vector<Eigen::Matrix3d> *mats,
-                  Eigen::MatrixXi *neighbour_indices, double max_distance = 0.0,
-                  bool reject_back_facing_rays = true) const;
+                  Eigen::MatrixXi *neighbour_indices, double max_distance = 0.0, bool reject_back_facing_rays = true,
+                  bool float_precision = false) const;
+  /// as above, using the neighbour @c index of this cloud, built by @c index.build(*this) or loaded from its sidecar.
+  /// If the index keeps a self search with these arguments (see @c NeighbourIndex::knnSelf) its neighbours are read in
+  /// place, otherwise the neighbours are searched one batch at a time
+  void getSurfels(const NeighbourIndex &index, int search_size, std::vector<Eigen::Vector3d> *centroids,
+                  std::vector<Eigen::Vector3d> *normals, std::vector<Eigen::Vector3d> *dimensions,
+                  std::vector<Eigen::Matrix3d> *mats, Eigen::MatrixXi *neighbour_indices, double max_distance = 0.0,
+                  bool reject_back_facing_rays = true, bool float_precision = false) const;
   /// Get first and second order moments of cloud. This can be used as a simple way to compare clouds
   /// numerically. Note that different stats guarantee different clouds, but same stats do not guarantee same clouds
   /// These stats are arranged as: start mean, start sigma, end mean, end sigma, colour mean, time mean, time sigma,
@@ -116,7 +137,9 @@ public:
   Eigen::Array<double, 22, 1> getMoments() const;
 
   /// generates just the normal vectors of the ray end points based on each point's nearest neighbours.
-  std::vector<Eigen::Vector3d> generateNormals(int search_size = 16);
+  /// @c approximate uses a voxel hashed neighbour search (see @c NeighbourIndex::buildApproximate), which is faster on
+  /// large clouds but finds neighbours from a subsample of each point's surroundings
+  std::vector<Eigen::Vector3d> generateNormals(int search_size = 16, bool approximate = false);
 
   /// split a cloud based on the passed in function
   void split(Cloud &cloud1, Cloud &cloud2, std::function<bool(int i)> fptr);
@@ -124,6 +147,8 @@ public:
   /// estimate the average spacing between end points of the ray cloud. This should be similar to the voxel
   /// width used on any spatially decimated ray clouds
   double estimatePointSpacing() const;
+  /// the same estimate for a compact @c cloud
+  static double estimatePointSpacing(const CompactCloud &cloud);
 
   /// Calculate the ray cloud bounds. By default, the bounds only consder the ray end points. This behaviour
   /// can be modified via the @p flags argument.
@@ -139,40 +164,75 @@ public:
 
   /// Static functions. These operate on the cloud file, and so do not require the full file to fit in memory
 
-  /// Version for estimating the spacing between points for raycloud files.
-  static double estimatePointSpacing(const std::string &file_name, const Cuboid &bounds, int num_points);
+  /// Version for estimating the spacing between points for raycloud files. Only the end points within @c bounds are
+  /// used, of which there are @c num_points. This uses the bounded @c read, so is faster on indexed files.
+  static double estimatePointSpacing(const std::string &file_name, const Cuboid &bounds, int64_t num_points);
 
   /// Calculate the key information of a ray cloud, such as its bounds
   /// @c ends are only the bounded ones. @c starts are for all rays
   /// @c rays is all rays, so using the minimum known length for unbounded rays
-  struct Info
+  struct RAYLIB_EXPORT Info
   {
+    /// set to the information of an empty cloud, ready to accumulate rays with @c addRay
+    void reset();
+    /// accumulate one ray. @c centroid holds the sum of the bounded end points until divided by @c num_bounded
+    void addRay(const Eigen::Vector3d &start, const Eigen::Vector3d &end, double time, const RGBA &colour);
+
     // Axis-aligned bounding boxes
     Cuboid ends_bound;    // just the end points (not including for unbounded rays)
     Cuboid starts_bound;  // all start points
     Cuboid rays_bound;    // all ray extents
 
-    int num_bounded;
-    int num_rays;
+    int64_t num_bounded;
+    int64_t num_rays;
     double min_time;
     double max_time;
     Eigen::Vector3d centroid;
     Eigen::Vector3d start_pos, end_pos;
   };
+  /// This uses the information cached in the file's sidecar (see @c saveInfo) when it is present and up to date,
+  /// otherwise it reads the whole file.
   static bool RAYLIB_EXPORT getInfo(const std::string &file_name, Info &info);
+  /// Cache the information of the ray cloud file in a sidecar file, for use by @c getInfo. This is done by CloudWriter.
+  static bool RAYLIB_EXPORT saveInfo(const std::string &file_name, const Info &info);
+  /// Load the cached information of the ray cloud file. Returns false if there is none, or if it is out of date
+  static bool RAYLIB_EXPORT loadInfo(const std::string &file_name, Info &info);
+  /// the name of the sidecar file that caches the information of ray cloud @c file_name
+  static std::string infoFileName(const std::string &file_name) { return file_name + ".info"; }
 
   /// Reads a ray cloud from file, and calls the function for each ray
-  /// This forwards the call to a function appropriate to the ray cloud file format
+  /// This forwards the call to a function appropriate to the ray cloud file format, .ply or .rcb
+  /// By default the next chunk is read from file in the background while @c apply processes the current one,
+  /// this can be tuned or disabled through @c options
   static bool read(const std::string &file_name,
                    std::function<void(std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends,
                                       std::vector<double> &times, std::vector<RGBA> &colours)>
-                     apply);
+                     apply,
+                   const PlyReadOptions &options = PlyReadOptions());
+
+  /// Reads the parts of a ray cloud file that may contain rays overlapping @c bounds, and calls the function for each
+  /// chunk of rays. Rays outside the bounds can still be passed to @c apply, so it should test each ray as before.
+  /// .rcb files use their block index. .ply files use a sidecar spatial index (see CloudIndex) when one has been built
+  /// for the current file, for example by rayinfo --index, otherwise the whole file is read.
+  static bool read(const std::string &file_name, const Cuboid &bounds,
+                   std::function<void(std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends,
+                                      std::vector<double> &times, std::vector<RGBA> &colours)>
+                     apply,
+                   const PlyReadOptions &options = PlyReadOptions());
 
 private:
   bool loadPLY(const std::string &file, int min_num_rays);
   // Convert the set of neighbouring indices into a eigen solution, which is an ellipsoid of best fit.
-  inline void eigenSolve(const std::vector<int> &ray_ids, const Eigen::MatrixXi &indices, int index, int num_neighbours,
+  // The @c num_neighbours neighbours of ray @c ray_id are points @c neighbours of the index, whose rays are @c ray_ids
+  inline void eigenSolve(const std::vector<int> &ray_ids, const int *neighbours, int ray_id, int num_neighbours,
                          Eigen::SelfAdjointEigenSolver<Eigen::Matrix3d> &solver, Eigen::Vector3d &centroid) const;
+  /// the surfels of the points in @c index, from the full neighbour search @c indices, or searching in batches if it
+  /// is null. See @c getSurfels
+  void surfelsFromNeighbours(const NeighbourIndex &index, const Eigen::MatrixXi *indices, int search_size,
+                             std::vector<Eigen::Vector3d> *centroids, std::vector<Eigen::Vector3d> *normals,
+                             std::vector<Eigen::Vector3d> *dimensions, std::vector<Eigen::Matrix3d> *mats,
+                             Eigen::MatrixXi *neighbour_indices, double max_distance, bool reject_back_facing_rays,
+                             bool float_precision) const;
 };
 
 }  // namespace ray
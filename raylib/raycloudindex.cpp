@@ -0,0 +1,195 @@
+// Copyright (c) 2020
+// Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+// ABN 41 687 119 230
+//
+// Author: Thomas Lowe
+#include "raycloudindex.h"
+#include "rayply.h"
+
+#include <sys/stat.h>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+namespace ray
+{
+namespace
+{
+const char kMagic[8] = { 'R', 'A', 'Y', 'I', 'N', 'D', 'E', 'X' };
+const uint32_t kVersion = 2;
+
+/// The sidecar file header
+struct IndexHeader
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t reserved;
+  /// size and modification time of the indexed cloud file, to detect a stale index
+  FileStamp cloud_stamp;
+  uint64_t rows_per_segment;
+  uint64_t num_segments;
+};
+
+/// An entry of the sidecar file, per segment
+struct IndexEntry
+{
+  uint64_t first_row;
+  double min_bound[3];
+  double max_bound[3];
+  double min_time;
+  double max_time;
+};
+
+}  // namespace
+
+bool FileStamp::read(const std::string &file_name)
+{
+  struct stat file_stat;
+  if (stat(file_name.c_str(), &file_stat) != 0)
+  {
+    return false;
+  }
+  size = static_cast<uint64_t>(file_stat.st_size);
+#if defined(__linux__)
+  modified = static_cast<int64_t>(file_stat.st_mtim.tv_sec) * 1000000000 + file_stat.st_mtim.tv_nsec;
+#else
+  modified = static_cast<int64_t>(file_stat.st_mtime);
+#endif
+  return true;
+}
+
+void CloudIndex::reset(size_t rows_per_segment)
+{
+  segments_.clear();
+  rows_per_segment_ = rows_per_segment;
+}
+
+void CloudIndex::addSegment(const std::vector<Eigen::Vector3d> &starts, const std::vector<Eigen::Vector3d> &ends,
+                            const std::vector<double> &times)
+{
+  CloudIndexSegment segment;
+  segment.first_row = segments_.size() * rows_per_segment_;
+  segment.min_bound = Eigen::Vector3d(1, 1, 1) * std::numeric_limits<double>::max();
+  segment.max_bound = Eigen::Vector3d(1, 1, 1) * std::numeric_limits<double>::lowest();
+  segment.min_time = std::numeric_limits<double>::max();
+  segment.max_time = std::numeric_limits<double>::lowest();
+  for (size_t i = 0; i < ends.size(); i++)
+  {
+    segment.min_bound = minVector(segment.min_bound, minVector(starts[i], ends[i]));
+    segment.max_bound = maxVector(segment.max_bound, maxVector(starts[i], ends[i]));
+    segment.min_time = std::min(segment.min_time, times[i]);
+    segment.max_time = std::max(segment.max_time, times[i]);
+  }
+  segments_.push_back(segment);
+}
+
+bool CloudIndex::build(const std::string &cloud_file, size_t rows_per_segment)
+{
+  reset(rows_per_segment);
+  // readPly delivers each chunk of chunk_size rows separately, so each chunk is one segment
+  auto add_segment = [this](std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends,
+                            std::vector<double> &times, std::vector<RGBA> &) { addSegment(starts, ends, times); };
+  PlyReadOptions options;
+  options.exact_chunk_size = true;
+  return readPly(cloud_file, true, add_segment, 0, false, rows_per_segment, options);
+}
+
+bool CloudIndex::save(const std::string &cloud_file) const
+{
+  IndexHeader header = IndexHeader();
+  memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.version = kVersion;
+  if (!header.cloud_stamp.read(cloud_file))
+  {
+    std::cerr << "Error: cannot find " << cloud_file << std::endl;
+    return false;
+  }
+  header.rows_per_segment = rows_per_segment_;
+  header.num_segments = segments_.size();
+
+  const std::string index_file = fileName(cloud_file);
+  std::ofstream out(index_file, std::ios::binary | std::ios::out);
+  if (out.fail())
+  {
+    std::cerr << "Warning: cannot write spatial index " << index_file << std::endl;
+    return false;
+  }
+  out.write(reinterpret_cast<const char *>(&header), sizeof(IndexHeader));
+  for (const auto &segment : segments_)
+  {
+    IndexEntry entry;
+    entry.first_row = segment.first_row;
+    for (int k = 0; k < 3; k++)
+    {
+      entry.min_bound[k] = segment.min_bound[k];
+      entry.max_bound[k] = segment.max_bound[k];
+    }
+    entry.min_time = segment.min_time;
+    entry.max_time = segment.max_time;
+    out.write(reinterpret_cast<const char *>(&entry), sizeof(IndexEntry));
+  }
+  return out.good();
+}
+
+bool CloudIndex::load(const std::string &cloud_file)
+{
+  segments_.clear();
+  std::ifstream in(fileName(cloud_file), std::ios::binary | std::ios::in);
+  if (in.fail())
+  {
+    return false;
+  }
+  IndexHeader header;
+  FileStamp cloud_stamp;
+  if (!in.read(reinterpret_cast<char *>(&header), sizeof(IndexHeader)) ||
+      memcmp(header.magic, kMagic, sizeof(kMagic)) != 0 || header.version != kVersion ||
+      header.rows_per_segment == 0 || !cloud_stamp.read(cloud_file) || cloud_stamp != header.cloud_stamp)
+  {
+    return false;
+  }
+  rows_per_segment_ = header.rows_per_segment;
+  std::vector<IndexEntry> entries(header.num_segments);
+  if (!in.read(reinterpret_cast<char *>(entries.data()), entries.size() * sizeof(IndexEntry)))
+  {
+    return false;
+  }
+  segments_.resize(entries.size());
+  for (size_t i = 0; i < entries.size(); i++)
+  {
+    const IndexEntry &entry = entries[i];
+    CloudIndexSegment &segment = segments_[i];
+    segment.first_row = entry.first_row;
+    segment.min_bound = Eigen::Vector3d(entry.min_bound[0], entry.min_bound[1], entry.min_bound[2]);
+    segment.max_bound = Eigen::Vector3d(entry.max_bound[0], entry.max_bound[1], entry.max_bound[2]);
+    segment.min_time = entry.min_time;
+    segment.max_time = entry.max_time;
+  }
+  return true;
+}
+
+std::vector<std::pair<size_t, size_t>> CloudIndex::rowRanges(const Cuboid &bounds, double min_time,
+                                                             double max_time) const
+{
+  std::vector<std::pair<size_t, size_t>> ranges;
+  for (size_t i = 0; i < segments_.size(); i++)
+  {
+    const CloudIndexSegment &segment = segments_[i];
+    if (segment.min_time > max_time || segment.max_time < min_time ||
+        !bounds.overlaps(Cuboid(segment.min_bound, segment.max_bound)))
+    {
+      continue;
+    }
+    const size_t last_row = i + 1 < segments_.size() ? static_cast<size_t>(segments_[i + 1].first_row) :
+                                                       std::numeric_limits<size_t>::max();
+    if (!ranges.empty() && ranges.back().second == segment.first_row)
+    {
+      ranges.back().second = last_row;  // extend the previous range
+    }
+    else
+    {
+      ranges.emplace_back(static_cast<size_t>(segment.first_row), last_row);
+    }
+  }
+  return ranges;
+}
+}  // namespace ray
@@ -0,0 +1,81 @@
+// Copyright (c) 2020
+// Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+// ABN 41 687 119 230
+//
+// Author: Thomas Lowe
+#ifndef RAYLIB_RAYCLOUDINDEX_H
+#define RAYLIB_RAYCLOUDINDEX_H
+
+#include "raylib/raylibconfig.h"
+#include "raycuboid.h"
+#include "rayutils.h"
+
+namespace ray
+{
+/// The size and modification time of a file, stored in sidecar files to detect when the file they describe has changed
+struct RAYLIB_EXPORT FileStamp
+{
+  uint64_t size = 0;
+  /// modification time, in nanoseconds where the platform provides them
+  int64_t modified = 0;
+
+  /// read the stamp of @c file_name, returning false if it does not exist
+  bool read(const std::string &file_name);
+  inline bool operator==(const FileStamp &other) const { return size == other.size && modified == other.modified; }
+  inline bool operator!=(const FileStamp &other) const { return !(*this == other); }
+};
+
+/// The bounds and time range of one segment of consecutive rows in a ray cloud .ply file
+struct RAYLIB_EXPORT CloudIndexSegment
+{
+  /// the first row of the segment in the file. The segment runs to the next segment's first row
+  uint64_t first_row;
+  /// bounds of the segment's rays, both starts and ends. min_bound > max_bound for segments with no valid rays
+  Eigen::Vector3d min_bound, max_bound;
+  double min_time, max_time;
+};
+
+/// A spatial index of a ray cloud .ply file, stored in a sidecar file next to the cloud (@c fileName()).
+/// The file is divided into segments of a fixed number of rows, and the index holds the bounds and time range of each
+/// one. Since ray clouds are generally in time order, each segment covers a compact part of the scan, so a spatial
+/// query needs to read only the segments that overlap it.
+/// The sidecar records the size and modification time of the cloud file, and is ignored once the cloud changes.
+class RAYLIB_EXPORT CloudIndex
+{
+public:
+  /// the default number of rows in each segment
+  static const size_t kDefaultRowsPerSegment = 65536;
+
+  /// the sidecar file name for the cloud @c cloud_file
+  static std::string fileName(const std::string &cloud_file) { return cloud_file + ".idx"; }
+
+  /// start an empty index with the given segment size
+  void reset(size_t rows_per_segment = kDefaultRowsPerSegment);
+  /// add the next segment, from the rays read from its rows. The file must be read in chunks of exactly
+  /// @c rowsPerSegment() rows, see PlyReadOptions::exact_chunk_size
+  void addSegment(const std::vector<Eigen::Vector3d> &starts, const std::vector<Eigen::Vector3d> &ends,
+                  const std::vector<double> &times);
+
+  /// build the index by reading the whole of @c cloud_file
+  bool build(const std::string &cloud_file, size_t rows_per_segment = kDefaultRowsPerSegment);
+  /// save the index to the sidecar file of @c cloud_file
+  bool save(const std::string &cloud_file) const;
+  /// load the sidecar index of @c cloud_file. Returns false if there is none, or if it is out of date
+  bool load(const std::string &cloud_file);
+
+  /// the row ranges [first, last) of the segments that overlap @c bounds, and optionally the time range
+  /// [@c min_time, @c max_time]
+  std::vector<std::pair<size_t, size_t>> rowRanges(
+    const Cuboid &bounds, double min_time = std::numeric_limits<double>::lowest(),
+    double max_time = std::numeric_limits<double>::max()) const;
+
+  inline const std::vector<CloudIndexSegment> &segments() const { return segments_; }
+  inline size_t rowsPerSegment() const { return rows_per_segment_; }
+
+private:
+  std::vector<CloudIndexSegment> segments_;
+  size_t rows_per_segment_ = kDefaultRowsPerSegment;
+};
+}  // namespace ray
+
+#endif  // RAYLIB_RAYCLOUDINDEX_H
@@ -6,9 +6,140 @@
 #include "raycloudwriter.h"
 #include "raycloud.h"
 
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <thread>
+
 namespace ray
 {
-bool CloudWriter::begin(const std::string &file_name)
+/// Bounded queue of chunks waiting to be converted and written by a background thread.
+/// The chunk vectors are recycled so that their allocations are reused from one chunk to the next.
+struct CloudWriteQueue
+{
+  struct Chunk
+  {
+    std::vector<Eigen::Vector3d> starts;
+    std::vector<Eigen::Vector3d> ends;
+    std::vector<double> times;
+    std::vector<RGBA> colours;
+  };
+
+  using WriteFunction = std::function<bool(const std::vector<Eigen::Vector3d> &starts,
+                                           const std::vector<Eigen::Vector3d> &ends, const std::vector<double> &times,
+                                           const std::vector<RGBA> &colours)>;
+
+  CloudWriteQueue(WriteFunction write, size_t max_queued)
+    : max_queued(max_queued)
+  {
+    thread = std::thread([this, write]() { run(write); });
+  }
+  ~CloudWriteQueue() { finish(); }
+
+  /// copy the rays onto the end of the queue, blocking while the queue is full
+  bool push(const std::vector<Eigen::Vector3d> &starts, const std::vector<Eigen::Vector3d> &ends,
+            const std::vector<double> &times, const std::vector<RGBA> &colours)
+  {
+    Chunk chunk;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      changed.wait(lock, [this] { return pending.size() < max_queued || failed; });
+      if (error)
+      {
+        std::rethrow_exception(error);
+      }
+      if (failed)
+      {
+        return false;
+      }
+      if (!spare.empty())
+      {
+        chunk = std::move(spare.back());
+        spare.pop_back();
+      }
+    }
+    chunk.starts.assign(starts.begin(), starts.end());
+    chunk.ends.assign(ends.begin(), ends.end());
+    chunk.times.assign(times.begin(), times.end());
+    chunk.colours.assign(colours.begin(), colours.end());
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      pending.push_back(std::move(chunk));
+    }
+    changed.notify_all();
+    return true;
+  }
+
+  /// write out all the queued chunks and stop the thread. Returns false if any chunk failed to write
+  bool finish()
+  {
+    if (thread.joinable())
+    {
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        finished = true;
+      }
+      changed.notify_all();
+      thread.join();
+    }
+    return !failed;
+  }
+
+  void run(const WriteFunction &write)
+  {
+    while (true)
+    {
+      Chunk chunk;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [this] { return !pending.empty() || finished; });
+        if (pending.empty() || failed)
+        {
+          return;
+        }
+        chunk = std::move(pending.front());
+        pending.pop_front();
+      }
+      bool success = false;
+      try
+      {
+        success = write(chunk.starts, chunk.ends, chunk.times, chunk.colours);
+      }
+      catch (...)  // e.g. std::bad_alloc, which is rethrown on the caller's thread
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        error = std::current_exception();
+      }
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        failed = failed || !success;
+        spare.push_back(std::move(chunk));
+      }
+      changed.notify_all();
+    }
+  }
+
+  size_t max_queued;
+  std::deque<Chunk> pending;
+  std::vector<Chunk> spare;
+  std::mutex mutex;
+  std::condition_variable changed;
+  bool finished = false;
+  bool failed = false;
+  std::exception_ptr error;
+  std::thread thread;
+};
+
+CloudWriter::CloudWriter()
+  : has_warned_(false)
+  , is_block_file_(false)
+{}
+
+CloudWriter::~CloudWriter() = default;
+
+bool CloudWriter::begin(const std::string &file_name, size_t max_queued_chunks)
 {
   if (file_name.empty())
   {
@@ -17,28 +148,108 @@ bool CloudWriter::begin(const std::string &file_name)
   }
   has_warned_ = false;
   file_name_ = file_name;
-  if (!writeRayCloudChunkStart(file_name_, ofs_))
+  is_block_file_ = isRayBlockFile(file_name_);
+  info_.reset();
+  write_failed_ = false;
+  if (is_block_file_ ? !block_writer_.begin(file_name_) : !writeRayCloudChunkStart(file_name_, ofs_))
   {
     return false;
   }
+  queue_.reset();
+  if (max_queued_chunks > 0)
+  {
+    queue_ = std::make_unique<CloudWriteQueue>(
+      [this](const std::vector<Eigen::Vector3d> &starts, const std::vector<Eigen::Vector3d> &ends,
+             const std::vector<double> &times,
+             const std::vector<RGBA> &colours) { return writeRays(starts, ends, times, colours); },
+      max_queued_chunks);
+  }
   return true;
 }
 
-void CloudWriter::end()
+bool CloudWriter::end()
 {
   if (file_name_.empty())  // no effect if begin has not been called
   {
-    return;
+    return false;
+  }
+  if (queue_)
+  {
+    if (!queue_->finish())
+    {
+      std::cerr << "Error: failed to write all rays to " << file_name_ << std::endl;
+      write_failed_ = true;
+    }
+    std::exception_ptr error = queue_->error;
+    queue_.reset();
+    if (error)
+    {
+      std::rethrow_exception(error);
+    }
   }
-  const unsigned long num_rays = ray::writeRayCloudChunkEnd(ofs_);
+  const unsigned long num_rays = is_block_file_ ? block_writer_.end() : ray::writeRayCloudChunkEnd(ofs_);
   std::cout << num_rays << " rays saved to " << file_name_ << std::endl;
-  ofs_.close();
+  if (is_block_file_)
+  {
+    write_failed_ = write_failed_ || !block_writer_.good();
+  }
+  else
+  {
+    write_failed_ = write_failed_ || !ofs_.good();
+    ofs_.close();
+    if (write_failed_)
+    {
+      // the information would not match the rays in the file, so remove any stale copy rather than saving it
+      std::remove(Cloud::infoFileName(file_name_).c_str());
+    }
+    else
+    {
+      info_.centroid /= static_cast<double>(info_.num_bounded);
+      Cloud::saveInfo(file_name_, info_);
+    }
+  }
+  return !write_failed_;
 }
 
 bool CloudWriter::writeChunk(const Cloud &chunk)
 {
-  return writeRayCloudChunk(ofs_, buffer_, chunk.starts, chunk.ends, chunk.times, chunk.colours, has_warned_);
+  return writeChunk(chunk.starts, chunk.ends, chunk.times, chunk.colours);
 }
 
+bool CloudWriter::writeChunk(const std::vector<Eigen::Vector3d> &starts, const std::vector<Eigen::Vector3d> &ends,
+                             const std::vector<double> &times, const std::vector<RGBA> &colours)
+{
+  if (queue_)
+  {
+    if (ends.empty())
+    {
+      return true;
+    }
+    return queue_->push(starts, ends, times, colours);
+  }
+  return writeRays(starts, ends, times, colours);
+}
 
+bool CloudWriter::writeRays(const std::vector<Eigen::Vector3d> &starts, const std::vector<Eigen::Vector3d> &ends,
+                            const std::vector<double> &times, const std::vector<RGBA> &colours)
+{
+  if (is_block_file_)
+  {
+    return block_writer_.writeChunk(starts, ends, times, colours);
+  }
+  if (!writeRayCloudChunk(ofs_, buffer_, starts, ends, times, colours, has_warned_))
+  {
+    write_failed_ = true;
+    return false;
+  }
+  Eigen::Vector3d start, end;
+  for (size_t i = 0; i < ends.size(); i++)
+  {
+    if (storedRay(starts[i], ends[i], start, end))
+    {
+      info_.addRay(start, end, times[i], colours[i]);
+    }
+  }
+  return true;
+}
 }  // namespace ray
@@ -7,35 +7,52 @@
 #define RAYLIB_RAYCLOUDWRITER_H
 
 #include "raylib/raylibconfig.h"
+#include "rayblockfile.h"
+#include "raycloud.h"
 #include "rayply.h"
 
+#include <memory>
+
 namespace ray
 {
+struct CloudWriteQueue;
+
 /// This helper class is for writing a ray cloud to a file, one chunk at a time
 /// These chunks can be any size, even 0
+/// Files with the .rcb extension are written in the block compressed format, otherwise as .ply
+/// Writers hold all of their own state, so separate writers can be used concurrently from different threads
+/// The Cloud::Info of .ply files is accumulated as the rays are written, and cached by @c end() for Cloud::getInfo
 class RAYLIB_EXPORT CloudWriter
 {
 public:
-  /// Open the file to write to
-  bool begin(const std::string &file_name);
+  CloudWriter();
+  ~CloudWriter();
+
+  /// Open the file to write to.
+  /// If @c max_queued_chunks is greater than zero then the chunks are converted and written on a background thread,
+  /// so that writing overlaps with the caller's processing. @c writeChunk copies the rays into a queue, and blocks
+  /// while @c max_queued_chunks chunks are already waiting to be written.
+  bool begin(const std::string &file_name, size_t max_queued_chunks = 0);
 
   /// write a set of rays to the file
   bool writeChunk(const class Cloud &chunk);
 
   /// write a set of rays to the file, direct arguments
-  bool writeChunk(std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends, std::vector<double> &times,
-                  std::vector<RGBA> &colours)
-  {
-    return writeRayCloudChunk(ofs_, buffer_, starts, ends, times, colours, has_warned_);
-  }
+  bool writeChunk(const std::vector<Eigen::Vector3d> &starts, const std::vector<Eigen::Vector3d> &ends,
+                  const std::vector<double> &times, const std::vector<RGBA> &colours);
 
-  /// finish writing, and adjust the vertex count at the start.
-  void end();
+  /// finish writing, adjust the vertex count at the start, and save the cloud's information (see Cloud::saveInfo).
+  /// Returns false if any of the rays failed to be written
+  bool end();
 
   /// return the stored file name
   const std::string &fileName() { return file_name_; }
 
 private:
+  /// write the rays in the format of the file, on the calling thread
+  bool writeRays(const std::vector<Eigen::Vector3d> &starts, const std::vector<Eigen::Vector3d> &ends,
+                 const std::vector<double> &times, const std::vector<RGBA> &colours);
+
   /// store the output file stream
   std::ofstream ofs_;
   /// store the file name, in order to provide a clear 'saved' message on end()
@@ -44,6 +61,15 @@ private:
   RayPlyBuffer buffer_;
   /// whether a warning has been issued or not. This prevents multiple warnings.
   bool has_warned_;
+  /// whether the file is in the .rcb format, written through @c block_writer_
+  bool is_block_file_;
+  RayBlockWriter block_writer_;
+  /// information of the rays written so far, as they will be read back from the file
+  Cloud::Info info_;
+  /// whether a chunk failed to write, in which case the information is not saved
+  bool write_failed_ = false;
+  /// queue of chunks and the thread that writes them, only used when writing in the background
+  std::unique_ptr<CloudWriteQueue> queue_;
 };
 
 }  // namespace ray
@@ -0,0 +1,138 @@
+// Copyright (c) 2020
+// Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+// ABN 41 687 119 230
+//
+// Author: Thomas Lowe
+#include "raycompactcloud.h"
+#include "raycloud.h"
+#include "raycloudwriter.h"
+#include "raymemory.h"
+
+namespace ray
+{
+void CompactCloud::setOrigin(const Eigen::Vector3d &origin)
+{
+  clearRays();
+  origin_ = origin;
+  has_origin_ = true;
+}
+
+void CompactCloud::addRay(const Eigen::Vector3d &start, const Eigen::Vector3d &end, double time, const RGBA &colour)
+{
+  if (ends_.empty() && !has_origin_)
+  {
+    origin_ = Eigen::Vector3d(std::round(end[0]), std::round(end[1]), std::round(end[2]));
+  }
+  const Eigen::Vector3f stored_end = (end - origin_).cast<float>();
+  ends_.push_back(stored_end);
+  if (start_storage_ == StartStorage::Positions)
+  {
+    starts_.push_back((start - origin_).cast<float>());
+  }
+  else
+  {
+    // relative to the stored end, so the start is recovered to the precision of the ray vector
+    starts_.push_back((start - (origin_ + stored_end.cast<double>())).cast<float>());
+  }
+  times_.push_back(time);
+  colours_.push_back(colour);
+}
+
+void CompactCloud::reserve(size_t size)
+{
+  starts_.reserve(size);
+  ends_.reserve(size);
+  times_.reserve(size);
+  colours_.reserve(size);
+}
+
+void CompactCloud::clear()
+{
+  clearRays();
+  origin_.setZero();
+  has_origin_ = false;
+}
+
+void CompactCloud::clearRays()
+{
+  starts_.clear();
+  ends_.clear();
+  times_.clear();
+  colours_.clear();
+}
+
+size_t CompactCloud::memoryUsage() const
+{
+  return starts_.capacity() * sizeof(Eigen::Vector3f) + ends_.capacity() * sizeof(Eigen::Vector3f) +
+         times_.capacity() * sizeof(double) + colours_.capacity() * sizeof(RGBA);
+}
+
+bool CompactCloud::load(const std::string &file_name)
+{
+  clearRays();
+  // reserve exactly when the cloud's information is cached, to avoid the vectors growing past the cloud size
+  Cloud::Info info;
+  if (Cloud::loadInfo(file_name, info))
+  {
+    reserve(static_cast<size_t>(info.num_rays));
+  }
+  auto add_rays = [this](std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends,
+                         std::vector<double> &times, std::vector<RGBA> &colours) {
+    for (size_t i = 0; i < ends.size(); i++)
+    {
+      addRay(starts[i], ends[i], times[i], colours[i]);
+    }
+  };
+  return Cloud::read(file_name, add_rays);
+}
+
+bool CompactCloud::save(const std::string &file_name) const
+{
+  CloudWriter writer;
+  if (!writer.begin(file_name))
+  {
+    return false;
+  }
+  const size_t chunk_size = Memory::chunkSize(1000000);
+  Cloud chunk;
+  for (size_t first = 0; first < rayCount(); first += chunk_size)
+  {
+    const size_t last = std::min(first + chunk_size, rayCount());
+    chunk.resize(last - first);
+    for (size_t i = first; i < last; i++)
+    {
+      chunk.starts[i - first] = start(i);
+      chunk.ends[i - first] = end(i);
+      chunk.times[i - first] = times_[i];
+      chunk.colours[i - first] = colours_[i];
+    }
+    if (!writer.writeChunk(chunk))
+    {
+      return false;
+    }
+  }
+  return writer.end();
+}
+
+void CompactCloud::fromCloud(const Cloud &cloud)
+{
+  clearRays();
+  reserve(cloud.rayCount());
+  for (size_t i = 0; i < cloud.rayCount(); i++)
+  {
+    addRay(cloud.starts[i], cloud.ends[i], cloud.times[i], cloud.colours[i]);
+  }
+}
+
+void CompactCloud::toCloud(Cloud &cloud) const
+{
+  cloud.resize(rayCount());
+  for (size_t i = 0; i < rayCount(); i++)
+  {
+    cloud.starts[i] = start(i);
+    cloud.ends[i] = end(i);
+    cloud.times[i] = times_[i];
+    cloud.colours[i] = colours_[i];
+  }
+}
+}  // namespace ray
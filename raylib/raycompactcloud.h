@@ -0,0 +1,88 @@
+// Copyright (c) 2020
+// Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+// ABN 41 687 119 230
+//
+// Author: Thomas Lowe
+#ifndef RAYLIB_RAYCOMPACTCLOUD_H
+#define RAYLIB_RAYCOMPACTCLOUD_H
+
+#include "raylib/raylibconfig.h"
+#include "rayutils.h"
+
+namespace ray
+{
+class Cloud;
+
+/// A ray cloud held in memory in 36 bytes per ray, rather than the 60 bytes of a Cloud, for processing large clouds.
+/// Positions are stored in single precision relative to a double precision @c origin(), which keeps them to within
+/// 0.1 mm up to 1 km from the origin. Alternatively the ray starts can be stored as the vector from the end point to
+/// the start, so their precision is relative to the ray length rather than the distance from the origin.
+/// The ray accessors match those of Cloud: @c rayCount(), @c start(i), @c end(i), @c time(i), @c colour(i) and
+/// @c rayBounded(i), so that algorithms can be written once for either type of cloud.
+class RAYLIB_EXPORT CompactCloud
+{
+public:
+  /// How the ray starts are stored
+  enum class StartStorage
+  {
+    /// relative to the origin, like the end points
+    Positions,
+    /// as the vector from the end point to the start
+    RayVectors
+  };
+
+  explicit CompactCloud(StartStorage start_storage = StartStorage::Positions)
+    : start_storage_(start_storage)
+  {}
+
+  /// the position that the stored points are relative to. Unless set with @c setOrigin, it is the first end point
+  /// added to the empty cloud, rounded to the nearest metre
+  inline const Eigen::Vector3d &origin() const { return origin_; }
+  /// set the origin, removing any rays
+  void setOrigin(const Eigen::Vector3d &origin);
+  inline StartStorage startStorage() const { return start_storage_; }
+
+  inline size_t rayCount() const { return ends_.size(); }
+  inline Eigen::Vector3d end(size_t i) const { return origin_ + ends_[i].cast<double>(); }
+  inline Eigen::Vector3d start(size_t i) const
+  {
+    return start_storage_ == StartStorage::Positions ? Eigen::Vector3d(origin_ + starts_[i].cast<double>()) :
+                                                       Eigen::Vector3d(end(i) + starts_[i].cast<double>());
+  }
+  inline double time(size_t i) const { return times_[i]; }
+  inline const RGBA &colour(size_t i) const { return colours_[i]; }
+  inline bool rayBounded(size_t i) const { return colours_[i].alpha > 0; }
+
+  /// add a new ray to the cloud
+  void addRay(const Eigen::Vector3d &start, const Eigen::Vector3d &end, double time, const RGBA &colour);
+  void reserve(size_t size);
+  /// remove all rays and the origin
+  void clear();
+  /// the memory used by the rays, in bytes
+  size_t memoryUsage() const;
+
+  /// load the ray cloud file @c file_name, one chunk at a time, so the full precision rays are never all in memory
+  bool load(const std::string &file_name);
+  /// save the cloud to @c file_name, one chunk at a time
+  bool save(const std::string &file_name) const;
+  /// replace the contents with the rays of @c cloud
+  void fromCloud(const Cloud &cloud);
+  /// replace the contents of @c cloud with the rays of this cloud
+  void toCloud(Cloud &cloud) const;
+
+private:
+  /// remove the rays, keeping the origin if it was set
+  void clearRays();
+
+  StartStorage start_storage_;
+  Eigen::Vector3d origin_ = Eigen::Vector3d::Zero();
+  /// whether the origin was set by @c setOrigin
+  bool has_origin_ = false;
+  std::vector<Eigen::Vector3f> starts_;
+  std::vector<Eigen::Vector3f> ends_;
+  std::vector<double> times_;
+  std::vector<RGBA> colours_;
+};
+}  // namespace ray
+
+#endif  // RAYLIB_RAYCOMPACTCLOUD_H
@@ -14,13 +14,13 @@ namespace ray
 bool decimateSpatial(const std::string &file_stub, double vox_width)
 {
   ray::CloudWriter writer;
-  if (!writer.begin(file_stub + "_decimated.ply"))
+  if (!writer.begin(file_stub + "_decimated.ply", 2))
     return false;
 
   // By maintaining these buffers below, we avoid almost all memory fragmentation
   ray::Cloud chunk;
   std::vector<int64_t> subsample;
-  std::set<Eigen::Vector3i, ray::Vector3iLess> voxel_set;
+  ray::VoxelSet voxel_set;
 
   auto decimate = [&](std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends,
                       std::vector<double> &times, std::vector<ray::RGBA> &colours) 
@@ -49,7 +49,7 @@ bool decimateSpatial(const std::string &file_stub, double vox_width)
 bool decimateTemporal(const std::string &file_stub, int num_rays)
 {
   ray::CloudWriter writer;
-  if (!writer.begin(file_stub + "_decimated.ply"))
+  if (!writer.begin(file_stub + "_decimated.ply", 2))
     return false;
 
   // By maintaining these buffers below, we avoid almost all memory fragmentation
@@ -79,12 +79,12 @@ bool decimateTemporal(const std::string &file_stub, int num_rays)
 bool decimateSpatioTemporal(const std::string &file_stub, double vox_width, int num_rays)
 {
   ray::CloudWriter writer;
-  if (!writer.begin(file_stub + "_decimated.ply"))
+  if (!writer.begin(file_stub + "_decimated.ply", 2))
     return false;
 
   // By maintaining these buffers below, we avoid almost all memory fragmentation
   ray::Cloud chunk;
-  std::map<Eigen::Vector3i, Eigen::Vector2i, ray::Vector3iLess> voxel_map;
+  ray::VoxelMap<Eigen::Vector2i> voxel_map;
   std::vector<Eigen::Vector3i> samples;
 
   auto decimate = [&](std::vector<Eigen::Vector3d> &, std::vector<Eigen::Vector3d> &ends,
@@ -168,7 +168,7 @@ bool decimateSpatioTemporal(const std::string &file_stub, double vox_width, int
 bool decimateRaysSpatial(const std::string &file_stub, double vox_width)
 {
   ray::CloudWriter writer;
-  if (!writer.begin(file_stub + "_decimated.ply"))
+  if (!writer.begin(file_stub + "_decimated.ply", 2))
     return false;
 
   // By maintaining these buffers below, we avoid almost all memory fragmentation
@@ -211,15 +211,15 @@ bool decimateRaysSpatial(const std::string &file_stub, double vox_width)
 bool decimateAngular(const std::string &file_stub, double radius_per_length)
 {
   ray::CloudWriter writer;
-  if (!writer.begin(file_stub + "_decimated.ply"))
+  if (!writer.begin(file_stub + "_decimated.ply", 2))
     return false;
 
   ray::Cloud chunk;
 
   int min_index = -20; // about a millimetre
   int max_index = 50;
-  std::vector<std::set<Eigen::Vector3i, ray::Vector3iLess>> voxel_sets(max_index + 1 - min_index);
-  std::vector<std::set<Eigen::Vector3i, ray::Vector3iLess>> visiteds(max_index + 1 - min_index);
+  std::vector<ray::VoxelSet> voxel_sets(max_index + 1 - min_index);
+  std::vector<ray::VoxelSet> visiteds(max_index + 1 - min_index);
   std::vector<int> candidate_indices;  
   const double root2 = std::sqrt(2.0);
   const double logroot2 = std::log(root2);
@@ -50,7 +50,7 @@ struct Subsampler
     return false;
   }
   std::vector<int64_t> subsample;
-  std::set<Eigen::Vector3i, ray::Vector3iLess> voxel_set;
+  ray::VoxelSet voxel_set;
   int index;
 };
 }  // namespace ray
@@ -6,20 +6,18 @@
 #include "rayellipsoid.h"
 
 #include "raycloud.h"
+#include "raycompactcloud.h"
+#include "rayneighbourindex.h"
 #include "rayprogress.h"
-
-#include <nabo/nabo.h>
-
-#include <memory>
-
-#if RAYLIB_WITH_TBB
-#include <tbb/parallel_for.h>
-#endif  // RAYLIB_WITH_TBB
+#include "raythreads.h"
 
 namespace ray
 {
-void generateEllipsoids(std::vector<Ellipsoid> *ellipsoids, Eigen::Vector3d *bounds_min, Eigen::Vector3d *bounds_max,
-                        const Cloud &cloud, Progress *progress)
+namespace
+{
+template <class CloudType>
+void generateEllipsoidsT(std::vector<Ellipsoid> *ellipsoids, Eigen::Vector3d *bounds_min, Eigen::Vector3d *bounds_max,
+                         const CloudType &cloud, Progress *progress)
 {
   ellipsoids->clear();
   ellipsoids->resize(cloud.rayCount());
@@ -27,38 +25,34 @@ void generateEllipsoids(std::vector<Ellipsoid> *ellipsoids, Eigen::Vector3d *bou
   const double max_double = std::numeric_limits<double>::max();
   Eigen::Vector3d ellipsoids_min(max_double, max_double, max_double);
   Eigen::Vector3d ellipsoids_max(-max_double, -max_double, -max_double);
-  Nabo::Parameters params("bucketSize", 8);
-
   if (progress)
   {
     progress->begin("generateEllipsoids - KDTree", 2);
   }
 
-  Eigen::MatrixXd points_p(3, cloud.ends.size());
-  for (size_t i = 0; i < cloud.rayCount(); ++i)
+  NeighbourIndex neighbour_index;
+  Eigen::MatrixXd points(3, cloud.rayCount());
+  for (size_t i = 0; i < cloud.rayCount(); i++)
   {
-    points_p.col(i) = cloud.ends[i];
+    points.col(i) = cloud.end(i);
   }
-  std::unique_ptr<Nabo::NNSearchD> nns(Nabo::NNSearchD::createKDTreeLinearHeap(points_p, 3));
-
-  // Run the search
-  Eigen::MatrixXi indices;
-  Eigen::MatrixXd dists2;
-  indices.resize(search_size, cloud.rayCount());
-  dists2.resize(search_size, cloud.rayCount());
+  neighbour_index.build(std::move(points));
 
   if (progress)
   {
     progress->increment();
   }
-  nns->knn(points_p, indices, dists2, search_size, kNearestNeighbourEpsilon, 0);
-  nns.reset(nullptr);
+  // Run the search
+  Eigen::MatrixXi indices;
+  Eigen::MatrixXd dists2;
+  neighbour_index.knn(neighbour_index.points(), search_size, indices, dists2);
+  neighbour_index.clear();
 
   if (progress)
   {
     progress->increment();
     progress->end();
-    progress->begin("generateEllipsoids", cloud.ends.size());
+    progress->begin("generateEllipsoids", cloud.rayCount());
   }
   const auto generate_ellipsoid = [&](size_t i)  //
   {
@@ -82,12 +76,12 @@ void generateEllipsoids(std::vector<Ellipsoid> *ellipsoids, Eigen::Vector3d *bou
     scatter.setZero();
     Eigen::Vector3d centroid(0, 0, 0);
     double num_neighbours = 0;
-    for (int j = 0; j < search_size && indices(j, i) != Nabo::NNSearchD::InvalidIndex; ++j)
+    for (int j = 0; j < search_size && indices(j, i) != NeighbourIndex::kInvalidIndex; ++j)
     {
       int index = indices(j, i);
       if (cloud.rayBounded(index))
       {
-        centroid += cloud.ends[index];
+        centroid += cloud.end(index);
         num_neighbours++;
       }
     }
@@ -96,12 +90,12 @@ void generateEllipsoids(std::vector<Ellipsoid> *ellipsoids, Eigen::Vector3d *bou
       return;
     }
     centroid /= num_neighbours;
-    for (int j = 0; j < search_size && indices(j, i) != Nabo::NNSearchD::InvalidIndex; j++)
+    for (int j = 0; j < search_size && indices(j, i) != NeighbourIndex::kInvalidIndex; j++)
     {
       int index = indices(j, i);
       if (cloud.rayBounded(index))
       {
-        Eigen::Vector3d offset = cloud.ends[index] - centroid;
+        Eigen::Vector3d offset = cloud.end(index) - centroid;
         scatter += offset * offset.transpose();
       }
     }
@@ -121,33 +115,12 @@ void generateEllipsoids(std::vector<Ellipsoid> *ellipsoids, Eigen::Vector3d *bou
     ellipsoid.eigen_mat.row(0) = (eigen_vector.col(0) / eigen_value[0]).cast<float>();
     ellipsoid.eigen_mat.row(1) = (eigen_vector.col(1) / eigen_value[1]).cast<float>();
     ellipsoid.eigen_mat.row(2) = (eigen_vector.col(2) / eigen_value[2]).cast<float>();
-    ellipsoid.time = cloud.times[i];
+    ellipsoid.time = cloud.time(i);
     ellipsoid.setExtents(eigen_vector, eigen_value);
   };
 
-#if RAYLIB_WITH_TBB
-  tbb::parallel_for<size_t>(0, cloud.rayCount(), generate_ellipsoid);
-
-  for (size_t i = 0; i < ellipsoids->size(); ++i)
-  {
-    Ellipsoid &ellipsoid = (*ellipsoids)[i];
-    const auto ellipsoid_min = ellipsoid.pos - ellipsoid.extents.cast<double>();
-    const auto ellipsoid_max = ellipsoid.pos + ellipsoid.extents.cast<double>();
+  parallelFor(0, cloud.rayCount(), generate_ellipsoid);
 
-    ellipsoids_min.x() = std::min(ellipsoids_min.x(), ellipsoid_min.x());
-    ellipsoids_min.y() = std::min(ellipsoids_min.y(), ellipsoid_min.y());
-    ellipsoids_min.z() = std::min(ellipsoids_min.z(), ellipsoid_min.z());
-    ellipsoids_max.x() = std::max(ellipsoids_max.x(), ellipsoid_max.x());
-    ellipsoids_max.y() = std::max(ellipsoids_max.y(), ellipsoid_max.y());
-    ellipsoids_max.z() = std::max(ellipsoids_max.z(), ellipsoid_max.z());
-  }
-#else   // RAYLIB_WITH_TBB
-  const size_t count = cloud.rayCount();
-  #pragma omp parallel for schedule(static)
-  for (size_t i = 0; i < count; ++i)
-  {
-    generate_ellipsoid(i);
-  }
   for (size_t i = 0; i < ellipsoids->size(); ++i)
   {
     Ellipsoid &ellipsoid = (*ellipsoids)[i];
@@ -161,7 +134,6 @@ void generateEllipsoids(std::vector<Ellipsoid> *ellipsoids, Eigen::Vector3d *bou
     ellipsoids_max.y() = std::max(ellipsoids_max.y(), ellipsoid_max.y());
     ellipsoids_max.z() = std::max(ellipsoids_max.z(), ellipsoid_max.z());
   }
-#endif  // RAYLIB_WITH_TBB
 
   if (bounds_min)
   {
@@ -173,4 +145,17 @@ void generateEllipsoids(std::vector<Ellipsoid> *ellipsoids, Eigen::Vector3d *bou
     *bounds_max = ellipsoids_max;
   }
 }
+}  // namespace
+
+void generateEllipsoids(std::vector<Ellipsoid> *ellipsoids, Eigen::Vector3d *bounds_min, Eigen::Vector3d *bounds_max,
+                        const Cloud &cloud, Progress *progress)
+{
+  generateEllipsoidsT(ellipsoids, bounds_min, bounds_max, cloud, progress);
+}
+
+void generateEllipsoids(std::vector<Ellipsoid> *ellipsoids, Eigen::Vector3d *bounds_min, Eigen::Vector3d *bounds_max,
+                        const CompactCloud &cloud, Progress *progress)
+{
+  generateEllipsoidsT(ellipsoids, bounds_min, bounds_max, cloud, progress);
+}
 }  // namespace ray
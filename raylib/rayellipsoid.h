@@ -16,6 +16,7 @@
 namespace ray
 {
 class Cloud;
+class CompactCloud;
 class Progress;
 
 enum class RAYLIB_EXPORT IntersectResult
@@ -47,6 +48,9 @@ public:
 /// shaped by the distribution of its neighbouring points.
 void RAYLIB_EXPORT generateEllipsoids(std::vector<Ellipsoid> *ellipsoids, Eigen::Vector3d *bounds_min,
                                       Eigen::Vector3d *bounds_max, const Cloud &cloud, Progress *progress = nullptr);
+void RAYLIB_EXPORT generateEllipsoids(std::vector<Ellipsoid> *ellipsoids, Eigen::Vector3d *bounds_min,
+                                      Eigen::Vector3d *bounds_max, const CompactCloud &cloud,
+                                      Progress *progress = nullptr);
 
 inline void Ellipsoid::clear()
 {
@@ -97,6 +101,10 @@ inline IntersectResult Ellipsoid::intersect(const Eigen::Vector3d &start, const
   {
     return IntersectResult::Miss;
   }
+  if (d + along_dist < 0.0)  // the ellipsoid is behind the ray start
+  {
+    return IntersectResult::Miss;
+  }
 
   const double pass_distance = 0.05;
   double ratio = pass_distance / dir.norm();
@@ -0,0 +1,152 @@
+// Copyright (c) 2020
+// Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+// ABN 41 687 119 230
+//
+// Author: Thomas Lowe
+#include "rayellipsoidbvh.h"
+
+#include <algorithm>
+#include <limits>
+
+namespace ray
+{
+const unsigned EllipsoidBvh::kLeafSize;
+
+void EllipsoidBvh::build(const std::vector<Ellipsoid> &ellipsoids)
+{
+  ellipsoids_ = &ellipsoids;
+  nodes_.clear();
+  ids_.clear();
+  item_boxes_.clear();
+  const double max_double = std::numeric_limits<double>::max();
+  Eigen::Vector3d min_bound(max_double, max_double, max_double), max_bound = -min_bound;
+  for (size_t i = 0; i < ellipsoids.size(); i++)
+  {
+    // unbounded rays have no ellipsoid
+    const Ellipsoid &ellipsoid = ellipsoids[i];
+    if (ellipsoid.extents != Eigen::Vector3f::Zero())
+    {
+      ids_.push_back(static_cast<unsigned>(i));
+      min_bound = minVector(min_bound, Eigen::Vector3d(ellipsoid.pos - ellipsoid.extents.cast<double>()));
+      max_bound = maxVector(max_bound, Eigen::Vector3d(ellipsoid.pos + ellipsoid.extents.cast<double>()));
+    }
+  }
+  if (ids_.empty())
+  {
+    return;
+  }
+  origin_ = min_bound;
+  // well above the float precision of the coordinates, and the rounding of the ray in the overlap test
+  tolerance_ = static_cast<float>(1e-5 * std::max(1.0, (max_bound - min_bound).maxCoeff()));
+
+  // split each node at the median of its items' centres along the longest axis of the centres' bounds
+  struct Range
+  {
+    unsigned node, first, last;
+  };
+  std::vector<Range> ranges;
+  nodes_.reserve(2 * ids_.size() / kLeafSize + 1);
+  nodes_.push_back(Node());
+  ranges.push_back({ 0, 0, static_cast<unsigned>(ids_.size()) });
+  while (!ranges.empty())
+  {
+    const Range range = ranges.back();
+    ranges.pop_back();
+    Eigen::Vector3d node_min(max_double, max_double, max_double), node_max = -node_min;
+    Eigen::Vector3d centre_min = node_min, centre_max = node_max;
+    for (unsigned i = range.first; i < range.last; i++)
+    {
+      const Ellipsoid &ellipsoid = ellipsoids[ids_[i]];
+      const Eigen::Vector3d extents = ellipsoid.extents.cast<double>();
+      node_min = minVector(node_min, Eigen::Vector3d(ellipsoid.pos - extents));
+      node_max = maxVector(node_max, Eigen::Vector3d(ellipsoid.pos + extents));
+      centre_min = minVector(centre_min, ellipsoid.pos);
+      centre_max = maxVector(centre_max, ellipsoid.pos);
+    }
+    Node &node = nodes_[range.node];
+    node.box = relativeBox(node_min, node_max);
+    node.index = range.first;
+    node.count = range.last - range.first;
+    if (node.count <= kLeafSize)
+    {
+      continue;
+    }
+    int axis;
+    (centre_max - centre_min).maxCoeff(&axis);
+    const unsigned middle = range.first + node.count / 2;
+    std::nth_element(ids_.begin() + range.first, ids_.begin() + middle, ids_.begin() + range.last,
+                     [&](unsigned a, unsigned b) { return ellipsoids[a].pos[axis] < ellipsoids[b].pos[axis]; });
+    const unsigned child = static_cast<unsigned>(nodes_.size());
+    node.index = child;
+    nodes_.push_back(Node());
+    nodes_.push_back(Node());
+    ranges.push_back({ child, range.first, middle });
+    ranges.push_back({ child + 1, middle, range.last });
+  }
+
+  item_boxes_.resize(ids_.size());
+  for (size_t i = 0; i < ids_.size(); i++)
+  {
+    const Ellipsoid &ellipsoid = ellipsoids[ids_[i]];
+    const Eigen::Vector3d extents = ellipsoid.extents.cast<double>();
+    item_boxes_[i] = relativeBox(ellipsoid.pos - extents, ellipsoid.pos + extents);
+  }
+}
+
+EllipsoidBvh::Box EllipsoidBvh::relativeBox(const Eigen::Vector3d &min_bound, const Eigen::Vector3d &max_bound) const
+{
+  Box box;
+  box.min_bound = (min_bound - origin_).cast<float>() - Eigen::Vector3f::Constant(tolerance_);
+  box.max_bound = (max_bound - origin_).cast<float>() + Eigen::Vector3f::Constant(tolerance_);
+  return box;
+}
+
+unsigned EllipsoidBvh::firstItem(unsigned root) const
+{
+  while (nodes_[root].count > kLeafSize)
+  {
+    root = nodes_[root].index;
+  }
+  return nodes_[root].index;
+}
+
+std::vector<unsigned> EllipsoidBvh::partition(const std::vector<size_t> &weights, size_t max_weight) const
+{
+  std::vector<unsigned> roots;
+  if (nodes_.empty())
+  {
+    return roots;
+  }
+  std::vector<unsigned> stack(1, 0);
+  while (!stack.empty())
+  {
+    const unsigned index = stack.back();
+    stack.pop_back();
+    const Node &node = nodes_[index];
+    const unsigned first = firstItem(index);
+    size_t weight = 0;
+    for (unsigned i = first; i < first + node.count && weight <= max_weight; i++)
+    {
+      weight += weights[ids_[i]];
+    }
+    if (node.count <= kLeafSize || weight <= max_weight)
+    {
+      roots.push_back(index);
+      continue;
+    }
+    stack.push_back(node.index + 1);
+    stack.push_back(node.index);
+  }
+  return roots;
+}
+
+std::vector<unsigned> EllipsoidBvh::ellipsoids(unsigned root) const
+{
+  if (nodes_.empty())
+  {
+    return std::vector<unsigned>();
+  }
+  const unsigned first = firstItem(root);
+  return std::vector<unsigned>(ids_.begin() + first, ids_.begin() + first + nodes_[root].count);
+}
+}  // namespace ray
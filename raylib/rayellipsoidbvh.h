@@ -0,0 +1,164 @@
+// Copyright (c) 2020
+// Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+// ABN 41 687 119 230
+//
+// Author: Thomas Lowe
+#ifndef RAYLIB_RAYELLIPSOIDBVH_H
+#define RAYLIB_RAYELLIPSOIDBVH_H
+
+#include "raylib/raylibconfig.h"
+#include "rayellipsoid.h"
+#include "rayutils.h"
+
+namespace ray
+{
+/// A bounding volume hierarchy over the bounding boxes of a set of ellipsoids, for finding the ellipsoids that a ray
+/// passes near. This is the ray-centric alternative to a RayIndexGrid: its size depends only on the number of
+/// ellipsoids, and the cost of a ray depends on the ellipsoids it passes rather than the cells it crosses, so long rays
+/// through sparse space are cheap.
+/// The boxes are stored as floats relative to the minimum bound and grown slightly, so the search is conservative, and
+/// each overlap it finds is then checked exactly.
+/// Usage: @c build from the ellipsoids, then call @c forEachOverlap for each ray.
+class RAYLIB_EXPORT EllipsoidBvh
+{
+public:
+  /// build the hierarchy over the @c ellipsoids that have non-zero extents. The ellipsoids are referenced by the
+  /// hierarchy, so must not change while it is in use
+  void build(const std::vector<Ellipsoid> &ellipsoids);
+
+  /// call @c func(ellipsoid_index) for each ellipsoid whose bounding box overlaps the segment from @c start to @c end,
+  /// searching only the subtree at node @c root
+  template <class Function>
+  void forEachOverlap(const Eigen::Vector3d &start, const Eigen::Vector3d &end, const Function &func,
+                      unsigned root = 0) const;
+
+  /// Divide the hierarchy into disjoint subtrees that together hold all of its ellipsoids, returning their root nodes.
+  /// Each subtree is either a leaf or has a total of @c weights (indexed by ellipsoid) no greater than @c max_weight.
+  std::vector<unsigned> partition(const std::vector<size_t> &weights, size_t max_weight) const;
+  /// the indices of the ellipsoids in the subtree at node @c root
+  std::vector<unsigned> ellipsoids(unsigned root) const;
+
+  /// the number of ellipsoids in the hierarchy
+  inline size_t size() const { return ids_.size(); }
+
+private:
+  /// the most ellipsoids in a leaf of the hierarchy
+  static const unsigned kLeafSize = 4;
+
+  /// an axis aligned box relative to @c origin_
+  struct Box
+  {
+    Eigen::Vector3f min_bound = Eigen::Vector3f::Zero();
+    Eigen::Vector3f max_bound = Eigen::Vector3f::Zero();
+  };
+  /// a node of the hierarchy, holding @c count items. A leaf has at most kLeafSize items, starting at @c index.
+  /// Otherwise its two children are the nodes at @c index and @c index + 1
+  struct Node
+  {
+    Box box;
+    unsigned index = 0;
+    unsigned count = 0;
+  };
+
+  /// the box from @c min_bound to @c max_bound, relative to @c origin_ and rounded outwards
+  Box relativeBox(const Eigen::Vector3d &min_bound, const Eigen::Vector3d &max_bound) const;
+  /// the first item of the subtree at node @c root
+  unsigned firstItem(unsigned root) const;
+  /// whether the segment from @c start along @c dir, with @c inv_dir its component-wise inverse, overlaps the box from
+  /// @c min_bound to @c max_bound
+  template <class Vector>
+  static inline bool overlaps(const Vector &min_bound, const Vector &max_bound, const Vector &start,
+                              const Vector &dir, const Vector &inv_dir);
+
+  const std::vector<Ellipsoid> *ellipsoids_ = nullptr;
+  Eigen::Vector3d origin_;
+  /// the distance by which the boxes are grown, to cover the float rounding of the boxes and rays
+  float tolerance_ = 0.0f;
+  std::vector<Node> nodes_;
+  /// the ellipsoid index of each item, grouped by leaf
+  std::vector<unsigned> ids_;
+  /// the bounding box of each item, in the same order as @c ids_
+  std::vector<Box> item_boxes_;
+};
+
+template <class Vector>
+bool EllipsoidBvh::overlaps(const Vector &min_bound, const Vector &max_bound, const Vector &start, const Vector &dir,
+                            const Vector &inv_dir)
+{
+  using Scalar = typename Vector::Scalar;
+  Scalar t_min = 0, t_max = 1;
+  for (int axis = 0; axis < 3; axis++)
+  {
+    if (dir[axis] == 0)
+    {
+      if (start[axis] < min_bound[axis] || start[axis] > max_bound[axis])
+      {
+        return false;
+      }
+      continue;
+    }
+    Scalar t0 = (min_bound[axis] - start[axis]) * inv_dir[axis];
+    Scalar t1 = (max_bound[axis] - start[axis]) * inv_dir[axis];
+    if (t0 > t1)
+    {
+      std::swap(t0, t1);
+    }
+    t_min = std::max(t_min, t0);
+    t_max = std::min(t_max, t1);
+    if (t_min > t_max)
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+template <class Function>
+void EllipsoidBvh::forEachOverlap(const Eigen::Vector3d &start, const Eigen::Vector3d &end, const Function &func,
+                                  unsigned root) const
+{
+  if (nodes_.empty())
+  {
+    return;
+  }
+  const Eigen::Vector3d dir = end - start;
+  const Eigen::Vector3d inv_dir = dir.cwiseInverse();
+  const Eigen::Vector3f relative_start = (start - origin_).cast<float>();
+  const Eigen::Vector3f dir_f = dir.cast<float>();
+  const Eigen::Vector3f inv_dir_f = dir_f.cwiseInverse();
+  // the hierarchy is split at the median, so its depth is at most log2 of the item count
+  unsigned stack[64];
+  int size = 0;
+  stack[size++] = root;
+  while (size > 0)
+  {
+    const Node &node = nodes_[stack[--size]];
+    if (!overlaps(node.box.min_bound, node.box.max_bound, relative_start, dir_f, inv_dir_f))
+    {
+      continue;
+    }
+    if (node.count > kLeafSize)
+    {
+      stack[size++] = node.index;
+      stack[size++] = node.index + 1;
+      continue;
+    }
+    for (unsigned i = node.index; i < node.index + node.count; i++)
+    {
+      if (!overlaps(item_boxes_[i].min_bound, item_boxes_[i].max_bound, relative_start, dir_f, inv_dir_f))
+      {
+        continue;
+      }
+      const Ellipsoid &ellipsoid = (*ellipsoids_)[ids_[i]];
+      const Eigen::Vector3d extents = ellipsoid.extents.cast<double>();
+      if (overlaps(Eigen::Vector3d(ellipsoid.pos - extents), Eigen::Vector3d(ellipsoid.pos + extents), start, dir,
+                   inv_dir))
+      {
+        func(ids_[i]);
+      }
+    }
+  }
+}
+}  // namespace ray
+
+#endif  // RAYLIB_RAYELLIPSOIDBVH_H
@@ -4,7 +4,7 @@
 //
 // Author: Thomas Lowe
 #include "rayfinealignment.h"
-#include <nabo/nabo.h>
+#include "rayneighbourindex.h"
 
 namespace ray
 {
@@ -90,20 +90,15 @@ void FineAlignment::generateSurfels()
     size_t q_size = candidates.size();
     size_t p_size = decimated_points.size();
     const int search_size = std::min(20, (int)p_size - 1);
-    Nabo::NNSearchD *nns;
     Eigen::MatrixXd points_q(3, q_size);
     for (size_t i = 0; i < q_size; i++) points_q.col(i) = candidate_points[i];
-    Eigen::MatrixXd points_p(3, p_size);
-    for (size_t i = 0; i < p_size; i++) points_p.col(i) = decimated_points[i];
-    nns = Nabo::NNSearchD::createKDTreeLinearHeap(points_p, 3);
+    NeighbourIndex neighbour_index;
+    neighbour_index.build(decimated_points);
 
     // Run the search
     Eigen::MatrixXi indices;
     Eigen::MatrixXd dists2;
-    indices.resize(search_size, q_size);
-    dists2.resize(search_size, q_size);
-    nns->knn(points_q, indices, dists2, search_size, 0.01 * max_spacing, 0, max_spacing);
-    delete nns;
+    neighbour_index.knn(points_q, search_size, indices, dists2, max_spacing, 0.01 * max_spacing);
 
     // Convert these set of nearest neighbours into surfels
     surfels_[c].reserve(q_size);
@@ -113,7 +108,7 @@ void FineAlignment::generateSurfels()
     for (size_t i = 0; i < q_size; i++)
     {
       ids.clear();
-      for (int j = 0; j < search_size && indices(j, i) != Nabo::NNSearchD::InvalidIndex; j++) ids.push_back(indices(j, i));
+      for (int j = 0; j < search_size && indices(j, i) != NeighbourIndex::kInvalidIndex; j++) ids.push_back(indices(j, i));
       if (ids.size() < min_points_per_ellipsoid)  // not dense enough
         continue;
 
@@ -172,7 +167,6 @@ void FineAlignment::generateSurfelMatches(std::vector<Match> &matches)
   int search_size = 1;
   size_t q_size = surfels_[0].size();
   size_t p_size = surfels_[1].size();
-  Nabo::NNSearchD *nns;
   Eigen::MatrixXd points_q(7, q_size);
   for (size_t i = 0; i < q_size; i++)
   {
@@ -189,20 +183,18 @@ void FineAlignment::generateSurfelMatches(std::vector<Match> &matches)
     p[2] *= 2.0;
     points_p.col(i) << p, s.normal, s.is_plane ? 1.0 : 0.0;
   }
-  nns = Nabo::NNSearchD::createKDTreeLinearHeap(points_p, 7);
+  NeighbourIndex neighbour_index;
+  neighbour_index.build(std::move(points_p));
 
   // Run the search
   Eigen::MatrixXi indices;
   Eigen::MatrixXd dists2;
-  indices.resize(search_size, q_size);
-  dists2.resize(search_size, q_size);
-  nns->knn(points_q, indices, dists2, search_size, ray::kNearestNeighbourEpsilon * max_normal_difference_, 0,
-           max_normal_difference_);
-  delete nns;
+  neighbour_index.knn(points_q, search_size, indices, dists2, max_normal_difference_,
+                      ray::kNearestNeighbourEpsilon * max_normal_difference_);
 
   for (int i = 0; i < (int)q_size; i++)
   {
-    for (int j = 0; j < search_size && indices(j, i) != Nabo::NNSearchD::InvalidIndex; j++)
+    for (int j = 0; j < search_size && indices(j, i) != NeighbourIndex::kInvalidIndex; j++)
     {
       Match match;
       match.ids[0] = i;
@@ -8,16 +8,13 @@
 
 #include "raylib/raylibconfig.h"
 
+#include "raythreads.h"
 #include "rayutils.h"
 
 #include <functional>
 
-#if RAYLIB_WITH_TBB
+// the grid's cells can be added to from within parallelFor
 #define RAYLIB_PARALLEL_GRID 1
-#if RAYLIB_PARALLEL_GRID
-#include <tbb/spin_mutex.h>
-#endif  // RAYLIB_PARALLEL_GRID
-#endif  // RAYLIB_WITH_TBB
 
 namespace ray
 {
@@ -29,15 +26,57 @@ struct RAYLIB_EXPORT GridRayInfo
   double ray_length;
 };
 
+/// Visit the index of each grid cell along the ray from @c ray_start to @c ray_end, for a grid with minimum corner
+/// @c box_min and cell width @c voxel_width. The indices are not limited to the grid's bounds.
+template <class VisitFunction>
+void walkRayCells(const Eigen::Vector3d &ray_start, const Eigen::Vector3d &ray_end, const Eigen::Vector3d &box_min,
+                  double voxel_width, VisitFunction visit)
+{
+  const Eigen::Vector3d dir = ray_end - ray_start;
+  const Eigen::Vector3d dir_sign(sgn(dir[0]), sgn(dir[1]), sgn(dir[2]));
+  const Eigen::Vector3d start = (ray_start - box_min) / voxel_width;
+  const Eigen::Vector3d end = (ray_end - box_min) / voxel_width;
+  const Eigen::Vector3i start_index((int)floor(start[0]), (int)floor(start[1]), (int)floor(start[2]));
+  const Eigen::Vector3i end_index((int)floor(end[0]), (int)floor(end[1]), (int)floor(end[2]));
+  const double length_sqr = (end_index - start_index).squaredNorm();
+  Eigen::Vector3i index = start_index;
+  for (;;)
+  {
+    visit(index);
+    if (index == end_index || (index - start_index).squaredNorm() > length_sqr)
+    {
+      break;
+    }
+    const Eigen::Vector3d mid = box_min + voxel_width * Eigen::Vector3d(index[0] + 0.5, index[1] + 0.5, index[2] + 0.5);
+    const Eigen::Vector3d next_boundary = mid + 0.5 * voxel_width * dir_sign;
+    const Eigen::Vector3d delta = next_boundary - ray_start;
+    const Eigen::Vector3d d(delta[0] / dir[0], delta[1] / dir[1], delta[2] / dir[2]);
+    if (d[0] < d[1] && d[0] < d[2])
+    {
+      index[0] += int(dir_sign[0]);
+    }
+    else if (d[1] < d[0] && d[1] < d[2])
+    {
+      index[1] += int(dir_sign[1]);
+    }
+    else
+    {
+      index[2] += int(dir_sign[2]);
+    }
+  }
+}
+
 /// 3D grid container class based on hash lookup, to accelerate the access to spatial data by location
 /// A hash lookup is used because ray cloud geometry is generally sparse, and so continuous 3D voxel arrays are memory
 /// intensive
+/// The cells are held in an open addressing hash table, keyed on the packed 3D cell index. When the grid is parallel,
+/// the table is split into shards by hash, each with its own lock, so concurrent inserts rarely contend.
 template <class T>
 class Grid
 {
 public:
 #if RAYLIB_PARALLEL_GRID
-  using Mutex = tbb::spin_mutex;
+  using Mutex = SpinMutex;
 #endif  // RAYLIB_PARALLEL_GRID
 
   class Cell
@@ -45,9 +84,6 @@ public:
   public:
     std::vector<T> data;
     Eigen::Vector3i index;
-#if RAYLIB_PARALLEL_GRID
-    Mutex mutex;
-#endif  // RAYLIB_PARALLEL_GRID
 
     inline Cell() {}
     inline Cell(const Eigen::Vector3i &index, T initial_datum)
@@ -55,18 +91,6 @@ public:
     {
       data.push_back(initial_datum);
     }
-
-    /// Copy constructor, excludes mutex
-    inline Cell(const Cell &other)
-      : data(other.data)
-      , index(other.index)
-    {}
-
-    /// RValue constructor, excludes mutex
-    inline Cell(Cell &&other)
-      : data(std::move(other.data))
-      , index(other.index)
-    {}
   };
 
   using WalkVoxelsVisitFunction =
@@ -132,34 +156,27 @@ public:
     Eigen::Vector3d diff = (box_max - box_min) / voxel_width;
     dims = Eigen::Vector3i(diff.array().ceil().cast<int>());
 
-    int bucket_size = dims[0] * dims[1];  // let's assume a surface for the map. This is still significantly better on
-                                          // memory than a 3D grid (dims[0]*dims[1]*dims[2])
-    buckets_.resize(bucket_size);
+    shards_.clear();
+    shards_.resize(kNumShards);
     null_cell_.index = Eigen::Vector3i(-1, -1, -1);
   }
 
   Cell &cell(int x, int y, int z) { return cell(Eigen::Vector3i(x, y, z)); }
   Cell &cell(const Eigen::Vector3i &index)
   {
-    int hash = hashFunc(index.x(), index.y(), index.z());
-    Bucket &bucket = buckets_.at(hash);
-    // linearly search through the bucket
-    for (auto &c : bucket.cells)
-      if (c.index == index)
-        return c;
-    return null_cell_;
+    const uint64_t hash = hashFunc(index);
+    Shard &shard = shards_[shardIndex(hash)];
+    const int32_t id = shard.find(index, hash);
+    return id == kEmptySlot ? null_cell_ : shard.cells[id];
   }
 
-
   const Cell &cell(int x, int y, int z) const { return cell(Eigen::Vector3i(x, y, z)); }
   const Cell &cell(const Eigen::Vector3i &index) const
   {
-    int hash = hashFunc(index.x(), index.y(), index.z());
-    const Bucket &bucket = buckets_.at(hash);
-    for (const auto &c : bucket.cells)
-      if (c.index == index)
-        return c;
-    return null_cell_;
+    const uint64_t hash = hashFunc(index);
+    const Shard &shard = shards_[shardIndex(hash)];
+    const int32_t id = shard.find(index, hash);
+    return id == kEmptySlot ? null_cell_ : shard.cells[id];
   }
 
   void insert(int x, int y, int z, const T &value)
@@ -170,68 +187,36 @@ public:
 
   void addCell(const Eigen::Vector3i &index)
   {
-    int hash = hashFunc(index[0], index[1], index[2]);
-    Bucket &bucket = buckets_.at(hash);
+    const uint64_t hash = hashFunc(index);
+    Shard &shard = shards_[shardIndex(hash)];
 #if RAYLIB_PARALLEL_GRID
-    Mutex::scoped_lock bucket_lock(bucket.mutex);
+    Mutex::scoped_lock shard_lock(shard.mutex);
 #endif  // RAYLIB_PARALLEL_GRID
-    for (auto &c : bucket.cells)
-    {
-      if (c.index == index)
-      {
-        return;
-      }
-    }
-    Cell new_cell;
-    new_cell.index = index;
-    bucket.cells.emplace_back(new_cell); // fill with empty cell
+    shard.findOrAdd(index, hash);
   }
 
   void insert(const Eigen::Vector3i &index, const T &value)
   {
-    int hash = hashFunc(index[0], index[1], index[2]);
-    Bucket &bucket = buckets_.at(hash);
+    const uint64_t hash = hashFunc(index);
+    Shard &shard = shards_[shardIndex(hash)];
 #if RAYLIB_PARALLEL_GRID
-    Mutex::scoped_lock bucket_lock(bucket.mutex);
+    Mutex::scoped_lock shard_lock(shard.mutex);
 #endif  // RAYLIB_PARALLEL_GRID
-    for (auto &c : bucket.cells)
-    {
-      if (c.index == index)
-      {
-#if RAYLIB_PARALLEL_GRID
-        Mutex::scoped_lock cell_lock(c.mutex);
-#endif  // RAYLIB_PARALLEL_GRID
-        if (c.index == index)
-        {
-          c.data.emplace_back(value);
-          return;
-        }
-      }
-    }
-    bucket.cells.emplace_back(Cell(index, value));
+    shard.cells[shard.findOrAdd(index, hash)].data.emplace_back(value);
   }
 
   // only inserts into a cell that exists
   void insertIfCellExists(const Eigen::Vector3i &index, const T &value)
   {
-    int hash = hashFunc(index[0], index[1], index[2]);
-    Bucket &bucket = buckets_.at(hash);
+    const uint64_t hash = hashFunc(index);
+    Shard &shard = shards_[shardIndex(hash)];
 #if RAYLIB_PARALLEL_GRID
-    Mutex::scoped_lock bucket_lock(bucket.mutex);
+    Mutex::scoped_lock shard_lock(shard.mutex);
 #endif  // RAYLIB_PARALLEL_GRID
-    for (auto &c : bucket.cells)
+    const int32_t id = shard.find(index, hash);
+    if (id != kEmptySlot)
     {
-      if (c.index == index)
-      {
-#if RAYLIB_PARALLEL_GRID
-        Mutex::scoped_lock cell_lock(c.mutex);
-#endif  // RAYLIB_PARALLEL_GRID
-        if (c.index == index)
-        {
-          c.data.emplace_back(value);
-          return;
-        }
-      }
+      shard.cells[id].data.emplace_back(value);
     }
   }
 
@@ -239,24 +224,20 @@ public:
   /// structure is for a given @c voxel_width.
   void report()
   {
-    size_t count = 0;
     size_t total_count = 0;
+    size_t slot_count = 0;
     size_t data_count = 0;
-    for (auto &bucket : buckets_)
+    for (auto &shard : shards_)
     {
-      size_t size = bucket.cells.size();
-      if (size > 0)
-        count++;
-      total_count += size;
-      for (auto &cell : bucket.cells)
+      total_count += shard.cells.size();
+      slot_count += shard.slots.size();
+      for (auto &cell : shard.cells)
       {
         data_count += cell.data.size();
       }
     }
-    std::cout << "buckets filled: " << count << " out of " << buckets_.size() << " buckets, which is "
-              << 100.0 * (double)count / (double)buckets_.size() << "%%" << std::endl;
-    std::cout << "voxels filled: " << total_count
-              << ", average size of filled bucket: " << (double)total_count / (double)count << std::endl;
+    std::cout << "voxels filled: " << total_count << " in " << shards_.size() << " shards, hash table load "
+              << 100.0 * (double)total_count / (double)std::max<size_t>(slot_count, 1) << "%" << std::endl;
     std::cout << "average data per filled voxel: " << (double)data_count / (double)total_count << std::endl;
     std::cout << "total data stored: " << data_count << std::endl;
   }
@@ -264,9 +245,9 @@ public:
   /// applies the @c visit function for all cells in the grid
   void walkCells(const WalkCellsVisitFunction &visit) const
   {
-    for (const auto &bucket : buckets_)
+    for (const auto &shard : shards_)
     {
-      for (const auto &cell : bucket.cells)
+      for (const auto &cell : shard.cells)
       {
         visit(*this, cell);
       }
@@ -278,29 +259,112 @@ public:
   Eigen::Vector3i dims;
 
 protected:
-  class Bucket
+#if RAYLIB_PARALLEL_GRID
+  static constexpr size_t kNumShards = 64;
+#else
+  static constexpr size_t kNumShards = 1;
+#endif  // RAYLIB_PARALLEL_GRID
+  static constexpr int32_t kEmptySlot = -1;
+
+  /// An open addressing hash table with linear probing. The cells are stored contiguously in insertion order, and the
+  /// slots hold their positions in @c cells, so that growing the table only moves the slots.
+  class Shard
   {
   public:
     std::vector<Cell> cells;
+    std::vector<int32_t> slots;
 #if RAYLIB_PARALLEL_GRID
     Mutex mutex;
 #endif  // RAYLIB_PARALLEL_GRID
 
-    inline Bucket() = default;
-    inline Bucket(const Bucket &other)
+    inline Shard() = default;
+    inline Shard(const Shard &other)
       : cells(other.cells)
+      , slots(other.slots)
     {}
-    inline Bucket(Bucket &&other)
+    inline Shard(Shard &&other)
       : cells(std::move(other.cells))
+      , slots(std::move(other.slots))
     {}
+
+    /// the position of the cell with @c index in @c cells, or kEmptySlot if it is not present
+    inline int32_t find(const Eigen::Vector3i &index, uint64_t hash) const
+    {
+      if (slots.empty())
+      {
+        return kEmptySlot;
+      }
+      const size_t mask = slots.size() - 1;
+      for (size_t slot = static_cast<size_t>(hash) & mask;; slot = (slot + 1) & mask)
+      {
+        const int32_t id = slots[slot];
+        if (id == kEmptySlot || cells[id].index == index)
+        {
+          return id;
+        }
+      }
+    }
+
+    /// the position of the cell with @c index in @c cells, adding an empty cell if it is not present
+    inline int32_t findOrAdd(const Eigen::Vector3i &index, uint64_t hash)
+    {
+      if (2 * (cells.size() + 1) > slots.size())  // keep the load at or below a half, for short probe sequences
+      {
+        grow();
+      }
+      const size_t mask = slots.size() - 1;
+      size_t slot = static_cast<size_t>(hash) & mask;
+      for (; slots[slot] != kEmptySlot; slot = (slot + 1) & mask)
+      {
+        if (cells[slots[slot]].index == index)
+        {
+          return slots[slot];
+        }
+      }
+      slots[slot] = static_cast<int32_t>(cells.size());
+      cells.emplace_back();
+      cells.back().index = index;
+      return slots[slot];
+    }
+
+  private:
+    void grow()
+    {
+      slots.assign(std::max<size_t>(16, 2 * slots.size()), kEmptySlot);
+      const size_t mask = slots.size() - 1;
+      for (size_t id = 0; id < cells.size(); id++)
+      {
+        size_t slot = static_cast<size_t>(hashFunc(cells[id].index)) & mask;
+        while (slots[slot] != kEmptySlot)
+        {
+          slot = (slot + 1) & mask;
+        }
+        slots[slot] = static_cast<int32_t>(id);
+      }
+    }
   };
 
-  inline int hashFunc(int x, int y, int z) const { return int((x * 17 + y * 101 + z * 797) % buckets_.size()); }
+  /// hash of the cell index, packed into 21 bits per axis. The top bits choose the shard and the bottom bits the slot
+  static inline uint64_t hashFunc(const Eigen::Vector3i &index)
+  {
+    const uint64_t mask = (uint64_t(1) << 21) - 1;
+    const uint64_t key = (uint64_t(uint32_t(index[0])) & mask) | ((uint64_t(uint32_t(index[1])) & mask) << 21) |
+                         ((uint64_t(uint32_t(index[2])) & mask) << 42);
+    uint64_t hash = key * 0x9E3779B97F4A7C15ull;
+    return hash ^ (hash >> 29);
+  }
+  /// the shard is taken from the top 6 bits of the hash, so that it is independent of the slot
+  static inline size_t shardIndex(uint64_t hash) { return static_cast<size_t>(hash >> 58) & (kNumShards - 1); }
 
-  std::vector<Bucket> buckets_;
+  std::vector<Shard> shards_;
   Cell null_cell_;
 };
 
+template <class T>
+constexpr size_t Grid<T>::kNumShards;
+template <class T>
+constexpr int32_t Grid<T>::kEmptySlot;
+
 template <class T>
 class ContiguousGrid
 {
@@ -0,0 +1,201 @@
+// Copyright (c) 2020
+// Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+// ABN 41 687 119 230
+//
+// Author: Thomas Lowe
+#include "rayindexgrid.h"
+#include "raycloud.h"
+#include "raycompactcloud.h"
+#include "raygrid.h"
+#include "rayprogress.h"
+#include "raythreads.h"
+
+#include <algorithm>
+#include <atomic>
+
+namespace ray
+{
+namespace
+{
+/// the first slot to probe for a cell key. The brick part of the key is hashed and the cell within the brick is kept,
+/// so that the eight cells of a brick have neighbouring slots
+inline uint64_t hashKey(uint64_t key)
+{
+  uint64_t hash = (key >> 3) * 0x9E3779B97F4A7C15ull;
+  hash ^= hash >> 29;
+  return (hash << 3) | (key & 7);
+}
+}  // namespace
+
+constexpr uint64_t RayIndexGrid::kNoKey;
+
+void RayIndexGrid::init(const Eigen::Vector3d &box_min, const Eigen::Vector3d &box_max, double voxel_width)
+{
+  this->box_min = box_min;
+  this->box_max = box_max;
+  this->voxel_width = voxel_width;
+  Eigen::Vector3d diff = (box_max - box_min) / voxel_width;
+  dims = Eigen::Vector3i(diff.array().ceil().cast<int>());
+  keys_.clear();
+  offsets_.clear();
+  ray_ids_.clear();
+  table_.clear();
+  pending_keys_.clear();
+}
+
+void RayIndexGrid::addCells(const std::vector<Eigen::Vector3d> &points)
+{
+  const size_t first = pending_keys_.size();
+  pending_keys_.resize(first + points.size());
+  parallelFor(0, points.size(), [&](size_t i) {
+    const Eigen::Vector3d pos = (points[i] - box_min) / voxel_width;
+    pending_keys_[first + i] =
+      key(Eigen::Vector3i((int)std::floor(pos[0]), (int)std::floor(pos[1]), (int)std::floor(pos[2])));
+  });
+}
+
+void RayIndexGrid::addCells(const CompactCloud &cloud)
+{
+  const size_t first = pending_keys_.size();
+  pending_keys_.resize(first + cloud.rayCount());
+  parallelFor(0, cloud.rayCount(), [&](size_t i) {
+    const Eigen::Vector3d pos = (cloud.end(i) - box_min) / voxel_width;
+    pending_keys_[first + i] =
+      key(Eigen::Vector3i((int)std::floor(pos[0]), (int)std::floor(pos[1]), (int)std::floor(pos[2])));
+  });
+}
+
+int64_t RayIndexGrid::find(uint64_t key) const
+{
+  if (key == kNoKey || table_.empty())
+  {
+    return -1;
+  }
+  const size_t mask = table_.size() - 1;
+  for (size_t slot = static_cast<size_t>(hashKey(key)) & mask;; slot = (slot + 1) & mask)
+  {
+    if (table_[slot].key == key)
+    {
+      return static_cast<int64_t>(table_[slot].cell);
+    }
+    if (table_[slot].key == kNoKey)
+    {
+      return -1;
+    }
+  }
+}
+
+void RayIndexGrid::build(const Cloud &cloud, Progress *progress)
+{
+  buildT(cloud, progress);
+}
+
+void RayIndexGrid::build(const CompactCloud &cloud, Progress *progress)
+{
+  buildT(cloud, progress);
+}
+
+template <class CloudType>
+void RayIndexGrid::buildT(const CloudType &cloud, Progress *progress)
+{
+  // the occupied cells, sorted and unique
+  pending_keys_.insert(pending_keys_.end(), keys_.begin(), keys_.end());
+  std::sort(pending_keys_.begin(), pending_keys_.end());
+  pending_keys_.erase(std::unique(pending_keys_.begin(), pending_keys_.end()), pending_keys_.end());
+  if (!pending_keys_.empty() && pending_keys_.back() == kNoKey)
+  {
+    pending_keys_.pop_back();  // points outside the grid
+  }
+  keys_.swap(pending_keys_);
+  pending_keys_.clear();
+  pending_keys_.shrink_to_fit();
+  const size_t num_cells = keys_.size();
+
+  // hash table at most half full
+  size_t table_size = 16;
+  while (table_size < 2 * num_cells)
+  {
+    table_size *= 2;
+  }
+  table_.assign(table_size, Slot{ kNoKey, 0 });
+  for (size_t i = 0; i < num_cells; i++)
+  {
+    size_t slot = static_cast<size_t>(hashKey(keys_[i])) & (table_size - 1);
+    while (table_[slot].key != kNoKey)
+    {
+      slot = (slot + 1) & (table_size - 1);
+    }
+    table_[slot] = Slot{ keys_[i], i };
+  }
+
+  if (progress)
+  {
+    progress->begin("fillRayGrid", 2 * cloud.rayCount());
+  }
+  // first pass: count the rays in each cell
+  std::vector<std::atomic<uint32_t>> counts(num_cells);
+  for (auto &count : counts)
+  {
+    count.store(0, std::memory_order_relaxed);
+  }
+  parallelFor(0, cloud.rayCount(), [&](size_t i) {
+    walkRayCells(cloud.start(i), cloud.end(i), box_min, voxel_width, [&](const Eigen::Vector3i &index) {
+      const int64_t cell_id = find(key(index));
+      if (cell_id >= 0)
+      {
+        counts[cell_id].fetch_add(1, std::memory_order_relaxed);
+      }
+    });
+    if (progress)
+    {
+      progress->increment();
+    }
+  });
+
+  offsets_.resize(num_cells + 1);
+  offsets_[0] = 0;
+  for (size_t i = 0; i < num_cells; i++)
+  {
+    offsets_[i + 1] = offsets_[i] + counts[i].load(std::memory_order_relaxed);
+    counts[i].store(0, std::memory_order_relaxed);
+  }
+
+  // second pass: write the rays into their cells' ranges
+  ray_ids_.resize(offsets_[num_cells]);
+  parallelFor(0, cloud.rayCount(), [&](size_t i) {
+    walkRayCells(cloud.start(i), cloud.end(i), box_min, voxel_width, [&](const Eigen::Vector3i &index) {
+      const int64_t cell_id = find(key(index));
+      if (cell_id >= 0)
+      {
+        ray_ids_[offsets_[cell_id] + counts[cell_id].fetch_add(1, std::memory_order_relaxed)] =
+          static_cast<unsigned>(i);
+      }
+    });
+    if (progress)
+    {
+      progress->increment();
+    }
+  });
+  // the fill order depends on the thread timing, so sort each cell to keep the results deterministic
+  parallelFor(0, num_cells,
+              [&](size_t i) { std::sort(ray_ids_.begin() + offsets_[i], ray_ids_.begin() + offsets_[i + 1]); });
+}
+
+RayIndexGrid::Rays RayIndexGrid::cell(const Eigen::Vector3i &index) const
+{
+  const int64_t cell_id = find(key(index));
+  if (cell_id < 0)
+  {
+    return Rays(nullptr, nullptr);
+  }
+  const unsigned *ids = ray_ids_.data();
+  return Rays(ids + offsets_[cell_id], ids + offsets_[cell_id + 1]);
+}
+
+size_t RayIndexGrid::memoryUsage() const
+{
+  return keys_.capacity() * sizeof(uint64_t) + offsets_.capacity() * sizeof(size_t) +
+         ray_ids_.capacity() * sizeof(unsigned) + table_.capacity() * sizeof(Slot) +
+         pending_keys_.capacity() * sizeof(uint64_t);
+}
+}  // namespace ray
@@ -0,0 +1,116 @@
+// Copyright (c) 2020
+// Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+// ABN 41 687 119 230
+//
+// Author: Thomas Lowe
+#ifndef RAYLIB_RAYINDEXGRID_H
+#define RAYLIB_RAYINDEXGRID_H
+
+#include "raylib/raylibconfig.h"
+#include "rayutils.h"
+
+namespace ray
+{
+class Cloud;
+class CompactCloud;
+class Progress;
+
+/// A read-only grid of the ray indices passing through each of a set of occupied cells, in compressed sparse row form.
+/// This is an alternative to filling a Grid<unsigned>, built in two passes over the rays. The first pass counts the
+/// rays in each cell and the second writes them into a single flat array, so no per cell allocations or locks are
+/// needed and both passes run in parallel.
+/// Usage: @c init the grid, mark the occupied cells with @c addCells, then @c build from a cloud.
+class RAYLIB_EXPORT RayIndexGrid
+{
+public:
+  /// The ray indices in one cell, in ascending order
+  class Rays
+  {
+  public:
+    Rays(const unsigned *begin, const unsigned *end)
+      : begin_(begin)
+      , end_(end)
+    {}
+    inline const unsigned *begin() const { return begin_; }
+    inline const unsigned *end() const { return end_; }
+    inline size_t size() const { return static_cast<size_t>(end_ - begin_); }
+    inline bool empty() const { return begin_ == end_; }
+
+  private:
+    const unsigned *begin_, *end_;
+  };
+
+  RayIndexGrid() {}
+  RayIndexGrid(const Eigen::Vector3d &box_min, const Eigen::Vector3d &box_max, double voxel_width)
+  {
+    init(box_min, box_max, voxel_width);
+  }
+
+  /// the grid is axis aligned, so initialised from a bounding box and a voxel width. This clears any contents
+  void init(const Eigen::Vector3d &box_min, const Eigen::Vector3d &box_max, double voxel_width);
+
+  /// mark the cells containing @c points as occupied. Only occupied cells store rays, and cells outside the bounds are
+  /// ignored. Call before @c build
+  void addCells(const std::vector<Eigen::Vector3d> &points);
+  /// mark the cells containing the end points of @c cloud as occupied
+  void addCells(const CompactCloud &cloud);
+
+  /// store the index of each ray of @c cloud in all of the occupied cells that it passes through. The grid is
+  /// read-only afterwards
+  void build(const Cloud &cloud, Progress *progress = nullptr);
+  void build(const CompactCloud &cloud, Progress *progress = nullptr);
+
+  /// the rays passing through the cell at @c index. Empty for unoccupied cells and cells outside the grid
+  Rays cell(const Eigen::Vector3i &index) const;
+  inline Rays cell(int x, int y, int z) const { return cell(Eigen::Vector3i(x, y, z)); }
+
+  /// the number of occupied cells
+  inline size_t cellCount() const { return keys_.size(); }
+  /// the total size of the grid's storage, in bytes
+  size_t memoryUsage() const;
+
+  Eigen::Vector3d box_min, box_max;
+  double voxel_width = 0.0;
+  Eigen::Vector3i dims = Eigen::Vector3i::Zero();
+
+private:
+  static constexpr uint64_t kNoKey = ~uint64_t(0);
+
+  /// the key of the cell at @c index, or kNoKey if it is outside the grid
+  inline uint64_t key(const Eigen::Vector3i &index) const
+  {
+    if (index[0] < 0 || index[1] < 0 || index[2] < 0 || index[0] >= dims[0] || index[1] >= dims[1] ||
+        index[2] >= dims[2])
+    {
+      return kNoKey;
+    }
+    // cells are grouped into 2x2x2 bricks, which are kept together in the hash table, so that the successive cells
+    // along a ray often share a cache line
+    const uint64_t brick = uint64_t(index[0] >> 1) +
+                           uint64_t((dims[0] + 1) >> 1) *
+                             (uint64_t(index[1] >> 1) + uint64_t((dims[1] + 1) >> 1) * uint64_t(index[2] >> 1));
+    return (brick << 3) | uint64_t((index[0] & 1) | ((index[1] & 1) << 1) | ((index[2] & 1) << 2));
+  }
+  /// the position of the occupied cell with @c key in @c keys_, or -1
+  inline int64_t find(uint64_t key) const;
+  template <class CloudType>
+  void buildT(const CloudType &cloud, Progress *progress);
+
+  /// occupied cell keys in ascending order, so cells are stored in z, y, x order of their bricks
+  std::vector<uint64_t> keys_;
+  /// the rays of cell i are ray_ids_[offsets_[i]] to ray_ids_[offsets_[i+1]]
+  std::vector<size_t> offsets_;
+  std::vector<unsigned> ray_ids_;
+  /// open addressing hash table from key to cell position. Each slot holds both, so a lookup touches one cache line
+  struct Slot
+  {
+    uint64_t key;
+    uint64_t cell;
+  };
+  std::vector<Slot> table_;
+  /// the occupied cells added since the last build, not yet sorted or unique
+  std::vector<uint64_t> pending_keys_;
+};
+}  // namespace ray
+
+#endif  // RAYLIB_RAYINDEXGRID_H
@@ -6,6 +6,7 @@
 #include "raylaz.h"
 #include "raylib/rayprogress.h"
 #include "raylib/rayprogressthread.h"
+#include "raymemory.h"
 #include "rayunused.h"
 
 #if RAYLIB_WITH_LAS
@@ -56,6 +57,7 @@ bool readLas(const std::string &file_name,
 
   ray::Progress progress;
   ray::ProgressThread progress_thread(progress);
+  chunk_size = Memory::chunkSize(chunk_size);
   const size_t num_chunks = (number_of_points + (chunk_size - 1)) / chunk_size;
   chunk_size = std::min(number_of_points, chunk_size);
   progress.begin("read and process", num_chunks);
@@ -259,7 +261,7 @@ bool LasWriter::writeChunk(const std::vector<Eigen::Vector3d> &points, const std
   {
     return true;  // this is acceptable behaviour. It avoids calling function checking for emptiness each time
   }
-  if (out_.fail())
+  if (!writer_)
   {
     std::cerr << "Error: cannot open " << file_name_ << " for writing." << std::endl;
     return false;
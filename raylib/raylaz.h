@@ -34,7 +34,8 @@ bool RAYLIB_EXPORT readLas(const std::string &file_name,
 bool RAYLIB_EXPORT writeLas(std::string file_name, const std::vector<Eigen::Vector3d> &points,
                             const std::vector<double> &times, const std::vector<RGBA> &colours);
 
-/// Class for chunked writing of las/laz files.
+/// Class for chunked writing of las/laz files. All of the writer's state is held in the object, so separate
+/// LasWriters can write to different files concurrently.
 class RAYLIB_EXPORT LasWriter
 {
 public:
@@ -47,11 +48,11 @@ public:
                   const std::vector<RGBA> &colours);
 
 private:
-  const std::string &file_name_;
+  std::string file_name_;
   std::ofstream out_;
 #if RAYLIB_WITH_LAS
   liblas::Header header_;
-  liblas::Writer *writer_;
+  liblas::Writer *writer_ = nullptr;
 #endif  // RAYLIB_WITH_LAS
 };
 }  // namespace ray
@@ -60,6 +60,7 @@
 #define RAYLIB_WITH_LAS @WITH_LAS@
 #define RAYLIB_WITH_QHULL @WITH_QHULL@
 #define RAYLIB_WITH_TBB @WITH_TBB@
+#define RAYLIB_WITH_OPENMP @WITH_OPENMP@
 #define RAYLIB_WITH_TIFF @WITH_TIFF@
 #define RAYLIB_WITH_NORMAL_FIELD @WITH_NORMAL_FIELD@
 #define RAYLIB_DOUBLE_RAYS @DOUBLE_RAYS@
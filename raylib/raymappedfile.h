@@ -0,0 +1,49 @@
+// Copyright (c) 2020
+// Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+// ABN 41 687 119 230
+//
+// Author: Thomas Lowe
+#ifndef RAYLIB_RAYMAPPEDFILE_H
+#define RAYLIB_RAYMAPPEDFILE_H
+
+#include "raylib/raylibconfig.h"
+
+#include <cstddef>
+#include <string>
+
+namespace ray
+{
+/// A read-only memory mapping of a whole file. This lets large binary files be decoded directly from the
+/// mapped pages, rather than through many small stream reads.
+/// @c open() returns false when the platform or file does not support mapping, in which case callers should fall back
+/// to buffered stream reading.
+class RAYLIB_EXPORT MappedFile
+{
+public:
+  MappedFile() = default;
+  ~MappedFile();
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  /// map the full contents of @c file_name into memory, read only
+  bool open(const std::string &file_name);
+  /// unmap the file. This is also called by the destructor
+  void close();
+
+  /// hint to the operating system that the mapping will be read from front to back
+  void adviseSequential() const;
+  /// hint that the byte range [@c offset, @c offset + @c length) has been consumed, so its pages can be dropped from
+  /// the resident set. This stops resident memory growing with the file size while streaming.
+  void release(size_t offset, size_t length) const;
+
+  inline bool isOpen() const { return data_ != nullptr; }
+  inline const unsigned char *data() const { return data_; }
+  inline size_t size() const { return size_; }
+
+private:
+  const unsigned char *data_ = nullptr;
+  size_t size_ = 0;
+};
+}  // namespace ray
+
+#endif  // RAYLIB_RAYMAPPEDFILE_H
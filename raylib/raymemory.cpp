@@ -0,0 +1,39 @@
+// Copyright (c) 2020
+// Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+// ABN 41 687 119 230
+//
+// Author: Thomas Lowe
+#include "raymemory.h"
+
+#include <algorithm>
+#include <limits>
+
+namespace ray
+{
+namespace
+{
+size_t memory_limit = 0;
+/// the smallest streamed chunk, below which the per-chunk overheads dominate
+const size_t kMinChunkSize = 10000;
+}  // namespace
+
+void Memory::setLimit(size_t bytes)
+{
+  memory_limit = bytes;
+}
+
+size_t Memory::limit()
+{
+  return memory_limit;
+}
+
+size_t Memory::chunkSize(size_t chunk_size)
+{
+  if (memory_limit == 0 || chunk_size == std::numeric_limits<size_t>::max())
+  {
+    return chunk_size;
+  }
+  const size_t limited_size = std::max(kMinChunkSize, memory_limit / (4 * kStreamedRayBytes));
+  return std::min(chunk_size, limited_size);
+}
+}  // namespace ray
@@ -0,0 +1,38 @@
+// Copyright (c) 2020
+// Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+// ABN 41 687 119 230
+//
+// Author: Thomas Lowe
+#ifndef RAYLIB_RAYMEMORY_H
+#define RAYLIB_RAYMEMORY_H
+
+#include "raylib/raylibconfig.h"
+
+#include <cstddef>
+
+namespace ray
+{
+/// The memory budget of the process, typically set from the --memory_limit command line option.
+/// The streaming functions size their chunks, grids and passes to fit within it. When it is not set they use their
+/// usual fixed sizes.
+class RAYLIB_EXPORT Memory
+{
+public:
+  /// the approximate memory used by each ray of a streamed chunk: the decoded ray, the chunk being read ahead, and
+  /// the caller's working copy
+  static const size_t kStreamedRayBytes = 256;
+
+  /// Set the memory limit in bytes, 0 removes the limit
+  static void setLimit(size_t bytes);
+  /// The memory limit in bytes, or 0 if it is not set
+  static size_t limit();
+  /// Whether a memory limit has been set
+  static bool limited() { return limit() > 0; }
+
+  /// The number of rays to stream at one time, which is @c chunk_size reduced so that a chunk uses at most a quarter
+  /// of the memory limit. A @c chunk_size of size_t max, which reads the whole cloud at once, is not reduced.
+  static size_t chunkSize(size_t chunk_size);
+};
+}  // namespace ray
+
+#endif  // RAYLIB_RAYMEMORY_H
@@ -5,30 +5,20 @@
 // Author: Kazys Stepanas, Tom Lowe
 #include "raymerger.h"
 
+#include "raycloudwriter.h"
+#include "raycompactcloud.h"
+#include "rayellipsoidbvh.h"
 #include "raygrid.h"
+#include "raymemory.h"
 #include "rayprogress.h"
+#include "raythreads.h"
 #include "rayunused.h"
 
-#if RAYLIB_WITH_TBB
-#include <tbb/enumerable_thread_specific.h>
-#include <tbb/parallel_for.h>
-#endif  // RAYLIB_WITH_TBB
-
 #include <algorithm>
 #include <iomanip>
 #include <iostream>
 #include <set>
 
-#if RAYLIB_WITH_TBB
-// With threads we use std::atomic_bool for the transient marks. These are default initialised to false. No additional
-// argument required
-#define MARKER_BOOL_INIT
-#else  // RAYLIB_WITH_TBB
-// Without threads, we use bool for the transient marks. There is no default construction, so we must provide the
-// initialisation argument
-#define MARKER_BOOL_INIT , false
-#endif  // RAYLIB_WITH_TBB
-
 namespace ray
 {
 class EllipsoidTransientMarker
@@ -52,10 +42,20 @@ public:
   /// @param merge_type The merging strategy.
   /// @param self_transient True when the @p ellipsoid was generated from @p cloud and we are looking for transient
   /// points within this cloud.
-  void mark(Ellipsoid *ellipsoid, std::vector<Merger::Bool> *transient_ray_marks, const Cloud &cloud,
-            const Grid<unsigned> &ray_grid, double num_rays, MergeType merge_type, bool self_transient,
+  template <class CloudType>
+  void mark(Ellipsoid *ellipsoid, std::vector<Merger::Bool> *transient_ray_marks, const CloudType &cloud,
+            const RayIndexGrid &ray_grid, double num_rays, MergeType merge_type, bool self_transient,
             bool ellipsoid_cloud_first);
 
+  /// Resolve whether the @p ellipsoid is transient from the rays that intersect it: the number of @p hits, with times
+  /// from @p first_intersection_time to @p last_intersection_time, and the rays of @p pass_through_ids which pass
+  /// through it. Parameters are as for @c mark().
+  template <class CloudType>
+  static void resolve(Ellipsoid *ellipsoid, unsigned hits, double first_intersection_time,
+                      double last_intersection_time, const std::vector<unsigned> &pass_through_ids,
+                      std::vector<Merger::Bool> *transient_ray_marks, const CloudType &cloud, double num_rays,
+                      MergeType merge_type, bool self_transient, bool ellipsoid_cloud_first);
+
 private:
   // Working memory.
 
@@ -87,6 +87,152 @@ public:
   }
 };
 
+namespace
+{
+/// the approximate memory used per ray by the transient filter of a tile: the ray, its ellipsoid and neighbour search,
+/// its ray grid entries and its result
+const size_t kTileRayBytes = 512;
+/// the memory used for the tiles of @c Merger::filterFile when no memory limit is set
+const size_t kTileMemory = size_t(4) << 30;
+
+/// the number of rays in each range traced through the ellipsoid hierarchy
+const size_t kBvhRangeSize = 4096;
+/// one in this many rays are traced to estimate the intersections of each ellipsoid
+const size_t kBvhSampleStep = 32;
+/// the memory used for the gathered ellipsoid intersections when no memory limit is set
+const size_t kBvhIntersectionMemory = size_t(1) << 30;
+
+/// the minimum bound of a ray grid, snapped down to a multiple of the voxel size so that the ray grids of different
+/// parts of a cloud share the same cell boundaries
+Eigen::Vector3d gridMinBound(const Eigen::Vector3d &bounds_min, double voxel_size)
+{
+  return (bounds_min / voxel_size).array().floor() * voxel_size;
+}
+
+/// warn when the largest horizontal ellipsoid extent @c max_extent of a tiled filter or merge is beyond the @c halo of
+/// the tiles, as the rays passing through those ellipsoids may not be loaded into their tile
+void checkHalo(double max_extent, double halo)
+{
+  if (max_extent > halo)
+  {
+    std::cerr << "Warning: ellipsoids extend " << max_extent << " m, beyond the tile halo of " << halo
+              << " m, so the results may differ from an untiled run. Use a halo of at least " << max_extent
+              << " m to match" << std::endl;
+  }
+}
+
+/// the largest horizontal extent of @c ellipsoids
+double maxHorizontalExtent(const std::vector<Ellipsoid> &ellipsoids)
+{
+  double max_extent = 0.0;
+  for (const auto &ellipsoid : ellipsoids)
+  {
+    max_extent = std::max(max_extent, double(std::max(ellipsoid.extents[0], ellipsoid.extents[1])));
+  }
+  return max_extent;
+}
+
+/// the estimated point spacing of either type of cloud
+double pointSpacing(const Cloud &cloud)
+{
+  return cloud.estimatePointSpacing();
+}
+double pointSpacing(const CompactCloud &cloud)
+{
+  return Cloud::estimatePointSpacing(cloud);
+}
+
+/// A division of the horizontal extent of some rays into square tiles, for processing clouds that are too large to
+/// fit in memory. Each tile is loaded with the rays that end within it (its interior rays) and those that pass within
+/// the halo around it.
+class TileLayout
+{
+public:
+  /// tiles of @c tile_width covering the horizontal extent of @c rays_bound, each with a @c halo
+  TileLayout(const Cuboid &rays_bound, double tile_width, double halo)
+    : rays_bound_(rays_bound)
+    , tile_width_(tile_width)
+    , halo_(halo)
+  {
+    const Eigen::Vector3d extent = rays_bound.max_bound_ - rays_bound.min_bound_;
+    tiles_x_ = std::max(1, static_cast<int>(std::ceil(extent[0] / tile_width)));
+    tiles_y_ = std::max(1, static_cast<int>(std::ceil(extent[1] / tile_width)));
+  }
+
+  /// the number of tiles
+  inline size_t count() const { return static_cast<size_t>(tiles_x_) * static_cast<size_t>(tiles_y_); }
+
+  /// call visit(tile, interior) for each tile that the ray is loaded into: the tile containing its end point, for which
+  /// it is interior, and the tiles whose halo it passes through
+  template <class Function>
+  void forEachTile(const Eigen::Vector3d &start, const Eigen::Vector3d &end, const Function &visit) const
+  {
+    const Eigen::Vector3d &origin = rays_bound_.min_bound_;
+    const int end_x = coord(end[0], 0, tiles_x_);
+    const int end_y = coord(end[1], 1, tiles_y_);
+    const Eigen::Vector3d lower = minVector(start, end);
+    const Eigen::Vector3d upper = maxVector(start, end);
+    const int max_x = coord(upper[0] + halo_, 0, tiles_x_);
+    const int max_y = coord(upper[1] + halo_, 1, tiles_y_);
+    for (int x = coord(lower[0] - halo_, 0, tiles_x_); x <= max_x; x++)
+    {
+      for (int y = coord(lower[1] - halo_, 1, tiles_y_); y <= max_y; y++)
+      {
+        const size_t tile = static_cast<size_t>(x) + static_cast<size_t>(tiles_x_) * static_cast<size_t>(y);
+        if (x == end_x && y == end_y)
+        {
+          visit(tile, true);
+          continue;
+        }
+        const Cuboid box(Eigen::Vector3d(origin[0] + x * tile_width_ - halo_, origin[1] + y * tile_width_ - halo_,
+                                         rays_bound_.min_bound_[2] - 1.0),
+                         Eigen::Vector3d(origin[0] + (x + 1) * tile_width_ + halo_,
+                                         origin[1] + (y + 1) * tile_width_ + halo_, rays_bound_.max_bound_[2] + 1.0));
+        Eigen::Vector3d clip_start = start, clip_end = end;
+        if (box.clipRay(clip_start, clip_end))
+        {
+          visit(tile, false);
+        }
+      }
+    }
+  }
+
+  /// Divide the tiles, with @c tile_counts rays each, into consecutive batches that fit in the memory limit (see
+  /// Memory). Returns the first tile of each batch, followed by the tile count.
+  static std::vector<size_t> batches(const std::vector<size_t> &tile_counts)
+  {
+    const size_t memory = Memory::limited() ? Memory::limit() : kTileMemory;
+    std::vector<size_t> batch_starts(1, 0);
+    size_t batch_bytes = 0;
+    for (size_t tile = 0; tile < tile_counts.size(); tile++)
+    {
+      const size_t tile_bytes = tile_counts[tile] * kTileRayBytes;
+      if (tile > batch_starts.back() && batch_bytes + tile_bytes > memory)
+      {
+        batch_starts.push_back(tile);
+        batch_bytes = 0;
+      }
+      batch_bytes += tile_bytes;
+    }
+    batch_starts.push_back(tile_counts.size());
+    return batch_starts;
+  }
+
+private:
+  /// the tile coordinate of @c value along @c axis, clamped to the @c count tiles
+  inline int coord(double value, int axis, int count) const
+  {
+    const int c = static_cast<int>(std::floor((value - rays_bound_.min_bound_[axis]) / tile_width_));
+    return std::max(0, std::min(c, count - 1));
+  }
+
+  Cuboid rays_bound_;
+  double tile_width_;
+  double halo_;
+  int tiles_x_, tiles_y_;
+};
+}  // namespace
+
 // TODO: Make config value
 const double test_width = 0.01;  // allows a minor variation when checking for similarity of rays
 
@@ -106,8 +252,9 @@ void rayLookup(const Cloud *cloud, std::set<Vector6i, Vector6iLess> &ray_lookup)
   }
 }
 
+template <class CloudType>
 void EllipsoidTransientMarker::mark(Ellipsoid *ellipsoid, std::vector<Merger::Bool> *transient_ray_marks,
-                                    const Cloud &cloud, const Grid<unsigned> &ray_grid, double num_rays,
+                                    const CloudType &cloud, const RayIndexGrid &ray_grid, double num_rays,
                                     MergeType merge_type, bool self_transient, bool ellipsoid_cloud_first)
 {
   if (ellipsoid->transient)
@@ -157,8 +304,7 @@ void EllipsoidTransientMarker::mark(Ellipsoid *ellipsoid, std::vector<Merger::Bo
     {
       for (int z = bmin[2]; z <= bmax[2]; z++)
       {
-        auto &ray_list = ray_grid.cell(x, y, z).data;
-        for (auto &ray_id : ray_list)
+        for (const unsigned ray_id : ray_grid.cell(x, y, z))
         {
           if (ray_tested[ray_id])
           {
@@ -178,7 +324,7 @@ void EllipsoidTransientMarker::mark(Ellipsoid *ellipsoid, std::vector<Merger::Bo
   {
     ray_tested[ray_id] = false;
 
-    switch (ellipsoid->intersect(cloud.starts[ray_id], cloud.ends[ray_id]))
+    switch (ellipsoid->intersect(cloud.start(ray_id), cloud.end(ray_id)))
     {
     default:
     case IntersectResult::Miss:
@@ -189,12 +335,25 @@ void EllipsoidTransientMarker::mark(Ellipsoid *ellipsoid, std::vector<Merger::Bo
       break;
     case IntersectResult::Hit:
       ++hits;
-      first_intersection_time = std::min(first_intersection_time, cloud.times[ray_id]);
-      last_intersection_time = std::max(last_intersection_time, cloud.times[ray_id]);
+      first_intersection_time = std::min(first_intersection_time, cloud.time(ray_id));
+      last_intersection_time = std::max(last_intersection_time, cloud.time(ray_id));
       break;
     }
   }
+  // the rays were found in cell order. Resolve them in ray order, as the BVH finds them, so that the same pass through
+  // rays are removed with either acceleration
+  std::sort(pass_through_ids.begin(), pass_through_ids.end());
+  resolve(ellipsoid, hits, first_intersection_time, last_intersection_time, pass_through_ids, transient_ray_marks,
+          cloud, num_rays, merge_type, self_transient, ellipsoid_cloud_first);
+}
 
+template <class CloudType>
+void EllipsoidTransientMarker::resolve(Ellipsoid *ellipsoid, unsigned hits, double first_intersection_time,
+                                       double last_intersection_time, const std::vector<unsigned> &pass_through_ids,
+                                       std::vector<Merger::Bool> *transient_ray_marks, const CloudType &cloud,
+                                       double num_rays, MergeType merge_type, bool self_transient,
+                                       bool ellipsoid_cloud_first)
+{
   size_t num_before = 0, num_after = 0;
   ellipsoid->num_rays = hits + pass_through_ids.size();
   if (num_rays == 0 || self_transient)
@@ -212,11 +371,11 @@ void EllipsoidTransientMarker::mark(Ellipsoid *ellipsoid, std::vector<Merger::Bo
     double misses = 0;
     for (auto &ray_id : pass_through_ids)
     {
-      if (cloud.times[ray_id] > last_intersection_time)
+      if (cloud.time(ray_id) > last_intersection_time)
       {
         num_after++;
       }
-      else if (cloud.times[ray_id] < first_intersection_time)
+      else if (cloud.time(ray_id) < first_intersection_time)
       {
         num_before++;
       }
@@ -233,7 +392,7 @@ void EllipsoidTransientMarker::mark(Ellipsoid *ellipsoid, std::vector<Merger::Bo
   {
     if (pass_through_ids.size() > 0)
     {
-      if (cloud.times[pass_through_ids[0]] > ellipsoid->time)
+      if (cloud.time(pass_through_ids[0]) > ellipsoid->time)
       {
         num_after = pass_through_ids.size();
       }
@@ -305,8 +464,8 @@ void EllipsoidTransientMarker::mark(Ellipsoid *ellipsoid, std::vector<Merger::Bo
       }
 
       unsigned ray_id = pass_through_ids[j];
-      if (!self_transient || cloud.times[ray_id] < first_intersection_time ||
-          cloud.times[ray_id] > last_intersection_time)
+      if (!self_transient || cloud.time(ray_id) < first_intersection_time ||
+          cloud.time(ray_id) > last_intersection_time)
       {
         // remove ray i
         (*transient_ray_marks)[ray_id] = true;
@@ -330,30 +489,301 @@ bool Merger::filter(const Cloud &cloud, Progress *progress)
     progress = &tracker;
   }
 
+  // Atomic do not support assignment and construction so we can't really retain the vector memory.
+  std::vector<Bool> transient_ray_marks(cloud.rayCount());
+  markTransients(cloud, &transient_ray_marks, progress);
+
+  finaliseFilter(cloud, transient_ray_marks);
+
+  progress->end();
+
+  return true;
+}
+
+bool Merger::filter(const CompactCloud &cloud, const std::string &fixed_file, const std::string &transient_file,
+                    Progress *progress)
+{
+  Progress tracker;
+  if (!progress)
+  {
+    progress = &tracker;
+  }
+
+  std::vector<Bool> transient_ray_marks(cloud.rayCount());
+  markTransients(cloud, &transient_ray_marks, progress);
+  progress->end();
+
+  // stream the rays into the two output files, in their original order
+  CloudWriter fixed_writer, transient_writer;
+  if (!fixed_writer.begin(fixed_file) || !transient_writer.begin(transient_file))
+  {
+    return false;
+  }
+  const size_t chunk_size = Memory::chunkSize(1000000);
+  Cloud fixed_chunk, transient_chunk;
+  for (size_t first = 0; first < cloud.rayCount(); first += chunk_size)
+  {
+    const size_t last = std::min(first + chunk_size, cloud.rayCount());
+    for (size_t i = first; i < last; i++)
+    {
+      Cloud &chunk = (ellipsoids_[i].transient || transient_ray_marks[i]) ? transient_chunk : fixed_chunk;
+      chunk.addRay(cloud.start(i), cloud.end(i), cloud.time(i), filteredColour(cloud, i));
+    }
+    if (!fixed_writer.writeChunk(fixed_chunk) || !transient_writer.writeChunk(transient_chunk))
+    {
+      return false;
+    }
+    fixed_chunk.clear();
+    transient_chunk.clear();
+  }
+  const bool fixed_written = fixed_writer.end();
+  const bool transient_written = transient_writer.end();
+  return fixed_written && transient_written;
+}
+
+template <class CloudType>
+void Merger::markTransients(const CloudType &cloud, std::vector<Bool> *transient_ray_marks, Progress *progress)
+{
   clear();
 
   Eigen::Vector3d bounds_min, bounds_max;
   generateEllipsoids(&ellipsoids_, &bounds_min, &bounds_max, cloud, progress);
 
-  const double voxel_size = voxelSizeForCloud(cloud);
-  if (config_.voxel_size == 0)
+  RayIndexGrid ray_grid;
+  if (config_.acceleration == MergerAcceleration::Grid)
   {
-    std::cout << "estimated required voxel size: " << voxel_size << std::endl;
+    const double voxel_size = voxelSizeForCloud(cloud);
+    if (config_.voxel_size == 0)
+    {
+      std::cout << "estimated required voxel size: " << voxel_size << std::endl;
+    }
+    ray_grid.init(gridMinBound(bounds_min, voxel_size), bounds_max, voxel_size);
+    seedRayGrid(&ray_grid, cloud);
+    fillRayGrid(&ray_grid, cloud, progress);
   }
 
-  Grid<unsigned> ray_grid(bounds_min, bounds_max, voxel_size);
-  seedRayGrid(&ray_grid, cloud);
-  fillRayGrid(&ray_grid, cloud, progress);
+  markIntersectedEllipsoids(cloud, ray_grid, transient_ray_marks, config_.num_rays_filter_threshold, true, progress);
+}
 
-  // Atomic do not support assignment and construction so we can't really retain the vector memory.
-  std::vector<Bool> transient_ray_marks(cloud.rayCount() MARKER_BOOL_INIT);
-  markIntersectedEllipsoids(cloud, ray_grid, &transient_ray_marks, config_.num_rays_filter_threshold, true, progress);
+bool Merger::filterFile(const std::string &cloud_file, const std::string &fixed_file,
+                        const std::string &transient_file, double tile_width, double halo, Progress *progress)
+{
+  Progress tracker;
+  if (!progress)
+  {
+    progress = &tracker;
+  }
+  clear();
+  if (tile_width <= 0.0)
+  {
+    std::cerr << "Error: the tile width must be positive" << std::endl;
+    return false;
+  }
+  Cloud::Info info;
+  if (!Cloud::getInfo(cloud_file, info))
+  {
+    return false;
+  }
+  // the voxel size of the whole cloud, so that the ray grid of each tile matches that of the in-memory filter
+  double voxel_size = config_.voxel_size;
+  if (voxel_size <= 0.0)
+  {
+    voxel_size = info.num_bounded > 0 ?
+                   4.0 * Cloud::estimatePointSpacing(cloud_file, info.ends_bound, info.num_bounded) :
+                   0.25;
+    std::cout << "estimated required voxel size: " << voxel_size << std::endl;
+  }
+  if (halo <= 0.0)
+  {
+    halo = 3.0 * voxel_size;
+  }
 
-  finaliseFilter(cloud, transient_ray_marks);
+  const TileLayout layout(info.rays_bound, tile_width, halo);
+  const size_t num_tiles = layout.count();
+
+  // count the rays of each tile, to divide the tiles into batches that fit in memory
+  std::vector<size_t> tile_counts(num_tiles, 0);
+  size_t num_rays = 0;
+  auto count = [&](std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends, std::vector<double> &,
+                   std::vector<RGBA> &) {
+    for (size_t i = 0; i < ends.size(); i++)
+    {
+      layout.forEachTile(starts[i], ends[i], [&tile_counts](size_t tile, bool) { tile_counts[tile]++; });
+    }
+    num_rays += ends.size();
+  };
+  if (!Cloud::read(cloud_file, count))
+  {
+    return false;
+  }
+  const std::vector<size_t> batch_starts = TileLayout::batches(tile_counts);
+  std::cout << "filtering " << num_tiles << " tiles in " << batch_starts.size() - 1 << " batches" << std::endl;
+
+  // the results of the whole cloud, by ray index
+  std::vector<bool> transient(num_rays, false);
+  std::vector<RGBA> colours(config_.colour_cloud ? num_rays : 0);
+  double max_extent = 0.0;
+  progress->begin("transient tiles", num_tiles);
+  for (size_t b = 0; b + 1 < batch_starts.size(); b++)
+  {
+    const size_t first_tile = batch_starts[b];
+    const size_t batch_size = batch_starts[b + 1] - first_tile;
+    std::vector<Cloud> clouds(batch_size);
+    std::vector<std::vector<size_t>> ray_ids(batch_size);
+    std::vector<std::vector<bool>> interiors(batch_size);
+    for (size_t t = 0; t < batch_size; t++)
+    {
+      clouds[t].reserve(tile_counts[first_tile + t]);
+      ray_ids[t].reserve(tile_counts[first_tile + t]);
+      interiors[t].reserve(tile_counts[first_tile + t]);
+    }
+    size_t ray_id = 0;
+    auto load = [&](std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends,
+                    std::vector<double> &times, std::vector<RGBA> &ray_colours) {
+      for (size_t i = 0; i < ends.size(); i++, ray_id++)
+      {
+        layout.forEachTile(starts[i], ends[i], [&](size_t tile, bool interior) {
+          if (tile < first_tile || tile >= first_tile + batch_size)
+          {
+            return;
+          }
+          const size_t t = tile - first_tile;
+          clouds[t].addRay(starts[i], ends[i], times[i], ray_colours[i]);
+          ray_ids[t].push_back(ray_id);
+          interiors[t].push_back(interior);
+        });
+      }
+    };
+    if (!Cloud::read(cloud_file, load))
+    {
+      return false;
+    }
 
+    // the tiles are filtered in parallel, and each tile's filter is serial within it unless it is the only tile
+    std::vector<std::vector<size_t>> transient_ids(batch_size);
+    std::vector<double> tile_extents(batch_size, 0.0);
+    parallelFor(0, batch_size,
+                [&](size_t t) {
+                  Merger tile_merger(config_);
+                  std::vector<bool> tile_transient;
+                  std::vector<RGBA> tile_colours;
+                  tile_merger.filterTile(clouds[t], interiors[t], voxel_size, &tile_transient, &tile_colours,
+                                         &tile_extents[t]);
+                  for (size_t i = 0; i < tile_transient.size(); i++)
+                  {
+                    if (tile_transient[i])
+                    {
+                      transient_ids[t].push_back(ray_ids[t][i]);
+                    }
+                    if (config_.colour_cloud && interiors[t][i])
+                    {
+                      colours[ray_ids[t][i]] = tile_colours[i];
+                    }
+                  }
+                  clouds[t] = Cloud();
+                  progress->increment();
+                },
+                1);
+    for (const auto &ids : transient_ids)
+    {
+      for (const size_t id : ids)
+      {
+        transient[id] = true;
+      }
+    }
+    max_extent = std::max(max_extent, *std::max_element(tile_extents.begin(), tile_extents.end()));
+  }
   progress->end();
+  checkHalo(max_extent, halo);
 
-  return true;
+  // stream the rays into the two output files, in their original order
+  CloudWriter fixed_writer, transient_writer;
+  if (!fixed_writer.begin(fixed_file) || !transient_writer.begin(transient_file))
+  {
+    return false;
+  }
+  Cloud fixed_chunk, transient_chunk;
+  size_t ray_id = 0;
+  bool write_failed = false;
+  auto split = [&](std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends,
+                   std::vector<double> &times, std::vector<RGBA> &ray_colours) {
+    for (size_t i = 0; i < ends.size(); i++, ray_id++)
+    {
+      Cloud &chunk = transient[ray_id] ? transient_chunk : fixed_chunk;
+      chunk.addRay(starts[i], ends[i], times[i], config_.colour_cloud ? colours[ray_id] : ray_colours[i]);
+    }
+    if (!fixed_writer.writeChunk(fixed_chunk) || !transient_writer.writeChunk(transient_chunk))
+    {
+      write_failed = true;
+    }
+    fixed_chunk.clear();
+    transient_chunk.clear();
+  };
+  if (!Cloud::read(cloud_file, split))
+  {
+    return false;
+  }
+  const bool fixed_written = fixed_writer.end();
+  const bool transient_written = transient_writer.end();
+  return !write_failed && fixed_written && transient_written;
+}
+
+void Merger::filterTile(const Cloud &cloud, const std::vector<bool> &interior, double voxel_size,
+                        std::vector<bool> *transient, std::vector<RGBA> *colours, double *max_extent)
+{
+  clear();
+  transient->assign(cloud.rayCount(), false);
+  colours->resize(cloud.rayCount());
+  *max_extent = 0.0;
+  if (cloud.rayCount() == 0)
+  {
+    return;
+  }
+  generateEllipsoids(&ellipsoids_, nullptr, nullptr, cloud);
+
+  // the ellipsoids of rays that end outside of the tile are incomplete, so they are not tested
+  const double max_double = std::numeric_limits<double>::max();
+  Eigen::Vector3d bounds_min(max_double, max_double, max_double);
+  Eigen::Vector3d bounds_max(-max_double, -max_double, -max_double);
+  for (size_t i = 0; i < ellipsoids_.size(); i++)
+  {
+    Ellipsoid &ellipsoid = ellipsoids_[i];
+    if (!interior[i])
+    {
+      ellipsoid.extents.setZero();
+    }
+    else if (ellipsoid.extents != Eigen::Vector3f::Zero())
+    {
+      bounds_min = minVector(bounds_min, Eigen::Vector3d(ellipsoid.pos - ellipsoid.extents.cast<double>()));
+      bounds_max = maxVector(bounds_max, Eigen::Vector3d(ellipsoid.pos + ellipsoid.extents.cast<double>()));
+    }
+  }
+  *max_extent = maxHorizontalExtent(ellipsoids_);
+  if (bounds_min[0] <= bounds_max[0])
+  {
+    Progress progress;
+    RayIndexGrid ray_grid;
+    if (config_.acceleration == MergerAcceleration::Grid)
+    {
+      ray_grid.init(gridMinBound(bounds_min, voxel_size), bounds_max, voxel_size);
+      seedRayGrid(&ray_grid, cloud);
+      fillRayGrid(&ray_grid, cloud, nullptr);
+    }
+    std::vector<Bool> transient_ray_marks(cloud.rayCount());
+    markIntersectedEllipsoids(cloud, ray_grid, &transient_ray_marks, config_.num_rays_filter_threshold, true,
+                              &progress);
+    for (size_t i = 0; i < cloud.rayCount(); i++)
+    {
+      (*transient)[i] = transient_ray_marks[i] || ellipsoids_[i].transient;
+    }
+  }
+  for (size_t i = 0; i < cloud.rayCount(); i++)
+  {
+    if (interior[i])
+    {
+      (*colours)[i] = filteredColour(cloud, i);
+    }
+  }
 }
 
 bool Merger::mergeMultiple(std::vector<Cloud> &clouds, Progress *progress)
@@ -367,39 +797,79 @@ bool Merger::mergeMultiple(std::vector<Cloud> &clouds, Progress *progress)
 
   clear();
 
-  std::vector<Grid<unsigned>> grids(clouds.size());
-  for (size_t c = 0; c < clouds.size(); c++)
+  // each grid is seeded with the end points of every cloud, so it covers all of their bounds. As in mergeTile(), the
+  // grids are snapped to their voxel size, so that their cells match those of mergeMultipleFiles()
+  Eigen::Vector3d bounds_min = Eigen::Vector3d::Constant(std::numeric_limits<double>::max());
+  Eigen::Vector3d bounds_max = Eigen::Vector3d::Constant(std::numeric_limits<double>::lowest());
+  for (const auto &cloud : clouds)
+  {
+    bounds_min = minVector(bounds_min, cloud.calcMinBound());
+    bounds_max = maxVector(bounds_max, cloud.calcMaxBound());
+  }
+  std::vector<RayIndexGrid> grids(clouds.size());
+  for (size_t c = 0; c < clouds.size() && config_.acceleration == MergerAcceleration::Grid; c++)
   {
     const double voxel_size = voxelSizeForCloud(clouds[c]);
     if (config_.voxel_size == 0)
     {
       std::cout << "estimated required voxel size for cloud " << c << ": " << voxel_size << std::endl;
     }
-    grids[c].init(clouds[c].calcMinBound(), clouds[c].calcMaxBound(), voxel_size);
+    grids[c].init(gridMinBound(bounds_min, voxel_size), bounds_max, voxel_size);
     for (size_t d = 0; d < clouds.size(); d++)
     {
       seedRayGrid(&grids[c], clouds[d]);
     }
   }
 
-  for (size_t c = 0; c < clouds.size(); c++)
+  for (size_t c = 0; c < clouds.size() && config_.acceleration == MergerAcceleration::Grid; c++)
   {
     fillRayGrid(&grids[c], clouds[c], progress);
-  }  
+  }
 
   std::vector<std::vector<Bool>> transient_ray_marks;
   transient_ray_marks.reserve(clouds.size());
   for (size_t c = 0; c < clouds.size(); c++)
   {
-    transient_ray_marks.emplace_back(std::vector<Bool>(clouds[c].rayCount() MARKER_BOOL_INIT));
+    transient_ray_marks.emplace_back(std::vector<Bool>(clouds[c].rayCount()));
+  }
+  markMergeTransients(clouds, grids, nullptr, &transient_ray_marks, progress);
+
+  for (size_t c = 0; c < clouds.size(); c++)
+  {
+    auto &cloud = clouds[c];
+    for (size_t i = 0; i < cloud.rayCount(); i++)
+    {
+      if (transient_ray_marks[c][i])
+      {
+        difference_.addRay(cloud, i);
+      }
+      else
+      {
+        fixed_.addRay(cloud, i);
+      }
+    }
   }
 
+  return true;
+}
+
+void Merger::markMergeTransients(const std::vector<Cloud> &clouds, const std::vector<RayIndexGrid> &grids,
+                                 std::vector<std::vector<Ellipsoid>> *cloud_ellipsoids,
+                                 std::vector<std::vector<Bool>> *transient_ray_marks, Progress *progress)
+{
   // now for each cloud, look for other clouds that penetrate it
   for (size_t c = 0; c < clouds.size(); c++)
   {
-    generateEllipsoids(&ellipsoids_, nullptr, nullptr, clouds[c], progress);
+    if (cloud_ellipsoids)
+    {
+      ellipsoids_.swap((*cloud_ellipsoids)[c]);
+    }
+    else
+    {
+      generateEllipsoids(&ellipsoids_, nullptr, nullptr, clouds[c], progress);
+    }
     // just set opacity
-    markIntersectedEllipsoids(clouds[c], grids[c], &transient_ray_marks[c], 0, false, progress);
+    markIntersectedEllipsoids(clouds[c], grids[c], &(*transient_ray_marks)[c], 0, false, progress);
 
     for (size_t d = 0; d < clouds.size(); d++)
     {
@@ -409,36 +879,275 @@ bool Merger::mergeMultiple(std::vector<Cloud> &clouds, Progress *progress)
       }
       const bool ellipsoid_cloud_first = c < d;  // used when argument order of the files is the merge type
       // use ellipsoid opacity to set transient flag true on transients
-      markIntersectedEllipsoids(clouds[d], grids[d], &transient_ray_marks[d], config_.num_rays_filter_threshold, false,
-                                progress, ellipsoid_cloud_first);
+      markIntersectedEllipsoids(clouds[d], grids[d], &(*transient_ray_marks)[d], config_.num_rays_filter_threshold,
+                                false, progress, ellipsoid_cloud_first);
     }
 
     for (size_t i = 0; i < clouds[c].rayCount(); i++)
     {
       if (ellipsoids_[i].transient)
       {
-        transient_ray_marks[c][i] = true;
+        (*transient_ray_marks)[c][i] = true;
+      }
+    }
+  }
+}
+
+bool Merger::mergeMultipleFiles(const std::vector<std::string> &cloud_files, const std::string &fixed_file,
+                                const std::string &difference_file, double tile_width, double halo,
+                                Progress *progress)
+{
+  Progress tracker;
+  if (!progress)
+  {
+    progress = &tracker;
+  }
+  clear();
+  if (tile_width <= 0.0)
+  {
+    std::cerr << "Error: the tile width must be positive" << std::endl;
+    return false;
+  }
+  if (cloud_files.empty())
+  {
+    std::cerr << "Error: no cloud files to merge" << std::endl;
+    return false;
+  }
+  // the voxel size of each whole cloud, so that the ray grids of each tile match those of mergeMultiple()
+  std::vector<double> voxel_sizes(cloud_files.size(), config_.voxel_size);
+  std::vector<Cloud::Info> infos(cloud_files.size());
+  for (size_t c = 0; c < cloud_files.size(); c++)
+  {
+    if (!Cloud::getInfo(cloud_files[c], infos[c]))
+    {
+      return false;
+    }
+  }
+  Cuboid rays_bound = infos[0].rays_bound;
+  for (size_t c = 0; c < cloud_files.size(); c++)
+  {
+    const Cloud::Info &info = infos[c];
+    rays_bound.min_bound_ = minVector(rays_bound.min_bound_, info.rays_bound.min_bound_);
+    rays_bound.max_bound_ = maxVector(rays_bound.max_bound_, info.rays_bound.max_bound_);
+    if (voxel_sizes[c] <= 0.0)
+    {
+      voxel_sizes[c] = info.num_bounded > 0 ?
+                         4.0 * Cloud::estimatePointSpacing(cloud_files[c], info.ends_bound, info.num_bounded) :
+                         0.25;
+      std::cout << "estimated required voxel size for cloud " << c << ": " << voxel_sizes[c] << std::endl;
+    }
+  }
+  if (halo <= 0.0)
+  {
+    halo = 3.0 * *std::max_element(voxel_sizes.begin(), voxel_sizes.end());
+  }
+  const TileLayout layout(rays_bound, tile_width, halo);
+  const size_t num_tiles = layout.count();
+
+  // count the rays of each tile over all of the clouds, to divide the tiles into batches that fit in memory
+  std::vector<size_t> tile_counts(num_tiles, 0);
+  std::vector<size_t> num_rays(cloud_files.size(), 0);
+  for (size_t c = 0; c < cloud_files.size(); c++)
+  {
+    auto count = [&](std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends,
+                     std::vector<double> &, std::vector<RGBA> &) {
+      for (size_t i = 0; i < ends.size(); i++)
+      {
+        layout.forEachTile(starts[i], ends[i], [&tile_counts](size_t tile, bool) { tile_counts[tile]++; });
+      }
+      num_rays[c] += ends.size();
+    };
+    if (!Cloud::read(cloud_files[c], count))
+    {
+      return false;
+    }
+  }
+  const std::vector<size_t> batch_starts = TileLayout::batches(tile_counts);
+  std::cout << "merging " << num_tiles << " tiles in " << batch_starts.size() - 1 << " batches" << std::endl;
+
+  // the results of each whole cloud, by ray index
+  std::vector<std::vector<bool>> transient(cloud_files.size());
+  for (size_t c = 0; c < cloud_files.size(); c++)
+  {
+    transient[c].assign(num_rays[c], false);
+  }
+  double max_extent = 0.0;
+  progress->begin("merge tiles", num_tiles);
+  for (size_t b = 0; b + 1 < batch_starts.size(); b++)
+  {
+    const size_t first_tile = batch_starts[b];
+    const size_t batch_size = batch_starts[b + 1] - first_tile;
+    // indexed by tile then by cloud
+    std::vector<std::vector<Cloud>> clouds(batch_size, std::vector<Cloud>(cloud_files.size()));
+    std::vector<std::vector<std::vector<size_t>>> ray_ids(batch_size,
+                                                          std::vector<std::vector<size_t>>(cloud_files.size()));
+    std::vector<std::vector<std::vector<bool>>> interiors(batch_size,
+                                                          std::vector<std::vector<bool>>(cloud_files.size()));
+    for (size_t c = 0; c < cloud_files.size(); c++)
+    {
+      size_t ray_id = 0;
+      auto load = [&](std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends,
+                      std::vector<double> &times, std::vector<RGBA> &colours) {
+        for (size_t i = 0; i < ends.size(); i++, ray_id++)
+        {
+          layout.forEachTile(starts[i], ends[i], [&](size_t tile, bool interior) {
+            if (tile < first_tile || tile >= first_tile + batch_size)
+            {
+              return;
+            }
+            const size_t t = tile - first_tile;
+            clouds[t][c].addRay(starts[i], ends[i], times[i], colours[i]);
+            ray_ids[t][c].push_back(ray_id);
+            interiors[t][c].push_back(interior);
+          });
+        }
+      };
+      if (!Cloud::read(cloud_files[c], load))
+      {
+        return false;
+      }
+    }
+
+    // the tiles are merged in parallel, and each tile's merge is serial within it unless it is the only tile
+    std::vector<std::vector<std::vector<size_t>>> transient_ids(batch_size,
+                                                                std::vector<std::vector<size_t>>(cloud_files.size()));
+    std::vector<double> tile_extents(batch_size, 0.0);
+    parallelFor(0, batch_size,
+                [&](size_t t) {
+                  Merger tile_merger(config_);
+                  std::vector<std::vector<bool>> tile_transient;
+                  tile_merger.mergeTile(clouds[t], interiors[t], voxel_sizes, &tile_transient, &tile_extents[t]);
+                  for (size_t c = 0; c < cloud_files.size(); c++)
+                  {
+                    for (size_t i = 0; i < tile_transient[c].size(); i++)
+                    {
+                      if (tile_transient[c][i])
+                      {
+                        transient_ids[t][c].push_back(ray_ids[t][c][i]);
+                      }
+                    }
+                  }
+                  std::vector<Cloud>().swap(clouds[t]);
+                  progress->increment();
+                },
+                1);
+    for (const auto &tile_ids : transient_ids)
+    {
+      for (size_t c = 0; c < tile_ids.size(); c++)
+      {
+        for (const size_t id : tile_ids[c])
+        {
+          transient[c][id] = true;
+        }
       }
     }
+    max_extent = std::max(max_extent, *std::max_element(tile_extents.begin(), tile_extents.end()));
+  }
+  progress->end();
+  checkHalo(max_extent, halo);
+
+  // stream the rays into the two output files, in the same order as mergeMultiple()
+  CloudWriter fixed_writer, difference_writer;
+  if (!fixed_writer.begin(fixed_file) || !difference_writer.begin(difference_file))
+  {
+    return false;
+  }
+  Cloud fixed_chunk, difference_chunk;
+  bool write_failed = false;
+  for (size_t c = 0; c < cloud_files.size(); c++)
+  {
+    size_t ray_id = 0;
+    auto split = [&](std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends,
+                     std::vector<double> &times, std::vector<RGBA> &colours) {
+      for (size_t i = 0; i < ends.size(); i++, ray_id++)
+      {
+        Cloud &chunk = transient[c][ray_id] ? difference_chunk : fixed_chunk;
+        chunk.addRay(starts[i], ends[i], times[i], colours[i]);
+      }
+      if (!fixed_writer.writeChunk(fixed_chunk) || !difference_writer.writeChunk(difference_chunk))
+      {
+        write_failed = true;
+      }
+      fixed_chunk.clear();
+      difference_chunk.clear();
+    };
+    if (!Cloud::read(cloud_files[c], split))
+    {
+      return false;
+    }
   }
+  const bool fixed_written = fixed_writer.end();
+  const bool difference_written = difference_writer.end();
+  return !write_failed && fixed_written && difference_written;
+}
 
+void Merger::mergeTile(const std::vector<Cloud> &clouds, const std::vector<std::vector<bool>> &interiors,
+                       const std::vector<double> &voxel_sizes, std::vector<std::vector<bool>> *transient,
+                       double *max_extent)
+{
+  clear();
+  transient->resize(clouds.size());
+  *max_extent = 0.0;
+  // the ellipsoids of rays that end outside of the tile are incomplete, so they are not tested
+  std::vector<std::vector<Ellipsoid>> cloud_ellipsoids(clouds.size());
+  const double max_double = std::numeric_limits<double>::max();
+  Eigen::Vector3d bounds_min(max_double, max_double, max_double);
+  Eigen::Vector3d bounds_max(-max_double, -max_double, -max_double);
   for (size_t c = 0; c < clouds.size(); c++)
   {
-    auto &cloud = clouds[c];
-    for (size_t i = 0; i < cloud.rayCount(); i++)
+    (*transient)[c].assign(clouds[c].rayCount(), false);
+    if (clouds[c].rayCount() == 0)
     {
-      if (transient_ray_marks[c][i])
+      continue;
+    }
+    generateEllipsoids(&cloud_ellipsoids[c], nullptr, nullptr, clouds[c]);
+    for (size_t i = 0; i < cloud_ellipsoids[c].size(); i++)
+    {
+      Ellipsoid &ellipsoid = cloud_ellipsoids[c][i];
+      if (!interiors[c][i])
       {
-        difference_.addRay(cloud, i);
+        ellipsoid.extents.setZero();
       }
-      else
+      else if (ellipsoid.extents != Eigen::Vector3f::Zero())
       {
-        fixed_.addRay(cloud, i);
+        bounds_min = minVector(bounds_min, Eigen::Vector3d(ellipsoid.pos - ellipsoid.extents.cast<double>()));
+        bounds_max = maxVector(bounds_max, Eigen::Vector3d(ellipsoid.pos + ellipsoid.extents.cast<double>()));
       }
     }
+    *max_extent = std::max(*max_extent, maxHorizontalExtent(cloud_ellipsoids[c]));
+  }
+  if (bounds_min[0] > bounds_max[0])
+  {
+    return;
   }
 
-  return true;
+  // each cloud's ray grid covers the interior ellipsoids of every cloud, since they are all tested against it
+  std::vector<RayIndexGrid> grids(clouds.size());
+  for (size_t c = 0; c < clouds.size() && config_.acceleration == MergerAcceleration::Grid; c++)
+  {
+    grids[c].init(gridMinBound(bounds_min, voxel_sizes[c]), bounds_max, voxel_sizes[c]);
+    for (size_t d = 0; d < clouds.size(); d++)
+    {
+      seedRayGrid(&grids[c], clouds[d]);
+    }
+    fillRayGrid(&grids[c], clouds[c], nullptr);
+  }
+
+  Progress progress;
+  std::vector<std::vector<Bool>> transient_ray_marks;
+  transient_ray_marks.reserve(clouds.size());
+  for (size_t c = 0; c < clouds.size(); c++)
+  {
+    transient_ray_marks.emplace_back(std::vector<Bool>(clouds[c].rayCount()));
+  }
+  markMergeTransients(clouds, grids, &cloud_ellipsoids, &transient_ray_marks, &progress);
+  for (size_t c = 0; c < clouds.size(); c++)
+  {
+    for (size_t i = 0; i < clouds[c].rayCount(); i++)
+    {
+      (*transient)[c][i] = transient_ray_marks[c][i];
+    }
+  }
 }
 
 bool Merger::mergeThreeWay(const Cloud &base_cloud, Cloud &cloud1, Cloud &cloud2, Progress *progress)
@@ -524,17 +1233,21 @@ bool Merger::mergeThreeWay(const Cloud &base_cloud, Cloud &cloud1, Cloud &cloud2
   }
   // otherwise we run combine on the altered clouds
   // first, grid the rays for fast lookup
-  Grid<unsigned> grids[2];
-  for (int c = 0; c < 2; c++)
+  // each grid is seeded with the end points of both clouds, so covers both of their bounds, snapped to its voxel size
+  const Eigen::Vector3d bounds_min = minVector(clouds[0]->calcMinBound(), clouds[1]->calcMinBound());
+  const Eigen::Vector3d bounds_max = maxVector(clouds[0]->calcMaxBound(), clouds[1]->calcMaxBound());
+  RayIndexGrid grids[2];
+  for (int c = 0; c < 2 && config_.acceleration == MergerAcceleration::Grid; c++)
   {
-    grids[c].init(clouds[c]->calcMinBound(), clouds[c]->calcMaxBound(), voxelSizeForCloud(*clouds[c]));
+    const double voxel_size = voxelSizeForCloud(*clouds[c]);
+    grids[c].init(gridMinBound(bounds_min, voxel_size), bounds_max, voxel_size);
     seedRayGrid(&grids[c], *clouds[0]); // to only fill rays in voxels occupied by cloud 0 or 1
     seedRayGrid(&grids[c], *clouds[1]);
     fillRayGrid(&grids[c], *clouds[c], progress);
   }
 
-  std::vector<Bool> transients[2] = { std::vector<Bool>(clouds[0]->rayCount() MARKER_BOOL_INIT),
-                                      std::vector<Bool>(clouds[1]->rayCount() MARKER_BOOL_INIT) };
+  std::vector<Bool> transients[2] = { std::vector<Bool>(clouds[0]->rayCount()),
+                                      std::vector<Bool>(clouds[1]->rayCount()) };
   // now for each cloud, represent the end points as ellipsoids, and ray cast the other cloud's rays against it
   for (int c = 0; c < 2; c++)
   {
@@ -591,22 +1304,13 @@ void Merger::clear()
 
 void Merger::seedRayGrid(Grid<unsigned> *grid, const Cloud &cloud)
 {
-  const auto seed_voxels = [grid, &cloud](unsigned i)
+  const auto seed_voxels = [grid, &cloud](size_t i)
   {
     Eigen::Vector3d end = (cloud.ends[i] - grid->box_min) / grid->voxel_width;
     Eigen::Vector3i index((int)floor(end[0]), (int)floor(end[1]), (int)floor(end[2]));
     grid->addCell(index);
   };
-#if RAYLIB_PARALLEL_GRID
-  tbb::parallel_for<unsigned>(0u, unsigned(cloud.rayCount()), seed_voxels);
-#else   // RAYLIB_PARALLEL_GRID
-  const unsigned int count = static_cast<unsigned int>(cloud.rayCount());
-//  #pragma omp parallel for schedule(static)
-  for (unsigned int i = 0; i < count; ++i)
-  {
-    seed_voxels(i);
-  }
-#endif  // RAYLIB_PARALLEL_GRID
+  parallelFor(0, cloud.rayCount(), seed_voxels);
 }
 
 void Merger::fillRayGrid(Grid<unsigned> *grid, const Cloud &cloud, Progress *progress)
@@ -616,68 +1320,49 @@ void Merger::fillRayGrid(Grid<unsigned> *grid, const Cloud &cloud, Progress *pro
     progress->begin("fillRayGrid", cloud.rayCount());
   }
 
-  const auto add_ray = [grid, &cloud, progress](unsigned i)  //
+  const auto add_ray = [grid, &cloud, progress](size_t i)  //
   {
-    Eigen::Vector3d dir = cloud.ends[i] - cloud.starts[i];
-    Eigen::Vector3d dir_sign(sgn(dir[0]), sgn(dir[1]), sgn(dir[2]));
-    Eigen::Vector3d start = (cloud.starts[i] - grid->box_min) / grid->voxel_width;
-    Eigen::Vector3d end = (cloud.ends[i] - grid->box_min) / grid->voxel_width;
-    Eigen::Vector3i start_index((int)floor(start[0]), (int)floor(start[1]), (int)floor(start[2]));
-    Eigen::Vector3i end_index((int)floor(end[0]), (int)floor(end[1]), (int)floor(end[2]));
-    double length_sqr = (end_index - start_index).squaredNorm();
-    Eigen::Vector3i index = start_index;
-    for (;;)
-    {
-      grid->insertIfCellExists(index, i);
-      if (index == end_index || (index - start_index).squaredNorm() > length_sqr)
-      {
-        break;
-      }
-      Eigen::Vector3d mid =
-        grid->box_min + grid->voxel_width * Eigen::Vector3d(index[0] + 0.5, index[1] + 0.5, index[2] + 0.5);
-      Eigen::Vector3d next_boundary = mid + 0.5 * grid->voxel_width * dir_sign;
-      Eigen::Vector3d delta = next_boundary - cloud.starts[i];
-      Eigen::Vector3d d(delta[0] / dir[0], delta[1] / dir[1], delta[2] / dir[2]);
-      if (d[0] < d[1] && d[0] < d[2])
-      {
-        index[0] += int(dir_sign[0]);
-      }
-      else if (d[1] < d[0] && d[1] < d[2])
-      {
-        index[1] += int(dir_sign[1]);
-      }
-      else
-      {
-        index[2] += int(dir_sign[2]);
-      }
-    }
-
+    const unsigned ray_id = static_cast<unsigned>(i);
+    walkRayCells(cloud.starts[i], cloud.ends[i], grid->box_min, grid->voxel_width,
+                 [grid, ray_id](const Eigen::Vector3i &index) { grid->insertIfCellExists(index, ray_id); });
     if (progress)
     {
       progress->increment();
     }
   };
 
-#if RAYLIB_PARALLEL_GRID
-  tbb::parallel_for<unsigned>(0u, unsigned(cloud.rayCount()), add_ray);
-#else   // RAYLIB_PARALLEL_GRID
-  const unsigned int count = static_cast<unsigned int>(cloud.rayCount());
-//  #pragma omp parallel for schedule(static)
-  for (unsigned int i = 0; i < count; ++i)
-  {
-    add_ray(i);
-  }
-#endif  // RAYLIB_PARALLEL_GRID
+  parallelFor(0, cloud.rayCount(), add_ray);
+}
+
+void Merger::seedRayGrid(RayIndexGrid *grid, const Cloud &cloud)
+{
+  grid->addCells(cloud.ends);
+}
+
+void Merger::seedRayGrid(RayIndexGrid *grid, const CompactCloud &cloud)
+{
+  grid->addCells(cloud);
 }
 
-double Merger::voxelSizeForCloud(const Cloud &cloud) const
+void Merger::fillRayGrid(RayIndexGrid *grid, const Cloud &cloud, Progress *progress)
+{
+  grid->build(cloud, progress);
+}
+
+void Merger::fillRayGrid(RayIndexGrid *grid, const CompactCloud &cloud, Progress *progress)
+{
+  grid->build(cloud, progress);
+}
+
+template <class CloudType>
+double Merger::voxelSizeForCloud(const CloudType &cloud) const
 {
   double voxel_size = config_.voxel_size;
   if (voxel_size <= 0)
   {
     if (cloud.rayCount() > 0)
     {
-      voxel_size = (config_.voxel_size > 0) ? config_.voxel_size : 4.0 * cloud.estimatePointSpacing();
+      voxel_size = (config_.voxel_size > 0) ? config_.voxel_size : 4.0 * pointSpacing(cloud);
     }
     else
     {
@@ -688,20 +1373,25 @@ double Merger::voxelSizeForCloud(const Cloud &cloud) const
   return voxel_size;
 }
 
-void Merger::markIntersectedEllipsoids(const Cloud &cloud, const Grid<unsigned> &ray_grid,
+template <class CloudType>
+void Merger::markIntersectedEllipsoids(const CloudType &cloud, const RayIndexGrid &ray_grid,
                                        std::vector<Bool> *transient_ray_marks, double num_rays, bool self_transient,
                                        Progress *progress, bool ellipsoid_cloud_first)
 {
+  if (config_.acceleration == MergerAcceleration::Bvh)
+  {
+    markIntersectedEllipsoidsBvh(cloud, transient_ray_marks, num_rays, self_transient, progress,
+                                 ellipsoid_cloud_first);
+    return;
+  }
   progress->begin("transient-mark-ellipsoids", cloud.rayCount());
 
   // Check each ellipsoid against the ray grid for intersections.
-#if RAYLIB_WITH_TBB
   // Declare thread local for ellipsoid marking
-  using ThreadLocalRayMarkers = tbb::enumerable_thread_specific<EllipsoidTransientMarker>;
-  ThreadLocalRayMarkers thread_markers(EllipsoidTransientMarker(cloud.rayCount()));
+  ThreadLocal<EllipsoidTransientMarker> thread_markers(EllipsoidTransientMarker(cloud.rayCount()));
 
-  auto tbb_process_ellipsoid = [this, &cloud, &ray_grid, transient_ray_marks, &num_rays, &thread_markers,
-                                ellipsoid_cloud_first, progress, self_transient](size_t ellipsoid_id)  //
+  auto process_ellipsoid = [this, &cloud, &ray_grid, transient_ray_marks, &num_rays, &thread_markers,
+                            ellipsoid_cloud_first, progress, self_transient](size_t ellipsoid_id)  //
   {
     // Resolve the ray marker for this thread.
     EllipsoidTransientMarker &marker = thread_markers.local();
@@ -709,35 +1399,154 @@ void Merger::markIntersectedEllipsoids(const Cloud &cloud, const Grid<unsigned>
                 self_transient, ellipsoid_cloud_first);
     progress->increment();
   };
-  tbb::parallel_for<size_t>(0u, cloud.rayCount(), tbb_process_ellipsoid);
-#else   // RAYLIB_WITH_TBB
-  std::vector<bool> ray_tested;
-  ray_tested.resize(cloud.rayCount(), false);
-  EllipsoidTransientMarker ellipsoid_maker(cloud.rayCount());
- // #pragma omp parallel for schedule(static)
-  for (size_t i = 0; i < ellipsoids_.size(); ++i)
+  // the ellipsoids may be from another cloud than the one being marked
+  parallelFor(0, ellipsoids_.size(), process_ellipsoid);
+}
+
+template <class CloudType>
+void Merger::markIntersectedEllipsoidsBvh(const CloudType &cloud, std::vector<Bool> *transient_ray_marks,
+                                          double num_rays, bool self_transient, Progress *progress,
+                                          bool ellipsoid_cloud_first)
+{
+  EllipsoidBvh bvh;
+  bvh.build(ellipsoids_);
+
+  // the rays are traced in fixed ranges, so that the order of the results does not depend on the thread count
+  const size_t num_ranges = (cloud.rayCount() + kBvhRangeSize - 1) / kBvhRangeSize;
+  // call func(ellipsoid_id, ray_id, result) for each ellipsoid in the subtree at root that every step'th ray of range r
+  // hits or passes through
+  auto trace_range = [&](size_t r, unsigned root, size_t step,
+                         const std::function<void(unsigned, unsigned, IntersectResult)> &func) {
+    const size_t last = std::min(cloud.rayCount(), (r + 1) * kBvhRangeSize);
+    for (size_t i = r * kBvhRangeSize; i < last; i += step)
+    {
+      const Eigen::Vector3d &start = cloud.start(i);
+      const Eigen::Vector3d &end = cloud.end(i);
+      bvh.forEachOverlap(start, end,
+                         [&](unsigned ellipsoid_id) {
+                           const Ellipsoid &ellipsoid = ellipsoids_[ellipsoid_id];
+                           if (ellipsoid.transient)
+                           {
+                             return;
+                           }
+                           const IntersectResult result = ellipsoid.intersect(start, end);
+                           if (result != IntersectResult::Miss)
+                           {
+                             func(ellipsoid_id, static_cast<unsigned>(i), result);
+                           }
+                         },
+                         root);
+    }
+  };
+
+  // The intersections of a set of ellipsoids are all gathered before they are resolved, which can be far larger than
+  // the cloud. So estimate the intersections of each ellipsoid from a sample of the rays, and resolve the ellipsoids a
+  // subtree at a time, each with intersections that fit within the memory budget.
+  struct Intersection
   {
-    ellipsoid_maker.mark(&ellipsoids_[i], transient_ray_marks, cloud, ray_grid, num_rays, config_.merge_type,
-                         self_transient, ellipsoid_cloud_first);
-    progress->increment();
+    unsigned ellipsoid;
+    unsigned ray;
+    bool hit;
+  };
+  std::vector<std::atomic<unsigned>> sample_counts(ellipsoids_.size());
+  parallelFor(0, num_ranges, [&](size_t r) {
+    trace_range(r, 0, kBvhSampleStep,
+                [&sample_counts](unsigned ellipsoid_id, unsigned, IntersectResult) { sample_counts[ellipsoid_id]++; });
+  });
+  std::vector<size_t> estimated_counts(ellipsoids_.size());
+  for (size_t i = 0; i < ellipsoids_.size(); i++)
+  {
+    estimated_counts[i] = kBvhSampleStep * sample_counts[i];
   }
-#endif  // RAYLIB_WITH_TBB
-}
+  std::vector<std::atomic<unsigned>>().swap(sample_counts);
+  const size_t memory = Memory::limited() ? Memory::limit() / 4 : kBvhIntersectionMemory;
+  const std::vector<unsigned> roots = bvh.partition(estimated_counts, memory / sizeof(Intersection));
 
+  progress->begin("transient-trace-rays", num_ranges * roots.size());
+  std::vector<unsigned> slots(ellipsoids_.size());
+  for (const unsigned root : roots)
+  {
+    const std::vector<unsigned> ellipsoid_ids = bvh.ellipsoids(root);
+    for (size_t i = 0; i < ellipsoid_ids.size(); i++)
+    {
+      slots[ellipsoid_ids[i]] = static_cast<unsigned>(i);
+    }
+    std::vector<std::vector<Intersection>> range_intersections(num_ranges);
+    parallelFor(0, num_ranges,
+                [&](size_t r) {
+                  std::vector<Intersection> &intersections = range_intersections[r];
+                  trace_range(r, root, 1, [&](unsigned ellipsoid_id, unsigned ray_id, IntersectResult result) {
+                    intersections.push_back({ slots[ellipsoid_id], ray_id, result == IntersectResult::Hit });
+                  });
+                  progress->increment();
+                },
+                1);
+
+    // group the intersections by ellipsoid, keeping them in ray order
+    std::vector<size_t> offsets(ellipsoid_ids.size() + 1, 0);
+    for (const auto &intersections : range_intersections)
+    {
+      for (const auto &intersection : intersections)
+      {
+        offsets[intersection.ellipsoid + 1]++;
+      }
+    }
+    for (size_t i = 1; i < offsets.size(); i++)
+    {
+      offsets[i] += offsets[i - 1];
+    }
+    std::vector<Intersection> sorted(offsets.back());
+    std::vector<size_t> cursors(offsets.begin(), offsets.end() - 1);
+    for (auto &intersections : range_intersections)
+    {
+      for (const auto &intersection : intersections)
+      {
+        sorted[cursors[intersection.ellipsoid]++] = intersection;
+      }
+      std::vector<Intersection>().swap(intersections);
+    }
+
+    parallelForRange(0, ellipsoid_ids.size(), 0, [&](size_t first, size_t last) {
+      std::vector<unsigned> pass_through_ids;
+      for (size_t e = first; e < last; e++)
+      {
+        Ellipsoid &ellipsoid = ellipsoids_[ellipsoid_ids[e]];
+        if (ellipsoid.transient)
+        {
+          continue;
+        }
+        double first_intersection_time = std::numeric_limits<double>::max();
+        double last_intersection_time = std::numeric_limits<double>::lowest();
+        unsigned hits = 0;
+        pass_through_ids.clear();
+        for (size_t j = offsets[e]; j < offsets[e + 1]; j++)
+        {
+          const unsigned ray_id = sorted[j].ray;
+          if (sorted[j].hit)
+          {
+            ++hits;
+            first_intersection_time = std::min(first_intersection_time, cloud.time(ray_id));
+            last_intersection_time = std::max(last_intersection_time, cloud.time(ray_id));
+          }
+          else
+          {
+            pass_through_ids.push_back(ray_id);
+          }
+        }
+        EllipsoidTransientMarker::resolve(&ellipsoid, hits, first_intersection_time, last_intersection_time,
+                                          pass_through_ids, transient_ray_marks, cloud, num_rays, config_.merge_type,
+                                          self_transient, ellipsoid_cloud_first);
+      }
+    });
+  }
+}
 
 void Merger::finaliseFilter(const Cloud &cloud, const std::vector<Bool> &transient_ray_marks)
 {
   // Lastly, generate the new ray clouds from this sphere information
   for (size_t i = 0; i < ellipsoids_.size(); i++)
   {
-    RGBA col = cloud.colours[i];
-    if (config_.colour_cloud)
-    {
-      col.red = (uint8_t)0;
-      col.blue = (uint8_t)(ellipsoids_[i].opacity * 255.0);
-      col.green = (uint8_t)((double)ellipsoids_[i].num_gone / ((double)ellipsoids_[i].num_gone + 10.0) * 255.0);
-    }
-
+    const RGBA col = filteredColour(cloud, i);
     if (ellipsoids_[i].transient || transient_ray_marks[i])
     {
       difference_.starts.emplace_back(cloud.starts[i]);
@@ -754,4 +1563,17 @@ void Merger::finaliseFilter(const Cloud &cloud, const std::vector<Bool> &transie
     }
   }
 }
+
+template <class CloudType>
+RGBA Merger::filteredColour(const CloudType &cloud, size_t i) const
+{
+  RGBA col = cloud.colour(i);
+  if (config_.colour_cloud)
+  {
+    col.red = (uint8_t)0;
+    col.blue = (uint8_t)(ellipsoids_[i].opacity * 255.0);
+    col.green = (uint8_t)((double)ellipsoids_[i].num_gone / ((double)ellipsoids_[i].num_gone + 10.0) * 255.0);
+  }
+  return col;
+}
 }  // namespace ray
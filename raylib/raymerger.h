@@ -10,6 +10,7 @@
 #include "raycloud.h"
 #include "rayellipsoid.h"
 #include "raygrid.h"
+#include "rayindexgrid.h"
 
 #include <atomic>
 #include <limits>
@@ -18,6 +19,7 @@
 namespace ray
 {
 class Cloud;
+class CompactCloud;
 class Progress;
 
 /// Mode selection for @c Merger
@@ -33,6 +35,19 @@ enum class RAYLIB_EXPORT MergeType : int
   All
 };
 
+/// How @c Merger finds the rays that intersect each ellipsoid. Both resolve each ellipsoid's rays in ray order, but
+/// they are not interchangeable: the grid only holds rays in the cells containing end points, so it misses a ray that
+/// passes through an ellipsoid only within empty cells, which the BVH finds. Their results can differ slightly.
+enum class RAYLIB_EXPORT MergerAcceleration : int
+{
+  /// Search a grid of the rays crossing each cell, over the cells of each ellipsoid's bounds. Its cost grows with the
+  /// cells that each ray crosses, and it is as fast or slightly faster for rays of a few metres.
+  Grid,
+  /// Trace each ray through a bounding volume hierarchy of the ellipsoids. Its cost grows with the ellipsoids that each
+  /// ray passes, so it is faster for long rays through sparse space, several times so for rays of 200 m.
+  Bvh
+};
+
 /// Parameter configuration structure for @c Merger
 struct RAYLIB_EXPORT MergerConfig
 {
@@ -40,6 +55,7 @@ struct RAYLIB_EXPORT MergerConfig
   double num_rays_filter_threshold = 20;
   MergeType merge_type = MergeType::Mininum;
   bool colour_cloud = true;
+  MergerAcceleration acceleration = MergerAcceleration::Grid;
 };
 
 /// A cloud merger which supports filtering 'transient' rays and merging from a ray clouds. A transient ray is one which
@@ -48,11 +64,8 @@ struct RAYLIB_EXPORT MergerConfig
 class RAYLIB_EXPORT Merger
 {
 public:
-#if RAYLIB_WITH_TBB
+  /// The transient marks are set from multiple threads
   using Bool = std::atomic_bool;
-#else   // RAYLIB_WITH_TBB
-  using Bool = bool;
-#endif  // RAYLIB_WITH_TBB
 
   Merger(const MergerConfig &config);
   ~Merger();
@@ -67,9 +80,33 @@ public:
   /// Perform the transient filtering on the given @p cloud .
   bool filter(const Cloud &cloud, Progress *progress = nullptr);
 
+  /// Perform the transient filtering on the compact @p cloud, streaming the results to @p fixed_file and
+  /// @p transient_file rather than holding them in memory. The results match those of @c filter() on the full
+  /// precision cloud, to within the precision of the compact cloud.
+  bool filter(const CompactCloud &cloud, const std::string &fixed_file, const std::string &transient_file,
+              Progress *progress = nullptr);
+
+  /// Perform the transient filtering on the cloud file @p cloud_file without loading it all into memory, streaming the
+  /// results to @p fixed_file and @p transient_file. The cloud is filtered in square tiles of @p tile_width in x and y,
+  /// each holding the rays that pass within @p halo of the tile. A halo of 0 uses three ray grid voxels.
+  /// The ellipsoid of each ray is tested in the tile containing its end point, so the results match @c filter()
+  /// wherever the ellipsoids and their neighbourhoods are within the halo. A warning is printed when they are not.
+  /// The tiles are filtered in parallel, in batches that fit in the memory limit (see Memory).
+  bool filterFile(const std::string &cloud_file, const std::string &fixed_file, const std::string &transient_file,
+                  double tile_width, double halo = 0.0, Progress *progress = nullptr);
+
   /// Multi-merge
   bool mergeMultiple(std::vector<Cloud> &clouds, Progress *progress = nullptr);
 
+  /// The multi-merge of the cloud files @p cloud_files without loading them all into memory, streaming the results to
+  /// @p fixed_file and @p difference_file. The clouds are merged in square tiles of @p tile_width in x and y, so only
+  /// the rays of each cloud that pass within @p halo of the tiles being merged are held in memory. A halo of 0 uses
+  /// three ray grid voxels. As for @c filterFile(), the results match @c mergeMultiple() wherever the ellipsoids and
+  /// their neighbourhoods are within the halo.
+  bool mergeMultipleFiles(const std::vector<std::string> &cloud_files, const std::string &fixed_file,
+                          const std::string &difference_file, double tile_width, double halo = 0.0,
+                          Progress *progress = nullptr);
+
   /// Three way merger
   bool mergeThreeWay(const Cloud &base_cloud, Cloud &cloud1, Cloud &cloud2, Progress *progress = nullptr);
 
@@ -90,20 +127,66 @@ public:
   /// @todo This needs a more global home
   static void fillRayGrid(Grid<unsigned> *grid, const Cloud &cloud, Progress *progress);
 
+  /// seed the compact ray grid with the end points of @p cloud, to tell it which voxels it needs to add rays in
+  static void seedRayGrid(RayIndexGrid *grid, const Cloud &cloud);
+  static void seedRayGrid(RayIndexGrid *grid, const CompactCloud &cloud);
+
+  /// Build the read-only @p grid from the rays of @p cloud. This gives the same cells as the Grid<unsigned> version,
+  /// using a fraction of the memory.
+  static void fillRayGrid(RayIndexGrid *grid, const Cloud &cloud, Progress *progress);
+  static void fillRayGrid(RayIndexGrid *grid, const CompactCloud &cloud, Progress *progress);
+
 private:
-  double voxelSizeForCloud(const Cloud &cloud) const;
+  /// The private functions which read a cloud are templated on the cloud type, Cloud or CompactCloud
+  template <class CloudType>
+  double voxelSizeForCloud(const CloudType &cloud) const;
+
+  /// Generate the ellipsoids of @p cloud and mark its transient rays in @p transient_ray_marks, for @c filter()
+  template <class CloudType>
+  void markTransients(const CloudType &cloud, std::vector<Bool> *transient_ray_marks, Progress *progress);
 
-  /// For all ellipsoids_ intersect with rays in @c cloud (accelerated using @c ray_grid)
+  /// For all ellipsoids_ intersect with rays in @c cloud (accelerated using @c ray_grid, which is unused and may be
+  /// empty for @c MergerAcceleration::Bvh)
   /// depending on config.merge_type, either mark the ellipsoid object as removed, or
   /// mark the ray (through @c transient_ray_marks) as removed.
   /// @c ellipsoid_cloud_first is used only for the 'order' merge type, to choose which to mark
-  void markIntersectedEllipsoids(const Cloud &cloud, const Grid<unsigned> &ray_grid,
+  template <class CloudType>
+  void markIntersectedEllipsoids(const CloudType &cloud, const RayIndexGrid &ray_grid,
                                  std::vector<Bool> *transient_ray_marks, double num_rays, bool self_transient,
                                  Progress *progress, bool ellipsoid_cloud_first = false);
 
+  /// The @c MergerAcceleration::Bvh version of @c markIntersectedEllipsoids(), which needs no ray grid.
+  template <class CloudType>
+  void markIntersectedEllipsoidsBvh(const CloudType &cloud, std::vector<Bool> *transient_ray_marks, double num_rays,
+                                    bool self_transient, Progress *progress, bool ellipsoid_cloud_first);
+
   /// Finalise the cloud filter and populate @c transientResults() and @c fixedResults() .
   void finaliseFilter(const Cloud &cloud, const std::vector<Bool> &transient_ray_marks);
 
+  /// The output colour of ray @c i of the filtered @c cloud
+  template <class CloudType>
+  RGBA filteredColour(const CloudType &cloud, size_t i) const;
+
+  /// Transient filter one tile of a larger cloud, for @c filterFile(). Only the ellipsoids of the @p interior rays,
+  /// which end within the tile, are tested. Sets @p transient for the rays found to be transient and @p colours for the
+  /// interior rays. @p max_extent is set to the largest horizontal extent of the interior ellipsoids.
+  void filterTile(const Cloud &cloud, const std::vector<bool> &interior, double voxel_size,
+                  std::vector<bool> *transient, std::vector<RGBA> *colours, double *max_extent);
+
+  /// Mark the transient rays of the multi-merge of @p clouds, using a ray grid of each cloud in @p grids (which may be
+  /// empty for @c MergerAcceleration::Bvh). The ellipsoids of each cloud are taken from @p cloud_ellipsoids, or
+  /// generated when it is null.
+  void markMergeTransients(const std::vector<Cloud> &clouds, const std::vector<RayIndexGrid> &grids,
+                           std::vector<std::vector<Ellipsoid>> *cloud_ellipsoids,
+                           std::vector<std::vector<Bool>> *transient_ray_marks, Progress *progress);
+
+  /// Multi-merge one tile of larger clouds, for @c mergeMultipleFiles(). Only the ellipsoids of the @p interiors rays
+  /// of each cloud, which end within the tile, are tested. Sets @p transient for the rays of each cloud found to be
+  /// transient, and @p max_extent to the largest horizontal extent of the interior ellipsoids.
+  void mergeTile(const std::vector<Cloud> &clouds, const std::vector<std::vector<bool>> &interiors,
+                 const std::vector<double> &voxel_sizes, std::vector<std::vector<bool>> *transient,
+                 double *max_extent);
+
   Cloud difference_;
   Cloud fixed_;
   MergerConfig config_;
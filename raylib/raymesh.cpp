@@ -8,6 +8,7 @@
 #include "raylaz.h"
 #include "rayply.h"
 #include "raycloudwriter.h"
+#include "raythreads.h"
 #include "rayunused.h"
 
 #include <set>
@@ -320,9 +321,8 @@ bool Mesh::splitCloud(const std::string &cloud_name, double offset, const std::s
                     std::vector<double> &times, std::vector<RGBA> &colours) 
   {
     Cloud in_chunk, out_chunk;
-    #pragma omp parallel for
-    for (int i = 0; i < (int)ends.size(); i++)
-    {
+    std::vector<char> inside(ends.size());
+    parallelFor(0, ends.size(), [&](size_t i) {
       int intersections = 0;
       Eigen::Vector3d start = (ends[i] - box_min) / voxel_width;
       Eigen::Vector3i index(start.cast<int>());
@@ -368,11 +368,13 @@ bool Mesh::splitCloud(const std::string &cloud_name, double offset, const std::s
           is_inside = inside_val;
         }
       }
-      Cloud &out = is_inside ? in_chunk : out_chunk;
-      #pragma omp critical
-      {
-        out.addRay(starts[i], ends[i], times[i], colours[i]);
-      }      
+      inside[i] = is_inside;
+    });
+    // split in file order
+    for (size_t i = 0; i < ends.size(); i++)
+    {
+      Cloud &out = inside[i] ? in_chunk : out_chunk;
+      out.addRay(starts[i], ends[i], times[i], colours[i]);
     }
     in_cloud.writeChunk(in_chunk);
     out_cloud.writeChunk(out_chunk);
@@ -0,0 +1,481 @@
+// Copyright (c) 2020
+// Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+// ABN 41 687 119 230
+//
+// Author: Thomas Lowe
+#include "rayneighbourindex.h"
+#include "raycloud.h"
+#include "raycompactcloud.h"
+#include "raycloudindex.h"
+#include "raythreads.h"
+
+#include <nabo/nabo.h>
+
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+
+namespace ray
+{
+namespace
+{
+const char kMagic[8] = { 'R', 'A', 'Y', 'N', 'E', 'I', 'G', 'H' };
+const uint32_t kVersion = 1;
+/// queries are searched in parallel batches of this many columns
+const int kQueryBatchSize = 1024;
+
+/// The sidecar file header
+struct NeighbourFileHeader
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t reserved;
+  /// size and modification time of the cloud file, to detect a stale index
+  FileStamp cloud_stamp;
+  uint64_t rows;
+  uint64_t cols;
+  uint64_t num_ray_ids;
+  uint64_t num_self_searches;
+};
+
+/// The sidecar file header of each self search, followed by its indices and square distances
+struct SelfSearchHeader
+{
+  int32_t search_size;
+  int32_t reserved;
+  double max_distance;
+  double epsilon;
+};
+
+/// the end points of the bounded rays in @c cloud, and the index of each ray
+template <class CloudType>
+Eigen::MatrixXd boundedEnds(const CloudType &cloud, std::vector<int> &ray_ids)
+{
+  ray_ids.clear();
+  ray_ids.reserve(cloud.rayCount());
+  for (int i = 0; i < static_cast<int>(cloud.rayCount()); i++)
+  {
+    if (cloud.rayBounded(i))
+    {
+      ray_ids.push_back(i);
+    }
+  }
+  Eigen::MatrixXd points(3, ray_ids.size());
+  for (size_t i = 0; i < ray_ids.size(); i++)
+  {
+    points.col(i) = cloud.end(ray_ids[i]);
+  }
+  return points;
+}
+}  // namespace
+
+struct NeighbourIndex::Tree
+{
+  std::unique_ptr<Nabo::NNSearchD> nns;
+  /// guards the deferred build of a loaded index's tree, since searches are const and may run concurrently
+  std::mutex mutex;
+};
+
+NeighbourIndex::NeighbourIndex()
+  : tree_(new Tree)
+{}
+
+NeighbourIndex::~NeighbourIndex() {}
+
+void NeighbourIndex::build(Eigen::MatrixXd points)
+{
+  points_.swap(points);
+  ray_ids_.clear();
+  buildTree();
+}
+
+void NeighbourIndex::build(const std::vector<Eigen::Vector3d> &points)
+{
+  Eigen::MatrixXd points_p(3, points.size());
+  for (size_t i = 0; i < points.size(); i++)
+  {
+    points_p.col(i) = points[i];
+  }
+  build(std::move(points_p));
+}
+
+void NeighbourIndex::build(const Cloud &cloud)
+{
+  std::vector<int> ray_ids;
+  build(boundedEnds(cloud, ray_ids));
+  ray_ids_.swap(ray_ids);
+}
+
+void NeighbourIndex::build(const CompactCloud &cloud)
+{
+  std::vector<int> ray_ids;
+  build(boundedEnds(cloud, ray_ids));
+  ray_ids_.swap(ray_ids);
+}
+
+void NeighbourIndex::buildApproximate(Eigen::MatrixXd points, double voxel_width, int max_per_voxel)
+{
+  clear();
+  if (points.rows() != 3 || voxel_width <= 0.0)
+  {
+    std::cerr << "Error: approximate neighbour index requires 3D points and a positive voxel width" << std::endl;
+    return;
+  }
+  points_.swap(points);
+  voxel_width_ = voxel_width;
+  max_per_voxel = std::max(max_per_voxel, 1);
+  // count the points in each voxel, then store an evenly spaced subsample of them contiguously. Spreading the
+  // subsample over the whole voxel avoids keeping only the first few points of a scan line
+  for (Eigen::Index i = 0; i < points_.cols(); i++)
+  {
+    voxels_[voxelIndex(points_.col(i))].total++;
+  }
+  int num_kept = 0;
+  for (auto &voxel : voxels_)
+  {
+    voxel.second.first = num_kept;
+    num_kept += std::min(voxel.second.total, max_per_voxel);
+  }
+  voxel_points_.resize(num_kept);
+  for (Eigen::Index i = 0; i < points_.cols(); i++)
+  {
+    VoxelPoints &voxel = voxels_.find(voxelIndex(points_.col(i)))->second;
+    const int64_t kept = std::min(voxel.total, max_per_voxel);
+    const int64_t seen = voxel.seen++;
+    if ((seen + 1) * kept / voxel.total > seen * kept / voxel.total)
+    {
+      voxel_points_[voxel.first + voxel.count++] = static_cast<int>(i);
+    }
+  }
+}
+
+void NeighbourIndex::buildApproximate(const Cloud &cloud, double voxel_width, int search_size, int max_per_voxel)
+{
+  if (voxel_width <= 0.0)
+  {
+    // a voxel width that holds about search_size points within the central voxel's neighbours on a surface
+    voxel_width = cloud.estimatePointSpacing() * std::sqrt(static_cast<double>(search_size) / kPi);
+  }
+  std::vector<int> ray_ids;
+  buildApproximate(boundedEnds(cloud, ray_ids), voxel_width, max_per_voxel);
+  ray_ids_.swap(ray_ids);
+}
+
+void NeighbourIndex::clear()
+{
+  tree_->nns.reset();
+  points_.resize(0, 0);
+  ray_ids_.clear();
+  self_searches_.clear();
+  voxel_width_ = 0.0;
+  voxels_.clear();
+  voxel_points_.clear();
+}
+
+void NeighbourIndex::buildTree()
+{
+  self_searches_.clear();
+  tree_->nns.reset();
+  voxel_width_ = 0.0;
+  voxels_.clear();
+  voxel_points_.clear();
+  ensureTree();
+}
+
+void NeighbourIndex::ensureTree() const
+{
+  std::lock_guard<std::mutex> lock(tree_->mutex);
+  if (!tree_->nns && !empty())
+  {
+    tree_->nns.reset(Nabo::NNSearchD::createKDTreeLinearHeap(points_, static_cast<int>(points_.rows())));
+  }
+}
+
+void NeighbourIndex::knn(const Eigen::MatrixXd &queries, int search_size, Eigen::MatrixXi &indices,
+                         Eigen::MatrixXd &dists2, double max_distance, double epsilon) const
+{
+  search_size = std::max(search_size, 0);
+  indices.resize(search_size, queries.cols());
+  dists2.resize(search_size, queries.cols());
+  if (empty() || search_size == 0)
+  {
+    indices.setConstant(kInvalidIndex);
+    dists2.setConstant(std::numeric_limits<double>::infinity());
+    return;
+  }
+  const double max_radius = max_distance != 0.0 ? max_distance : std::numeric_limits<double>::infinity();
+  if (!approximate())
+  {
+    ensureTree();
+  }
+  const auto search = [&](const Eigen::MatrixXd &batch_queries, Eigen::MatrixXi &batch_indices,
+                          Eigen::MatrixXd &batch_dists2) {
+    if (approximate())
+    {
+      voxelKnn(batch_queries, search_size, batch_indices, batch_dists2, max_radius);
+    }
+    else
+    {
+      tree_->nns->knn(batch_queries, batch_indices, batch_dists2, search_size, epsilon, 0, max_radius);
+    }
+  };
+  if (queries.cols() <= kQueryBatchSize)
+  {
+    search(queries, indices, dists2);
+    return;
+  }
+  const int num_batches = static_cast<int>((queries.cols() + kQueryBatchSize - 1) / kQueryBatchSize);
+  const auto search_batch = [&](size_t batch) {
+    const Eigen::Index first = static_cast<Eigen::Index>(batch) * kQueryBatchSize;
+    const Eigen::Index count = std::min<Eigen::Index>(kQueryBatchSize, queries.cols() - first);
+    const Eigen::MatrixXd batch_queries = queries.middleCols(first, count);
+    Eigen::MatrixXi batch_indices(search_size, count);
+    Eigen::MatrixXd batch_dists2(search_size, count);
+    search(batch_queries, batch_indices, batch_dists2);
+    indices.middleCols(first, count) = batch_indices;
+    dists2.middleCols(first, count) = batch_dists2;
+  };
+  parallelFor(0, num_batches, search_batch, 1);
+}
+
+void NeighbourIndex::voxelKnn(const Eigen::MatrixXd &queries, int search_size, Eigen::MatrixXi &indices,
+                              Eigen::MatrixXd &dists2, double max_distance) const
+{
+  const double max_dist2 = max_distance * max_distance;
+  // successive queries are often in the same voxel, so the 3x3x3 voxels around the last query's voxel are kept
+  VoxelPoints neighbours[27];
+  int num_neighbours = 0;
+  Eigen::Vector3i last_centre(std::numeric_limits<int>::max(), 0, 0);
+  for (Eigen::Index q = 0; q < queries.cols(); q++)
+  {
+    const Eigen::Vector3d query = queries.col(q);
+    const Eigen::Vector3i centre = voxelIndex(query);
+    if (centre != last_centre)
+    {
+      num_neighbours = 0;
+      for (int x = centre[0] - 1; x <= centre[0] + 1; x++)
+      {
+        for (int y = centre[1] - 1; y <= centre[1] + 1; y++)
+        {
+          for (int z = centre[2] - 1; z <= centre[2] + 1; z++)
+          {
+            const auto voxel = voxels_.find(Eigen::Vector3i(x, y, z));
+            if (voxel != voxels_.end())
+            {
+              neighbours[num_neighbours++] = voxel->second;
+            }
+          }
+        }
+      }
+      last_centre = centre;
+    }
+    // keep the nearest search_size candidates in order, by insertion
+    int num_found = 0;
+    for (int n = 0; n < num_neighbours; n++)
+    {
+      const int *ids = voxel_points_.data() + neighbours[n].first;
+      for (int k = 0; k < neighbours[n].count; k++)
+      {
+        const int id = ids[k];
+        const double dist2 = (points_.col(id) - query).squaredNorm();
+        if (dist2 == 0.0 || dist2 > max_dist2 || (num_found == search_size && dist2 >= dists2(search_size - 1, q)))
+        {
+          continue;
+        }
+        int j = std::min(num_found, search_size - 1);
+        for (; j > 0 && dists2(j - 1, q) > dist2; j--)
+        {
+          indices(j, q) = indices(j - 1, q);
+          dists2(j, q) = dists2(j - 1, q);
+        }
+        indices(j, q) = id;
+        dists2(j, q) = dist2;
+        num_found = std::min(num_found + 1, search_size);
+      }
+    }
+    for (int j = num_found; j < search_size; j++)
+    {
+      indices(j, q) = kInvalidIndex;
+      dists2(j, q) = std::numeric_limits<double>::infinity();
+    }
+  }
+}
+
+const NeighbourIndex::SelfSearch *NeighbourIndex::findSelfSearch(int search_size, double max_distance,
+                                                                 double epsilon) const
+{
+  for (const auto &search : self_searches_)
+  {
+    if (search.search_size == search_size && search.max_distance == max_distance && search.epsilon == epsilon)
+    {
+      return &search;
+    }
+  }
+  return nullptr;
+}
+
+const NeighbourIndex::SelfSearch &NeighbourIndex::knnSelf(int search_size, double max_distance, double epsilon)
+{
+  if (const SelfSearch *search = findSelfSearch(search_size, max_distance, epsilon))
+  {
+    return *search;
+  }
+  self_searches_.push_back(SelfSearch{ search_size, max_distance, epsilon, Eigen::MatrixXi(), Eigen::MatrixXd() });
+  SelfSearch &search = self_searches_.back();
+  knn(points_, search_size, search.indices, search.dists2, max_distance, epsilon);
+  return search;
+}
+
+int NeighbourIndex::nearest(const Eigen::VectorXd &query, double max_distance, double *dist2) const
+{
+  Eigen::MatrixXi indices;
+  Eigen::MatrixXd dists2;
+  knn(query, 1, indices, dists2, max_distance, 0.0);
+  if (dist2)
+  {
+    *dist2 = dists2(0, 0);
+  }
+  return indices(0, 0);
+}
+
+void NeighbourIndex::radiusSearch(const Eigen::VectorXd &query, double radius, std::vector<int> &indices) const
+{
+  indices.clear();
+  Eigen::MatrixXi found;
+  Eigen::MatrixXd dists2;
+  // the KD-tree only finds a fixed number of neighbours, so grow the search until it reaches the radius
+  const int num_points = static_cast<int>(size());
+  for (int search_size = std::min(16, num_points);; search_size = std::min(2 * search_size, num_points))
+  {
+    knn(query, search_size, found, dists2, radius, 0.0);
+    if (search_size == num_points || found(search_size - 1, 0) == kInvalidIndex)
+    {
+      break;
+    }
+  }
+  for (int j = 0; j < found.rows() && found(j, 0) != kInvalidIndex; j++)
+  {
+    indices.push_back(found(j, 0));
+  }
+}
+
+bool NeighbourIndex::save(const std::string &cloud_file) const
+{
+  if (approximate())
+  {
+    std::cerr << "Warning: approximate neighbour indices are not saved" << std::endl;
+    return false;
+  }
+  NeighbourFileHeader header = NeighbourFileHeader();
+  memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.version = kVersion;
+  if (!header.cloud_stamp.read(cloud_file))
+  {
+    std::cerr << "Error: cannot find " << cloud_file << std::endl;
+    return false;
+  }
+  header.rows = static_cast<uint64_t>(points_.rows());
+  header.cols = static_cast<uint64_t>(points_.cols());
+  header.num_ray_ids = ray_ids_.size();
+  header.num_self_searches = self_searches_.size();
+
+  const std::string index_file = fileName(cloud_file);
+  std::ofstream out(index_file, std::ios::binary | std::ios::out);
+  if (out.fail())
+  {
+    std::cerr << "Warning: cannot write neighbour index " << index_file << std::endl;
+    return false;
+  }
+  out.write(reinterpret_cast<const char *>(&header), sizeof(NeighbourFileHeader));
+  out.write(reinterpret_cast<const char *>(points_.data()), points_.size() * sizeof(double));
+  out.write(reinterpret_cast<const char *>(ray_ids_.data()), ray_ids_.size() * sizeof(int));
+  for (const auto &search : self_searches_)
+  {
+    SelfSearchHeader search_header = SelfSearchHeader();
+    search_header.search_size = search.search_size;
+    search_header.max_distance = search.max_distance;
+    search_header.epsilon = search.epsilon;
+    out.write(reinterpret_cast<const char *>(&search_header), sizeof(SelfSearchHeader));
+    out.write(reinterpret_cast<const char *>(search.indices.data()), search.indices.size() * sizeof(int));
+    out.write(reinterpret_cast<const char *>(search.dists2.data()), search.dists2.size() * sizeof(double));
+  }
+  return out.good();
+}
+
+bool NeighbourIndex::load(const std::string &cloud_file)
+{
+  clear();
+  std::ifstream in(fileName(cloud_file), std::ios::binary | std::ios::in);
+  if (in.fail())
+  {
+    return false;
+  }
+  NeighbourFileHeader header;
+  FileStamp cloud_stamp;
+  if (!in.read(reinterpret_cast<char *>(&header), sizeof(NeighbourFileHeader)) ||
+      memcmp(header.magic, kMagic, sizeof(kMagic)) != 0 || header.version != kVersion ||
+      !cloud_stamp.read(cloud_file) || cloud_stamp != header.cloud_stamp)
+  {
+    return false;
+  }
+  // the sizes in the header must fit in the rest of the file before anything is allocated from them
+  const std::streamoff data_start = in.tellg();
+  in.seekg(0, std::ios::end);
+  uint64_t remaining = static_cast<uint64_t>(in.tellg() - data_start);
+  in.seekg(data_start);
+  if (header.rows > 0 && header.cols > remaining / (header.rows * sizeof(double)))
+  {
+    return false;
+  }
+  remaining -= header.rows * header.cols * sizeof(double);
+  if (header.num_ray_ids > remaining / sizeof(int))
+  {
+    return false;
+  }
+  remaining -= header.num_ray_ids * sizeof(int);
+  if (header.num_self_searches > remaining / sizeof(SelfSearchHeader))
+  {
+    return false;
+  }
+  Eigen::MatrixXd points(header.rows, header.cols);
+  std::vector<int> ray_ids(header.num_ray_ids);
+  if (!in.read(reinterpret_cast<char *>(points.data()), points.size() * sizeof(double)) ||
+      !in.read(reinterpret_cast<char *>(ray_ids.data()), ray_ids.size() * sizeof(int)))
+  {
+    return false;
+  }
+  std::deque<SelfSearch> self_searches(header.num_self_searches);
+  for (auto &search : self_searches)
+  {
+    SelfSearchHeader search_header;
+    if (!in.read(reinterpret_cast<char *>(&search_header), sizeof(SelfSearchHeader)) ||
+        search_header.search_size < 0)
+    {
+      return false;
+    }
+    remaining -= sizeof(SelfSearchHeader);
+    const uint64_t search_bytes = static_cast<uint64_t>(search_header.search_size) * (sizeof(int) + sizeof(double));
+    if (search_bytes > 0 && header.cols > remaining / search_bytes)
+    {
+      return false;
+    }
+    remaining -= search_bytes * header.cols;
+    search.search_size = search_header.search_size;
+    search.max_distance = search_header.max_distance;
+    search.epsilon = search_header.epsilon;
+    search.indices.resize(search.search_size, points.cols());
+    search.dists2.resize(search.search_size, points.cols());
+    if (!in.read(reinterpret_cast<char *>(search.indices.data()), search.indices.size() * sizeof(int)) ||
+        !in.read(reinterpret_cast<char *>(search.dists2.data()), search.dists2.size() * sizeof(double)))
+    {
+      return false;
+    }
+  }
+  // the search tree is built when it is first needed, since the saved self searches may be all that is used
+  points_.swap(points);
+  ray_ids_.swap(ray_ids);
+  self_searches_.swap(self_searches);
+  return true;
+}
+}  // namespace ray
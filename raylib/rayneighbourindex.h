@@ -0,0 +1,134 @@
+// Copyright (c) 2020
+// Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+// ABN 41 687 119 230
+//
+// Author: Thomas Lowe
+#ifndef RAYLIB_RAYNEIGHBOURINDEX_H
+#define RAYLIB_RAYNEIGHBOURINDEX_H
+
+#include "raylib/raylibconfig.h"
+#include "rayutils.h"
+
+#include <deque>
+#include <memory>
+
+namespace ray
+{
+class Cloud;
+class CompactCloud;
+
+/// A nearest neighbour search structure (KD-tree) over a set of points, built once and queried many times.
+/// Results follow the libnabo conventions: the neighbours of query i are in column i of a search_size x num_queries
+/// matrix, nearest first, with @c kInvalidIndex after the last neighbour found. Points at zero distance from the
+/// query are not returned.
+/// An index built from a cloud can be saved to a sidecar file next to the cloud file (@c fileName()), together with
+/// the results of its self searches, so that later processing of the same file can skip the searches. Like the other
+/// sidecar files, it is ignored once the cloud file changes. A loaded index only builds its search tree when a
+/// search other than a saved self search needs it.
+/// An approximate index (@c buildApproximate) replaces the KD-tree with a voxel hash, for when the exact nearest
+/// neighbours are not needed, such as for normals and shape estimation on large clouds.
+class RAYLIB_EXPORT NeighbourIndex
+{
+public:
+  /// the index of a missing neighbour, the same as Nabo::NNSearchD::InvalidIndex
+  static const int kInvalidIndex = -1;
+
+  NeighbourIndex();
+  ~NeighbourIndex();
+  // the search tree refers to the stored points, so the index cannot be copied or moved
+  NeighbourIndex(const NeighbourIndex &) = delete;
+  NeighbourIndex &operator=(const NeighbourIndex &) = delete;
+
+  /// build the index over the columns of @c points, which can have any number of rows
+  void build(Eigen::MatrixXd points);
+  void build(const std::vector<Eigen::Vector3d> &points);
+  /// build the index over the end points of the bounded rays in @c cloud. Point i is ray @c rayIds()[i] of the cloud
+  void build(const Cloud &cloud);
+  void build(const CompactCloud &cloud);
+  /// build an approximate index over the columns of the 3 row matrix @c points. Points are hashed into voxels of width
+  /// @c voxel_width, keeping at most @c max_per_voxel points in each voxel, and a search only looks in the 3x3x3 voxels
+  /// around the query. So neighbours are found within @c voxel_width of the query, from a subsample of the dense areas
+  void buildApproximate(Eigen::MatrixXd points, double voxel_width, int max_per_voxel = 8);
+  /// build an approximate index over the end points of the bounded rays in @c cloud. A zero @c voxel_width is chosen
+  /// from the cloud's point spacing, to find about @c search_size neighbours per point
+  void buildApproximate(const Cloud &cloud, double voxel_width = 0.0, int search_size = 16, int max_per_voxel = 8);
+  void clear();
+
+  inline size_t size() const { return static_cast<size_t>(points_.cols()); }
+  inline bool empty() const { return points_.cols() == 0; }
+  /// the indexed points, one per column
+  inline const Eigen::MatrixXd &points() const { return points_; }
+  /// the ray of each point, when the index is built from a cloud
+  inline const std::vector<int> &rayIds() const { return ray_ids_; }
+  /// whether this is an approximate, voxel hashed index
+  inline bool approximate() const { return voxel_width_ > 0.0; }
+
+  /// the @c search_size nearest neighbours of each column of @c queries, within @c max_distance if it is non-zero.
+  /// @c epsilon is the allowed relative error in the neighbour distances. Large sets of queries are searched in
+  /// parallel batches
+  void knn(const Eigen::MatrixXd &queries, int search_size, Eigen::MatrixXi &indices, Eigen::MatrixXd &dists2,
+           double max_distance = 0.0, double epsilon = kNearestNeighbourEpsilon) const;
+  /// the arguments and results of a search of the indexed points themselves
+  struct SelfSearch
+  {
+    int search_size;
+    double max_distance;
+    double epsilon;
+    Eigen::MatrixXi indices;
+    Eigen::MatrixXd dists2;
+  };
+  /// as @c knn of the indexed points themselves. The results are kept in the index, so a repeated search is free. The
+  /// returned reference stays valid until the index is rebuilt or cleared
+  const SelfSearch &knnSelf(int search_size, double max_distance = 0.0, double epsilon = kNearestNeighbourEpsilon);
+  /// the kept self search with these arguments, or null if there is none
+  const SelfSearch *findSelfSearch(int search_size, double max_distance = 0.0,
+                                   double epsilon = kNearestNeighbourEpsilon) const;
+  /// the nearest point to @c query within @c max_distance if it is non-zero, or kInvalidIndex
+  int nearest(const Eigen::VectorXd &query, double max_distance = 0.0, double *dist2 = nullptr) const;
+  /// all points within @c radius of @c query, nearest first
+  void radiusSearch(const Eigen::VectorXd &query, double radius, std::vector<int> &indices) const;
+
+  /// the sidecar file name for the cloud @c cloud_file
+  static std::string fileName(const std::string &cloud_file) { return cloud_file + ".nbr"; }
+  /// save the index and its self search results to the sidecar file of @c cloud_file. Approximate indices are not saved
+  bool save(const std::string &cloud_file) const;
+  /// load the sidecar index of @c cloud_file. Returns false if there is none, or if it is out of date
+  bool load(const std::string &cloud_file);
+
+private:
+  /// rebuild the search tree over points_
+  void buildTree();
+  /// build the search tree of a loaded index, if it has not been built yet
+  void ensureTree() const;
+  /// the search of an approximate index, see @c knn
+  void voxelKnn(const Eigen::MatrixXd &queries, int search_size, Eigen::MatrixXi &indices, Eigen::MatrixXd &dists2,
+                double max_distance) const;
+  inline Eigen::Vector3i voxelIndex(const Eigen::Vector3d &point) const
+  {
+    return Eigen::Vector3i(int(std::floor(point[0] / voxel_width_)), int(std::floor(point[1] / voxel_width_)),
+                           int(std::floor(point[2] / voxel_width_)));
+  }
+
+  struct Tree;
+  std::unique_ptr<Tree> tree_;
+  Eigen::MatrixXd points_;
+  std::vector<int> ray_ids_;
+
+  /// the voxels of an approximate index. The points kept in each voxel are voxel_points_[first] to
+  /// voxel_points_[first + count - 1], out of @c total points in the voxel
+  struct VoxelPoints
+  {
+    int first = 0;
+    int count = 0;
+    int total = 0;
+    int seen = 0;  // used while building
+  };
+  double voxel_width_ = 0.0;
+  VoxelMap<VoxelPoints> voxels_;
+  std::vector<int> voxel_points_;
+  /// a deque, so that references to earlier searches stay valid as searches are added
+  std::deque<SelfSearch> self_searches_;
+};
+}  // namespace ray
+
+#endif  // RAYLIB_RAYNEIGHBOURINDEX_H
@@ -6,10 +6,21 @@
 #include "rayparse.h"
 #include <iostream>
 #include <limits>
+#include "raymemory.h"
+#include "raythreads.h"
 #include "rayutils.h"
 
 namespace ray
 {
+namespace
+{
+/// the options that every tool accepts
+IntArgument thread_count(1, 100000);
+OptionalKeyValueArgument threads_option("threads", 0, &thread_count);
+IntArgument memory_mb(1, 100000000);
+OptionalKeyValueArgument memory_option("memory_limit", 0, &memory_mb);
+}  // namespace
+
 std::string getFileNameStub(const std::string &name)
 {
   const size_t last_dot = name.find_last_of('.');
@@ -36,6 +47,8 @@ bool parseCommandLine(int argc, char *argv[], const std::vector<FixedArgument *>
   // set them) if the format matches.
   if (set_values_ && !parseCommandLine(argc, argv, fixed_arguments, optional_arguments, false))
     return false;
+  optional_arguments.push_back(&threads_option);
+  optional_arguments.push_back(&memory_option);
   int c = 1;
   for (auto &l : fixed_arguments)
   {
@@ -59,6 +72,14 @@ bool parseCommandLine(int argc, char *argv[], const std::vector<FixedArgument *>
     if (!found)
       return false;  // no optional argument matches argument c
   }
+  if (set_values_)
+  {
+    // the first initialisation wins, so this overrides the tool's own call to Threads::init
+    if (threads_option.isSet())
+      Threads::init(thread_count.value());
+    if (memory_option.isSet())
+      Memory::setLimit(static_cast<size_t>(memory_mb.value()) * 1000000);
+  }
   return true;
 }
 
@@ -381,7 +402,7 @@ bool OptionalFlagArgument::parse(int argc, char *argv[], int &index, bool set_va
   if (index >= argc)
     return false;
   std::string str(argv[index]);
-  if (str == ("--" + name_) || str == ("-" + std::string(1, character_)))
+  if (str == ("--" + name_) || (character_ != 0 && str == ("-" + std::string(1, character_))))
   {
     if (set_value)
       is_set_ = true;
@@ -396,7 +417,7 @@ bool OptionalKeyValueArgument::parse(int argc, char *argv[], int &index, bool se
   if (index >= argc)
     return false;
   std::string str(argv[index]);
-  if (str == ("--" + name_) || str == ("-" + std::string(1, character_)))
+  if (str == ("--" + name_) || (character_ != 0 && str == ("-" + std::string(1, character_))))
   {
     if (set_value)
       is_set_ = true;
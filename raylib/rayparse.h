@@ -39,6 +39,9 @@ std::string RAYLIB_EXPORT getFileNameExtension(const std::string &name);
 /// if (!format1 && !format2)
 ///   print_usage_and_exit();
 /// Values are set only for the parseCommandLine that returned true. e.g. scale_val.value() is used if format1
+///
+/// Every format also accepts the global options --threads 4, the number of threads to use, and --memory_limit 1000,
+/// the memory budget in MB for the streaming functions. These are applied when a format matches.
 bool RAYLIB_EXPORT
   parseCommandLine(int argc, char *argv[], const std::vector<struct FixedArgument *> &fixed_arguments,
                    std::vector<struct OptionalArgument *> optional_arguments = std::vector<struct OptionalArgument *>(),
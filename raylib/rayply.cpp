@@ -6,22 +6,32 @@
 #include "rayply.h"
 #include "raylib/rayprogress.h"
 #include "raylib/rayprogressthread.h"
+#include "raycloudwriter.h"
+#include "raymappedfile.h"
+#include "raymemory.h"
 #include "raymesh.h"
+#include "raythreads.h"
 
+#include <condition_variable>
+#include <cstring>
+#include <deque>
 #include <fstream>
+#include <iomanip>
 #include <iostream>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <type_traits>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif  // defined(__SSE2__)
 // #define OUTPUT_MOMENTS // useful when setting up unit test expected ray clouds
 
 namespace ray
 {
 namespace
 {
-// these are set once and are constant after that
-unsigned long chunk_header_length = 0;
-unsigned long point_cloud_chunk_header_length = 0;
-unsigned long vertex_size_pos = 0;
-unsigned long point_cloud_vertex_size_pos = 0;
-
 enum DataType
 {
   kDTfloat,
@@ -31,25 +41,186 @@ enum DataType
   kDTint,
   kDTnone
 };
-}  // namespace
 
-bool writeRayCloudChunkStart(const std::string &file_name, std::ofstream &out)
+/// The row layout written by @c writeRayCloudChunkStart, for position scalar type @c PosT (float, or double when
+/// written with RAYLIB_DOUBLE_RAYS), with the conversion kernels between a row and the ray's fields.
+/// The float conversions use SSE2 where available (always, on x86-64), otherwise scalar code.
+template <class PosT>
+struct CanonicalRayRow
 {
-  int num_zeros = std::numeric_limits<unsigned long>::digits10;
-  out.open(file_name, std::ios::binary | std::ios::out);
-  if (out.fail())
+  static const int kTimeOffset = 3 * sizeof(PosT);
+  static const int kNormalOffset = kTimeOffset + sizeof(double);
+  static const int kColourOffset = kNormalOffset + 3 * sizeof(float);
+  static const int kRowSize = kColourOffset + sizeof(RGBA);
+
+  /// pack a ray into @c row. The normal field stores the vector from the end to the start of the ray
+  static inline void encode(const Eigen::Vector3d &start, const Eigen::Vector3d &end, double time, RGBA colour,
+                            unsigned char *row)
   {
-    std::cerr << "Error: cannot open " << file_name << " for writing." << std::endl;
-    return false;
+    storePosition(end, row);
+#if defined(__SSE2__)
+    const __m128d ray_xy = _mm_sub_pd(_mm_loadu_pd(start.data()), _mm_loadu_pd(end.data()));
+    _mm_storel_pi(reinterpret_cast<__m64 *>(row + kNormalOffset), _mm_cvtpd_ps(ray_xy));
+    const float ray_z = static_cast<float>(start[2] - end[2]);
+    memcpy(row + kNormalOffset + 2 * sizeof(float), &ray_z, sizeof(float));
+#else
+    const float ray[3] = { static_cast<float>(start[0] - end[0]), static_cast<float>(start[1] - end[1]),
+                           static_cast<float>(start[2] - end[2]) };
+    memcpy(row + kNormalOffset, ray, sizeof(ray));
+#endif  // defined(__SSE2__)
+    memcpy(row + kTimeOffset, &time, sizeof(double));
+    memcpy(row + kColourOffset, &colour, sizeof(RGBA));
+  }
+
+  /// unpack the fields of @c row. The start of the ray is @c end + @c normal
+  static inline void decode(const unsigned char *row, Eigen::Vector3d &end, Eigen::Vector3d &normal, double &time,
+                            RGBA &colour)
+  {
+    loadPosition(row, end);
+    loadFloats(row + kNormalOffset, normal);
+    memcpy(&time, row + kTimeOffset, sizeof(double));
+    memcpy(&colour, row + kColourOffset, sizeof(RGBA));
+  }
+
+  static inline void storePosition(const Eigen::Vector3d &pos, unsigned char *row)
+  {
+    if (std::is_same<PosT, double>::value)
+    {
+      memcpy(row, pos.data(), 3 * sizeof(double));
+      return;
+    }
+#if defined(__SSE2__)
+    _mm_storel_pi(reinterpret_cast<__m64 *>(row), _mm_cvtpd_ps(_mm_loadu_pd(pos.data())));
+    const float z = static_cast<float>(pos[2]);
+    memcpy(row + 2 * sizeof(float), &z, sizeof(float));
+#else
+    const float p[3] = { static_cast<float>(pos[0]), static_cast<float>(pos[1]), static_cast<float>(pos[2]) };
+    memcpy(row, p, sizeof(p));
+#endif  // defined(__SSE2__)
+  }
+
+  static inline void loadPosition(const unsigned char *row, Eigen::Vector3d &pos)
+  {
+    if (std::is_same<PosT, double>::value)
+    {
+      memcpy(pos.data(), row, 3 * sizeof(double));
+      return;
+    }
+    loadFloats(row, pos);
+  }
+
+  /// widen the three floats at @c src
+  static inline void loadFloats(const unsigned char *src, Eigen::Vector3d &v)
+  {
+#if defined(__SSE2__)
+    _mm_storeu_pd(v.data(), _mm_cvtps_pd(_mm_castpd_ps(_mm_load_sd(reinterpret_cast<const double *>(src)))));
+    float z;
+    memcpy(&z, src + 2 * sizeof(float), sizeof(float));
+    v[2] = z;
+#else
+    float f[3];
+    memcpy(f, src, sizeof(f));
+    v = Eigen::Vector3d(f[0], f[1], f[2]);
+#endif  // defined(__SSE2__)
+  }
+};
+
+/// The row layout written by @c writePointCloudChunkStart: position, time and colour
+template <class PosT>
+struct CanonicalPointRow
+{
+  static const int kTimeOffset = 3 * sizeof(PosT);
+  static const int kColourOffset = kTimeOffset + sizeof(double);
+  static const int kRowSize = kColourOffset + sizeof(RGBA);
+
+  static inline void encode(const Eigen::Vector3d &point, double time, RGBA colour, unsigned char *row)
+  {
+    CanonicalRayRow<PosT>::storePosition(point, row);
+    memcpy(row + kTimeOffset, &time, sizeof(double));
+    memcpy(row + kColourOffset, &colour, sizeof(RGBA));
+  }
+
+  /// unpack the fields of @c row
+  static inline void decode(const unsigned char *row, Eigen::Vector3d &point, double &time, RGBA &colour)
+  {
+    CanonicalRayRow<PosT>::loadPosition(row, point);
+    memcpy(&time, row + kTimeOffset, sizeof(double));
+    memcpy(&colour, row + kColourOffset, sizeof(RGBA));
+  }
+};
+
+#if RAYLIB_DOUBLE_RAYS
+using RayRow = CanonicalRayRow<double>;
+using PointRow = CanonicalPointRow<double>;
+#else
+using RayRow = CanonicalRayRow<float>;
+using PointRow = CanonicalPointRow<float>;
+#endif
+static_assert(RayRow::kRowSize == sizeof(RayPlyEntry), "ray row layout must match RayPlyEntry");
+static_assert(PointRow::kRowSize == sizeof(PointPlyEntry), "point row layout must match PointPlyEntry");
+
+/// false if @c v has NaNs, or (in float precision files) is so far from the origin that it is suspicious
+inline bool isValid(const Eigen::Vector3d &v)
+{
+#if RAYLIB_DOUBLE_RAYS
+  return v == v;
+#else
+  return v == v && std::abs(v[0]) <= 100000.0;
+#endif
+}
+
+/// print a warning if the ray at index @c i has NaNs or a suspicious location
+void warnIfInvalid(const Eigen::Vector3d &start, const Eigen::Vector3d &end, size_t i, bool &has_warned)
+{
+  if (!(end == end))
+  {
+    std::cout << "WARNING: nans in point: " << i << ": " << end.transpose() << std::endl;
+    has_warned = true;
+  }
+#if !RAYLIB_DOUBLE_RAYS
+  if (std::abs(end[0]) > 100000.0)
+  {
+    std::cout << "WARNING: very large point location at: " << i << ": " << end.transpose() << ", suspicious"
+              << std::endl;
+    has_warned = true;
+  }
+#endif
+  if (!(start == start))
+  {
+    std::cout << "WARNING: nans in start: " << i << ": " << start.transpose() << std::endl;
+    has_warned = true;
+  }
+}
+
+/// print a warning if the point at index @c i has NaNs or a suspicious location
+void warnIfInvalid(const Eigen::Vector3d &point, size_t i, bool &has_warned)
+{
+  if (!(point == point))
+  {
+    std::cout << "WARNING: nans in point: " << i << ": " << point.transpose() << std::endl;
+    has_warned = true;
   }
+#if !RAYLIB_DOUBLE_RAYS
+  if (std::abs(point[0]) > 100000.0)
+  {
+    std::cout << "WARNING: very large point location at: " << i << ": " << point.transpose() << ", suspicious"
+              << std::endl;
+    has_warned = true;
+  }
+#endif
+}
+
+/// The header of the .ply files written in chunks. The vertex count is zero padded to a fixed width so that it can be
+/// filled in once all the chunks are written, without moving the data. The header is a function of the vertex count
+/// only, so the chunked writers need no state beyond the stream itself.
+std::string chunkedPlyHeader(unsigned long num_vertices, bool is_ray_cloud)
+{
+  std::stringstream out;
   out << "ply" << std::endl;
   out << "format binary_little_endian 1.0" << std::endl;
   out << "comment generated by raycloudtools library" << std::endl;
-  out << "element vertex ";
-  for (int i = 0; i < num_zeros; i++)
-    out << "0";  // fill in with zeros. I will replace rightmost characters later, to give actual number
-  vertex_size_pos = out.tellp();
-  out << std::endl;
+  out << "element vertex " << std::setw(std::numeric_limits<unsigned long>::digits10) << std::setfill('0')
+      << num_vertices << std::endl;
 #if RAYLIB_DOUBLE_RAYS
   out << "property double x" << std::endl;
   out << "property double y" << std::endl;
@@ -60,21 +231,54 @@ bool writeRayCloudChunkStart(const std::string &file_name, std::ofstream &out)
   out << "property float z" << std::endl;
 #endif
   out << "property double time" << std::endl;
+  if (is_ray_cloud)
+  {
 #if RAYLIB_WITH_NORMAL_FIELD
-  out << "property float nx" << std::endl;
-  out << "property float ny" << std::endl;
-  out << "property float nz" << std::endl;
+    out << "property float nx" << std::endl;
+    out << "property float ny" << std::endl;
+    out << "property float nz" << std::endl;
 #else
-  out << "property float rayx" << std::endl;
-  out << "property float rayy" << std::endl;
-  out << "property float rayz" << std::endl;
+    out << "property float rayx" << std::endl;
+    out << "property float rayy" << std::endl;
+    out << "property float rayz" << std::endl;
 #endif
+  }
   out << "property uchar red" << std::endl;
   out << "property uchar green" << std::endl;
   out << "property uchar blue" << std::endl;
   out << "property uchar alpha" << std::endl;
   out << "end_header" << std::endl;
-  chunk_header_length = out.tellp();
+  return out.str();
+}
+
+/// the length of the chunked ray cloud or point cloud header
+unsigned long chunkedPlyHeaderLength(bool is_ray_cloud)
+{
+  static const unsigned long ray_cloud_length = static_cast<unsigned long>(chunkedPlyHeader(0, true).length());
+  static const unsigned long point_cloud_length = static_cast<unsigned long>(chunkedPlyHeader(0, false).length());
+  return is_ray_cloud ? ray_cloud_length : point_cloud_length;
+}
+
+/// fill in the vertex count of a chunked .ply file from the size of the data written after the header
+unsigned long writeChunkedPlyEnd(std::ofstream &out, bool is_ray_cloud, size_t row_size)
+{
+  const unsigned long size = static_cast<unsigned long>(out.tellp()) - chunkedPlyHeaderLength(is_ray_cloud);
+  const unsigned long number_of_vertices = size / static_cast<unsigned long>(row_size);
+  out.seekp(0);
+  out << chunkedPlyHeader(number_of_vertices, is_ray_cloud);
+  return number_of_vertices;
+}
+}  // namespace
+
+bool writeRayCloudChunkStart(const std::string &file_name, std::ofstream &out)
+{
+  out.open(file_name, std::ios::binary | std::ios::out);
+  if (out.fail())
+  {
+    std::cerr << "Error: cannot open " << file_name << " for writing." << std::endl;
+    return false;
+  }
+  out << chunkedPlyHeader(0, true);
   return true;
 }
 
@@ -87,57 +291,21 @@ bool writeRayCloudChunk(std::ofstream &out, RayPlyBuffer &vertices, const std::v
     // this is not an error. Allowing empty chunks avoids wrapping every call to writeRayCloudChunk in a condition
     return true;
   }
-  if (out.tellp() < (long)chunk_header_length)
+  if (out.tellp() < (long)chunkedPlyHeaderLength(true))
   {
     std::cerr << "Error: file header has not been written, use writeRayCloudChunkStart" << std::endl;
     return false;
   }
   vertices.resize(ends.size());
 
+  unsigned char *rows = reinterpret_cast<unsigned char *>(vertices.data());
   for (size_t i = 0; i < ends.size(); i++)
   {
-    if (!has_warned)
+    if (!has_warned && !(isValid(ends[i]) && isValid(starts[i])))
     {
-      if (!(ends[i] == ends[i]))
-      {
-        std::cout << "WARNING: nans in point: " << i << ": " << ends[i].transpose() << std::endl;
-        has_warned = true;
-      }
-#if !RAYLIB_DOUBLE_RAYS
-      if (std::abs(ends[i][0]) > 100000.0)
-      {
-        std::cout << "WARNING: very large point location at: " << i << ": " << ends[i].transpose() << ", suspicious"
-                  << std::endl;
-        has_warned = true;
-      }
-#endif
-      bool b = starts[i] == starts[i];
-      if (!b)
-      {
-        std::cout << "WARNING: nans in start: " << i << ": " << starts[i].transpose() << std::endl;
-        has_warned = true;
-      }
+      warnIfInvalid(starts[i], ends[i], i, has_warned);
     }
-    Eigen::Vector3d n = starts[i] - ends[i];
-    union U  // TODO: this is nasty, better to just make vertices an unsigned char vector
-    {
-      float f[2];
-      double d;
-    };
-    U u;
-    u.d = times[i];
-
-#if RAYLIB_DOUBLE_RAYS
-    U end0, end1, end2;
-    end0.d = ends[i][0];
-    end1.d = ends[i][1];
-    end2.d = ends[i][2];
-    vertices[i] << end0.f[0], end0.f[1], end1.f[0], end1.f[1], end2.f[0], end2.f[1], u.f[0], u.f[1], (float)n[0],
-      (float)n[1], (float)n[2], (float &)colours[i];
-#else
-    vertices[i] << (float)ends[i][0], (float)ends[i][1], (float)ends[i][2], u.f[0], u.f[1], (float)n[0], (float)n[1],
-      (float)n[2], (float &)colours[i];
-#endif
+    RayRow::encode(starts[i], ends[i], times[i], colours[i], rows + i * RayRow::kRowSize);
   }
   out.write((const char *)&vertices[0], sizeof(RayPlyEntry) * vertices.size());
   if (!out.good())
@@ -150,14 +318,20 @@ bool writeRayCloudChunk(std::ofstream &out, RayPlyBuffer &vertices, const std::v
 
 unsigned long writeRayCloudChunkEnd(std::ofstream &out)
 {
-  const unsigned long size = static_cast<unsigned long>(out.tellp()) - chunk_header_length;
-  const unsigned long number_of_rays = size / sizeof(RayPlyEntry);
-  std::stringstream stream;
-  stream << number_of_rays;
-  std::string str = stream.str();
-  out.seekp(vertex_size_pos - str.length());
-  out << str;
-  return number_of_rays;
+  return writeChunkedPlyEnd(out, true, sizeof(RayPlyEntry));
+}
+
+bool storedRay(const Eigen::Vector3d &start, const Eigen::Vector3d &end, Eigen::Vector3d &stored_start,
+               Eigen::Vector3d &stored_end)
+{
+  unsigned char row[RayRow::kRowSize];
+  RayRow::encode(start, end, 0.0, RGBA(0, 0, 0, 0), row);
+  Eigen::Vector3d normal;
+  double time;
+  RGBA colour;
+  RayRow::decode(row, stored_end, normal, time, colour);
+  stored_start = stored_end + normal;
+  return stored_end == stored_end && normal == normal;
 }
 
 // Save the polygon file to disk
@@ -190,7 +364,6 @@ bool writePlyRayCloud(const std::string &file_name, const std::vector<Eigen::Vec
 
 bool writePointCloudChunkStart(const std::string &file_name, std::ofstream &out)
 {
-  int num_zeros = std::numeric_limits<unsigned long>::digits10;
   std::cout << "saving to " << file_name << " ..." << std::endl;
   out.open(file_name, std::ios::binary | std::ios::out);
   if (out.fail())
@@ -198,30 +371,7 @@ bool writePointCloudChunkStart(const std::string &file_name, std::ofstream &out)
     std::cerr << "Error: cannot open " << file_name << " for writing." << std::endl;
     return false;
   }
-  out << "ply" << std::endl;
-  out << "format binary_little_endian 1.0" << std::endl;
-  out << "comment generated by raycloudtools library" << std::endl;
-  out << "element vertex ";
-  for (int i = 0; i < num_zeros; i++)
-    out << "0";  // fill in with zeros. I will replace rightmost characters later, to give actual number
-  point_cloud_vertex_size_pos = out.tellp();  // same value as for ray cloud, so we can use the same varia
-  out << std::endl;
-#if RAYLIB_DOUBLE_RAYS
-  out << "property double x" << std::endl;
-  out << "property double y" << std::endl;
-  out << "property double z" << std::endl;
-#else
-  out << "property float x" << std::endl;
-  out << "property float y" << std::endl;
-  out << "property float z" << std::endl;
-#endif
-  out << "property double time" << std::endl;
-  out << "property uchar red" << std::endl;
-  out << "property uchar green" << std::endl;
-  out << "property uchar blue" << std::endl;
-  out << "property uchar alpha" << std::endl;
-  out << "end_header" << std::endl;
-  point_cloud_chunk_header_length = out.tellp();
+  out << chunkedPlyHeader(0, false);
   return true;
 }
 
@@ -233,49 +383,21 @@ bool writePointCloudChunk(std::ofstream &out, PointPlyBuffer &vertices, const st
     std::cerr << "Error: saving out ray file chunk with zero rays" << std::endl;
     return false;
   }
-  if (out.tellp() < (long)point_cloud_chunk_header_length)
+  if (out.tellp() < (long)chunkedPlyHeaderLength(false))
   {
     std::cerr << "Error: file header has not been written, use writeRayCloudChunkStart" << std::endl;
     return false;
   }
   vertices.resize(points.size());  // allocates the chunk size the first time, and nullop on subsequent chunks
 
+  unsigned char *rows = reinterpret_cast<unsigned char *>(vertices.data());
   for (size_t i = 0; i < points.size(); i++)
   {
-    if (!has_warned)
+    if (!has_warned && !isValid(points[i]))
     {
-      if (!(points[i] == points[i]))
-      {
-        std::cout << "WARNING: nans in point: " << i << ": " << points[i].transpose() << std::endl;
-        has_warned = true;
-      }
-#if !RAYLIB_DOUBLE_RAYS
-      if (std::abs(points[i][0]) > 100000.0)
-      {
-        std::cout << "WARNING: very large point location at: " << i << ": " << points[i].transpose() << ", suspicious"
-                  << std::endl;
-        has_warned = true;
-      }
-#endif
+      warnIfInvalid(points[i], i, has_warned);
     }
-    union U  // TODO: this is nasty, better to just make vertices an unsigned char vector
-    {
-      float f[2];
-      double d;
-    };
-    U u;
-    u.d = times[i];
-#if RAYLIB_DOUBLE_RAYS
-    U end0, end1, end2;
-    end0.d = points[i][0];
-    end1.d = points[i][1];
-    end2.d = points[i][2];
-    vertices[i] << end0.f[0], end0.f[1], end1.f[0], end1.f[1], end2.f[0], end2.f[1], u.f[0], u.f[1],
-      (float &)colours[i];
-#else
-    vertices[i] << (float)points[i][0], (float)points[i][1], (float)points[i][2], (float)u.f[0], (float)u.f[1],
-      (float &)colours[i];
-#endif
+    PointRow::encode(points[i], times[i], colours[i], rows + i * PointRow::kRowSize);
   }
   out.write((const char *)&vertices[0], sizeof(PointPlyEntry) * vertices.size());
   if (!out.good())
@@ -288,13 +410,7 @@ bool writePointCloudChunk(std::ofstream &out, PointPlyBuffer &vertices, const st
 
 void writePointCloudChunkEnd(std::ofstream &out)
 {
-  const unsigned long size = static_cast<unsigned long>(out.tellp()) - point_cloud_chunk_header_length;
-  const unsigned long number_of_points = size / sizeof(PointPlyEntry);
-  std::stringstream stream;
-  stream << number_of_points;
-  std::string str = stream.str();
-  out.seekp(point_cloud_vertex_size_pos - str.length());
-  out << str;
+  const unsigned long number_of_points = writeChunkedPlyEnd(out, false, sizeof(PointPlyEntry));
   std::cout << "... saved out " << number_of_points << " points." << std::endl;
 }
 
@@ -326,13 +442,519 @@ bool writePlyPointCloud(const std::string &file_name, const std::vector<Eigen::V
   return true;
 }
 
+namespace
+{
+/// The vertex layout of a ray cloud or point cloud .ply file, as described by its header
+struct PlyLayout
+{
+  int row_size = 0;
+  int offset = -1;
+  int normal_offset = -1;
+  int time_offset = -1;
+  int colour_offset = -1;
+  int intensity_offset = -1;
+  bool time_is_float = false;
+  bool pos_is_float = false;
+  bool normal_is_float = false;
+  DataType intensity_type = kDTnone;
+};
+
+/// A warning raised while decoding. Only the first warning in the file is reported.
+struct PlyWarning
+{
+  std::string message;
+  bool is_error = false;
+};
+
+/// The rays decoded from a contiguous range of rows in the file
+struct PlyChunk
+{
+  std::vector<Eigen::Vector3d> starts;
+  std::vector<Eigen::Vector3d> ends;
+  std::vector<double> times;
+  std::vector<RGBA> colours;
+  std::vector<uint8_t> intensities;
+  PlyWarning warning;
+
+  /// reserve exactly @c size rays, so that decoding into the chunk never reallocates
+  void reserve(const PlyLayout &layout, size_t size)
+  {
+    starts.reserve(size);
+    ends.reserve(size);
+    times.reserve(size);
+    colours.reserve(size);
+    if (layout.intensity_offset != -1)
+      intensities.reserve(size);
+  }
+  void resize(const PlyLayout &layout, size_t size)
+  {
+    starts.resize(size);
+    ends.resize(size);
+    times.resize(size);
+    if (layout.colour_offset != -1)
+      colours.resize(size);
+    if (layout.intensity_offset != -1)
+      intensities.resize(size);
+  }
+  /// move the rays in [@c from, @c from + @c count) down to index @c to
+  void moveDown(const PlyLayout &layout, size_t from, size_t to, size_t count)
+  {
+    std::move(starts.begin() + from, starts.begin() + from + count, starts.begin() + to);
+    std::move(ends.begin() + from, ends.begin() + from + count, ends.begin() + to);
+    std::move(times.begin() + from, times.begin() + from + count, times.begin() + to);
+    if (layout.colour_offset != -1)
+      std::move(colours.begin() + from, colours.begin() + from + count, colours.begin() + to);
+    if (layout.intensity_offset != -1)
+      std::move(intensities.begin() + from, intensities.begin() + from + count, intensities.begin() + to);
+  }
+  void clear()
+  {
+    starts.clear();
+    ends.clear();
+    times.clear();
+    colours.clear();
+    intensities.clear();
+    warning = PlyWarning();
+  }
+};
+
+/// number of rows decoded as a single parallel work item
+const size_t kDecodeBlockRows = 1 << 16;
+
+/// reads a value of type T from a (possibly unaligned) location in the row
+template <class T>
+inline T readValue(const unsigned char *row, int offset)
+{
+  T value;
+  memcpy(&value, row + offset, sizeof(T));
+  return value;
+}
+
+/// reads a 3-vector stored as either floats or doubles
+inline Eigen::Vector3d readVector3(const unsigned char *row, int offset, bool is_float)
+{
+  if (is_float)
+  {
+    float v[3];
+    memcpy(v, row + offset, sizeof(v));
+    return Eigen::Vector3d(v[0], v[1], v[2]);
+  }
+  Eigen::Vector3d v;
+  memcpy(v.data(), row + offset, sizeof(double) * 3);
+  return v;
+}
+
+/// sets @c warning if the end point of row @c i is NaN or suspiciously large
+void checkEnd(const Eigen::Vector3d &end, bool end_valid, size_t i, PlyWarning &warning)
+{
+  if (end_valid && std::abs(end[0]) <= 100000.0)
+  {
+    return;
+  }
+  std::stringstream message;
+  if (!end_valid)
+  {
+    message << "warning, NANs in point " << i << ", removing all NANs.";
+  }
+  else if (std::abs(end[0]) > 100000.0)
+  {
+    message << "warning: very large data in point " << i << ", suspicious: " << end.transpose();
+  }
+  warning.message = message.str();
+}
+
+/// sets @c warning if the start offset (stored in the normal field) of row @c i is NaN or suspiciously large
+void checkNormal(const Eigen::Vector3d &normal, bool norm_valid, size_t i, PlyWarning &warning)
+{
+  if (norm_valid && std::abs(normal[0]) <= 100000.0)
+  {
+    return;
+  }
+  std::stringstream message;
+  if (!norm_valid)
+  {
+    message << "warning, NANs in raystart stored in normal " << i << ", removing all such rays.";
+  }
+  else if (std::abs(normal[0]) > 100000.0)
+  {
+    message << "Error: very large ray length in ray index " << i << " " << normal.transpose() << ", bad input."
+            << std::endl;
+    message << "Use rayexport then rayimport the exported point cloud with a fixed trajectory file";
+    warning.is_error = true;
+  }
+  warning.message = message.str();
+}
+
+/// Decode @c count consecutive rows starting at file row @c first_row, writing the valid rays into @c chunk from index
+/// @c out_index onwards. Rays containing NaNs are skipped, so this returns the number of rays written.
+size_t decodeRows(const PlyLayout &layout, bool is_ray_cloud, const unsigned char *rows, size_t first_row, size_t count,
+                  double max_intensity, PlyChunk &chunk, size_t out_index, PlyWarning &warning)
+{
+  size_t j = out_index;
+  for (size_t r = 0; r < count; r++)
+  {
+    const unsigned char *row = rows + r * layout.row_size;
+    const size_t i = first_row + r;
+    Eigen::Vector3d end = readVector3(row, layout.offset, layout.pos_is_float);
+    bool end_valid = end == end;
+    if (warning.message.empty())
+      checkEnd(end, end_valid, i, warning);
+    if (!end_valid)
+      continue;
+
+    Eigen::Vector3d normal(0, 0, 0);
+    if (is_ray_cloud)
+    {
+      normal = readVector3(row, layout.normal_offset, layout.normal_is_float);
+      bool norm_valid = normal == normal;
+      if (warning.message.empty())
+        checkNormal(normal, norm_valid, i, warning);
+      if (!norm_valid)
+        continue;
+    }
+
+    chunk.starts[j] = end + normal;
+    chunk.ends[j] = end;
+    if (layout.time_offset != -1)
+    {
+      if (layout.time_is_float)
+        chunk.times[j] = (double)readValue<float>(row, layout.time_offset);
+      else
+        chunk.times[j] = readValue<double>(row, layout.time_offset);
+    }
+    else
+    {
+      chunk.times[j] = (double)i;  // 1 second per ray, starting at 0
+    }
+
+    if (layout.colour_offset != -1)
+    {
+      chunk.colours[j] = readValue<RGBA>(row, layout.colour_offset);
+    }
+    if (!is_ray_cloud && layout.intensity_offset != -1)
+    {
+      double intensity;
+      if (layout.intensity_type == kDTfloat)
+        intensity = (double)readValue<float>(row, layout.intensity_offset);
+      else if (layout.intensity_type == kDTdouble)
+        intensity = readValue<double>(row, layout.intensity_offset);
+      else  // (intensity_type == kDTushort)
+        intensity = (double)readValue<unsigned short>(row, layout.intensity_offset);
+      if (intensity >= 0.0)
+      {
+        // only intensity exactly 0 will be used for alpha=0 in uint_8 format.
+        intensity = std::ceil(255.0 * clamped(intensity / max_intensity, 0.0, 1.0));
+      }
+      // support for special codes for out of range cases, defined by intensity:
+      // -1 non-return of unknown length
+      // -2 the object is within minimum range, so range is not certain but small
+      // -3 outside maximum range, so range is uncertain but large
+      else if (intensity == -1.0)
+      {
+        intensity = 0.0;
+      }
+      else  // here a range is specified, just low certainty. We choose to this range.
+      {
+        intensity = 1.0;
+      }
+      chunk.intensities[j] = static_cast<uint8_t>(intensity);
+    }
+    j++;
+  }
+  return j - out_index;
+}
+
+/// whether the file's layout is the @c CanonicalRayRow<PosT> layout
+template <class PosT>
+bool matchesCanonicalRayRow(const PlyLayout &layout, bool is_ray_cloud)
+{
+  using Row = CanonicalRayRow<PosT>;
+  return is_ray_cloud && layout.row_size == Row::kRowSize && layout.offset == 0 &&
+         layout.pos_is_float == std::is_same<PosT, float>::value && layout.time_offset == Row::kTimeOffset &&
+         !layout.time_is_float && layout.normal_offset == Row::kNormalOffset && layout.normal_is_float &&
+         layout.colour_offset == Row::kColourOffset;
+}
+
+/// Specialisation of @c decodeRows for the @c CanonicalRayRow layout. With the offsets and types fixed at compile time
+/// the loop is straight-line code. Every row is copied, and the output index only advances past valid rays, so NaN
+/// rays are overwritten rather than branched around.
+template <class PosT>
+size_t decodeCanonicalRows(const PlyLayout &, bool, const unsigned char *rows, size_t first_row, size_t count, double,
+                           PlyChunk &chunk, size_t out_index, PlyWarning &warning)
+{
+  using Row = CanonicalRayRow<PosT>;
+  Eigen::Vector3d *starts = chunk.starts.data() + out_index;
+  Eigen::Vector3d *ends = chunk.ends.data() + out_index;
+  double *times = chunk.times.data() + out_index;
+  RGBA *colours = chunk.colours.data() + out_index;
+  size_t j = 0;
+  for (size_t r = 0; r < count; r++)
+  {
+    Eigen::Vector3d normal;
+    Row::decode(rows + r * Row::kRowSize, ends[j], normal, times[j], colours[j]);
+    const Eigen::Vector3d &end = ends[j];
+    starts[j] = end + normal;
+
+    const bool end_valid = end == end;
+    const bool norm_valid = normal == normal;
+    if (!(end_valid && norm_valid && std::abs(end[0]) <= 100000.0 && std::abs(normal[0]) <= 100000.0) &&
+        warning.message.empty())
+    {
+      checkEnd(end, end_valid, first_row + r, warning);
+      if (end_valid && warning.message.empty())
+        checkNormal(normal, norm_valid, first_row + r, warning);
+    }
+    j += (end_valid && norm_valid) ? 1 : 0;
+  }
+  return j;
+}
+
+/// whether the file's layout is the @c CanonicalPointRow<PosT> layout
+template <class PosT>
+bool matchesCanonicalPointRow(const PlyLayout &layout, bool is_ray_cloud)
+{
+  using Row = CanonicalPointRow<PosT>;
+  return !is_ray_cloud && layout.row_size == Row::kRowSize && layout.offset == 0 &&
+         layout.pos_is_float == std::is_same<PosT, float>::value && layout.time_offset == Row::kTimeOffset &&
+         !layout.time_is_float && layout.colour_offset == Row::kColourOffset && layout.intensity_offset == -1;
+}
+
+/// Specialisation of @c decodeRows for the @c CanonicalPointRow layout, as @c decodeCanonicalRows is for rays.
+/// The start of each ray is its end point.
+template <class PosT>
+size_t decodeCanonicalPointRows(const PlyLayout &, bool, const unsigned char *rows, size_t first_row, size_t count,
+                                double, PlyChunk &chunk, size_t out_index, PlyWarning &warning)
+{
+  using Row = CanonicalPointRow<PosT>;
+  Eigen::Vector3d *starts = chunk.starts.data() + out_index;
+  Eigen::Vector3d *ends = chunk.ends.data() + out_index;
+  double *times = chunk.times.data() + out_index;
+  RGBA *colours = chunk.colours.data() + out_index;
+  size_t j = 0;
+  for (size_t r = 0; r < count; r++)
+  {
+    Row::decode(rows + r * Row::kRowSize, ends[j], times[j], colours[j]);
+    const Eigen::Vector3d &end = ends[j];
+    starts[j] = end;
+
+    const bool end_valid = end == end;
+    if (!(end_valid && std::abs(end[0]) <= 100000.0) && warning.message.empty())
+    {
+      checkEnd(end, end_valid, first_row + r, warning);
+    }
+    j += end_valid ? 1 : 0;
+  }
+  return j;
+}
+
+/// signature shared by the row decoders
+using RowDecoder = size_t (*)(const PlyLayout &layout, bool is_ray_cloud, const unsigned char *rows, size_t first_row,
+                              size_t count, double max_intensity, PlyChunk &chunk, size_t out_index,
+                              PlyWarning &warning);
+
+/// Choose the row decoder for the file once, from its header. The canonical layouts get a specialised decoder,
+/// and anything else uses the general @c decodeRows
+RowDecoder selectRowDecoder(const PlyLayout &layout, bool is_ray_cloud)
+{
+  if (matchesCanonicalRayRow<float>(layout, is_ray_cloud))
+  {
+    return &decodeCanonicalRows<float>;
+  }
+  if (matchesCanonicalRayRow<double>(layout, is_ray_cloud))
+  {
+    return &decodeCanonicalRows<double>;
+  }
+  if (matchesCanonicalPointRow<float>(layout, is_ray_cloud))
+  {
+    return &decodeCanonicalPointRows<float>;
+  }
+  if (matchesCanonicalPointRow<double>(layout, is_ray_cloud))
+  {
+    return &decodeCanonicalPointRows<double>;
+  }
+  return &decodeRows;
+}
+
+/// Decode @c count rows starting at file row @c first_row, appending the valid rays to @c chunk.
+/// The rows are split into blocks which are decoded concurrently when @c parallel is set. Each block writes into its
+/// own range of the output, and the ranges are then closed up in block order, so the rays stay in file order.
+/// If the rows are in @c mapped_file then each block's pages are released once it is decoded.
+void decodeRowsParallel(RowDecoder decode_rows, const PlyLayout &layout, bool is_ray_cloud, const unsigned char *rows,
+                        size_t first_row, size_t count, double max_intensity, PlyChunk &chunk, bool parallel,
+                        const MappedFile *mapped_file = nullptr)
+{
+  const size_t out_index = chunk.ends.size();
+  chunk.resize(layout, out_index + count);
+  const size_t num_blocks = (count + kDecodeBlockRows - 1) / kDecodeBlockRows;
+  std::vector<size_t> written(num_blocks);
+  std::vector<PlyWarning> warnings(num_blocks);
+  const auto decode_block = [&](size_t b) {
+    const size_t block_start = b * kDecodeBlockRows;
+    const size_t block_count = std::min(kDecodeBlockRows, count - block_start);
+    const unsigned char *block_rows = rows + block_start * layout.row_size;
+    written[b] = decode_rows(layout, is_ray_cloud, block_rows, first_row + block_start, block_count, max_intensity,
+                             chunk, out_index + block_start, warnings[b]);
+    if (mapped_file)
+    {
+      mapped_file->release(static_cast<size_t>(block_rows - mapped_file->data()),
+                           block_count * static_cast<size_t>(layout.row_size));
+    }
+  };
+  if (parallel)
+  {
+    parallelFor(0, num_blocks, decode_block, 1);
+  }
+  else
+  {
+    for (size_t b = 0; b < num_blocks; b++) decode_block(b);
+  }
+
+  size_t end_index = out_index;
+  for (size_t b = 0; b < num_blocks; b++)
+  {
+    const size_t block_index = out_index + b * kDecodeBlockRows;
+    if (end_index != block_index)
+    {
+      chunk.moveDown(layout, block_index, end_index, written[b]);
+    }
+    end_index += written[b];
+    if (chunk.warning.message.empty())
+    {
+      chunk.warning = warnings[b];
+    }
+  }
+  chunk.resize(layout, end_index);
+}
+
+/// Supplies decoded chunks in file order. With @c max_in_flight greater than zero, a background thread decodes up
+/// to that many chunks ahead of the consumer, so that file reading and decoding overlap with the processing of
+/// the current chunk. With zero, each chunk is decoded on demand in @c next().
+class ChunkReadAhead
+{
+public:
+  using DecodeFunction = std::function<void(size_t chunk_index, PlyChunk &chunk)>;
+
+  ChunkReadAhead(size_t num_chunks, size_t max_in_flight, DecodeFunction decode)
+    : decode_(decode)
+    , num_chunks_(num_chunks)
+    , chunks_(std::max<size_t>(1, std::min(num_chunks, max_in_flight + 1)))
+  {
+    for (auto &chunk : chunks_)
+    {
+      free_.push_back(&chunk);
+    }
+    if (max_in_flight > 0 && num_chunks > 1)
+    {
+      thread_ = std::thread(&ChunkReadAhead::run, this);
+    }
+  }
+  ~ChunkReadAhead()
+  {
+    if (thread_.joinable())
+    {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        quit_ = true;
+      }
+      changed_.notify_all();
+      thread_.join();
+    }
+  }
+
+  /// The next decoded chunk in file order. It must be handed back with @c recycle() before the following call.
+  PlyChunk &next()
+  {
+    if (!thread_.joinable())
+    {
+      PlyChunk &chunk = chunks_[0];
+      decode_(next_index_++, chunk);
+      return chunk;
+    }
+    std::unique_lock<std::mutex> lock(mutex_);
+    changed_.wait(lock, [this] { return !ready_.empty() || error_; });
+    if (error_)
+    {
+      std::rethrow_exception(error_);
+    }
+    PlyChunk *chunk = ready_.front();
+    ready_.pop_front();
+    return *chunk;
+  }
+  /// return a chunk's buffers for the decoding of a later chunk
+  void recycle(PlyChunk &chunk)
+  {
+    chunk.clear();
+    if (thread_.joinable())
+    {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        free_.push_back(&chunk);
+      }
+      changed_.notify_all();
+    }
+  }
+
+private:
+  void run()
+  {
+    try
+    {
+      for (size_t i = 0; i < num_chunks_; i++)
+      {
+        PlyChunk *chunk;
+        {
+          std::unique_lock<std::mutex> lock(mutex_);
+          changed_.wait(lock, [this] { return !free_.empty() || quit_; });
+          if (quit_)
+          {
+            return;
+          }
+          chunk = free_.front();
+          free_.pop_front();
+        }
+        decode_(i, *chunk);
+        {
+          std::lock_guard<std::mutex> lock(mutex_);
+          ready_.push_back(chunk);
+        }
+        changed_.notify_all();
+      }
+    }
+    catch (...)  // e.g. std::bad_alloc, which is passed on to the consumer
+    {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        error_ = std::current_exception();
+      }
+      changed_.notify_all();
+    }
+  }
+
+  DecodeFunction decode_;
+  size_t num_chunks_;
+  size_t next_index_ = 0;
+  std::vector<PlyChunk> chunks_;
+  std::deque<PlyChunk *> free_;
+  std::deque<PlyChunk *> ready_;
+  std::mutex mutex_;
+  std::condition_variable changed_;
+  bool quit_ = false;
+  std::exception_ptr error_;
+  std::thread thread_;
+};
+}  // namespace
+
 bool readPly(const std::string &file_name, bool is_ray_cloud,
              std::function<void(std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends,
                                 std::vector<double> &times, std::vector<RGBA> &colours)>
-               apply, 
-             double max_intensity, bool times_optional, size_t chunk_size)
+               apply,
+             double max_intensity, bool times_optional, size_t chunk_size, const PlyReadOptions &options)
 {
   std::cout << "reading: " << file_name << std::endl;
+  if (!options.exact_chunk_size)
+  {
+    chunk_size = Memory::chunkSize(chunk_size);
+  }
   std::ifstream input(file_name.c_str(), std::ios::in | std::ios::binary);
   if (input.fail())
   {
@@ -340,13 +962,7 @@ bool readPly(const std::string &file_name, bool is_ray_cloud,
     return false;
   }
   std::string line;
-  int row_size = 0;
-  int offset = -1, normal_offset = -1, time_offset = -1, colour_offset = -1;
-  int intensity_offset = -1;
-  bool time_is_float = false;
-  bool pos_is_float = false;
-  bool normal_is_float = false;
-  DataType intensity_type = kDTnone;
+  PlyLayout layout;
   int rowsteps[] = { int(sizeof(float)), int(sizeof(double)), int(sizeof(unsigned short)), int(sizeof(unsigned char)), int(sizeof(int)),
                      0 };  // to match each DataType enum
 
@@ -378,77 +994,71 @@ bool readPly(const std::string &file_name, bool is_ray_cloud,
 
     if (line == "property float x" || line == "property double x")
     {
-      offset = row_size;
+      layout.offset = layout.row_size;
       if (line.find("float") != std::string::npos)
-        pos_is_float = true;
+        layout.pos_is_float = true;
     }
     if (line == "property float rayx" || line == "property double rayx")
     {
 #if RAYLIB_WITH_NORMAL_FIELD
-      if (normal_offset == -1)
+      if (layout.normal_offset == -1)
 #endif
       {
-        normal_offset = row_size;
-        normal_is_float = line.find("float") != std::string::npos;
+        layout.normal_offset = layout.row_size;
+        layout.normal_is_float = line.find("float") != std::string::npos;
       }
     }
     if (line == "property float nx" || line == "property double nx")
     {
 #if !RAYLIB_WITH_NORMAL_FIELD
-      if (normal_offset == -1)
+      if (layout.normal_offset == -1)
 #endif
       {
-        normal_offset = row_size;
-        normal_is_float = line.find("float") != std::string::npos;
+        layout.normal_offset = layout.row_size;
+        layout.normal_is_float = line.find("float") != std::string::npos;
       }
     }
     if (line.find("time") != std::string::npos)
     {
-      time_offset = row_size;
+      layout.time_offset = layout.row_size;
       if (line.find("float") != std::string::npos)
-        time_is_float = true;
+        layout.time_is_float = true;
     }
     if (line.find("intensity") != std::string::npos)
     {
-      intensity_offset = row_size;
-      intensity_type = data_type;
+      layout.intensity_offset = layout.row_size;
+      layout.intensity_type = data_type;
     }
     if (line == "property uchar red" || line == "property uint8 red")
-      colour_offset = row_size;
+      layout.colour_offset = layout.row_size;
 
-    row_size += rowsteps[data_type];
+    layout.row_size += rowsteps[data_type];
   }
-  if (offset == -1)
+  if (layout.offset == -1)
   {
     std::cerr << "could not find position properties of file: " << file_name << std::endl;
     return false;
   }
-  if (is_ray_cloud && normal_offset == -1)
+  if (is_ray_cloud && layout.normal_offset == -1)
   {
     std::cerr << "could not find normal properties of file: " << file_name << std::endl;
     std::cerr << "ray clouds store the ray starts using the normal field" << std::endl;
     return false;
   }
 
-  std::streampos start = input.tellg();
+  const size_t header_length = static_cast<size_t>(input.tellg());
   input.seekg(0, input.end);
-  size_t length = input.tellg() - start;
-  input.seekg(start);
+  size_t length = static_cast<size_t>(input.tellg()) - header_length;
+  input.seekg(header_length);
+  const size_t row_size = static_cast<size_t>(layout.row_size);
   size_t size = length / row_size;
 
-  ray::Progress progress;
-  ray::ProgressThread progress_thread(progress);
-  size_t num_chunks = (size + (chunk_size - 1)) / chunk_size;
-  progress.begin("read and process", num_chunks);
-
-  std::vector<unsigned char> vertices(row_size);
-  bool warning_set = false;
   if (size == 0)
   {
     std::cerr << "no entries found in ply file" << std::endl;
     return false;
   }
-  if (time_offset == -1)
+  if (layout.time_offset == -1)
   {
     if (times_optional)
     {
@@ -460,14 +1070,14 @@ bool readPly(const std::string &file_name, bool is_ray_cloud,
       return false;
     }
   }
-  if (colour_offset == -1)
+  if (layout.colour_offset == -1)
   {
     std::cout << "warning: no colour information found in " << file_name
               << ", setting colours red->green->blue based on time" << std::endl;
   }
-  if (!is_ray_cloud && intensity_offset != -1)
+  if (!is_ray_cloud && layout.intensity_offset != -1)
   {
-    if (colour_offset != -1)
+    if (layout.colour_offset != -1)
     {
       std::cout << "warning: intensity and colour information both found in file. Replacing alpha with intensity value."
                 << std::endl;
@@ -479,103 +1089,100 @@ bool readPly(const std::string &file_name, bool is_ray_cloud,
     }
   }
 
-  // pre-reserving avoids memory fragmentation
-  std::vector<Eigen::Vector3d> ends;
-  std::vector<Eigen::Vector3d> starts;
-  std::vector<double> times;
-  std::vector<ray::RGBA> colours;
-  std::vector<uint8_t> intensities;
-  size_t reserve_size = std::min(chunk_size, size);
-  ends.reserve(reserve_size);
-  starts.reserve(reserve_size);
-  if (time_offset != -1)
-    times.reserve(reserve_size);
-  if (colour_offset != -1)
-    colours.reserve(reserve_size);
-  if (intensity_offset != -1)
-    intensities.reserve(reserve_size);
-  bool any_returns = false;
-  int identical_times = 0;
-  double last_time = std::numeric_limits<double>::lowest();
-  double last_unique_time = std::numeric_limits<double>::lowest();
-  
-  for (size_t i = 0; i < size; i++)
+  // the body is decoded directly from the mapped pages where possible, otherwise it is read in blocks of rows
+  MappedFile mapped_file;
+  const unsigned char *body = nullptr;
+  if (options.memory_map && mapped_file.open(file_name) && mapped_file.size() >= header_length + size * row_size)
   {
-    input.read((char *)&vertices[0], row_size);
-    Eigen::Vector3d end;
-    if (pos_is_float)
-    {
-      Eigen::Vector3f e = (Eigen::Vector3f &)vertices[offset];
-      end = Eigen::Vector3d(e[0], e[1], e[2]);
-    }
-    else
+    mapped_file.adviseSequential();
+    body = mapped_file.data() + header_length;
+  }
+  const size_t read_rows = std::max<size_t>(1, (size_t(1) << 26) / row_size);  // 64 MB reads when not memory mapped
+  std::vector<unsigned char> buffer;
+
+  ray::Progress progress;
+  ray::ProgressThread progress_thread(progress);
+
+  // the first row and number of rows of each chunk
+  std::vector<std::pair<size_t, size_t>> chunk_rows;
+  auto add_chunks = [&chunk_rows, chunk_size](size_t first, size_t last) {
+    for (size_t row = first; row < last; row += chunk_size)
     {
-      end = (Eigen::Vector3d &)vertices[offset];
+      chunk_rows.emplace_back(row, std::min(chunk_size, last - row));
     }
-    bool end_valid = end == end;
-    if (!warning_set)
+  };
+  if (options.row_ranges.empty())
+  {
+    add_chunks(0, size);
+  }
+  else
+  {
+    // merge overlapping and adjacent ranges, so that the chunks are as large as possible
+    std::vector<std::pair<size_t, size_t>> ranges = options.row_ranges;
+    std::sort(ranges.begin(), ranges.end());
+    size_t first = 0, last = 0;
+    for (const auto &range : ranges)
     {
-      if (!end_valid)
-      {
-        std::cout << "warning, NANs in point " << i << ", removing all NANs." << std::endl;
-        warning_set = true;
-      }
-      if (std::abs(end[0]) > 100000.0)
+      if (range.first > last)
       {
-        std::cout << "warning: very large data in point " << i << ", suspicious: " << end.transpose() << std::endl;
-        warning_set = true;
+        add_chunks(first, last);
+        first = range.first;
       }
+      last = std::max(last, std::min(range.second, size));
     }
-    if (!end_valid)
-      continue;
+    add_chunks(first, last);
+  }
+  const size_t num_chunks = chunk_rows.size();
+  progress.begin("read and process", num_chunks);
 
-    Eigen::Vector3d normal(0, 0, 0);
-    if (is_ray_cloud)
+  // the decoder is chosen once per file, so that the common layouts avoid per-row branching on the field types
+  const RowDecoder row_decoder = selectRowDecoder(layout, is_ray_cloud);
+  // decodes the rows of one chunk. The rows within the chunk are decoded in parallel
+  auto decode_chunk = [&](size_t chunk_index, PlyChunk &chunk) {
+    const size_t first_row = chunk_rows[chunk_index].first;
+    const size_t num_rows = chunk_rows[chunk_index].second;
+    chunk.reserve(layout, num_rows);
+    if (body)
     {
-      if (normal_is_float)
-      {
-        Eigen::Vector3f n = (Eigen::Vector3f &)vertices[normal_offset];
-        normal = Eigen::Vector3d(n[0], n[1], n[2]);
-      }
-      else
-      {
-        normal = (Eigen::Vector3d &)vertices[normal_offset];
-      }
-      bool norm_valid = normal == normal;
-      if (!warning_set)
+      // the decoded rows are released as they go, so a large chunk doesn't hold the whole mapped file in memory
+      decodeRowsParallel(row_decoder, layout, is_ray_cloud, body + first_row * row_size, first_row, num_rows,
+                         max_intensity, chunk, options.parallel_decode, &mapped_file);
+    }
+    else
+    {
+      input.seekg(header_length + first_row * row_size);
+      for (size_t r = 0; r < num_rows; r += read_rows)
       {
-        if (!norm_valid)
-        {
-          std::cout << "warning, NANs in raystart stored in normal " << i << ", removing all such rays." << std::endl;
-          warning_set = true;
-        }
+        const size_t count = std::min(read_rows, num_rows - r);
+        buffer.resize(count * row_size);
+        input.read((char *)buffer.data(), buffer.size());
+        decodeRowsParallel(row_decoder, layout, is_ray_cloud, buffer.data(), first_row + r, count, max_intensity,
+                           chunk, options.parallel_decode);
       }
-      if (!norm_valid)
-        continue;
-      if (std::abs(normal[0]) > 100000.0 && !warning_set)
-      {
-        std::cerr << "Error: very large ray length in ray index " << i << " " << normal.transpose() << ", bad input." << std::endl;
-        std::cerr << "Use rayexport then rayimport the exported point cloud with a fixed trajectory file" << std::endl;
-        warning_set = true;
-      }        
     }
+  };
+  ChunkReadAhead read_ahead(num_chunks, options.read_ahead_chunks, decode_chunk);
 
-    starts.push_back(end + normal);
-    ends.push_back(end);
-    if (time_offset != -1)
+  bool warning_set = false;
+  bool any_returns = false;
+  int identical_times = 0;
+  double last_time = std::numeric_limits<double>::lowest();
+  double last_unique_time = std::numeric_limits<double>::lowest();
+
+  // chunks are finalised and passed to apply in file order
+  for (size_t c = 0; c < num_chunks; c++)
+  {
+    PlyChunk &chunk = read_ahead.next();
+    if (!warning_set && !chunk.warning.message.empty())
     {
-      double time;
-      if (time_is_float)
-      {
-        time = (double)((float &)vertices[time_offset]);
-      }
-      else
-      {  
-        time = (double &)vertices[time_offset];
-      }
-      if (!is_ray_cloud)
+      (chunk.warning.is_error ? std::cerr : std::cout) << chunk.warning.message << std::endl;
+      warning_set = true;
+    }
+    if (!is_ray_cloud && layout.time_offset != -1)
+    {
+      for (auto &time : chunk.times)
       {
-        if (time==last_unique_time)
+        if (time == last_unique_time)
         {
           const double time_delta = 1e-6; // this is a sufficient difference for rayrestore (see time_eps in rayrestore.cpp)
           time = last_time + time_delta;
@@ -587,108 +1194,55 @@ bool readPly(const std::string &file_name, bool is_ray_cloud,
         }
         last_time = time;
       }
-      times.push_back(time);
     }
-
-    if (colour_offset != -1)
+    if (layout.colour_offset == -1)
     {
-      RGBA colour = (RGBA &)vertices[colour_offset];
-      colours.push_back(colour);
+      colourByTime(chunk.times, chunk.colours);
     }
     if (!is_ray_cloud)
     {
-      if (intensity_offset != -1)
+      std::vector<RGBA> &colours = chunk.colours;
+      if (layout.intensity_offset != -1)
       {
-        double intensity;
-        if (intensity_type == kDTfloat)
-          intensity = (double)((float &)vertices[intensity_offset]);
-        else if (intensity_type == kDTdouble)
-          intensity = (double &)vertices[intensity_offset];
-        else  // (intensity_type == kDTushort)
-          intensity = (double)((unsigned short &)vertices[intensity_offset]);
-        if (intensity >= 0.0)
-        {
-          // only intensity exactly 0 will be used for alpha=0 in uint_8 format.
-          intensity = std::ceil(255.0 * clamped(intensity / max_intensity, 0.0, 1.0));  
-        }
-        // support for special codes for out of range cases, defined by intensity:
-        // -1 non-return of unknown length
-        // -2 the object is within minimum range, so range is not certain but small
-        // -3 outside maximum range, so range is uncertain but large
-        else if (intensity == -1.0) 
+        for (size_t j = 0; j < chunk.intensities.size(); j++)
         {
-          intensity = 0.0;
-        }
-        else // here a range is specified, just low certainty. We choose to this range.
-        {
-          intensity = 1.0;
-        }
-        intensities.push_back(static_cast<uint8_t>(intensity));
-      }
-    }
-    if (ends.size() == chunk_size || i == size - 1)
-    {
-      if (time_offset == -1)
-      {
-        times.resize(ends.size());
-        for (size_t j = 0; j < times.size(); j++) 
-        {
-          times[j] = (double)(i + j);
+          colours[j].alpha = chunk.intensities[j];
+          // colour zero-intensity rays black. This is a helpful debug tool.
+          if (chunk.intensities[j] == 0)
+          {
+            colours[j].red = colours[j].green = colours[j].blue = 0;
+          }
+          else
+          {
+            any_returns = true;
+          }
         }
       }
-      if (colour_offset == -1)
-      {
-        colourByTime(times, colours);
-      }
-      if (!is_ray_cloud)
+      else
       {
-        if (intensity_offset != -1)
+        for (size_t j = 0; j < colours.size(); j++)
         {
-          for (size_t j = 0; j < intensities.size(); j++)
+          if (colours[j].alpha == 0)
           {
-            colours[j].alpha = intensities[j];
             // colour zero-intensity rays black. This is a helpful debug tool.
-            if (intensities[j] == 0)
-            {
-              colours[j].red = colours[j].green = colours[j].blue = 0;
-            }
-            else
-            {
-              any_returns = true;
-            }
+            colours[j].red = colours[j].green = colours[j].blue = 0;
           }
-        }
-        else
-        {
-          for (size_t j = 0; j < colours.size(); j++)
+          else
           {
-            if (colours[j].alpha == 0)
-            {
-              // colour zero-intensity rays black. This is a helpful debug tool.
-              colours[j].red = colours[j].green = colours[j].blue = 0;
-            }
-            else
-            {
-              any_returns = true;
-            }
+            any_returns = true;
           }
         }
       }
-      apply(starts, ends, times, colours);
-      starts.clear();
-      ends.clear();
-      times.clear();
-      colours.clear();
-      intensities.clear();
-      progress.increment();
-
-      if (!is_ray_cloud && i==size-1 && identical_times > 0)
-      {
-        std::cout << std::endl;
-        std::cout << "warning: " << identical_times << "/" << size << " rays have identical times," << std::endl;
-        std::cout << "since rayrestore relies on unique time stamps, a 1 microsecond increment has been applied for these times." << std::endl;
-      }
     }
+    apply(chunk.starts, chunk.ends, chunk.times, chunk.colours);
+    read_ahead.recycle(chunk);
+    progress.increment();
+  }
+  if (!is_ray_cloud && identical_times > 0)
+  {
+    std::cout << std::endl;
+    std::cout << "warning: " << identical_times << "/" << size << " rays have identical times," << std::endl;
+    std::cout << "since rayrestore relies on unique time stamps, a 1 microsecond increment has been applied for these times." << std::endl;
   }
   progress.end();
   progress_thread.requestQuit();
@@ -709,16 +1263,25 @@ bool readPly(const std::string &file_name, std::vector<Eigen::Vector3d> &starts,
              std::vector<double> &times, std::vector<RGBA> &colours, bool is_ray_cloud, double max_intensity)
 {
   // Note: this lambda function assumes that the passed in vectors are end-of-life, and can be moved
-  // this is true for the readPly function, with maximum chunk size.
+  // this is true for the readPly function, with maximum chunk size. The single chunk is decoded into vectors reserved
+  // at the size in the file header, so moving them out leaves no second copy of the cloud
   auto apply = [&](std::vector<Eigen::Vector3d> &start_points, std::vector<Eigen::Vector3d> &end_points,
                    std::vector<double> &time_points, std::vector<RGBA> &colour_values) 
   {
+    if (ends.empty())
+    {
+      starts.swap(start_points);
+      ends.swap(end_points);
+      times.swap(time_points);
+      colours.swap(colour_values);
+      return;
+    }
     starts.insert(starts.end(), start_points.begin(), start_points.end());
     ends.insert(ends.end(), end_points.begin(), end_points.end());
     times.insert(times.end(), time_points.begin(), time_points.end());
     colours.insert(colours.end(), colour_values.begin(), colour_values.end());
   };
-  return readPly(file_name, is_ray_cloud, apply, max_intensity, std::numeric_limits<size_t>::max());
+  return readPly(file_name, is_ray_cloud, apply, max_intensity, true, std::numeric_limits<size_t>::max());
 }
 
 bool writePlyMesh(const std::string &file_name, const Mesh &mesh, bool flip_normals)
@@ -1013,30 +1576,29 @@ bool readPlyMesh(const std::string &file, Mesh &mesh)
 bool convertCloud(const std::string &in_name, const std::string &out_name,
                   std::function<void(Eigen::Vector3d &start, Eigen::Vector3d &ends, double &time, RGBA &colour)> apply)
 {
-  std::ofstream ofs;
-  if (!writeRayCloudChunkStart(out_name, ofs))
+  // writing on a background thread lets the reading, conversion and writing of successive chunks overlap
+  CloudWriter writer;
+  if (!writer.begin(out_name, 2))
   {
     return false;
   }
-  ray::RayPlyBuffer buffer;
 
-  bool has_warned = false;
   // run the function 'apply' on each ray as it is read in, and write it out, one chunk at a time
-  auto applyToChunk = [&apply, &buffer, &ofs, &has_warned](std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends,
-                                              std::vector<double> &times, std::vector<ray::RGBA> &colours) {
+  auto applyToChunk = [&apply, &writer](std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends,
+                                        std::vector<double> &times, std::vector<ray::RGBA> &colours) {
     for (size_t i = 0; i < ends.size(); i++)
     {
       // We can adjust the applyToChunk arguments directly as they are non-const and their modification doesn't have
       // side effects
       apply(starts[i], ends[i], times[i], colours[i]);
     }
-    ray::writeRayCloudChunk(ofs, buffer, starts, ends, times, colours, has_warned);
+    writer.writeChunk(starts, ends, times, colours);
   };
   if (!ray::readPly(in_name, true, applyToChunk, 0))
   {
     return false;
   }
-  ray::writeRayCloudChunkEnd(ofs);
+  writer.end();
   return true;
 }
 
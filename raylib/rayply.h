@@ -34,6 +34,25 @@ bool RAYLIB_EXPORT readPlyMesh(const std::string &file, class Mesh &mesh);
 /// write a .ply file representing a triangular mesh
 bool RAYLIB_EXPORT writePlyMesh(const std::string &file_name, const class Mesh &mesh, bool flip_normals = false);
 
+/// Options controlling how the chunked @c readPly streams the file
+struct RAYLIB_EXPORT PlyReadOptions
+{
+  /// decode directly from a memory mapping of the file, rather than through stream reads. Falls back to buffered
+  /// stream reads if the file cannot be mapped.
+  bool memory_map = true;
+  /// decode the rows of each chunk on multiple threads. Chunks are still passed to @c apply in file order.
+  bool parallel_decode = true;
+  /// the number of chunks that a background thread may decode ahead of the chunk being processed by @c apply.
+  /// 1 gives double buffering, 0 reads each chunk only once the previous one has been processed.
+  size_t read_ahead_chunks = 1;
+  /// if non-empty, only the rows in these [first, last) ranges are read, for example the parts of the file found by a
+  /// spatial index. Chunks do not cross range boundaries.
+  std::vector<std::pair<size_t, size_t>> row_ranges;
+  /// read exactly @c chunk_size rows at a time, rather than reducing the chunk size to fit the memory limit (see
+  /// Memory::chunkSize). Needed where each chunk must be a fixed set of rows, such as the segments of a CloudIndex.
+  bool exact_chunk_size = false;
+};
+
 /// ready in a ray cloud or point cloud .ply file, and call the @c apply function one chunk at a time,
 /// @c chunk_size is the number of rays to read at one time. This method can be used on large clouds where
 /// the full set of rays is not required to be in memory at one time.
@@ -41,8 +60,9 @@ bool RAYLIB_EXPORT writePlyMesh(const std::string &file_name, const class Mesh &
 bool RAYLIB_EXPORT readPly(const std::string &file_name, bool is_ray_cloud,
                            std::function<void(std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends,
                                               std::vector<double> &times, std::vector<RGBA> &colours)>
-                             apply, 
-                           double max_intensity, bool times_optional = false, size_t chunk_size = 1000000);
+                             apply,
+                           double max_intensity, bool times_optional = false, size_t chunk_size = 1000000,
+                           const PlyReadOptions &options = PlyReadOptions());
 
 
 /// write a .ply file representing a point cloud
@@ -61,6 +81,10 @@ bool RAYLIB_EXPORT writeRayCloudChunk(std::ofstream &out, RayPlyBuffer &vertices
                                       const std::vector<Eigen::Vector3d> &ends, const std::vector<double> &times,
                                       const std::vector<RGBA> &colours, bool &has_warned);
 unsigned long RAYLIB_EXPORT writeRayCloudChunkEnd(std::ofstream &out);
+/// The start and end of a ray as they are read back after writeRayCloudChunk, which stores them at the precision of
+/// the file. Returns false if the ray is not read back at all, because it contains NaNs.
+bool RAYLIB_EXPORT storedRay(const Eigen::Vector3d &start, const Eigen::Vector3d &end, Eigen::Vector3d &stored_start,
+                             Eigen::Vector3d &stored_end);
 
 /// Chunked version of writePlyPointCloud
 bool RAYLIB_EXPORT writePointCloudChunkStart(const std::string &file_name, std::ofstream &out);
@@ -6,6 +6,7 @@
 #include "rayrenderer.h"
 #include "imagewrite.h"
 #include "raycloud.h"
+#include "raymemory.h"
 #include "raylib/raylibconfig.h"
 #include "rayparse.h"
 #if RAYLIB_WITH_TIFF   // build option to support outputting to geotif (.tif) format
@@ -283,7 +284,8 @@ void DensityGrid::calculateDensities(const std::string &file_name)
       {
         continue; // ray is outside of bounds
       }
-      bounded_ = colours[i].alpha > 0;
+      bounded_ = colours[i].alpha > 0 && (ends[i].array() >= hit_bounds_.min_bound_.array()).all() &&
+                 (ends[i].array() < hit_bounds_.max_bound_.array()).all();
       walkGrid((start - bounds_.min_bound_) / voxel_width_, (end - bounds_.min_bound_) / voxel_width_, *this);
     }
   };
@@ -431,26 +433,61 @@ bool renderCloud(const std::string &cloud_file, const Cuboid &bounds, ViewDirect
 #endif
       Cuboid grid_bounds = bounds;
       grid_bounds.min_bound_ -= Eigen::Vector3d(pix_width, pix_width, pix_width);
-      DensityGrid grid(grid_bounds, pix_width, dims);
+#if DENSITY_MIN_RAYS > 0
+      const int halo = 2;  // the neighbour priors of each layer use the next two layers
+#else
+      const int halo = 0;
+#endif
+      // under a memory limit, a grid that doesn't fit is processed in slabs of layers along the view axis, reading the
+      // cloud once per slab. Each slab has extra halo layers for the neighbour priors of its last layers
+      int slab_layers = depth;
+      const size_t layer_bytes =
+        static_cast<size_t>(dims[ax1]) * static_cast<size_t>(dims[ax2]) * sizeof(DensityGrid::Voxel);
+      const size_t grid_budget = Memory::limit() / 2;
+      if (Memory::limited() && static_cast<size_t>(dims[axis]) * layer_bytes > grid_budget)
+      {
+        slab_layers = std::max(1, static_cast<int>(grid_budget / layer_bytes) - halo);
+        std::cout << "density grid exceeds the memory limit, so calculating it in "
+                  << (depth + slab_layers - 1) / slab_layers << " slabs" << std::endl;
+      }
+      for (int first = 0; first < depth; first += slab_layers)
+      {
+        const int last = std::min(first + slab_layers, depth);
+        Eigen::Vector3i slab_dims = dims;
+        slab_dims[axis] = std::min(last + halo, dims[axis]) - first;
+        Cuboid slab_bounds = grid_bounds;
+        Cuboid hit_bounds(Eigen::Vector3d::Constant(-std::numeric_limits<double>::infinity()),
+                          Eigen::Vector3d::Constant(std::numeric_limits<double>::infinity()));
+        slab_bounds.min_bound_[axis] += first * pix_width;
+        if (first > 0)
+          hit_bounds.min_bound_[axis] = slab_bounds.min_bound_[axis];
+        if (first + slab_dims[axis] < dims[axis])
+        {
+          slab_bounds.max_bound_[axis] = slab_bounds.min_bound_[axis] + slab_dims[axis] * pix_width;
+          hit_bounds.max_bound_[axis] = slab_bounds.max_bound_[axis];
+        }
+        DensityGrid grid(slab_bounds, pix_width, slab_dims);
+        grid.setHitBounds(hit_bounds);
 
-      grid.calculateDensities(cloud_file);
+        grid.calculateDensities(cloud_file);
 
-      grid.addNeighbourPriors();
+        grid.addNeighbourPriors();
 
-      for (int x = 0; x < width; x++)
-      {
-        for (int y = 0; y < height; y++)
+        for (int x = 0; x < width; x++)
         {
-          double total_density = 0.0;
-          for (int z = 0; z < depth; z++)
+          for (int y = 0; y < height; y++)
           {
-            Eigen::Vector3i ind;
-            ind[axis] = z;
-            ind[ax1] = x;
-            ind[ax2] = y;
-            total_density += grid.voxels()[grid.getIndex(ind)].density();
+            double total_density = 0.0;
+            for (int z = first; z < last; z++)
+            {
+              Eigen::Vector3i ind;
+              ind[axis] = z - first;
+              ind[ax1] = x;
+              ind[ax2] = y;
+              total_density += grid.voxels()[grid.getIndex(ind)].density();
+            }
+            pixels[x + width * y] += Eigen::Vector4d(total_density, total_density, total_density, total_density);
           }
-          pixels[x + width * y] = Eigen::Vector4d(total_density, total_density, total_density, total_density);
         }
       }
     }
@@ -527,7 +564,7 @@ bool renderCloud(const std::string &cloud_file, const Cuboid &bounds, ViewDirect
           }
         }
       };
-      if (!Cloud::read(cloud_file, render))
+      if (!Cloud::read(cloud_file, bounds, render))
         return false;
     }
 
@@ -61,6 +61,8 @@ struct RAYLIB_EXPORT DensityGrid
 
   DensityGrid(const Cuboid &grid_bounds, double vox_width, const Eigen::Vector3i &dims)
     : bounds_(grid_bounds)
+    , hit_bounds_(Eigen::Vector3d::Constant(-std::numeric_limits<double>::infinity()),
+                  Eigen::Vector3d::Constant(std::numeric_limits<double>::infinity()))
     , voxel_width_(vox_width)
     , voxel_dims_(dims)
   {
@@ -96,6 +98,9 @@ struct RAYLIB_EXPORT DensityGrid
 
   /// This streams in a ray cloud file, and fills in the voxel density information
   void calculateDensities(const std::string &file_name);
+  /// Only count rays that end within @c hit_bounds as hits, including the minimum bound but not the maximum. This is
+  /// for a grid that is one slab of a larger grid, so that rays ending beyond the slab don't hit its boundary voxels
+  inline void setHitBounds(const Cuboid &hit_bounds) { hit_bounds_ = hit_bounds; }
   /// To void low-ray-count voxels giving unstable density estimates, we fuse with neighbour information
   /// up to a specified minimum number of rays. Specified in DENSITY_MIN_RAYS
   void addNeighbourPriors();
@@ -112,6 +117,7 @@ struct RAYLIB_EXPORT DensityGrid
   inline bool operator()(const Eigen::Vector3i &p, const Eigen::Vector3i &target, double in_length, double out_length, double max_length);
 private:
   Cuboid bounds_;
+  Cuboid hit_bounds_;
   std::vector<Voxel> voxels_;
   double voxel_width_;
   Eigen::Vector3i voxel_dims_;
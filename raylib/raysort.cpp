@@ -0,0 +1,340 @@
+// Copyright (c) 2020
+// Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+// ABN 41 687 119 230
+//
+// Author: Thomas Lowe
+#include "raysort.h"
+#include "raycloud.h"
+#include "raycloudwriter.h"
+#include "raythreads.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <queue>
+
+namespace ray
+{
+namespace
+{
+/// spread the lower 21 bits of @c value out to every third bit
+inline uint64_t spreadBits(uint64_t value)
+{
+  value &= 0x1fffff;
+  value = (value | (value << 32)) & 0x1f00000000ffffull;
+  value = (value | (value << 16)) & 0x1f0000ff0000ffull;
+  value = (value | (value << 8)) & 0x100f00f00f00f00full;
+  value = (value | (value << 4)) & 0x10c30c30c30c30c3ull;
+  value = (value | (value << 2)) & 0x1249249249249249ull;
+  return value;
+}
+
+/// a ray with its sort key, as stored in the run files
+struct KeyedRay
+{
+  uint64_t key;
+  double start[3];
+  double end[3];
+  double time;
+  RGBA colour;
+};
+
+/// the number of rays written to the output at a time
+const size_t kSortChunkSize = 100000;
+/// the smallest block of a run to sort on its own thread
+const size_t kMinSortBlockSize = 65536;
+/// the smallest read buffer of each run being merged, in rays. Merging more runs than fit in the memory limit with
+/// buffers of this size takes more than one pass
+const size_t kMinMergeBufferSize = 4096;
+
+/// stable sort of @c rays by key. Blocks of the rays are sorted in parallel, then merged in pairs, each level of pairs
+/// in parallel. The number of blocks depends only on the number of rays, so the result does not depend on the threads
+void parallelStableSort(std::vector<KeyedRay> &rays)
+{
+  auto less = [](const KeyedRay &a, const KeyedRay &b) { return a.key < b.key; };
+  size_t num_blocks = 1;
+  while (num_blocks < 64 && 2 * num_blocks * kMinSortBlockSize <= rays.size())
+  {
+    num_blocks *= 2;
+  }
+  const size_t block_size = (rays.size() + num_blocks - 1) / num_blocks;
+  auto block = [&](size_t i) { return rays.begin() + std::min(i * block_size, rays.size()); };
+  parallelFor(0, num_blocks, [&](size_t i) { std::stable_sort(block(i), block(i + 1), less); }, 1);
+  for (size_t width = 1; width < num_blocks; width *= 2)
+  {
+    parallelFor(0, num_blocks / (2 * width),
+                [&](size_t i) {
+                  const size_t first = 2 * width * i;
+                  std::inplace_merge(block(first), block(first + width), block(first + 2 * width), less);
+                },
+                1);
+  }
+}
+
+/// reads one sorted run file back a buffer at a time
+class RunReader
+{
+public:
+  bool open(const std::string &file_name, size_t buffer_size)
+  {
+    ifs_.open(file_name, std::ios::binary);
+    buffer_.resize(buffer_size);
+    return ifs_.is_open() && refill();
+  }
+  inline const KeyedRay &front() const { return buffer_[pos_]; }
+  /// move to the next ray, returns false at the end of the run
+  inline bool next() { return ++pos_ < count_ || refill(); }
+
+private:
+  bool refill()
+  {
+    ifs_.read(reinterpret_cast<char *>(buffer_.data()), buffer_.size() * sizeof(KeyedRay));
+    count_ = static_cast<size_t>(ifs_.gcount()) / sizeof(KeyedRay);
+    pos_ = 0;
+    return count_ > 0;
+  }
+  std::ifstream ifs_;
+  std::vector<KeyedRay> buffer_;
+  size_t pos_ = 0;
+  size_t count_ = 0;
+};
+
+/// the name of temporary run file @c index of merge pass @c pass, the initial runs being pass 0
+std::string runFileName(const std::string &out_file, size_t pass, size_t index)
+{
+  return out_file + ".run" + std::to_string(pass) + "_" + std::to_string(index);
+}
+
+/// k-way merge of the sorted runs in @c run_files, passing each ray to @c add in key order. The earlier run is taken on
+/// equal keys, to keep the sort stable. The read buffers of the runs share @c memory_limit bytes
+template <class AddRay>
+bool mergeRuns(const std::vector<std::string> &run_files, size_t memory_limit, AddRay add)
+{
+  std::vector<RunReader> readers(run_files.size());
+  const size_t buffer_size = std::max<size_t>(memory_limit / (sizeof(KeyedRay) * run_files.size()), 1);
+  using Head = std::pair<uint64_t, size_t>;
+  std::priority_queue<Head, std::vector<Head>, std::greater<Head>> heads;
+  for (size_t i = 0; i < readers.size(); i++)
+  {
+    if (!readers[i].open(run_files[i], buffer_size))
+    {
+      std::cerr << "Error: cannot read temporary sort file " << run_files[i] << std::endl;
+      return false;
+    }
+    heads.push(Head(readers[i].front().key, i));
+  }
+  while (!heads.empty())
+  {
+    const size_t i = heads.top().second;
+    heads.pop();
+    add(readers[i].front());
+    if (readers[i].next())
+    {
+      heads.push(Head(readers[i].front().key, i));
+    }
+  }
+  return true;
+}
+
+/// collects rays into chunks for the cloud writer
+class ChunkWriter
+{
+public:
+  explicit ChunkWriter(CloudWriter &writer)
+    : writer_(writer)
+  {}
+  inline void add(const KeyedRay &ray)
+  {
+    chunk_.addRay(Eigen::Vector3d(ray.start[0], ray.start[1], ray.start[2]),
+                  Eigen::Vector3d(ray.end[0], ray.end[1], ray.end[2]), ray.time, ray.colour);
+    if (chunk_.rayCount() == kSortChunkSize)
+    {
+      flush();
+    }
+  }
+  void flush()
+  {
+    writer_.writeChunk(chunk_);
+    chunk_.clear();
+  }
+
+private:
+  CloudWriter &writer_;
+  Cloud chunk_;
+};
+
+/// sort the rays of @c in_file by the key of each ray, into @c out_file
+bool sortFile(const std::string &in_file, const std::string &out_file,
+              const std::function<uint64_t(const Eigen::Vector3d &start, const Eigen::Vector3d &end, double time)> &key,
+              size_t memory_limit)
+{
+  // the merges of a sort need a buffer as large as the run
+  const size_t run_size = std::max<size_t>(memory_limit / (2 * sizeof(KeyedRay)), 1);
+  std::vector<KeyedRay> run;
+  run.reserve(run_size);
+  std::vector<std::string> run_files;
+  bool run_error = false;
+  // stable sort, so rays with equal keys stay in file order
+  auto sort_run = [&run]() { parallelStableSort(run); };
+  auto remove_runs = [&run_files]() {
+    for (auto &name : run_files)
+    {
+      std::remove(name.c_str());
+    }
+  };
+  auto write_run = [&]() {
+    sort_run();
+    const std::string run_file = runFileName(out_file, 0, run_files.size());
+    run_files.push_back(run_file);
+    std::ofstream ofs(run_file, std::ios::binary);
+    ofs.write(reinterpret_cast<const char *>(run.data()), run.size() * sizeof(KeyedRay));
+    if (!ofs)
+    {
+      std::cerr << "Error: cannot write temporary sort file " << run_file << std::endl;
+      run_error = true;
+    }
+    run.clear();
+  };
+  auto add_rays = [&](std::vector<Eigen::Vector3d> &starts, std::vector<Eigen::Vector3d> &ends,
+                      std::vector<double> &times, std::vector<RGBA> &colours) {
+    for (size_t i = 0; i < ends.size() && !run_error; i++)
+    {
+      KeyedRay ray;
+      ray.key = key(starts[i], ends[i], times[i]);
+      std::memcpy(ray.start, starts[i].data(), sizeof(ray.start));
+      std::memcpy(ray.end, ends[i].data(), sizeof(ray.end));
+      ray.time = times[i];
+      ray.colour = colours[i];
+      run.push_back(ray);
+      if (run.size() == run_size)
+      {
+        write_run();
+      }
+    }
+  };
+  if (!Cloud::read(in_file, add_rays) || run_error)
+  {
+    remove_runs();
+    return false;
+  }
+
+  CloudWriter writer;
+  if (!writer.begin(out_file, 2))
+  {
+    remove_runs();
+    return false;
+  }
+  ChunkWriter chunks(writer);
+  if (run_files.empty())
+  {
+    // the whole file fits in one run
+    sort_run();
+    for (auto &ray : run)
+    {
+      chunks.add(ray);
+    }
+    chunks.flush();
+    writer.end();
+    return true;
+  }
+  if (!run.empty())
+  {
+    write_run();
+  }
+  std::vector<KeyedRay>().swap(run);
+  if (run_error)
+  {
+    remove_runs();
+    return false;
+  }
+
+  // merge at most max_runs runs at a time, so that each run's read buffer holds at least kMinMergeBufferSize rays.
+  // When there are more, consecutive groups of runs are first merged into longer runs, which keeps the sort stable
+  const size_t max_runs = std::max<size_t>(memory_limit / (sizeof(KeyedRay) * kMinMergeBufferSize), 2);
+  for (size_t pass = 1; run_files.size() > max_runs; pass++)
+  {
+    std::vector<std::string> merged_files;
+    for (size_t first = 0; first < run_files.size() && !run_error; first += max_runs)
+    {
+      const std::vector<std::string> group(run_files.begin() + first,
+                                           run_files.begin() + std::min(first + max_runs, run_files.size()));
+      const std::string merged_file = runFileName(out_file, pass, merged_files.size());
+      merged_files.push_back(merged_file);
+      std::ofstream ofs(merged_file, std::ios::binary);
+      run_error = !mergeRuns(group, memory_limit, [&ofs](const KeyedRay &ray) {
+        ofs.write(reinterpret_cast<const char *>(&ray), sizeof(KeyedRay));
+      });
+      ofs.close();
+      if (!ofs)
+      {
+        std::cerr << "Error: cannot write temporary sort file " << merged_file << std::endl;
+        run_error = true;
+      }
+    }
+    remove_runs();
+    run_files.swap(merged_files);
+    if (run_error)
+    {
+      remove_runs();
+      return false;
+    }
+  }
+  if (!mergeRuns(run_files, memory_limit, [&chunks](const KeyedRay &ray) { chunks.add(ray); }))
+  {
+    remove_runs();
+    return false;
+  }
+  chunks.flush();
+  writer.end();
+  remove_runs();
+  return true;
+}
+}  // namespace
+
+uint64_t mortonCode(const Eigen::Vector3d &point, const Eigen::Vector3d &min_bound, double voxel_width)
+{
+  // clamped before the conversion to an integer, which could otherwise overflow
+  const double max_index = static_cast<double>((1 << 21) - 1);
+  uint64_t code = 0;
+  for (int axis = 0; axis < 3; axis++)
+  {
+    const double index = std::floor((point[axis] - min_bound[axis]) / voxel_width);
+    const double value = std::max(0.0, std::min(index, max_index));
+    code |= spreadBits(static_cast<uint64_t>(value)) << axis;
+  }
+  return code;
+}
+
+uint64_t timeKey(double time)
+{
+  uint64_t bits;
+  std::memcpy(&bits, &time, sizeof(bits));
+  // flip all the bits of negative numbers and the sign bit of positive ones, so the keys order as the times
+  return (bits & (uint64_t(1) << 63)) ? ~bits : bits | (uint64_t(1) << 63);
+}
+
+bool sortSpatial(const std::string &in_file, const std::string &out_file, double voxel_width, size_t memory_limit)
+{
+  Cloud::Info info;
+  if (!Cloud::getInfo(in_file, info))
+  {
+    return false;
+  }
+  const Eigen::Vector3d min_bound = info.num_bounded > 0 ? info.ends_bound.min_bound_ : Eigen::Vector3d(0, 0, 0);
+  return sortFile(in_file, out_file,
+                  [&min_bound, voxel_width](const Eigen::Vector3d &, const Eigen::Vector3d &end, double) {
+                    return mortonCode(end, min_bound, voxel_width);
+                  },
+                  memory_limit);
+}
+
+bool sortTime(const std::string &in_file, const std::string &out_file, size_t memory_limit)
+{
+  return sortFile(
+    in_file, out_file, [](const Eigen::Vector3d &, const Eigen::Vector3d &, double time) { return timeKey(time); },
+    memory_limit);
+}
+}  // namespace ray
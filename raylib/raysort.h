@@ -0,0 +1,42 @@
+// Copyright (c) 2020
+// Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+// ABN 41 687 119 230
+//
+// Author: Thomas Lowe
+#ifndef RAYLIB_RAYSORT_H
+#define RAYLIB_RAYSORT_H
+
+#include "raylib/raylibconfig.h"
+#include "rayutils.h"
+
+namespace ray
+{
+/// the default memory budget of the file sorts, in bytes
+static const size_t kSortMemoryLimit = size_t(1) << 30;
+
+/// the Morton (Z-order) code of the voxel of width @c voxel_width containing @c point, interleaving 21 bits of each
+/// axis. Voxels are counted from @c min_bound, normally the minimum bound of the cloud's end points, so that the
+/// order of georeferenced clouds far from the origin is kept. Voxels over 2^21 voxels from @c min_bound on an axis
+/// are clamped
+RAYLIB_EXPORT uint64_t mortonCode(const Eigen::Vector3d &point, const Eigen::Vector3d &min_bound, double voxel_width);
+
+/// a key that sorts in the same order as @c time, with negative times first
+RAYLIB_EXPORT uint64_t timeKey(double time);
+
+/// sort the rays of the file @c in_file into @c out_file along a Morton curve of the @c voxel_width voxels containing
+/// their end points, so that rays ending near each other are mostly near each other in the file. The voxels are counted
+/// from the minimum bound of the bounded end points, from the file's cached information (see @c Cloud::getInfo).
+/// The sort is stable and matches @c Cloud::sortSpatial.
+/// This is an external merge sort: the file is read in runs that fit in @c memory_limit bytes, each run is sorted in
+/// parallel and stored in a temporary file next to @c out_file, and the runs are merged into @c out_file. The limit
+/// does not include the buffers of the file reader and writer. A file that fits in one run is sorted in memory.
+bool RAYLIB_EXPORT sortSpatial(const std::string &in_file, const std::string &out_file, double voxel_width,
+                               size_t memory_limit = kSortMemoryLimit);
+
+/// sort the rays of the file @c in_file into @c out_file by time, for example to restore the time order of a spatially
+/// sorted or combined file. The sort is stable, and within @c memory_limit bytes as for @c sortSpatial
+bool RAYLIB_EXPORT sortTime(const std::string &in_file, const std::string &out_file,
+                            size_t memory_limit = kSortMemoryLimit);
+}  // namespace ray
+
+#endif  // RAYLIB_RAYSORT_H
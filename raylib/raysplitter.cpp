@@ -10,6 +10,7 @@
 #include "extraction/rayforest.h"
 #include "raycloudwriter.h"
 #include "raycuboid.h"
+#include "raymemory.h"
 #include "extraction/raytrees.h"
 
 namespace ray
@@ -340,17 +341,26 @@ bool splitGrid(const std::string &file_name, const std::string &cloud_name_stub,
     std::cerr << "error: output of over 50,000 files is probably a mistake, exiting" << std::endl;
     return false;
   }
-  const int max_open_files = 256;
+  // each open cell holds a file buffer and its share of the streamed chunk. Under a memory limit, fewer cells are open
+  // at once and the cloud is read in more passes
+  int max_open_files = 256;
+  if (Memory::limited())
+  {
+    const size_t cell_bytes = 1000000;
+    max_open_files =
+      static_cast<int>(std::max<size_t>(1, std::min<size_t>(max_open_files, Memory::limit() / (2 * cell_bytes))));
+  }
+  const int num_passes = (length + max_open_files - 1) / max_open_files;
   if (length > max_open_files)
   {
     std::cout << "Warning: nominally more than " << max_open_files << " file pointers will be open at once." << std::endl;
-    std::cout << "Diving the operation into " << 1+length/max_open_files << " passes" << std::endl;
+    std::cout << "Diving the operation into " << num_passes << " passes" << std::endl;
   }
   for (int pass = 0; pass<length; pass+=max_open_files)
   {
     if (pass > 0)
     {
-      std::cout << "Running pass " << 1 + pass/max_open_files << " / " << 1+length/max_open_files << std::endl;
+      std::cout << "Running pass " << 1 + pass/max_open_files << " / " << num_passes << std::endl;
     }
     std::vector<CloudWriter> cells(max_open_files);
     std::vector<Cloud> chunks(max_open_files);
@@ -435,7 +445,10 @@ bool splitGrid(const std::string &file_name, const std::string &cloud_name_stub,
         if (chunks[i].ends.size() > 0)
         {
           cells[i].writeChunk(chunks[i]);
-          chunks[i].clear();
+          if (Memory::limited())
+            chunks[i] = Cloud();  // release the cell's chunk memory rather than keeping it for the next chunk
+          else
+            chunks[i].clear();
         }
       }
     };
@@ -5,34 +5,172 @@
 // Author: Kazys Stepanas
 #include "raythreads.h"
 
-#include "rayunused.h"
-
 #if RAYLIB_WITH_TBB
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_for.h>
+#include <tbb/task_arena.h>
 #include <tbb/task_scheduler_init.h>
+#elif RAYLIB_WITH_OPENMP
+#include <omp.h>
+#else  // RAYLIB_WITH_TBB
+#include <condition_variable>
+#include <mutex>
+#include <thread>
 #endif  // RAYLIB_WITH_TBB
 
 using namespace ray;
 
 namespace
 {
+/// the thread count set by Threads::init, or 0 if it has not been called
+int init_thread_count = 0;
+
 #if RAYLIB_WITH_TBB
 std::unique_ptr<tbb::task_scheduler_init> scheduler;
+#else   // RAYLIB_WITH_TBB
+/// the index of this thread in the parallel function that it is running
+thread_local int thread_index = 0;
+/// whether this thread is running a parallel function, in which case nested calls run serially
+thread_local bool in_parallel = false;
+
+/// Marks the calling thread as running part of a parallel function, for its lifetime.
+class ParallelScope
+{
+public:
+  explicit ParallelScope(int index)
+    : previous_index_(thread_index)
+    , previous_in_parallel_(in_parallel)
+  {
+    thread_index = index;
+    in_parallel = true;
+  }
+  ~ParallelScope()
+  {
+    thread_index = previous_index_;
+    in_parallel = previous_in_parallel_;
+  }
+
+private:
+  int previous_index_;
+  bool previous_in_parallel_;
+};
 #endif  // RAYLIB_WITH_TBB
+
+#if !RAYLIB_WITH_TBB && !RAYLIB_WITH_OPENMP
+/// A fixed set of worker threads which, together with the calling thread, run one job at a time.
+class ThreadPool
+{
+public:
+  explicit ThreadPool(int thread_count)
+  {
+    for (int i = 1; i < thread_count; i++)
+    {
+      workers_.emplace_back(&ThreadPool::work, this, i);
+    }
+  }
+  ~ThreadPool()
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      quit_ = true;
+    }
+    start_.notify_all();
+    for (auto &worker : workers_)
+    {
+      worker.join();
+    }
+  }
+
+  /// Run @c job(thread_index) on each thread of the pool, including the calling thread as index 0, and return once all
+  /// have finished. Returns false without running the job if the pool is busy with another caller's job.
+  bool tryRun(const std::function<void(int)> &job)
+  {
+    std::unique_lock<std::mutex> run_lock(run_mutex_, std::try_to_lock);
+    if (!run_lock.owns_lock())
+    {
+      return false;
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      job_ = &job;
+      pending_ = workers_.size();
+      generation_++;
+    }
+    start_.notify_all();
+    job(0);
+    std::unique_lock<std::mutex> lock(mutex_);
+    finished_.wait(lock, [this]() { return pending_ == 0; });
+    job_ = nullptr;
+    return true;
+  }
+
+private:
+  void work(int index)
+  {
+    size_t generation = 0;
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (;;)
+    {
+      start_.wait(lock, [this, generation]() { return quit_ || generation_ != generation; });
+      if (quit_)
+      {
+        return;
+      }
+      generation = generation_;
+      const std::function<void(int)> *job = job_;
+      lock.unlock();
+      (*job)(index);
+      lock.lock();
+      if (--pending_ == 0)
+      {
+        finished_.notify_one();
+      }
+    }
+  }
+
+  std::vector<std::thread> workers_;
+  /// held by the caller whose job is running
+  std::mutex run_mutex_;
+  /// guards the job state below
+  std::mutex mutex_;
+  std::condition_variable start_;
+  std::condition_variable finished_;
+  const std::function<void(int)> *job_ = nullptr;
+  size_t generation_ = 0;
+  size_t pending_ = 0;
+  bool quit_ = false;
+};
+
+std::mutex pool_mutex;
+std::unique_ptr<ThreadPool> pool;
+
+/// the pool of Threads::threadCount() threads, created on first use
+ThreadPool &threadPool()
+{
+  std::lock_guard<std::mutex> lock(pool_mutex);
+  if (!pool)
+  {
+    pool = std::make_unique<ThreadPool>(Threads::threadCount());
+  }
+  return *pool;
+}
+#endif  // !RAYLIB_WITH_TBB && !RAYLIB_WITH_OPENMP
 }  // namespace
 
 int Threads::availableThreads()
 {
 #if RAYLIB_WITH_TBB
   return tbb::task_scheduler_init::default_num_threads();
+#elif RAYLIB_WITH_OPENMP
+  return omp_get_num_procs();
 #else   // RAYLIB_WITH_TBB
-  return 1;  // Single threaded.
+  return std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
 #endif  // RAYLIB_WITH_TBB
 }
 
 
 int Threads::recommendedThreadCount()
 {
-#if RAYLIB_WITH_TBB
   // Thread performance seems to peek between 4-6. For optimal threads, we use at least 2 threads (if available) up to
   // 6 threads. We try to leave one thread free and unused for the system and other processes.
   const int target_thread_count = MaxRecommendedThreads;
@@ -42,30 +180,104 @@ int Threads::recommendedThreadCount()
     thread_count = std::min(thread_count - 1, target_thread_count);
   }
   return thread_count;
+}
+
+
+void Threads::init(int thread_count)
+{
+  if (init_thread_count > 0)
+  {
+    return;
+  }
+  init_thread_count = availableThreads();
+  if (thread_count == ThreadCountRecommended)
+  {
+    init_thread_count = recommendedThreadCount();
+  }
+  else if (thread_count > 0)
+  {
+    init_thread_count = thread_count;
+  }
+#if RAYLIB_WITH_TBB
+  scheduler = std::make_unique<tbb::task_scheduler_init>(init_thread_count);
+#elif RAYLIB_WITH_OPENMP
+  // also caps any OpenMP loops outside of the parallel functions
+  omp_set_num_threads(init_thread_count);
 #else   // RAYLIB_WITH_TBB
-  return 1;  // Single threaded.
+  // the pool is sized on first use, so replace any pool created before the thread count was set
+  std::lock_guard<std::mutex> lock(pool_mutex);
+  pool.reset();
 #endif  // RAYLIB_WITH_TBB
 }
 
 
-void Threads::init(int thread_count)
+int Threads::threadCount()
+{
+  return init_thread_count > 0 ? init_thread_count : availableThreads();
+}
+
+
+int Threads::threadIndex()
 {
 #if RAYLIB_WITH_TBB
-  if (!scheduler)
+  const int index = tbb::this_task_arena::current_thread_index();
+  return index == tbb::task_arena::not_initialized ? 0 : index;
+#else   // RAYLIB_WITH_TBB
+  return thread_index;
+#endif  // RAYLIB_WITH_TBB
+}
+
+
+void ray::parallelForRange(size_t begin, size_t end, size_t grain_size,
+                           const std::function<void(size_t first, size_t last)> &range_func)
+{
+  if (end <= begin)
+  {
+    return;
+  }
+  const size_t count = end - begin;
+  const size_t thread_count = static_cast<size_t>(Threads::threadCount());
+  if (grain_size == 0)
   {
-    // Translate to TBB thread count
-    int init_thread_count = tbb::task_scheduler_init::automatic;
-    if (thread_count == ThreadCountRecommended)
+    // several ranges per thread, to balance uneven work
+    grain_size = std::max<size_t>(1, count / (8 * thread_count));
+  }
+#if RAYLIB_WITH_TBB
+  tbb::parallel_for(tbb::blocked_range<size_t>(begin, end, grain_size),
+                    [&range_func](const tbb::blocked_range<size_t> &range) { range_func(range.begin(), range.end()); });
+#else   // RAYLIB_WITH_TBB
+  const size_t num_ranges = (count + grain_size - 1) / grain_size;
+  if (num_ranges == 1 || thread_count == 1 || in_parallel)
+  {
+    range_func(begin, end);
+    return;
+  }
+  auto run_range = [&](size_t r) { range_func(begin + r * grain_size, std::min(end, begin + (r + 1) * grain_size)); };
+#if RAYLIB_WITH_OPENMP
+  const int num_threads = static_cast<int>(std::min(thread_count, num_ranges));
+  #pragma omp parallel num_threads(num_threads)
+  {
+    ParallelScope scope(omp_get_thread_num());
+    #pragma omp for schedule(dynamic, 1)
+    for (long long r = 0; r < static_cast<long long>(num_ranges); r++)
     {
-      init_thread_count = recommendedThreadCount();
+      run_range(static_cast<size_t>(r));
     }
-    else if (thread_count > 0)
+  }
+#else   // RAYLIB_WITH_OPENMP
+  std::atomic<size_t> next_range(0);
+  const std::function<void(int)> job = [&](int index) {
+    ParallelScope scope(index);
+    for (size_t r = next_range++; r < num_ranges; r = next_range++)
     {
-      init_thread_count = thread_count;
+      run_range(r);
     }
-    scheduler = std::make_unique<tbb::task_scheduler_init>(init_thread_count);
+  };
+  if (!threadPool().tryRun(job))
+  {
+    // another thread is using the pool
+    range_func(begin, end);
   }
-#else   // RAYLIB_WITH_TBB
-  RAYLIB_UNUSED(thread_count);
+#endif  // RAYLIB_WITH_OPENMP
 #endif  // RAYLIB_WITH_TBB
 }
@@ -8,7 +8,15 @@
 
 #include "raylib/raylibconfig.h"
 
+#include <algorithm>
+#include <atomic>
+#include <functional>
 #include <memory>
+#include <vector>
+
+#if RAYLIB_WITH_TBB
+#include <tbb/enumerable_thread_specific.h>
+#endif  // RAYLIB_WITH_TBB
 
 namespace ray
 {
@@ -17,9 +25,9 @@ namespace ray
 /// Typical usage is to call @c init() at the start of your program. This is optional and it not specified, all
 /// available threads will be used.
 ///
-/// Note: some parts of the program may use threads even when Intel TBB is not availabe (via OpenMP).
-///
-/// @todo Also cap OpenMP thread usage.
+/// The thread count applies to all of the parallel functions below, @c parallelFor(), @c parallelReduce() and
+/// @c ThreadLocal, which run on Intel TBB when available, otherwise on OpenMP, otherwise on a built in pool of
+/// std::threads.
 class RAYLIB_EXPORT Threads
 {
 public:
@@ -31,16 +39,173 @@ public:
   /// The maximum number of threads to use for @c recommendedThreadCount() .
   static const int MaxRecommendedThreads = 8;
 
-  /// Returns the number of available threads. When built with Intel TBB, this returns the number of available
-  /// processors. Without TBB, this returns 1.
+  /// Returns the number of available threads, which is the number of available processors.
   static int availableThreads();
 
   /// Query the recommended thread count. This is set at least two threads if available, prefering one less than the
   /// @c availableThreads() up to @c MaxRecommendedThreads threads.
   static int recommendedThreadCount();
 
-  /// Initialise the thread count.
+  /// Initialise the thread count. Only the first call has any effect, so a count given on the command line can be set
+  /// before a tool's own default.
   static void init(int thread_count = ThreadCountRecommended);
+
+  /// The number of threads that the parallel functions use, as set by @c init(), otherwise all available threads.
+  static int threadCount();
+
+  /// The index of the calling thread within the parallel function that it is running, in [0, @c threadCount() ).
+  /// This is 0 outside of the parallel functions.
+  static int threadIndex();
+};
+
+/// Call @c range_func(first, last) on consecutive ranges of [begin, end) in parallel, and return once all are done.
+/// The ranges are at least @c grain_size long, except for the last. A grain size of 0 picks one from the number of
+/// threads. Calls from within a parallel function run serially on the calling thread.
+RAYLIB_EXPORT void parallelForRange(size_t begin, size_t end, size_t grain_size,
+                                    const std::function<void(size_t first, size_t last)> &range_func);
+
+/// Call @c func(i) for each i in [begin, end) in parallel. @c grain_size is the smallest number of consecutive
+/// indices given to one thread at a time, use 1 where each call does a lot of work.
+template <class Function>
+void parallelFor(size_t begin, size_t end, const Function &func, size_t grain_size = 0)
+{
+  parallelForRange(begin, end, grain_size, [&func](size_t first, size_t last) {
+    for (size_t i = first; i < last; i++)
+    {
+      func(i);
+    }
+  });
+}
+
+/// Accumulate @c func(i, value) for each i in [begin, end) in parallel, and return the combined value. Each range of
+/// indices accumulates into its own copy of @c identity, and the ranges are combined in index order by
+/// @c combine(a, b). The ranges depend only on the number of indices, so the result does not depend on the threads.
+template <class T, class Function, class Combine>
+T parallelReduce(size_t begin, size_t end, const T &identity, const Function &func, const Combine &combine)
+{
+  const size_t min_range_size = 1024;
+  const size_t max_ranges = 64;
+  const size_t count = end > begin ? end - begin : 0;
+  const size_t num_ranges = std::min(max_ranges, (count + min_range_size - 1) / min_range_size);
+  if (num_ranges <= 1)
+  {
+    T value = identity;
+    for (size_t i = begin; i < end; i++)
+    {
+      func(i, value);
+    }
+    return value;
+  }
+  const size_t range_size = (count + num_ranges - 1) / num_ranges;
+  std::vector<T> values(num_ranges, identity);
+  parallelFor(0, num_ranges,
+              [&](size_t r) {
+                const size_t last = std::min(end, begin + (r + 1) * range_size);
+                for (size_t i = begin + r * range_size; i < last; i++)
+                {
+                  func(i, values[r]);
+                }
+              },
+              1);
+  T result = values[0];
+  for (size_t r = 1; r < num_ranges; r++)
+  {
+    result = combine(result, values[r]);
+  }
+  return result;
+}
+
+/// A separate copy of @c T for each thread of the parallel functions, such as working memory that is expensive to
+/// create. Each copy is constructed from the exemplar when its thread first calls @c local().
+template <class T>
+class ThreadLocal
+{
+public:
+  explicit ThreadLocal(const T &exemplar = T())
+#if RAYLIB_WITH_TBB
+    : values_(exemplar)
+#else   // RAYLIB_WITH_TBB
+    : exemplar_(exemplar)
+    , values_(static_cast<size_t>(Threads::threadCount()))
+#endif  // RAYLIB_WITH_TBB
+  {}
+
+  /// The copy for the calling thread. This must not be shared between concurrent parallel functions.
+  T &local()
+  {
+#if RAYLIB_WITH_TBB
+    return values_.local();
+#else   // RAYLIB_WITH_TBB
+    std::unique_ptr<T> &value = values_[static_cast<size_t>(Threads::threadIndex())];
+    if (!value)
+    {
+      value.reset(new T(exemplar_));
+    }
+    return *value;
+#endif  // RAYLIB_WITH_TBB
+  }
+
+  /// Call @c func(value) on the copy of each thread that has used one.
+  template <class Function>
+  void forEach(const Function &func)
+  {
+#if RAYLIB_WITH_TBB
+    for (auto &value : values_)
+    {
+      func(value);
+    }
+#else   // RAYLIB_WITH_TBB
+    for (auto &value : values_)
+    {
+      if (value)
+      {
+        func(*value);
+      }
+    }
+#endif  // RAYLIB_WITH_TBB
+  }
+
+private:
+#if RAYLIB_WITH_TBB
+  tbb::enumerable_thread_specific<T> values_;
+#else   // RAYLIB_WITH_TBB
+  T exemplar_;
+  std::vector<std::unique_ptr<T>> values_;
+#endif  // RAYLIB_WITH_TBB
+};
+
+/// A lock for short critical sections, which spins rather than sleeping while it waits.
+/// It meets the BasicLockable requirements, so can be used with std::lock_guard, and also has a @c scoped_lock.
+class SpinMutex
+{
+public:
+  inline void lock()
+  {
+    while (flag_.test_and_set(std::memory_order_acquire))
+    {
+    }
+  }
+  inline void unlock() { flag_.clear(std::memory_order_release); }
+
+  /// Holds the lock for its lifetime.
+  class scoped_lock
+  {
+  public:
+    explicit scoped_lock(SpinMutex &mutex)
+      : mutex_(mutex)
+    {
+      mutex_.lock();
+    }
+    ~scoped_lock() { mutex_.unlock(); }
+    scoped_lock(const scoped_lock &) = delete;
+    scoped_lock &operator=(const scoped_lock &) = delete;
+
+  private:
+    SpinMutex &mutex_;
+  };
+
+private:
+  std::atomic_flag flag_ = ATOMIC_FLAG_INIT;
 };
 }  // namespace ray
 
@@ -8,6 +8,7 @@
 
 #include "raylib/raylibconfig.h"
 #include "rayrandom.h"
+#include "rayvoxelset.h"
 
 #include <Eigen/Dense>
 #include <algorithm>
@@ -110,8 +111,10 @@ public:
   }
 };
 
+/// append to @c indices the first of @c points in each voxel of width @c voxel_width that is not already in
+/// @c vox_set. Reuse @c vox_set to subsample consistently across chunks of a cloud
 inline void voxelSubsample(const std::vector<Eigen::Vector3d> &points, double voxel_width,
-                           std::vector<int64_t> &indices, std::set<Eigen::Vector3i, Vector3iLess> &vox_set)
+                           std::vector<int64_t> &indices, VoxelSet &vox_set)
 {
   for (int64_t i = 0; i < (int64_t)points.size(); i++)
   {
@@ -127,7 +130,7 @@ inline void voxelSubsample(const std::vector<Eigen::Vector3d> &points, double vo
 inline void voxelSubsample(const std::vector<Eigen::Vector3d> &points, double voxel_width,
                            std::vector<int64_t> &indices)
 {
-  std::set<Eigen::Vector3i, Vector3iLess> vox_set;
+  VoxelSet vox_set;
   voxelSubsample(points, voxel_width, indices, vox_set);
 }
 
@@ -0,0 +1,367 @@
+// Copyright (c) 2020
+// Commonwealth Scientific and Industrial Research Organisation (CSIRO)
+// ABN 41 687 119 230
+//
+// Author: Thomas Lowe
+#ifndef RAYLIB_RAYVOXELSET_H
+#define RAYLIB_RAYVOXELSET_H
+
+#include "raylib/raylibconfig.h"
+
+#include <Eigen/Dense>
+#include <cstdint>
+#include <iterator>
+#include <utility>
+#include <vector>
+
+namespace ray
+{
+/// hash of a voxel index, packed into 21 bits per axis and mixed. The top bits of the hash depend on all three axes,
+/// so tables should take their slot from those. Indices that differ only above the packed bits share a hash, so
+/// tables must still compare the full index
+inline uint64_t voxelHash(const Eigen::Vector3i &index)
+{
+  const uint64_t mask = (uint64_t(1) << 21) - 1;
+  const uint64_t key = (uint64_t(uint32_t(index[0])) & mask) | ((uint64_t(uint32_t(index[1])) & mask) << 21) |
+                       ((uint64_t(uint32_t(index[2])) & mask) << 42);
+  uint64_t hash = key * 0x9E3779B97F4A7C15ull;
+  return hash ^ (hash >> 29);
+}
+
+/// An unordered map from voxel index to @c T, with the interface of the std::map subset used on voxels.
+/// It is an open addressing hash table with linear probing, so unlike std::map there is no allocation per voxel, and
+/// @c clear() keeps the capacity so the table can be reused between chunks of a cloud without reallocating.
+/// Iteration order is unspecified, and iterators are invalidated by insertion.
+template <class T>
+class VoxelMap
+{
+  struct Slot
+  {
+    std::pair<Eigen::Vector3i, T> value;
+    bool used = false;
+  };
+
+  template <class SlotType, class ValueType>
+  class Iterator
+  {
+  public:
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = std::pair<Eigen::Vector3i, T>;
+    using difference_type = std::ptrdiff_t;
+    using pointer = ValueType *;
+    using reference = ValueType &;
+
+    Iterator(SlotType *slot, SlotType *end)
+      : slot_(slot)
+      , end_(end)
+    {
+      skipUnused();
+    }
+    /// iterators convert to const iterators
+    template <class OtherSlotType, class OtherValueType>
+    Iterator(const Iterator<OtherSlotType, OtherValueType> &other)
+      : slot_(other.slot_)
+      , end_(other.end_)
+    {}
+    inline reference operator*() const { return slot_->value; }
+    inline pointer operator->() const { return &slot_->value; }
+    inline Iterator &operator++()
+    {
+      ++slot_;
+      skipUnused();
+      return *this;
+    }
+    inline Iterator operator++(int)
+    {
+      Iterator old = *this;
+      ++(*this);
+      return old;
+    }
+    inline bool operator==(const Iterator &other) const { return slot_ == other.slot_; }
+    inline bool operator!=(const Iterator &other) const { return slot_ != other.slot_; }
+
+  private:
+    template <class, class>
+    friend class Iterator;
+    inline void skipUnused()
+    {
+      while (slot_ != end_ && !slot_->used) ++slot_;
+    }
+    SlotType *slot_, *end_;
+  };
+
+public:
+  using key_type = Eigen::Vector3i;
+  using mapped_type = T;
+  using value_type = std::pair<Eigen::Vector3i, T>;
+  using iterator = Iterator<Slot, value_type>;
+  using const_iterator = Iterator<const Slot, const value_type>;
+
+  VoxelMap() {}
+  explicit VoxelMap(size_t count) { reserve(count); }
+
+  inline iterator begin() { return iterator(slots_.data(), slots_.data() + slots_.size()); }
+  inline iterator end() { return iterator(slots_.data() + slots_.size(), slots_.data() + slots_.size()); }
+  inline const_iterator begin() const { return const_iterator(slots_.data(), slots_.data() + slots_.size()); }
+  inline const_iterator end() const
+  {
+    return const_iterator(slots_.data() + slots_.size(), slots_.data() + slots_.size());
+  }
+
+  inline size_t size() const { return size_; }
+  inline bool empty() const { return size_ == 0; }
+  /// the number of voxels that can be stored without reallocating
+  inline size_t capacity() const { return slots_.size() / 2; }
+
+  /// remove all voxels, keeping the capacity
+  void clear()
+  {
+    for (auto &slot : slots_)
+    {
+      if (slot.used)
+      {
+        slot.value.second = T();
+        slot.used = false;
+      }
+    }
+    size_ = 0;
+  }
+
+  /// make room for @c count voxels without reallocating
+  void reserve(size_t count)
+  {
+    size_t num_slots = 16;
+    while (num_slots < 2 * count)
+    {
+      num_slots *= 2;
+    }
+    if (num_slots > slots_.size())
+    {
+      rehash(num_slots);
+    }
+  }
+
+  iterator find(const Eigen::Vector3i &index)
+  {
+    const size_t slot = findSlot(index);
+    return slot == kNotFound ? end() : iterator(&slots_[slot], slots_.data() + slots_.size());
+  }
+  const_iterator find(const Eigen::Vector3i &index) const
+  {
+    const size_t slot = findSlot(index);
+    return slot == kNotFound ? end() : const_iterator(&slots_[slot], slots_.data() + slots_.size());
+  }
+  inline size_t count(const Eigen::Vector3i &index) const { return findSlot(index) == kNotFound ? 0 : 1; }
+
+  /// insert @c value if its voxel is not already present. Returns the voxel's entry, and whether it was inserted
+  std::pair<iterator, bool> insert(const value_type &value)
+  {
+    bool inserted;
+    Slot &slot = findOrAdd(value.first, &inserted);
+    if (inserted)
+    {
+      slot.value.second = value.second;
+    }
+    return std::make_pair(iterator(&slot, slots_.data() + slots_.size()), inserted);
+  }
+
+  /// the value at voxel @c index, default constructed if it is not already present
+  T &operator[](const Eigen::Vector3i &index)
+  {
+    bool inserted;
+    return findOrAdd(index, &inserted).value.second;
+  }
+
+  /// remove voxel @c index, returning the number of voxels removed
+  size_t erase(const Eigen::Vector3i &index)
+  {
+    size_t slot = findSlot(index);
+    if (slot == kNotFound)
+    {
+      return 0;
+    }
+    // move later entries of the probe sequence back into the gap, so that lookups never stop short at an empty slot
+    const size_t mask = slots_.size() - 1;
+    for (size_t next = (slot + 1) & mask; slots_[next].used; next = (next + 1) & mask)
+    {
+      const size_t first = firstSlot(slots_[next].value.first);
+      if (((next - first) & mask) >= ((next - slot) & mask))
+      {
+        slots_[slot].value = std::move(slots_[next].value);
+        slot = next;
+      }
+    }
+    slots_[slot].value.second = T();
+    slots_[slot].used = false;
+    size_--;
+    return 1;
+  }
+
+private:
+  static constexpr size_t kNotFound = ~size_t(0);
+
+  size_t findSlot(const Eigen::Vector3i &index) const
+  {
+    if (size_ == 0)
+    {
+      return kNotFound;
+    }
+    const size_t mask = slots_.size() - 1;
+    for (size_t slot = firstSlot(index);; slot = (slot + 1) & mask)
+    {
+      if (!slots_[slot].used)
+      {
+        return kNotFound;
+      }
+      if (slots_[slot].value.first == index)
+      {
+        return slot;
+      }
+    }
+  }
+
+  /// the first slot to probe for voxel @c index, from the top bits of its hash
+  inline size_t firstSlot(const Eigen::Vector3i &index) const
+  {
+    return static_cast<size_t>(voxelHash(index) >> shift_);
+  }
+
+  Slot &findOrAdd(const Eigen::Vector3i &index, bool *inserted)
+  {
+    if (2 * (size_ + 1) > slots_.size())  // keep the table at most half full
+    {
+      rehash(slots_.empty() ? 16 : 2 * slots_.size());
+    }
+    const size_t mask = slots_.size() - 1;
+    for (size_t slot = firstSlot(index);; slot = (slot + 1) & mask)
+    {
+      Slot &entry = slots_[slot];
+      if (!entry.used)
+      {
+        entry.value.first = index;
+        entry.used = true;
+        size_++;
+        *inserted = true;
+        return entry;
+      }
+      if (entry.value.first == index)
+      {
+        *inserted = false;
+        return entry;
+      }
+    }
+  }
+
+  void rehash(size_t num_slots)
+  {
+    std::vector<Slot> old_slots(num_slots);
+    old_slots.swap(slots_);
+    shift_ = 64;
+    for (size_t n = num_slots; n > 1; n /= 2)
+    {
+      shift_--;
+    }
+    const size_t mask = num_slots - 1;
+    for (auto &old_slot : old_slots)
+    {
+      if (!old_slot.used)
+      {
+        continue;
+      }
+      size_t slot = firstSlot(old_slot.value.first);
+      while (slots_[slot].used)
+      {
+        slot = (slot + 1) & mask;
+      }
+      slots_[slot].value = std::move(old_slot.value);
+      slots_[slot].used = true;
+    }
+  }
+
+  std::vector<Slot> slots_;
+  size_t size_ = 0;
+  /// 64 - log2 of the number of slots
+  int shift_ = 64;
+};
+
+template <class T>
+constexpr size_t VoxelMap<T>::kNotFound;
+
+/// An unordered set of voxel indices, with the interface of the std::set subset used on voxels. See @c VoxelMap
+class VoxelSet
+{
+  struct Empty
+  {
+  };
+  using Map = VoxelMap<Empty>;
+
+public:
+  using key_type = Eigen::Vector3i;
+  using value_type = Eigen::Vector3i;
+
+  /// iterates over the voxel indices in the set
+  class const_iterator
+  {
+  public:
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = Eigen::Vector3i;
+    using difference_type = std::ptrdiff_t;
+    using pointer = const Eigen::Vector3i *;
+    using reference = const Eigen::Vector3i &;
+
+    explicit const_iterator(const Map::const_iterator &it)
+      : it_(it)
+    {}
+    inline reference operator*() const { return it_->first; }
+    inline pointer operator->() const { return &it_->first; }
+    inline const_iterator &operator++()
+    {
+      ++it_;
+      return *this;
+    }
+    inline const_iterator operator++(int)
+    {
+      const_iterator old = *this;
+      ++it_;
+      return old;
+    }
+    inline bool operator==(const const_iterator &other) const { return it_ == other.it_; }
+    inline bool operator!=(const const_iterator &other) const { return it_ != other.it_; }
+
+  private:
+    Map::const_iterator it_;
+  };
+  using iterator = const_iterator;
+
+  VoxelSet() {}
+  explicit VoxelSet(size_t count)
+    : map_(count)
+  {}
+
+  inline const_iterator begin() const { return const_iterator(map_.begin()); }
+  inline const_iterator end() const { return const_iterator(map_.end()); }
+  inline size_t size() const { return map_.size(); }
+  inline bool empty() const { return map_.empty(); }
+  inline size_t capacity() const { return map_.capacity(); }
+  /// remove all voxels, keeping the capacity
+  inline void clear() { map_.clear(); }
+  /// make room for @c count voxels without reallocating
+  inline void reserve(size_t count) { map_.reserve(count); }
+
+  inline const_iterator find(const Eigen::Vector3i &index) const { return const_iterator(map_.find(index)); }
+  inline size_t count(const Eigen::Vector3i &index) const { return map_.count(index); }
+  /// insert voxel @c index. Returns its position, and whether it was not already present
+  inline std::pair<const_iterator, bool> insert(const Eigen::Vector3i &index)
+  {
+    auto result = map_.insert(Map::value_type(index, Empty()));
+    return std::make_pair(const_iterator(result.first), result.second);
+  }
+  /// remove voxel @c index, returning the number of voxels removed
+  inline size_t erase(const Eigen::Vector3i &index) { return map_.erase(index); }
+
+private:
+  Map map_;
+};
+}  // namespace ray
+
+#endif  // RAYLIB_RAYVOXELSET_H
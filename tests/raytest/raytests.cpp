@@ -5,12 +5,22 @@
 // Author: Thomas Lowe
 
 #include "raycloud.h"
+#include "raycloudindex.h"
+#include "raycompactcloud.h"
+#include "rayellipsoid.h"
+#include "rayneighbourindex.h"
+#include "raymemory.h"
+#include "raymerger.h"
 #include "raymesh.h"
 #include "rayply.h"
+#include "raysort.h"
 #include "rayforeststructure.h"
 #include <vector>
 #include <gtest/gtest.h>
+#include <cstdio>
 #include <cstdlib>
+#include <fstream>
+#include <set>
 
 /// Raycloud testing framework. In each test, the statistics of the resulting clouds are compared to the statistics
 /// of the cloud when it was confirmed to be operating correctly. 
@@ -59,6 +69,27 @@ namespace raytest
     }
   }
 
+  /// Compare the ray cloud files @c file1 and @c file2, which should hold the same rays in the same order
+  void compareRays(const std::string &file1, const std::string &file2)
+  {
+    ray::Cloud cloud1, cloud2;
+    EXPECT_TRUE(cloud1.load(file1));
+    EXPECT_TRUE(cloud2.load(file2));
+    ASSERT_EQ(cloud1.rayCount(), cloud2.rayCount());
+    size_t num_different = 0;
+    for (size_t i = 0; i < cloud1.rayCount(); i++)
+    {
+      const ray::RGBA &colour1 = cloud1.colours[i], &colour2 = cloud2.colours[i];
+      if (cloud1.starts[i] != cloud2.starts[i] || cloud1.ends[i] != cloud2.ends[i] ||
+          cloud1.times[i] != cloud2.times[i] || colour1.red != colour2.red || colour1.green != colour2.green ||
+          colour1.blue != colour2.blue || colour1.alpha != colour2.alpha)
+      {
+        num_different++;
+      }
+    }
+    EXPECT_EQ(num_different, 0u);
+  }
+
   /// Creates two copies of the same room with a rotational difference, then aligns the first onto the second 
   TEST(Basic, RayAlign)
   {
@@ -91,6 +122,18 @@ namespace raytest
     ray::Cloud cloud;
     EXPECT_TRUE(cloud.load("room_combined.ply"));
     compareMoments(cloud.getMoments(), {-0.0867714, -0.0679941, 0.546619, 0.0215326, 0.0272819, 0.499969, -0.305657, -0.186353, 0.582642, 2.95777, 2.47531, 1.63323, 17.4967, 10.1789, 0.305355, 0.763356, 0.427376, 0.979005, 0.318409, 0.225661, 0.389366, 0.143369});
+    // merging in tiles gives the same rays as merging the whole clouds
+    for (const std::string merge_type : { "min", "max", "oldest" })
+    {
+      EXPECT_EQ(command("./raycombine " + merge_type + " room.ply room2.ply 1 rays"), 0);
+      EXPECT_EQ(copy("room_combined.ply room_combined_untiled.ply"), 0);
+      EXPECT_EQ(command("./raycombine " + merge_type + " room.ply room2.ply 1 rays --tile 2"), 0);
+      compareRays("room_combined.ply", "room_combined_untiled.ply");
+    }
+    // there is nothing to merge in tiles without any clouds
+    ray::MergerConfig config;
+    ray::Merger merger(config);
+    EXPECT_FALSE(merger.mergeMultipleFiles({}, "room_combined.ply", "room_differences.ply", 2.0));
   }
   
   /// Creates a building with random seed 1, and compares to the expected results
@@ -153,12 +196,92 @@ namespace raytest
   TEST(Basic, RaySmooth)
   {
     EXPECT_EQ(command("raycreate room 1"), 0);
+    std::remove(ray::NeighbourIndex::fileName("room.ply").c_str());  // from any earlier run
     EXPECT_EQ(command("raysmooth room.ply"), 0);
     ray::Cloud cloud;
     EXPECT_TRUE(cloud.load("room_smooth.ply"));
     compareMoments(cloud.getMoments(), {-0.108066, -0.0410134, 0.052168, 7.05134e-08, 8.45038e-08, 1.93877e-08, -0.27615, -0.0761079, 0.0656267, 2.42413, 2.13691, 1.28163, 17.539, 10.1994, 0.304682, 0.761892, 0.429502, 0.987362, 0.318932, 0.225742, 0.389901, 0.111705});
+    // the neighbour search is only kept when asked for, and reusing it gives the same result
+    EXPECT_FALSE(std::ifstream(ray::NeighbourIndex::fileName("room.ply")).good());
+    EXPECT_EQ(command("raysmooth room.ply --save_neighbours"), 0);
+    EXPECT_TRUE(std::ifstream(ray::NeighbourIndex::fileName("room.ply")).good());
+    EXPECT_EQ(command("raysmooth room.ply"), 0);
+    ray::Cloud reused;
+    EXPECT_TRUE(reused.load("room_smooth.ply"));
+    ASSERT_EQ(reused.rayCount(), cloud.rayCount());
+    for (size_t i = 0; i < cloud.rayCount(); i++)
+    {
+      EXPECT_EQ(reused.ends[i], cloud.ends[i]);
+    }
+    // single precision surface fitting gives almost the same result
+    EXPECT_EQ(command("raysmooth room.ply --float_precision"), 0);
+    EXPECT_TRUE(cloud.load("room_smooth.ply"));
+    compareMoments(cloud.getMoments(), {-0.108066, -0.0410134, 0.052168, 7.05134e-08, 8.45038e-08, 1.93877e-08, -0.27615, -0.0761079, 0.0656267, 2.42413, 2.13691, 1.28163, 17.539, 10.1994, 0.304682, 0.761892, 0.429502, 0.987362, 0.318932, 0.225742, 0.389901, 0.111705}, 0.001);
+
+    // a corrupt size in the saved index is rejected rather than allocated
+    ray::NeighbourIndex index;
+    EXPECT_TRUE(index.load("room.ply"));
+    {
+      std::fstream corrupt(ray::NeighbourIndex::fileName("room.ply"), std::ios::binary | std::ios::in | std::ios::out);
+      const uint64_t cols = uint64_t(1) << 60;
+      corrupt.seekp(40);  // the point count in the file header
+      corrupt.write(reinterpret_cast<const char *>(&cols), sizeof(cols));
+    }
+    EXPECT_FALSE(index.load("room.ply"));
   }  
 
+  /// Creates a room, sorts it spatially and then back into time order, which should restore the original cloud
+  TEST(Basic, RaySort)
+  {
+    EXPECT_EQ(command("raycreate room 1"), 0);
+    EXPECT_EQ(command("raysort room.ply 10 cm"), 0);
+    EXPECT_EQ(command("raysort room_sorted.ply time"), 0);
+    ray::Cloud cloud, sorted, restored;
+    EXPECT_TRUE(cloud.load("room.ply"));
+    EXPECT_TRUE(sorted.load("room_sorted.ply"));
+    EXPECT_TRUE(restored.load("room_sorted_sorted.ply"));
+    ASSERT_EQ(sorted.rayCount(), cloud.rayCount());
+    ASSERT_EQ(restored.rayCount(), cloud.rayCount());
+    EXPECT_TRUE(((sorted.getMoments() - cloud.getMoments()).abs() < 1e-6).all());
+    for (size_t i = 0; i < cloud.rayCount(); i++)
+    {
+      EXPECT_EQ(restored.ends[i], cloud.ends[i]);
+      EXPECT_EQ(restored.times[i], cloud.times[i]);
+    }
+
+    // a small memory budget sorts in many runs, merged over several passes, which gives the same order as the in memory
+    // sort
+    EXPECT_TRUE(ray::sortSpatial("room.ply", "room_runs.ply", 0.1, size_t(1) << 20));
+    ray::Cloud runs_sorted;
+    EXPECT_TRUE(runs_sorted.load("room_runs.ply"));
+    cloud.sortSpatial(0.1);
+    ASSERT_EQ(runs_sorted.rayCount(), cloud.rayCount());
+    for (size_t i = 0; i < cloud.rayCount(); i++)
+    {
+      EXPECT_EQ(runs_sorted.ends[i], cloud.ends[i]);
+      EXPECT_EQ(runs_sorted.times[i], cloud.times[i]);
+    }
+
+    // a georeferenced cloud, far from the origin, is still sorted along the curve rather than collapsed into one voxel
+    EXPECT_EQ(command("raytranslate room.ply 500000,6000000,0"), 0);
+    EXPECT_EQ(command("raysort room.ply 10 cm"), 0);
+    ray::Cloud far_sorted;
+    EXPECT_TRUE(far_sorted.load("room_sorted.ply"));
+    ASSERT_EQ(far_sorted.rayCount(), cloud.rayCount());
+    Eigen::Vector3d min_bound, max_bound;
+    EXPECT_TRUE(far_sorted.calcBounds(&min_bound, &max_bound));
+    std::set<uint64_t> codes;
+    uint64_t last_code = 0;
+    for (size_t i = 0; i < far_sorted.rayCount(); i++)
+    {
+      const uint64_t code = ray::mortonCode(far_sorted.ends[i], min_bound, 0.1);
+      EXPECT_GE(code, last_code);
+      last_code = code;
+      codes.insert(code);
+    }
+    EXPECT_GT(codes.size(), 1000u);
+  }
+
   /// Creates a room, then splits it around a plane, comparing agaisnt the expected result
   TEST(Basic, RaySplit)
   {
@@ -169,6 +292,22 @@ namespace raytest
     compareMoments(cloud.getMoments(), {-0.467731, 1.05075, 1.43662, 2.20441, 1.60162, 0.106775, -0.77974, 1.03139, 1.57353, 3.67521, 2.64766, 0.485084, 17.3995, 10.279, 0.311066, 0.759795, 0.425206, 0.951355, 0.321609, 0.226785, 0.39073, 0.215125});
   }  
 
+  /// Intersects rays with a sphere of radius 0.1 at the origin. A ray starting beyond it misses it, rather than passing
+  /// through it
+  TEST(Basic, RayEllipsoidIntersect)
+  {
+    ray::Ellipsoid ellipsoid;
+    ellipsoid.clear();
+    ellipsoid.eigen_mat = Eigen::Matrix3f::Identity() / 0.1f;
+    ellipsoid.extents = Eigen::Vector3f(0.1f, 0.1f, 0.1f);
+    const Eigen::Vector3d before(-1.0, 0.0, 0.0), beyond(1.0, 0.0, 0.0), far_beyond(2.0, 0.0, 0.0);
+    EXPECT_EQ(ellipsoid.intersect(before, beyond), ray::IntersectResult::Passthrough);
+    EXPECT_EQ(ellipsoid.intersect(before, Eigen::Vector3d::Zero()), ray::IntersectResult::Hit);
+    EXPECT_EQ(ellipsoid.intersect(before, Eigen::Vector3d(-0.5, 0.0, 0.0)), ray::IntersectResult::Miss);
+    EXPECT_EQ(ellipsoid.intersect(beyond, far_beyond), ray::IntersectResult::Miss);
+    EXPECT_EQ(ellipsoid.intersect(beyond, Eigen::Vector3d(1.0, 1.0, 0.0)), ray::IntersectResult::Miss);
+  }
+
   /// Creates a room and runs raytransients, comparing the identified transients ray cloud to the expected results
   TEST(Basic, RayTransients)
   {
@@ -177,8 +316,70 @@ namespace raytest
     ray::Cloud cloud;
     EXPECT_TRUE(cloud.load("room_transient.ply"));
     compareMoments(cloud.getMoments(), {-1.05406, -0.240721, -0.0629182, 5.05649e-08, 3.32941e-08, 2.54759e-08, 0.268724, -0.136746, -0.596782, 1.04798, 0.921776, 0.527205, 32.1452, 6.7491, 0.205871, 0.395641, 0.884296, 1, 0.225501, 0.296487, 0.153923, 0});
+    // filtering in tiles gives the same rays, with the default halo and with one covering every ellipsoid
+    EXPECT_EQ(copy("room_transient.ply room_transient_untiled.ply"), 0);
+    EXPECT_EQ(copy("room_fixed.ply room_fixed_untiled.ply"), 0);
+    for (const std::string halo : { "", " --halo 4" })
+    {
+      EXPECT_EQ(command("raytransients min room.ply 1 rays --tile 2" + halo), 0);
+      compareRays("room_transient.ply", "room_transient_untiled.ply");
+      compareRays("room_fixed.ply", "room_fixed_untiled.ply");
+    }
+    // as does tracing the rays through an ellipsoid hierarchy
+    EXPECT_EQ(command("raytransients min room.ply 1 rays --bvh"), 0);
+    EXPECT_TRUE(cloud.load("room_transient.ply"));
+    compareMoments(cloud.getMoments(), {-1.05406, -0.240721, -0.0629182, 5.05649e-08, 3.32941e-08, 2.54759e-08, 0.268724, -0.136746, -0.596782, 1.04798, 0.921776, 0.527205, 32.1452, 6.7491, 0.205871, 0.395641, 0.884296, 1, 0.225501, 0.296487, 0.153923, 0});
+    // which finds the same rays as the ray grid, so both give identical results
+    for (const std::string merge_type : { "min", "max" })
+    {
+      EXPECT_EQ(command("raytransients " + merge_type + " room.ply 1 rays"), 0);
+      EXPECT_EQ(copy("room_transient.ply room_transient_grid.ply"), 0);
+      EXPECT_EQ(command("raytransients " + merge_type + " room.ply 1 rays --bvh"), 0);
+      compareRays("room_transient.ply", "room_transient_grid.ply");
+    }
+    // and filtering the cloud held in single precision
+    EXPECT_EQ(command("raytransients min room.ply 1 rays --compact"), 0);
+    EXPECT_TRUE(cloud.load("room_transient.ply"));
+    compareMoments(cloud.getMoments(), {-1.05406, -0.240721, -0.0629182, 5.05649e-08, 3.32941e-08, 2.54759e-08, 0.268724, -0.136746, -0.596782, 1.04798, 0.921776, 0.527205, 32.1452, 6.7491, 0.205871, 0.395641, 0.884296, 1, 0.225501, 0.296487, 0.153923, 0});
   }  
 
+  /// Holds a georeferenced room in a compact cloud, whose rays should be recovered to within 0.1 mm, for either way
+  /// of storing the ray starts
+  TEST(Basic, RayCompactCloud)
+  {
+    EXPECT_EQ(command("raycreate room 1"), 0);
+    ray::Cloud room;
+    EXPECT_TRUE(room.load("room.ply"));
+    // georeference the room in memory, as the .ply file holds the rays in single precision. Add a ray near 1 km away
+    const Eigen::Vector3d offset(500000.0, 6000000.0, 100.0);
+    ray::Cloud cloud;
+    for (size_t i = 0; i < room.rayCount(); i++)
+    {
+      cloud.addRay(room.starts[i] + offset, room.ends[i] + offset, room.times[i], room.colours[i]);
+    }
+    cloud.addRay(offset + Eigen::Vector3d(700.0, 700.0, 10.0), offset + Eigen::Vector3d(701.0, 699.0, 10.5), 1.0,
+                 room.colours[0]);
+
+    for (const auto storage : { ray::CompactCloud::StartStorage::Positions, ray::CompactCloud::StartStorage::RayVectors })
+    {
+      ray::CompactCloud compact(storage);
+      compact.setOrigin(offset);
+      compact.fromCloud(cloud);
+      ray::Cloud recovered;
+      compact.toCloud(recovered);
+      ASSERT_EQ(recovered.rayCount(), cloud.rayCount());
+      double max_error = 0.0;
+      for (size_t i = 0; i < cloud.rayCount(); i++)
+      {
+        max_error = std::max(max_error, (recovered.starts[i] - cloud.starts[i]).norm());
+        max_error = std::max(max_error, (recovered.ends[i] - cloud.ends[i]).norm());
+        EXPECT_EQ(recovered.times[i], cloud.times[i]);
+        EXPECT_EQ(recovered.colours[i].alpha, cloud.colours[i].alpha);
+      }
+      EXPECT_LT(max_error, 1e-4);
+    }
+  }
+
   /// Creates a forest and translates it in all three axes, comparing to the expected result
   TEST(Basic, RayTranslate)
   {
@@ -189,6 +390,126 @@ namespace raytest
     compareMoments(cloud.getMoments(), {9.66298, 21.3454, 31.7177, 6.0926, 5.75511, 0.56438, 9.69155, 21.3605, 33.0883, 6.10555, 5.82564, 3.20507, 62.683, 36.1903, 0.514327, 0.504407, 0.413534, 1, 0.372377, 0.365965, 0.391709, 0});
   }
 
+  /// Saves a room in the block compressed .rcb format and loads it back, comparing to the .ply original
+  TEST(Basic, RayBlockFile)
+  {
+    EXPECT_EQ(command("raycreate room 1"), 0);
+    ray::Cloud cloud, compressed;
+    EXPECT_TRUE(cloud.load("room.ply"));
+    cloud.save("room.rcb");
+    EXPECT_TRUE(compressed.load("room.rcb"));
+    EXPECT_EQ(compressed.rayCount(), cloud.rayCount());
+    const Eigen::ArrayXd moments = cloud.getMoments();
+    compareMoments(compressed.getMoments(), std::vector<double>(moments.data(), moments.data() + moments.size()), 0.001);
+
+    // a corrupt block count, which wraps to a zero index size when multiplied out, is rejected
+    EXPECT_EQ(copy("room.rcb corrupt.rcb"), 0);
+    {
+      std::fstream corrupt("corrupt.rcb", std::ios::binary | std::ios::in | std::ios::out);
+      const uint64_t num_blocks = uint64_t(1) << 61;
+      corrupt.seekp(40);  // the block count in the file header
+      corrupt.write(reinterpret_cast<const char *>(&num_blocks), sizeof(num_blocks));
+    }
+    ray::Cloud corrupt_cloud;
+    EXPECT_FALSE(corrupt_cloud.load("corrupt.rcb"));
+
+    // as is a corrupt ray count in the block index, before it is used to size the rays
+    EXPECT_EQ(copy("room.rcb corrupt.rcb"), 0);
+    {
+      std::fstream corrupt("corrupt.rcb", std::ios::binary | std::ios::in | std::ios::out);
+      uint64_t index_offset = 0;
+      corrupt.seekg(48);  // the index offset in the file header
+      corrupt.read(reinterpret_cast<char *>(&index_offset), sizeof(index_offset));
+      const uint64_t num_rays = uint64_t(1) << 60;
+      corrupt.seekp(index_offset + 8);  // the ray count of the first index entry
+      corrupt.write(reinterpret_cast<const char *>(&num_rays), sizeof(num_rays));
+    }
+    EXPECT_FALSE(corrupt_cloud.load("corrupt.rcb"));
+  }
+
+  /// Writes the end points of a room as a point cloud and reads them back, which should give the stored points
+  TEST(Basic, RayPointCloudFile)
+  {
+    EXPECT_EQ(command("raycreate room 1"), 0);
+    ray::Cloud cloud;
+    EXPECT_TRUE(cloud.load("room.ply"));
+    EXPECT_TRUE(ray::writePlyPointCloud("room_points.ply", cloud.ends, cloud.times, cloud.colours));
+    std::vector<Eigen::Vector3d> starts, ends;
+    std::vector<double> times;
+    std::vector<ray::RGBA> colours;
+    EXPECT_TRUE(ray::readPly("room_points.ply", starts, ends, times, colours, false));
+    ASSERT_EQ(ends.size(), cloud.rayCount());
+    for (size_t i = 0; i < cloud.rayCount(); i++)
+    {
+#if RAYLIB_DOUBLE_RAYS
+      const Eigen::Vector3d stored = cloud.ends[i];
+#else
+      const Eigen::Vector3d stored = cloud.ends[i].cast<float>().cast<double>();
+#endif
+      EXPECT_EQ(ends[i], stored);
+      EXPECT_EQ(starts[i], stored);
+      EXPECT_EQ(times[i], cloud.times[i]);
+      EXPECT_EQ(colours[i].alpha, cloud.colours[i].alpha);
+      if (cloud.colours[i].alpha > 0)
+      {
+        EXPECT_EQ(colours[i].red, cloud.colours[i].red);
+        EXPECT_EQ(colours[i].green, cloud.colours[i].green);
+        EXPECT_EQ(colours[i].blue, cloud.colours[i].blue);
+      }
+    }
+  }
+
+  /// Reads a small box of a room through its spatial index, which should give the same rays in the box as the full
+  /// cloud. The index is only saved when requested
+  TEST(Basic, RayCloudIndex)
+  {
+    EXPECT_EQ(command("raycreate room 1"), 0);
+    std::remove(ray::CloudIndex::fileName("room.ply").c_str());  // from any earlier run
+    ray::Cloud cloud;
+    EXPECT_TRUE(cloud.load("room.ply"));
+    const ray::Cuboid box(Eigen::Vector3d(-1.0, -1.0, -1.0), Eigen::Vector3d(0.5, 0.5, 0.5));
+    size_t num_in_box = 0;
+    for (const auto &end : cloud.ends)
+    {
+      num_in_box += box.intersects(end) ? 1 : 0;
+    }
+    EXPECT_GT(num_in_box, 0u);
+
+    size_t num_read = 0, num_read_in_box = 0;
+    auto count = [&](std::vector<Eigen::Vector3d> &, std::vector<Eigen::Vector3d> &ends, std::vector<double> &,
+                     std::vector<ray::RGBA> &) {
+      num_read += ends.size();
+      for (const auto &end : ends)
+      {
+        num_read_in_box += box.intersects(end) ? 1 : 0;
+      }
+    };
+    EXPECT_TRUE(ray::Cloud::read("room.ply", box, count));
+    EXPECT_EQ(num_read_in_box, num_in_box);
+    EXPECT_FALSE(std::ifstream(ray::CloudIndex::fileName("room.ply")).good());
+
+    EXPECT_EQ(command("rayinfo room.ply --index"), 0);
+    EXPECT_TRUE(std::ifstream(ray::CloudIndex::fileName("room.ply")).good());
+    num_read = num_read_in_box = 0;
+    EXPECT_TRUE(ray::Cloud::read("room.ply", box, count));
+    EXPECT_EQ(num_read_in_box, num_in_box);
+    EXPECT_LE(num_read, cloud.rayCount());
+
+    // under a memory limit that reduces the streamed chunks below the segment size, the segments still match their rows
+    const size_t rows_per_segment = 16384;
+    ray::Memory::setLimit(size_t(1) << 20);
+    ASSERT_LT(ray::Memory::chunkSize(rows_per_segment), rows_per_segment);
+    ray::CloudIndex index;
+    EXPECT_TRUE(index.build("room.ply", rows_per_segment));
+    EXPECT_TRUE(index.save("room.ply"));
+    ASSERT_EQ(index.segments().size(), (cloud.rayCount() + rows_per_segment - 1) / rows_per_segment);
+    num_read = num_read_in_box = 0;
+    EXPECT_TRUE(ray::Cloud::read("room.ply", box, count));
+    ray::Memory::setLimit(0);
+    EXPECT_EQ(num_read_in_box, num_in_box);
+    EXPECT_LE(num_read, cloud.rayCount());
+  }
+
 #if RAYLIB_WITH_QHULL
   /// Creates a terrain ray cloud, then wraps it from below, comparing the mesh to the expected results
   TEST(Basic, RayWrap)